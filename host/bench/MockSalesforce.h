@@ -0,0 +1,370 @@
+/*
+  MockSalesforce.h - Local stand-in for the Salesforce token and REST endpoints
+  Released into the public domain.
+
+  Listens on 127.0.0.1 and answers token, flow and platform event requests
+  the way the real org does. There is no TLS on the host, the client side
+  handshake stand-in (HostTLS in WiFiClientSecure.h) takes its place.
+
+    MockSalesforce server;
+    server.start();
+    server.route();   // redirects login and instance hosts to the server
+
+  Batches are answered per item: a Composite request with one result per
+  subrequest, a flow call with one result per input. Items whose body
+  contains "fail":true fail, the way a rejected record would.
+
+  keepAlive false answers every request with Connection: close, the way
+  SFManager used to talk to the org. dropNext closes the next connection
+  that sends a request without answering, as a server timing out an idle
+  connection does.
+
+  Bodies sent with Content-Encoding: gzip are inflated with zlib before
+  they are looked at, a broken one is answered 400.
+
+  Every token request gets a token of its own, good for tokenLifetime ms
+  (0 for as long as the process runs). Requests to the instance without a
+  token the org issued, or with an expired one, are answered 401
+  INVALID_SESSION_ID. errorRate percent of the requests to the instance
+  are answered 503, spread evenly, the way an org under load sheds them.
+  jitter adds up to that many ms to latency, differently per request.
+
+  There is no TLS on the host, the handshake is what the client side
+  stand-in (HostTLS) makes it. Everything runs over 127.0.0.1.
+*/
+
+#if !defined(MOCK_SALESFORCE_H)
+#define MOCK_SALESFORCE_H
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+
+#define MOCK_SF_INSTANCE "mock.my.salesforce.com"
+
+class MockSalesforce {
+public:
+  std::atomic<bool> keepAlive{true};
+  std::atomic<int> latency{0};        // ms from request to response, overlaps when pipelined
+  std::atomic<int> dropNext{0};
+  std::atomic<int> jitter{0};         // ms at most added to latency
+  std::atomic<int> errorRate{0};      // % of instance requests answered 503
+  std::atomic<int> tokenLifetime{0};  // ms a token is good for, 0 for ever
+
+  std::atomic<uint32_t> connections{0};
+  std::atomic<uint32_t> requests{0};
+  std::atomic<uint32_t> items{0};     // events and flow inputs, batched or not
+  std::atomic<uint32_t> grants{0};    // Token requests, password or refresh_token
+  std::atomic<uint32_t> refreshGrants{0};
+  std::atomic<long> lastSeq{-1};      // Highest "seq" seen in an item body
+  std::atomic<uint32_t> reordered{0}; // Items whose "seq" came after a higher one
+  std::atomic<uint32_t> gzipped{0};   // Requests with a gzip body
+  std::atomic<uint64_t> bodyBytes{0}; // Request bodies as sent
+  std::atomic<uint64_t> rawBytes{0};  // and once inflated
+  std::atomic<uint32_t> errors{0};    // Answered 503 by errorRate
+  std::atomic<uint32_t> rejected{0};  // Answered 401, no or an expired token
+
+  ~MockSalesforce(){ stop(); }
+
+  bool start(){
+    _fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t size = sizeof(address);
+    if(bind(_fd, (sockaddr *)&address, size) != 0 || listen(_fd, 8) != 0){
+      ::close(_fd);
+      _fd = -1;
+      return false;
+    }
+    getsockname(_fd, (sockaddr *)&address, &size);
+    _port = ntohs(address.sin_port);
+
+    _running = true;
+    _accept = std::thread(&MockSalesforce::acceptLoop, this);
+    return true;
+  }
+
+  void stop(){
+    if(!_running){
+      return;
+    }
+    _running = false;
+    shutdown(_fd, SHUT_RDWR);
+    ::close(_fd);
+    _accept.join();
+  }
+
+  void route(){
+    HostNetwork::redirect("login.salesforce.com", 443, "127.0.0.1", _port);
+    HostNetwork::redirect(MOCK_SF_INSTANCE, 443, "127.0.0.1", _port);
+  }
+
+  uint16_t port(){ return _port; }
+
+private:
+  int _fd = -1;
+  uint16_t _port = 0;
+  std::atomic<bool> _running{false};
+  std::thread _accept;
+
+  void acceptLoop(){
+    while(_running){
+      int fd = accept(_fd, NULL, NULL);
+      if(fd < 0){
+        continue;
+      }
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      connections++;
+      std::thread(&MockSalesforce::serve, this, fd).detach();
+    }
+  }
+
+  typedef std::chrono::steady_clock Clock;
+
+  // Tokens issued and when, shared by every server so a token kept in NVS
+  // by one simulation is still known to the next, as with a real org.
+  static std::mutex &tokenLock(){ static std::mutex lock; return lock; }
+  static std::map<std::string, Clock::time_point> &tokens(){ static std::map<std::string, Clock::time_point> issued; return issued; }
+
+  static std::string issueToken(){
+    std::lock_guard<std::mutex> guard(tokenLock());
+    std::string token = "MOCKTOKEN" + std::to_string(tokens().size() + 1);
+    tokens()[token] = Clock::now();
+    return token;
+  }
+
+  bool validToken(const std::string &token){
+    std::lock_guard<std::mutex> guard(tokenLock());
+    std::map<std::string, Clock::time_point>::iterator found = tokens().find(token);
+    return found != tokens().end() && (tokenLifetime == 0 || Clock::now() - found->second < std::chrono::milliseconds(tokenLifetime));
+  }
+
+  // The same spread for every run, n-th request in, 0 to 99.
+  static int spread(uint32_t n){ return n * 37 % 100; }
+
+  static std::string eventResult(){ return "{\"id\":\"e00xx0000000001AAA\",\"success\":true,\"errors\":[]}"; }
+  static std::string eventError(){ return "[{\"message\":\"mock failure\",\"errorCode\":\"INVALID_FIELD\"}]"; }
+  static bool failed(const std::string &json){ return json.find("\"fail\":true") != std::string::npos; }
+
+  void sequence(const std::string &json){
+    size_t at = json.find("\"seq\":");
+    if(at == std::string::npos){
+      return;
+    }
+    long seq = atol(json.c_str() + at + 6);
+    if(seq <= lastSeq){
+      reordered++;
+    }
+    lastSeq = seq;
+  }
+
+  static bool gunzip(const std::string &data, std::string &result){
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if(inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK){
+      return false;
+    }
+    stream.next_in = (Bytef *)data.data();
+    stream.avail_in = data.size();
+    int status = Z_OK;
+    while(status == Z_OK){
+      char buffer[4096];
+      stream.next_out = (Bytef *)buffer;
+      stream.avail_out = sizeof(buffer);
+      status = inflate(&stream, Z_NO_FLUSH);
+      result.append(buffer, sizeof(buffer) - stream.avail_out);
+    }
+    inflateEnd(&stream);
+    return status == Z_STREAM_END;
+  }
+
+  // Elements of the array under key, nesting and strings aware enough for
+  // what SFManager sends.
+  static std::vector<std::string> elements(const std::string &json, const char *key){
+    std::vector<std::string> result;
+    size_t pos = json.find("\"" + std::string(key) + "\":[");
+    if(pos == std::string::npos){
+      return result;
+    }
+    pos = json.find('[', pos) + 1;
+
+    int depth = 0;
+    bool text = false;
+    size_t begin = pos;
+    for(size_t i = pos; i < json.size(); i++){
+      char c = json[i];
+      if(text){
+        if(c == '\\') i++;
+        else if(c == '"') text = false;
+        continue;
+      }
+      if(c == '"') text = true;
+      else if(c == '{' || c == '[') depth++;
+      else if((c == '}' || c == ']') && depth > 0) depth--;
+      else if(depth == 0 && (c == ',' || c == ']')){
+        if(i > begin) result.push_back(json.substr(begin, i - begin));
+        if(c == ']') break;
+        begin = i + 1;
+      }
+    }
+    return result;
+  }
+
+  static bool readLine(int fd, std::string &pending, std::string &line, Clock::time_point &received){
+    while(true){
+      size_t end = pending.find("\r\n");
+      if(end != std::string::npos){
+        line = pending.substr(0, end);
+        pending.erase(0, end + 2);
+        return true;
+      }
+      // Take everything that is already in, pipelined requests count from
+      // when they arrived rather than when their turn comes.
+      char buffer[4096];
+      ssize_t count = recv(fd, buffer, sizeof(buffer), 0);
+      if(count <= 0){
+        return false;
+      }
+      received = Clock::now();
+      do {
+        pending.append(buffer, count);
+        count = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+      } while(count > 0);
+    }
+  }
+
+  void serve(int fd){
+    std::string pending, line;
+    Clock::time_point received;
+    while(readLine(fd, pending, line, received)){
+      std::string path = line.substr(line.find(' ') + 1);
+      path = path.substr(0, path.find(' '));
+
+      size_t length = 0;
+      bool gzip = false;
+      std::string token;
+      while(readLine(fd, pending, line, received) && !line.empty()){
+        if(strncasecmp(line.c_str(), "Content-Length:", 15) == 0){
+          length = strtoul(line.c_str() + 15, NULL, 10);
+        }
+        if(strncasecmp(line.c_str(), "Content-Encoding:", 17) == 0){
+          gzip = line.find("gzip") != std::string::npos;
+        }
+        if(strncasecmp(line.c_str(), "Authorization: Bearer ", 22) == 0){
+          token = line.substr(22);
+        }
+      }
+      while(pending.size() < length){
+        char buffer[512];
+        ssize_t count = recv(fd, buffer, sizeof(buffer), 0);
+        if(count <= 0){
+          ::close(fd);
+          return;
+        }
+        pending.append(buffer, count);
+      }
+      std::string content = pending.substr(0, length);
+      pending.erase(0, length);
+      uint32_t number = requests++;
+      bodyBytes += length;
+
+      bool broken = false;
+      if(gzip){
+        std::string inflated;
+        broken = !gunzip(content, inflated);
+        content = inflated;
+        gzipped++;
+      }
+      rawBytes += content.size();
+
+      int drop = dropNext;
+      if(drop > 0 && dropNext.compare_exchange_strong(drop, drop - 1)){
+        break;
+      }
+      int wait = latency + (jitter > 0 ? spread(number * 7 + 3) * (jitter + 1) / 100 : 0);
+      std::this_thread::sleep_until(received + std::chrono::milliseconds(wait));
+
+      std::string body;
+      int status = 200;
+      if(broken){
+        body = "[{\"message\":\"mock bad gzip body\",\"errorCode\":\"JSON_PARSER_ERROR\"}]";
+        status = 400;
+      }
+      else if(path == "/services/oauth2/token"){
+        grants++;
+        refreshGrants += content.find("grant_type=refresh_token") != std::string::npos;
+        body = "{\"access_token\":\"" + issueToken() + "\",\"instance_url\":\"https://" MOCK_SF_INSTANCE "\",\"id\":\"https://login.salesforce.com/id/mock\",\"token_type\":\"Bearer\",\"issued_at\":\"1601510400000\",\"signature\":\"bW9jaw==\"}";
+      }
+      else if(!validToken(token)){
+        body = "[{\"message\":\"Session expired or invalid\",\"errorCode\":\"INVALID_SESSION_ID\"}]";
+        status = 401;
+        rejected++;
+      }
+      else if(spread(number) < errorRate){
+        body = "[{\"message\":\"mock overload\",\"errorCode\":\"SERVER_UNAVAILABLE\"}]";
+        status = 503;
+        errors++;
+      }
+      else if(path.find("/composite") != std::string::npos){
+        std::vector<std::string> subrequests = elements(content, "compositeRequest");
+        body = "{\"compositeResponse\":[";
+        for(size_t i = 0; i < subrequests.size(); i++){
+          bool fail = failed(subrequests[i]);
+          sequence(subrequests[i]);
+          body += std::string(i > 0 ? "," : "") + "{\"body\":" + (fail ? eventError() : eventResult()) +
+            ",\"httpHeaders\":{},\"httpStatusCode\":" + (fail ? "400" : "201") + ",\"referenceId\":\"r" + std::to_string(i) + "\"}";
+        }
+        body += "]}";
+        items += subrequests.size();
+      }
+      else if(path.find("/actions/custom/flow/") != std::string::npos){
+        std::vector<std::string> inputs = elements(content, "inputs");
+        if(inputs.empty()){
+          inputs.push_back(content);
+        }
+        body = "[";
+        for(size_t i = 0; i < inputs.size(); i++){
+          bool fail = failed(inputs[i]);
+          sequence(inputs[i]);
+          status = fail ? 400 : status;
+          body += std::string(i > 0 ? "," : "") + "{\"actionName\":\"mock\",\"errors\":" +
+            (fail ? "[{\"statusCode\":\"UNKNOWN_EXCEPTION\",\"message\":\"mock failure\"}]" : "null") +
+            ",\"isSuccess\":" + (fail ? "false" : "true") + ",\"outputValues\":{}}";
+        }
+        body += "]";
+        items += inputs.size();
+      }
+      else {
+        sequence(content);
+        body = failed(content) ? eventError() : eventResult();
+        status = failed(content) ? 400 : 201;
+        items++;
+      }
+
+      bool close = !keepAlive || path == "/services/oauth2/token";
+      std::string response = "HTTP/1.1 " + std::to_string(status) + (status < 300 ? " OK" : status == 401 ? " Unauthorized" : status == 503 ? " Service Unavailable" : " Bad Request") + "\r\nContent-Type: application/json\r\nContent-Length: " +
+        std::to_string(body.size()) + "\r\n" + (close ? "Connection: close\r\n" : "") + "\r\n" + body;
+      send(fd, response.data(), response.size(), MSG_NOSIGNAL);
+      if(close){
+        break;
+      }
+    }
+    ::close(fd);
+  }
+};
+
+#endif
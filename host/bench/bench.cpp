@@ -0,0 +1,1420 @@
+/*
+  bench.cpp - Host benchmarks for the ESPUtils library
+  Released into the public domain.
+
+  Micro benchmarks time the message, dispatch, schema, parameter, scheduler,
+  queue, spool, HTTP parsing, JSON extraction and deflate paths in wall clock ns/op. The simulations run the managers against the
+  virtual clock, so their results are in virtual milliseconds and identical
+  from run to run. Built three times, see CMakeLists.txt:
+
+    espu_bench        managers on the loop task, heap messages
+    espu_bench_pool   USE_MESSAGE_POOL
+    espu_bench_tasks  USE_TASKS (simulations need the loop task, skipped)
+
+  Run under perf or valgrind to look at a single path:
+
+    espu_bench dispatch
+
+  The load section drives SFManager against the mock org at set rates.
+  With key=value arguments it runs once with those settings instead:
+
+    espu_bench load rate=500 seconds=10 latency=50 jitter=100 errors=2 lifetime=3000 flows=30
+*/
+
+#include <ESPUtils.h>
+#include <UtilSchema.h>
+#include <UtilTask.h>
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include "MockSalesforce.h"
+
+static volatile uint32_t sink = 0;
+
+//------------------------------------------------------------------------------------
+// Heap kept for ESP.getFreeHeap() and getMinFreeHeap(), see HostHeap. Each
+// block carries its size and whether it was counted, another thread may
+// free it.
+
+static void *hostAllocate(size_t size){
+  size_t *block = (size_t *)malloc(size + 2 * sizeof(size_t));
+  if(block == NULL){
+    return NULL;
+  }
+  block[0] = size;
+  block[1] = HostHeap::tracked();
+  if(block[1]){
+    HostHeap::allocated(size);
+  }
+  return block + 2;
+}
+
+static void hostFree(void *pointer){
+  if(pointer == NULL){
+    return;
+  }
+  size_t *block = (size_t *)pointer - 2;
+  if(block[1]){
+    HostHeap::freed(block[0]);
+  }
+  free(block);
+}
+
+void *operator new(size_t size){
+  void *pointer = hostAllocate(size);
+  if(pointer == NULL){
+    throw std::bad_alloc();
+  }
+  return pointer;
+}
+
+void *operator new[](size_t size){ return operator new(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return hostAllocate(size); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return hostAllocate(size); }
+void operator delete(void *pointer) noexcept { hostFree(pointer); }
+void operator delete[](void *pointer) noexcept { hostFree(pointer); }
+void operator delete(void *pointer, const std::nothrow_t &) noexcept { hostFree(pointer); }
+void operator delete[](void *pointer, const std::nothrow_t &) noexcept { hostFree(pointer); }
+
+//------------------------------------------------------------------------------------
+
+template<typename F> static void bench(const char *name, uint32_t iterations, F body){
+  for(uint32_t i = 0; i < iterations / 10; i++){
+    body(i);
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for(uint32_t i = 0; i < iterations; i++){
+    body(i);
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  printf("  %-44s %10.1f ns/op\n", name, ns / iterations);
+}
+
+// Sections named on the command line, all of them when none is.
+static bool selected(int argc, char **argv, const char *section){
+  bool named = false;
+  for(int i = 1; i < argc; i++){
+    if(strcmp(argv[i], section) == 0){
+      return true;
+    }
+    named = named || strchr(argv[i], '=') == NULL;
+  }
+  return !named;
+}
+
+
+//------------------------------------------------------------------------------------
+// Message delivery, copy per callback vs view
+
+static void byValue(UtilMessage message){ sink += message.size(); }
+static void byView(UtilMessageView message){ sink += message.size(); }
+
+static void benchMessage(){
+  puts("message");
+  byte payload[64];
+  for(int i = 0; i < 64; i++){
+    payload[i] = i;
+  }
+  UtilMessage message;
+  message.write(payload, sizeof(payload));
+
+  void (*copyCallback)(UtilMessage) = byValue;
+  UtilMessageCallback viewCallback = byView;
+
+  bench("deliver 64B by copy", 1000000, [&](uint32_t){ copyCallback(message); });
+  bench("deliver 64B by view", 1000000, [&](uint32_t){ viewCallback(UtilMessageView(message.data(), message.size())); });
+  bench("build 64B message", 1000000, [&](uint32_t){
+    UtilMessage built;
+    built.write(payload, sizeof(payload));
+    sink += built.size();
+  });
+}
+
+//------------------------------------------------------------------------------------
+// LoRa framing, header prepended in the headroom vs copied into a new message
+
+static void benchFraming(){
+  puts("framing");
+  byte payload[32] = {};
+  byte header[LORA_HEADER_SIZE] = {0x12, 0x34, 0xFF, 0xFF, sizeof(payload)};
+
+  bench("frame 32B, header copy", 1000000, [&](uint32_t){
+    UtilMessage message;
+    message.write(payload, sizeof(payload));
+    UtilMessage framed;
+    framed.write(header, sizeof(header));
+    framed.write(message.data(), message.size());
+    sink += framed.size();
+  });
+  bench("frame 32B, writeFront", 1000000, [&](uint32_t){
+    UtilMessage message;
+    message.write(payload, sizeof(payload));
+    message.writeFront(header, sizeof(header));
+    sink += message.size();
+  });
+}
+
+//------------------------------------------------------------------------------------
+// Dispatch by key byte
+
+static void handleCommand(byte key, UtilMessageView &message){ sink += key + message.bytesAvailable(); }
+
+static void benchDispatch(){
+  puts("dispatch");
+  UtilDispatcher dispatcher;
+  dispatcher.onRange(CMD_KEY, handleCommand);
+  byte packet[] = {CMD_KEY + 1, 1, 2, 3};
+  byte unknown[] = {0x01, 1, 2, 3};
+
+  bench("dispatch registered key", 5000000, [&](uint32_t){ dispatcher.dispatch(UtilMessageView(packet, sizeof(packet))); });
+  bench("dispatch unhandled key", 5000000, [&](uint32_t){ dispatcher.dispatch(UtilMessageView(unknown, sizeof(unknown))); });
+}
+
+//------------------------------------------------------------------------------------
+// Struct schema
+
+struct Reading {
+  uint32_t sensor;
+  int16_t temperature;
+  float humidity;
+  char label[12];
+};
+
+typedef UtilSchema<
+  UTIL_FIELD(Reading, sensor,      UtilVarint),
+  UTIL_FIELD(Reading, temperature, UtilZigZag),
+  UTIL_FIELD(Reading, humidity,    UtilFloat),
+  UTIL_FIELD(Reading, label,       UtilText)
+> ReadingSchema;
+
+static void benchSchema(){
+  puts("schema");
+  Reading reading = {300, -12, 45.5f, "greenhouse"};
+  UtilMessage encoded;
+  ReadingSchema::encode(encoded, reading);
+
+  bench("encode Reading", 1000000, [&](uint32_t){
+    UtilMessage message;
+    ReadingSchema::encode(message, reading);
+    sink += message.size();
+  });
+  bench("decode Reading", 1000000, [&](uint32_t){
+    Reading decoded;
+    UtilMessageView view(encoded.data(), encoded.size());
+    ReadingSchema::decode(view, decoded);
+    sink += decoded.sensor;
+  });
+}
+
+//------------------------------------------------------------------------------------
+// Parameters, a Preferences open/close per call vs the RAM cache
+
+UTIL_PARAM(BENCH_LEVEL, "BENCH_I", int32_t, 0);
+
+static void benchParameters(){
+  puts("parameters");
+  ESPUtils::clearPreferences();
+  ESPUtils::setParameter("BENCH_I", 42);
+  ESPUtils::setParameter("BENCH_S", String("value"));
+
+  bench("read int, Preferences per call", 1000000, [&](uint32_t){
+    Preferences p;
+    p.begin(UTIL_PREF_KEY, false);
+    sink += p.getInt("BENCH_I", 0);
+    p.end();
+  });
+  bench("read int, cached", 1000000, [&](uint32_t){ sink += ESPUtils::getParameterI("BENCH_I"); });
+  bench("read int, UTIL_PARAM descriptor", 1000000, [&](uint32_t){ sink += UtilParameters::get(BENCH_LEVEL); });
+  bench("read string, cached", 1000000, [&](uint32_t){ sink += ESPUtils::getParameterS("BENCH_S").length(); });
+
+  // A provisioning burst, every key set 10 times within a second
+  const UtilFlushPolicy policies[] = {util_flush_immediate, util_flush_timer};
+  const char *names[] = {"immediate", "timer"};
+  for(int i = 0; i < 2; i++){
+    UtilParameters::setPolicy(policies[i], 1000);
+    HostNVS::instance().resetStats();
+    for(int n = 0; n < 10; n++){
+      ESPUtils::setParameter(UTIL_SSID_KEY, "ssid" + String(n));
+      ESPUtils::setParameter(UTIL_PASS_KEY, "pass" + String(n));
+      ESPUtils::setParameter(UTIL_REMOTE_ADDRESS, "ABC" + String(n));
+      HostClock::advance(100);
+      UtilScheduler::run();
+    }
+    HostClock::advance(1000);
+    UtilScheduler::run();
+
+    char name[64];
+    snprintf(name, sizeof(name), "flash writes for 30 sets, %s", names[i]);
+    printf("  %-44s %10u\n", name, HostNVS::instance().writes);
+  }
+
+  // Provisioning SSID, password and LoRa remote, one message each vs one ESP_PARAMS
+  UtilMessage bulk(ESP_PARAMS);
+  UtilParameters::writeString(bulk, UTIL_SSID_KEY, "ssid");
+  UtilParameters::writeString(bulk, UTIL_PASS_KEY, "pass");
+  UtilParameters::writeString(bulk, UTIL_REMOTE_ADDRESS, "ABCD");
+  for(int i = 0; i < 2; i++){
+    UtilParameters::setPolicy(policies[i], 1000);
+    for(int n = 0; n < 2; n++){
+      UtilMessage single[] = {UtilMessage(ESP_SSID, "ssid" + to_string(n)), UtilMessage(ESP_PASS, "pass" + to_string(n)), UtilMessage(ESP_LORA_REMOTE, "AB" + to_string(n))};
+      HostNVS::instance().resetStats();
+      if(n == 0){
+        for(int k = 0; k < 3; k++){
+          ESPUtils::handleMessage(UtilMessageView(single[k].data(), single[k].size()));
+        }
+      } else {
+        ESPUtils::handleMessage(UtilMessageView(bulk.data(), bulk.size()));
+      }
+      uint32_t atOnce = HostNVS::instance().writes;
+      HostClock::advance(1000);
+      UtilScheduler::run();
+
+      char name[64];
+      snprintf(name, sizeof(name), "provisioning writes, %s, %s", n == 0 ? "3 messages" : "ESP_PARAMS", names[i]);
+      printf("  %-44s %10u (%u later)\n", name, atOnce, HostNVS::instance().writes - atOnce);
+    }
+  }
+  UtilParameters::setPolicy(util_flush_immediate);
+
+  // The same 3 keys set one by one and as a transaction, what reaches nvs_commit()
+  for(int n = 0; n < 2; n++){
+    HostNVS::instance().resetStats();
+    if(n == 1){
+      UtilParameters::begin();
+    }
+    UtilParameters::put(UTIL_PARAM_SSID, "ssid-" + String(n));
+    UtilParameters::put(UTIL_PARAM_PASS, "pass-" + String(n));
+    UtilParameters::put(UTIL_PARAM_REMOTE, "CD" + String(n));
+    if(n == 1){
+      UtilParameters::commit();
+    }
+    UtilScheduler::run();
+    printf("  %-44s %10u (%u writes)\n", n == 0 ? "NVS commits, 3 keys set one by one" : "NVS commits, 3 key transaction",
+      HostNVS::instance().commits, HostNVS::instance().writes);
+  }
+
+  // Cloning the namespace (the keys above plus 24 more) in 200 byte chunks
+  for(int i = 0; i < 24; i++){
+    ESPUtils::setParameter("CLONE_" + String(i), i * 1000);
+  }
+  UtilScheduler::run();
+  UtilMessage snapshot;
+  UtilParameters::snapshot(snapshot);
+  uint32_t since = UtilParameters::generation();
+  ESPUtils::setParameter("CLONE_3", -1);
+  UtilMessage delta;
+  UtilParameters::snapshot(delta, since);
+
+  printf("  %-44s %10d bytes, %d frames of 200\n", "full snapshot", snapshot.size(), UtilParameters::chunkCount(snapshot, 200));
+  printf("  %-44s %10d bytes\n", "delta snapshot, 1 key changed", delta.size());
+  bench("snapshot export", 10000, [&](uint32_t){
+    UtilMessage message;
+    UtilParameters::snapshot(message);
+    sink += message.size();
+  });
+  bench("snapshot restore", 10000, [&](uint32_t){ sink += UtilParameters::restore(UtilMessageView(snapshot.data(), snapshot.size())); });
+}
+
+//------------------------------------------------------------------------------------
+// Scheduler, 16 periodic timers over a virtual day
+
+static uint32_t timerRuns = 0;
+template<int N> static void timer(){ timerRuns++; }
+
+template<int N> static void scheduleTimers(){
+  UtilScheduler::schedule(timer<N>, 0, 100 + N * 250);
+  scheduleTimers<N - 1>();
+}
+template<> void scheduleTimers<-1>(){}
+
+template<int N> static void cancelTimers(){
+  UtilScheduler::cancel(timer<N>);
+  cancelTimers<N - 1>();
+}
+template<> void cancelTimers<-1>(){}
+
+static void benchScheduler(){
+  puts("scheduler");
+  scheduleTimers<UTIL_SCHEDULER_CAPACITY - 1>();
+
+  uint64_t day = 24UL * 3600 * 1000;
+  uint64_t until = HostClock::now() + day;
+  uint32_t wakeups = 0;
+  timerRuns = 0;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  while(HostClock::now() < until){
+    UtilScheduler::run();
+    HostClock::advance(UtilScheduler::idleTime(until - HostClock::now()));
+    wakeups++;
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+  printf("  %-44s %10.1f ns/op\n", "timer run", ns / timerRuns);
+  printf("  %-44s %10u\n", "timer runs per virtual day", timerRuns);
+  printf("  %-44s %10u (polling: %llu)\n", "loop wakeups per virtual day", wakeups, (unsigned long long)day);
+  printf("  %-44s %10u ms\n", "max lateness", UtilScheduler::maxLateness);
+
+  cancelTimers<UTIL_SCHEDULER_CAPACITY - 1>();
+}
+
+//------------------------------------------------------------------------------------
+// SPSC queue between two UtilTasks
+
+#define QUEUE_MESSAGES 200000
+
+static UtilSPSCQueue<UtilMessage, UTIL_TASK_QUEUE_SIZE> queue;
+static std::atomic<uint32_t> produced(0);
+static std::atomic<uint32_t> consumed(0);
+
+static void producer(){
+  if(produced >= QUEUE_MESSAGES){
+    UtilTask::pause(1);
+    return;
+  }
+  UtilMessage message((byte)produced.load());
+  message.write(0x42);
+  if(queue.push(std::move(message))){
+    produced++;
+  } else {
+    UtilTask::pause(0);
+  }
+}
+
+static void consumer(){
+  UtilMessage message;
+  if(queue.pop(message)){
+    sink += message.size();
+    consumed++;
+  } else {
+    UtilTask::pause(0);
+  }
+}
+
+static void benchQueue(){
+  puts("queue");
+  UtilTask producerTask;
+  UtilTask consumerTask;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  consumerTask.start("consumer", consumer);
+  producerTask.start("producer", producer);
+  while(consumed < QUEUE_MESSAGES){
+    UtilTask::pause(1);
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  producerTask.stop();
+  consumerTask.stop();
+
+  printf("  %-44s %10.1f ns/op\n", "message across tasks", ns / QUEUE_MESSAGES);
+}
+
+// Priority lanes under overload: telemetry arrives twice as fast as it
+// drains, one reading in ten is an alarm. Every alarm has to come out, in
+// the order it went in.
+struct Sample {
+  uint32_t lane;
+  uint32_t seq;
+};
+
+static void benchPriority(){
+  static UtilPriorityQueue<Sample, 20, 3> lanes;
+  bench("priority queue push and pop", 1000000, [&](uint32_t i){
+    Sample sample = {1, i};
+    lanes.push(sample, 1);
+    lanes.pop(sample);
+    sink += sample.seq;
+  });
+
+  lanes.policy[2] = queue_drop_oldest;
+  uint32_t alarms = 0, delivered = 0, disorder = 0, dropped = 0;
+  Sample sample;
+  for(uint32_t i = 0; i < 100000 || !lanes.isEmpty(); i++){
+    if(i < 100000){
+      sample.lane = i % 10 == 0 ? 0 : 2;
+      sample.seq = sample.lane == 0 ? alarms++ : i;
+      if(lanes.push(sample, sample.lane) != queue_added){
+        dropped++;
+      }
+    }
+    if(i % 2 == 0 || i >= 100000){
+      lanes.hold();     // As SFManager does while it sends
+      lanes.release(1);
+      if(lanes.pop(sample) && sample.lane == 0){
+        disorder += sample.seq != delivered++;
+      }
+    }
+  }
+  printf("  %-44s %10u of %u, %u out of order\n", "alarms delivered, overloaded", delivered, alarms, disorder);
+  printf("  %-44s %10u (high water %d, longest wait %lu ms)\n", "telemetry dropped oldest first", dropped, lanes.highWater, lanes.maxWait);
+}
+
+//------------------------------------------------------------------------------------
+// Flash spool, on the host stand-in for SPIFFS. Appends cost the same with
+// one record spooled or ten thousand, commits write 12 bytes.
+
+static void spoolAppends(UtilSpool &spool, const char *name, uint32_t count){
+  uint8_t record[64];
+  memset(record, 'x', sizeof(record));
+  bench(name, count, [&](uint32_t i){
+    record[0] = i;
+    sink += spool.append(record, sizeof(record));
+  });
+}
+
+static void benchSpool(){
+  puts("spool (64 byte records, 16 KB segments)");
+  HostFlash::instance().erase();
+  UtilSpool spool;
+  spool.begin("bench", 16384, 1024);
+  spoolAppends(spool, "append, spool empty", 1000);
+  spoolAppends(spool, "append, 1000 records behind it", 1000);
+  spoolAppends(spool, "append, 10000 records behind it", 10000);
+  printf("  %-44s %10zu KB in %d segments, %u dropped\n", "spooled", spool.bytes() / 1024, spool.segments(), spool.dropped);
+
+  size_t size;
+  UtilSpoolMark mark;
+  uint32_t read = 0;
+  HostFlash::instance().resetStats();
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  while(spool.read(size, mark) != NULL){
+    if(++read % 20 == 0){
+      spool.commit(mark); // As SFManager does, once per round trip
+    }
+  }
+  spool.commit(mark);
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  printf("  %-44s %10.1f ns/op\n", "read back, commit every 20", ns / read);
+  printf("  %-44s %10u (%u compactions, %u segments removed)\n", "commit points written", spool.committed, spool.compactions,
+    HostFlash::instance().removes);
+
+  // Power lost half way through a write, then a restart
+  spool.append((const uint8_t *)"before", 6);
+  HostFlash::instance().tearNext(20);
+  spool.append((const uint8_t *)"lost when the power went", 24);
+  spool.end();
+  spool.begin("bench", 16384, 1024);
+  spool.append((const uint8_t *)"after", 5);
+  String found;
+  const uint8_t *record;
+  while((record = spool.read(size, mark)) != NULL){
+    found += String(found.length() > 0 ? "," : "");
+    found.concat((const char *)record, size);
+  }
+  printf("  %-44s %10s (%u corrupt)\n", "torn write, records after restart", found.c_str(), spool.corrupt);
+  spool.end();
+  HostFlash::instance().erase();
+}
+
+//------------------------------------------------------------------------------------
+// HTTP responses parsed as they arrive, 128 bytes at a time, and requests
+// written the way SFManager did before UtilHTTPRequest
+
+// Takes whatever is written, counting the writes.
+class NullClient : public Client {
+public:
+  uint32_t writes = 0;
+  int connect(const char *, uint16_t) override { return 1; }
+  size_t write(uint8_t) override { writes++; return 1; }
+  size_t write(const uint8_t *, size_t size) override { writes++; return size; }
+  using Print::write;
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int read(uint8_t *, size_t) override { return -1; }
+  int peek() override { return -1; }
+  uint8_t connected() override { return 1; }
+  void stop() override {}
+};
+
+static void printRequest(Client &client, String path, String &body, const String &host, const String &token){
+  client.println("POST "+ path +" HTTP/1.1");
+  client.println("Host: "+ host);
+  client.println("Content-Type: application/json");
+  client.println("Content-Length: "+ String(body.length(), DEC));
+  client.println("Authorization: Bearer "+ token);
+  client.println();
+  client.print(body);
+}
+
+static void writeRequest(UtilHTTPRequest &request, const char *path, const String &target, const String &body, const String &host, const String &token){
+  request.print("POST /services/data/" SFRA_API);
+  request.print(path);
+  request.print(target);
+  request.print(" HTTP/1.1\r\n");
+  request.header("Host", host);
+  request.header("Content-Type", "application/json");
+  request.header("Content-Length", (unsigned long)body.length());
+  request.print("Authorization: Bearer ");
+  request.print(token);
+  request.print("\r\n\r\n");
+  request.print(body);
+}
+
+static void benchRequests(){
+  String host = "na1.my.salesforce.com";
+  String token = "00D000000000001!AQ0AQHqx0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789";
+  String target = "Reading__e";
+  String body = "{\"Device__c\":\"esp32-0001\",\"Value__c\":21.5}";
+
+  NullClient client;
+  bench("request, println per line", 200000, [&](uint32_t){
+    String api = "/services/data/"+ String(SFRA_API);
+    printRequest(client, api +"/sobjects/"+ target, body, host, token);
+  });
+  uint32_t printWrites = client.writes;
+  client.writes = 0;
+
+  static UtilHTTPRequest request;
+  bench("request, UtilHTTPRequest", 200000, [&](uint32_t){
+    request.begin(client);
+    writeRequest(request, "/sobjects/", target, body, host, token);
+    request.send();
+  });
+  printf("  %-44s %10.1f println, %u UtilHTTPRequest\n", "client writes per request", (double)printWrites / 220000, client.writes / 220000);
+}
+
+static void benchHTTP(){
+  puts("http");
+  String result = "{\"body\":{\"id\":\"e00xx0000000001AAA\",\"success\":true,\"errors\":[]},\"httpHeaders\":{},\"httpStatusCode\":201,\"referenceId\":\"r0\"}";
+  String body = "{\"compositeResponse\":[";
+  for(int i = 0; i < 10; i++){
+    body += (i > 0 ? "," : "") + result;
+  }
+  body += "]}";
+
+  String headers = "HTTP/1.1 200 OK\r\nDate: Thu, 01 Oct 2020 00:00:00 GMT\r\nContent-Type: application/json;charset=UTF-8\r\nVary: Accept-Encoding\r\n";
+  String sized = headers + "Content-Length: " + String(body.length()) + "\r\n\r\n" + body;
+  char size[16];
+  snprintf(size, sizeof(size), "%x\r\n", body.length() / 2);
+  String half = body.substring(0, body.length() / 2);
+  String chunked = headers + "Transfer-Encoding: chunked\r\n\r\n" + size + half + "\r\n" + size + body.substring(body.length() / 2) + "\r\n0\r\n\r\n";
+
+  static char kept[UTIL_HTTP_BODY_SIZE + 1];
+  static UtilHTTPParser parser(kept, sizeof(kept));
+  const String *responses[] = {&sized, &chunked};
+  const char *names[] = {"composite of 10, Content-Length (ns/response)", "composite of 10, chunked (ns/response)"};
+  for(int r = 0; r < 2; r++){
+    const uint8_t *data = (const uint8_t *)responses[r]->c_str();
+    size_t length = responses[r]->length();
+    bench(names[r], 20000, [&](uint32_t){
+      parser.discard();
+      for(size_t i = 0; i < length; i += 128){
+        parser.feed(data + i, length - i < 128 ? length - i : 128);
+      }
+      sink += parser.bodyLength();
+    });
+  }
+  printf("  %-44s %10u bytes\n", "parser footprint, any response size", (unsigned)sizeof(UtilHTTPParser));
+  printf("  %-44s %10u bytes\n", "and the body kept, UTIL_HTTP_BODY_SIZE", (unsigned)sizeof(kept));
+
+  // The results SFManager picks out of a composite response as it streams by
+  static char payload[256], success[8], status[8];
+  static int results;
+  static UtilJSONField fields[] = {
+    {"compositeResponse[]", NULL, 0, 0, false, false},
+    {"compositeResponse[].body", payload, sizeof(payload), 0, false, false},
+    {"compositeResponse[].body.success", success, sizeof(success), 0, false, false},
+    {"compositeResponse[].httpStatusCode", status, sizeof(status), 0, false, false}
+  };
+  static UtilJSONExtractor json;
+  json.callback = [](int field){ results += field == 0; };
+  parser.onBody = [](const uint8_t *data, size_t size){ json.feed(data, size); };
+  const uint8_t *data = (const uint8_t *)chunked.c_str();
+  bench("composite of 10, chunked, results extracted", 20000, [&](uint32_t){
+    parser.discard();
+    json.begin(fields, 4);
+    for(size_t i = 0; i < chunked.length(); i += 128){
+      parser.feed(data + i, chunked.length() - i < 128 ? chunked.length() - i : 128);
+    }
+    sink += results;
+  });
+  parser.onBody = NULL;
+
+  // The same results found with the indexed scanner over the kept body
+  bench("composite of 10, kept then scanned", 20000, [&](uint32_t){
+    int begin, end, pos, count = 0;
+    if(utilJSONMember(body, 0, "compositeResponse", begin, end)){
+      pos = begin;
+      while(utilJSONElement(body, pos, begin, end)){
+        int valueBegin, valueEnd;
+        utilJSONMember(body, begin, "httpStatusCode", valueBegin, valueEnd);
+        utilJSONMember(body, begin, "body", valueBegin, valueEnd);
+        count += body.substring(valueBegin, valueEnd).indexOf("\"success\":true") != -1;
+      }
+    }
+    sink += count;
+  });
+  printf("  %-44s %10u bytes\n", "extractor footprint, any response size", (unsigned)sizeof(UtilJSONExtractor));
+}
+
+//------------------------------------------------------------------------------------
+// Request bodies gzipped by UtilDeflate, counted rather than kept
+
+// A flow call of count telemetry inputs, the way SFManager batches them.
+static String telemetryBody(int count, int seq){
+  String body = "{\"inputs\":[";
+  for(int i = 0; i < count; i++){
+    body += String(i > 0 ? "," : "") + "{\"seq\":" + String(seq + i) + ",\"Device__c\":\"esp32-0001\",\"Temperature__c\":" +
+      String(20 + (seq + i) % 7) + ".5,\"Humidity__c\":" + String(40 + (seq + i) % 13) + ",\"Battery__c\":3.9" + String((seq + i) % 10) +
+      ",\"Status__c\":\"OK\",\"Firmware__c\":\"1.4.2\"}";
+  }
+  return body + "]}";
+}
+
+static void benchDeflate(){
+  puts("deflate");
+  static UtilDeflate deflate;
+  UtilHTTPLength length;
+  String bodies[] = {telemetryBody(1, 0), telemetryBody(10, 0), String()};
+  for(int i = 0; i < 2048; i++){
+    bodies[2] += (char)('!' + esp_random() % 90);
+  }
+  const char *names[] = {"1 telemetry input", "10 telemetry inputs", "2 KB random text"};
+  for(int b = 0; b < 3; b++){
+    String &body = bodies[b];
+    char name[64];
+    snprintf(name, sizeof(name), "%s, %u bytes", names[b], body.length());
+    bench(name, 20000, [&](uint32_t){
+      length.length = 0;
+      deflate.begin(length);
+      deflate.print(body);
+      deflate.end();
+      sink += deflate.out;
+    });
+    printf("  %-44s %10u bytes gzipped, %.0f%% of the body\n", "", deflate.out, 100.0 * deflate.out / body.length());
+  }
+  printf("  %-44s %10u bytes (UTIL_DEFLATE_WINDOW %d)\n", "compressor footprint, any body size", (unsigned)sizeof(UtilDeflate), UTIL_DEFLATE_WINDOW);
+}
+
+//------------------------------------------------------------------------------------
+// Manager simulations on the virtual clock
+
+#ifndef USE_TASKS
+
+static void onMessage(UtilMessageView message){ sink += message.size(); }
+static void onRequest(bool success, String payload){ sink += success; }
+
+static void spin(uint64_t ms){
+  uint64_t until = HostClock::now() + ms;
+  while(HostClock::now() < until){
+    ESPUtils::loop();
+    WiFi.hostSettle();
+    HostClock::advance(1);
+  }
+}
+
+static void simWiFi(){
+  puts("wifi (virtual ms)");
+  WiFiManager::beginConnection("bench", "bench");
+  WiFi.hostSettle();
+
+  uint64_t total = 0;
+  int drops = 10;
+  for(int i = 0; i < drops; i++){
+    uint32_t begins = WiFi.hostBegins();
+    WiFi.hostSetAvailable(false);
+    WiFi.hostSettle();
+    WiFi.hostSetAvailable(true);
+
+    uint64_t start = HostClock::now();
+    while(WiFi.hostBegins() == begins && HostClock::now() - start < 10000){
+      ESPUtils::loop();
+      WiFi.hostSettle();
+      HostClock::advance(1);
+    }
+    total += HostClock::now() - start;
+    spin(10);
+  }
+  printf("  %-44s %10.1f ms (WIFI_RETRY_DELAY %d)\n", "reconnect after drop", (double)total / drops, WIFI_RETRY_DELAY);
+}
+
+static void simSF(){
+  puts("sfra (virtual ms)");
+  // Nothing listens on port 1, every token request is refused at once.
+  HostNetwork::redirect("login.salesforce.com", 443, "127.0.0.1", 1);
+  HostNetwork::attempts() = 0;
+
+  SFMan.flowRequest("Bench", "{}", onRequest);
+  uint64_t window = 10000;
+  spin(window);
+  printf("  %-44s %10u (SFRA_RETRY_DELAY %d)\n", "token attempts in 10 s, host down", HostNetwork::attempts().load(), SFRA_RETRY_DELAY);
+  HostNetwork::clearRedirects();
+}
+
+// Works the SF queue on the wall clock. The loop task would do other work
+// while responses are in flight, here it gives the CPU to the mock server.
+static void drainSF(){
+  SFMan.loop();
+  if(SFMan.phase != sf_phase_idle){
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+}
+
+static int flowsDone = 0;
+static void onFlow(bool success, String payload){ flowsDone += success; }
+
+static void runFlows(MockSalesforce &server, const char *name, int count){
+  SFMan.disconnect();
+  uint32_t connections = server.connections;
+  flowsDone = 0;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  int queued = 0;
+  while(queued < count || SFMan.pendingRequests()){
+    while(queued < count && !SFMan.requests.isFull()){
+      SFMan.requests.push({sf_type_flow, "Bench", "{}", onFlow}, sf_priority_normal);
+      queued++;
+    }
+    drainSF();
+  }
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  printf("  %-44s %10.1f req/s %7.2f ms/req %4u connects %s\n", name, count * 1000 / ms, ms / count,
+    server.connections - connections, flowsDone == count ? "" : "(failures)");
+}
+
+static bool startMock(MockSalesforce &server){
+  if(!server.start()){
+    puts("  mock server failed to start");
+    return false;
+  }
+  server.route();
+  HostClock::useRealTime(true); // Timeouts and handshakes go by millis()
+  WiFiManager::beginConnection("bench", "bench");
+  WiFi.hostSettle();
+
+  // Fetch the token first
+  SFMan.flowRequest("Bench", "{}", onRequest);
+  while(SFMan.pendingRequests()){
+    drainSF();
+  }
+  return true;
+}
+
+static void stopMock(MockSalesforce &server){
+  SFMan.disconnect();
+  server.stop();
+  HostNetwork::clearRedirects();
+  HostClock::useRealTime(false);
+}
+
+// Average and last ms of each phase a request went through.
+static void printPhases(){
+  const char *names[] = {"idle", "resolve", "connect", "handshake", "send", "receive"};
+  for(int i = sf_phase_resolve; i < sf_phase_count; i++){
+    UtilSFRAPhaseTime &time = SFMan.phaseTimes[i];
+    char name[48];
+    snprintf(name, sizeof(name), "phase %s", names[i]);
+    printf("  %-44s %10.2f ms avg %7lu ms last %4u timeouts\n", name, time.count > 0 ? (double)time.total / time.count : 0.0,
+      time.last, time.timeouts);
+  }
+}
+
+// How long the caller is held by a request that needs a new connection.
+static void enqueueDisconnected(){
+  SFMan.disconnect();
+  flowsDone = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  SFMan.flowRequest("Bench", "{}", onFlow);
+  SFMan.loop();
+  double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+  while(SFMan.pendingRequests()){
+    drainSF();
+  }
+  printf("  %-44s %10.1f us %s\n", "enqueue and loop(), disconnected", us, flowsDone == 1 ? "" : "(failures)");
+}
+
+// Wall clock, full handshakes only so the connections are what differs.
+static void simSFKeepAlive(){
+  puts("sfra keep-alive (wall ms, 10 ms handshake, 5 ms latency)");
+  HostTLS::fullHandshake() = 10;
+  UtilTLSCache::lifetime = 0;
+  MockSalesforce server;
+  server.latency = 5;
+  if(!startMock(server)){
+    return;
+  }
+
+  int count = 200;
+  server.keepAlive = false;
+  SFMan.pipelineDepth = 1;
+  runFlows(server, "connection per request", count);
+  server.keepAlive = true;
+  runFlows(server, "keep-alive", count);
+  SFMan.pipelineDepth = SFRA_PIPELINE_DEPTH;
+  runFlows(server, "keep-alive, pipelined", count);
+  enqueueDisconnected();
+  printPhases();
+
+  stopMock(server);
+  UtilTLSCache::lifetime = UTIL_TLS_LIFETIME;
+}
+
+// A burst of events queued at once, drained with batchSize events per round trip.
+static void runBurst(MockSalesforce &server, int batch, int count){
+  SFMan.batchSize = batch;
+  uint32_t requests = server.requests;
+  flowsDone = 0;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for(int i = 0; i < count; i++){
+    SFMan.requests.push({sf_type_event, "Reading__e", "{\"Value__c\":" + String(i) + "}", onFlow}, sf_priority_normal);
+  }
+  while(SFMan.pendingRequests()){
+    drainSF();
+  }
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  char name[48];
+  snprintf(name, sizeof(name), "burst of %d events, batch size %d", count, batch);
+  printf("  %-44s %10.1f ev/s %7.2f ms/ev %4u round trips %s\n", name, count * 1000 / ms, ms / count,
+    server.requests - requests, flowsDone == count ? "" : "(failures)");
+}
+
+// Keep-alive, one request in flight, so only the batch size differs.
+static void simSFBatch(){
+  puts("sfra batching (wall ms, 5 ms latency, pipeline depth 1)");
+  UtilTLSCache::lifetime = 0;
+  MockSalesforce server;
+  server.latency = 5;
+  if(!startMock(server)){
+    return;
+  }
+
+  SFMan.pipelineDepth = 1;
+  int sizes[] = {1, 5, 10, 20};
+  for(int i = 0; i < 4; i++){
+    runBurst(server, sizes[i], UTILS_SF_CAPACITY);
+  }
+  SFMan.pipelineDepth = SFRA_PIPELINE_DEPTH;
+  SFMan.batchSize = SFRA_BATCH_SIZE;
+
+  stopMock(server);
+  UtilTLSCache::lifetime = UTIL_TLS_LIFETIME;
+}
+
+// An outage: events keep coming while WiFi is down, they are spooled and go
+// out in order once it is back. RAM never holds more than the queue does.
+static void simSFSpool(){
+  puts("sfra spool (wall ms, 5 ms latency, 2000 events during an outage)");
+  HostFlash::instance().erase();
+  MockSalesforce server;
+  server.latency = 5;
+  SFMan.spooling = true;
+  if(!startMock(server)){
+    return;
+  }
+
+  int count = 2000;
+  flowsDone = 0;
+  WiFi.hostSetAvailable(false);
+  WiFi.hostSettle();
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for(int i = 0; i < count; i++){
+    SFMan.eventRequest("Reading__e", "{\"seq\":" + String(i) + "}", onFlow);
+    SFMan.loop();
+  }
+  double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+  printf("  %-44s %10.1f us/ev %7zu KB spooled, %d in RAM\n", "enqueue and loop(), offline", us / count, SFMan.spool.bytes() / 1024,
+    SFMan.requests.size());
+
+  server.lastSeq = -1;
+  WiFi.hostSetAvailable(true);
+  WiFiManager::beginConnection("bench", "bench");
+  WiFi.hostSettle();
+  int highWater = 0;
+  start = std::chrono::steady_clock::now();
+  while(SFMan.pendingRequests()){
+    drainSF();
+    highWater = SFMan.requests.size() > highWater ? SFMan.requests.size() : highWater;
+  }
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  printf("  %-44s %10.1f ev/s %7d of %d delivered, %u out of order\n", "replayed once back online", count * 1000 / ms, flowsDone, count,
+    server.reordered.load());
+  printf("  %-44s %10d (UTILS_SF_CAPACITY %d)\n", "requests in RAM at most", highWater, UTILS_SF_CAPACITY);
+
+  stopMock(server);
+  SFMan.spooling = SFRA_SPOOL_DEFAULT;
+  SFMan.spool.end();
+  HostFlash::instance().erase();
+}
+
+// What a request costs on air, by the TLS records and TCP segments the
+// host stand-in counts for each write.
+static void printWrites(const char *name, int count){
+  printf("  %-44s %10.1f writes %5.1f records %5.1f segments %6.0f bytes\n", name, (double)HostTLS::writes() / count,
+    (double)HostTLS::records() / count, (double)HostTLS::segments() / count, (double)HostTLS::airBytes() / count);
+  HostTLS::resetStats();
+}
+
+static void simSFWrites(){
+  puts("sfra writes (per request, 4 KB TLS records, 1436 byte segments)");
+  MockSalesforce server;
+  if(!startMock(server)){
+    return;
+  }
+  int count = 100;
+  String body = "{\"Device__c\":\"esp32-0001\",\"Value__c\":21.5}";
+
+  // As SFManager wrote them before, one println per line
+  WiFiClientSecure client;
+  UtilHTTPParser parser;
+  client.connect(SFMan.instance.c_str(), SFMan.hostPort);
+  HostTLS::resetStats();
+  for(int i = 0; i < count; i++){
+    printRequest(client, "/services/data/" SFRA_API "/sobjects/Reading__e", body, SFMan.instance, SFMan.token);
+    parser.reset();
+    while(parser.read(client) != http_complete){
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  }
+  printWrites("println per line", count);
+  client.stop();
+
+  SFMan.disconnect();
+  SFMan.pipelineDepth = 1;
+  SFMan.batchSize = 1;
+  SFMan.requests.push({sf_type_event, "Reading__e", body, onFlow}, sf_priority_normal);
+  while(SFMan.pendingRequests()){
+    drainSF(); // Connected before counting
+  }
+  HostTLS::resetStats();
+  for(int i = 0; i < count; i++){
+    SFMan.requests.push({sf_type_event, "Reading__e", body, onFlow}, sf_priority_normal);
+    while(SFMan.pendingRequests()){
+      drainSF();
+    }
+  }
+  printWrites("UtilHTTPRequest", count);
+
+  SFMan.pipelineDepth = SFRA_PIPELINE_DEPTH;
+  for(int i = 0; i < count; i++){
+    SFMan.requests.push({sf_type_event, "Reading__e", body, onFlow}, sf_priority_normal);
+    if(SFMan.requests.isFull() || i == count - 1){
+      while(SFMan.pendingRequests()){
+        drainSF();
+      }
+    }
+  }
+  printWrites("UtilHTTPRequest, pipelined", count);
+  SFMan.batchSize = SFRA_BATCH_SIZE;
+
+  stopMock(server);
+}
+
+// Telemetry through a slow uplink, a cellular backhaul behind a WiFi
+// bridge. Batched flow calls of 10 inputs, raw and gzipped.
+static void runUplink(MockSalesforce &server, const char *name, bool compressing, int count){
+  SFMan.compressing = compressing;
+  SFMan.compressed = SFMan.compressedIn = SFMan.compressedOut = SFMan.compressTime = 0;
+  uint64_t bytes = server.bodyBytes;
+  flowsDone = 0;
+  HostTLS::resetStats();
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  int queued = 0;
+  while(queued < count || SFMan.pendingRequests()){
+    while(queued < count && !SFMan.requests.isFull()){
+      String input = telemetryBody(1, queued);
+      SFMan.requests.push({sf_type_flow, "Telemetry", input, onFlow}, sf_priority_normal);
+      queued++;
+    }
+    drainSF();
+  }
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  printf("  %-44s %10.1f ev/s %6.1f body bytes/ev %6.0f air bytes/ev %s\n", name, count * 1000 / ms,
+    (double)(server.bodyBytes - bytes) / count, (double)HostTLS::airBytes() / count, flowsDone == count ? "" : "(failures)");
+  if(compressing){
+    printf("  %-44s %10.1f%% of the body, %u us per body (wall)\n", "gzipped", 100.0 * SFMan.compressedOut / SFMan.compressedIn,
+      SFMan.compressed > 0 ? SFMan.compressTime / SFMan.compressed : 0);
+  }
+  SFMan.compressing = SFRA_COMPRESS_DEFAULT;
+}
+
+static void simSFCompress(){
+  puts("sfra compression (wall ms, 32 KB/s uplink, 20 ms latency)");
+  MockSalesforce server;
+  server.latency = 20;
+  if(!startMock(server)){
+    return;
+  }
+  HostTLS::uplink() = 32 * 1024;
+  runUplink(server, "telemetry, raw", false, 1000);
+  runUplink(server, "telemetry, gzip", true, 1000);
+  HostTLS::uplink() = 0;
+  printf("  %-44s %10u of %u requests\n", "inflated by the mock org", server.gzipped.load(), server.requests.load());
+  stopMock(server);
+}
+
+// Events and flow calls at a steady rate, each timed from eventRequest()
+// or flowRequest() to its callback. A lane keeps its order, so callbacks
+// come in the order the requests went in, one after another.
+struct LoadSettings {
+  int rate = 200;     // Requests per second offered
+  int seconds = 2;
+  int flows = 50;     // % of them flow calls, the rest events
+  int latency = 20;   // ms the mock org takes, see MockSalesforce
+  int jitter = 0;
+  int errors = 0;     // % answered 503
+  int lifetime = 0;   // ms a token is good for, 0 for ever
+};
+
+static std::vector<double> loadQueued;   // ms each request went in
+static std::vector<double> loadLatency;  // ms to its callback
+static std::chrono::steady_clock::time_point loadStart;
+static bool loadQueuing = false;
+static int loadFailed = 0;
+static int loadRejected = 0;
+
+static double loadNow(){
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loadStart).count();
+}
+
+static void onLoad(bool success, String payload){
+  if(loadQueuing){
+    loadRejected++; // The queue was full, it never went in
+    return;
+  }
+  size_t done = loadLatency.size();
+  loadLatency.push_back(loadNow() - loadQueued[done]);
+  loadFailed += !success;
+}
+
+static double percentile(std::vector<double> &values, double p){
+  if(values.empty()){
+    return 0;
+  }
+  std::sort(values.begin(), values.end());
+  return values[std::min(values.size() - 1, (size_t)(p * values.size()))];
+}
+
+static void runLoad(const LoadSettings &settings){
+  MockSalesforce server;
+  server.latency = settings.latency;
+  server.jitter = settings.jitter;
+  if(!startMock(server)){
+    return;
+  }
+  server.errorRate = settings.errors;
+  server.tokenLifetime = settings.lifetime;
+
+  int count = settings.rate * settings.seconds;
+  loadQueued.clear();
+  loadLatency.clear();
+  loadQueued.reserve(count);
+  loadLatency.reserve(count);
+  loadFailed = loadRejected = 0;
+  uint32_t connects = SFMan.connects;
+  uint32_t grants = SFMan.grants;
+  HostHeap::resetPeak();
+  int64_t heap = HostHeap::used();
+
+  loadStart = std::chrono::steady_clock::now();
+  int issued = 0;
+  while(issued < count || (SFMan.pendingRequests() && loadNow() < settings.seconds * 1000 + 10000)){
+    while(issued < count && loadNow() >= issued * 1000.0 / settings.rate){
+      String body = "{\"seq\":" + String(issued) + ",\"Device__c\":\"esp32-0001\",\"Value__c\":21.5}";
+      loadQueuing = true;
+      UtilQueueResult result = issued * 37 % 100 < settings.flows ?
+        SFMan.flowRequest("Telemetry", "{\"inputs\":[" + body + "]}", onLoad, sf_priority_low) :
+        SFMan.eventRequest("Reading__e", body, onLoad, sf_priority_low);
+      loadQueuing = false;
+      if(result != queue_rejected){
+        loadQueued.push_back(loadNow());
+      }
+      issued++;
+    }
+    drainSF();
+  }
+  double ms = loadNow();
+  size_t done = loadLatency.size();
+
+  char name[64];
+  snprintf(name, sizeof(name), "%d req/s offered, %d%% flows", settings.rate, settings.flows);
+  printf("  %-44s %10.1f req/s p50 %6.1f p99 %6.1f max %6.1f ms\n", name, done * 1000 / ms, percentile(loadLatency, 0.5),
+    percentile(loadLatency, 0.99), percentile(loadLatency, 1));
+  printf("  %-44s %10.1f KB heap high water %3u connects %3u tokens %4d failed %4d rejected %3u 503 %3u 401\n", "",
+    (HostHeap::peak() - heap) / 1024.0, SFMan.connects - connects, SFMan.grants - grants, loadFailed, loadRejected,
+    server.errors.load(), server.rejected.load());
+
+  stopMock(server);
+}
+
+// The value of a key=value argument, fallback without one.
+static int option(int argc, char **argv, const char *key, int fallback){
+  size_t length = strlen(key);
+  for(int i = 1; i < argc; i++){
+    if(strncmp(argv[i], key, length) == 0 && argv[i][length] == '='){
+      return atoi(argv[i] + length + 1);
+    }
+  }
+  return fallback;
+}
+
+static bool configured(int argc, char **argv){
+  for(int i = 1; i < argc; i++){
+    if(strchr(argv[i], '=') != NULL){
+      return true;
+    }
+  }
+  return false;
+}
+
+static void simSFLoad(int argc, char **argv){
+  puts("sfra load (wall ms, 40 ms full / 8 ms resumed handshake, 20 ms latency unless set)");
+  HostTLS::fullHandshake() = 40;
+  HostTLS::resumedHandshake() = 8;
+
+  LoadSettings settings;
+  if(configured(argc, argv)){
+    settings.rate = option(argc, argv, "rate", settings.rate);
+    settings.seconds = option(argc, argv, "seconds", settings.seconds);
+    settings.flows = option(argc, argv, "flows", settings.flows);
+    settings.latency = option(argc, argv, "latency", settings.latency);
+    settings.jitter = option(argc, argv, "jitter", settings.jitter);
+    settings.errors = option(argc, argv, "errors", settings.errors);
+    settings.lifetime = option(argc, argv, "lifetime", settings.lifetime);
+    runLoad(settings);
+  }
+  else {
+    int rates[] = {50, 200, 1000};
+    for(int i = 0; i < 3; i++){
+      settings.rate = rates[i];
+      runLoad(settings);
+    }
+    settings.rate = 200;
+    settings.jitter = 60;
+    puts("  with up to 60 ms jitter");
+    runLoad(settings);
+    settings.errors = 2;
+    puts("  and 2% of requests answered 503");
+    runLoad(settings);
+    settings.errors = 0;
+    settings.lifetime = 1000;
+    puts("  and tokens the org expires after 1 s");
+    runLoad(settings);
+  }
+
+  SFMan.clearToken();
+}
+
+// From a restart to the first event delivered, RAM is gone and NVS kept.
+static void runColdStart(MockSalesforce &server, const char *name){
+  SFMan.disconnect();
+  SFMan.clearToken(false);
+  UtilTLSCache::clear(false);
+  uint32_t grants = server.grants;
+  flowsDone = 0;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  SFMan.eventRequest("Reading__e", "{}", onFlow);
+  while(SFMan.pendingRequests()){
+    drainSF();
+  }
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  printf("  %-44s %10.1f ms %9u token requests %s\n", name, ms, server.grants - grants, flowsDone == 1 ? "" : "(failures)");
+}
+
+// An event every 100 ms over a few sessions of 2 s. The token is fetched
+// again refreshMargin s ahead, between events, so none waits for it.
+static void runSessions(MockSalesforce &server, const char *name, uint32_t margin){
+  SFMan.sessionTimeout = 2;
+  SFMan.refreshMargin = margin;
+  SFMan.clearToken(false);
+  uint32_t grants = server.grants;
+  double worst = 0, total = 0;
+  int count = 60;
+  flowsDone = 0;
+
+  for(int i = 0; i < count; i++){
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    SFMan.eventRequest("Reading__e", "{}", onFlow);
+    while(SFMan.pendingRequests()){
+      drainSF();
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    worst = i > 0 && ms > worst ? ms : worst; // The first one has no token yet
+    total += ms;
+    while(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(100)){
+      drainSF();
+    }
+  }
+  printf("  %-44s %10.1f ms avg %7.1f ms worst %3u tokens %s\n", name, total / count, worst, server.grants - grants,
+    flowsDone == count ? "" : "(failures)");
+  SFMan.sessionTimeout = SFRA_SESSION_TIMEOUT;
+  SFMan.refreshMargin = SFRA_REFRESH_MARGIN;
+}
+
+static void simSFToken(){
+  puts("sfra token (wall ms, 40 ms full / 8 ms resumed handshake, 5 ms latency)");
+  HostTLS::fullHandshake() = 40;
+  HostTLS::resumedHandshake() = 8;
+  MockSalesforce server;
+  server.latency = 5;
+  if(!startMock(server)){
+    return;
+  }
+
+  runColdStart(server, "cold start, token in RAM only");
+  SFMan.persistToken = true;
+  SFMan.refreshToken();
+  SFMan.eventRequest("Reading__e", "{}", onFlow); // Stores the token
+  while(SFMan.pendingRequests()){
+    drainSF();
+  }
+  runColdStart(server, "cold start, token in NVS");
+  SFMan.persistToken = SFRA_TOKEN_PERSIST_DEFAULT;
+  SFMan.clearToken();
+
+  SFMan.refreshGrant = "MOCKREFRESH";
+  runSessions(server, "2 s sessions, refreshed 1 s ahead", 1);
+  printf("  %-44s %10u\n", "refresh_token grants", server.refreshGrants.load());
+  SFMan.refreshGrant = SFRA_REFRESH_TOKEN;
+
+  stopMock(server);
+}
+
+// One request per wakeup, the connection is gone each time as after deep sleep.
+static void runWakeups(const char *name, int count, bool reboot){
+  UtilTLSCache::resetStats();
+  uint32_t writes = HostNVS::instance().writes;
+  flowsDone = 0;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for(int i = 0; i < count; i++){
+    SFMan.disconnect();
+    if(reboot){
+      UtilTLSCache::clear(false);
+    }
+    SFMan.requests.push({sf_type_flow, "Bench", "{}", onFlow}, sf_priority_normal);
+    while(SFMan.pendingRequests()){
+      drainSF();
+    }
+  }
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  printf("  %-44s %10.2f ms/req %3u resumed %3u full %3u nvs writes %s\n", name, ms / count, UtilTLSCache::hits,
+    UtilTLSCache::misses, HostNVS::instance().writes - writes, flowsDone == count ? "" : "(failures)");
+}
+
+static void simTLS(){
+  puts("tls resumption (wall ms, 40 ms full / 8 ms resumed handshake)");
+  HostTLS::fullHandshake() = 40;
+  HostTLS::resumedHandshake() = 8;
+  MockSalesforce server;
+  if(!startMock(server)){
+    return;
+  }
+
+  int count = 20;
+  UtilTLSCache::lifetime = 0;
+  runWakeups("no session cache", count, false);
+  UtilTLSCache::lifetime = UTIL_TLS_LIFETIME;
+  runWakeups("sessions in RAM, light sleep", count, false);
+  runWakeups("sessions in RAM, deep sleep", count, true);
+  UtilTLSCache::persist = true;
+  runWakeups("sessions in NVS, deep sleep", count, true);
+
+  UtilTLSCache::persist = UTIL_TLS_PERSIST_DEFAULT;
+  UtilTLSCache::clear();
+  stopMock(server);
+}
+
+static void simLoRa(){
+  puts("lora (virtual ms)");
+  LoRa.hostClearSent();
+  LoRaMan.beginClient(onMessage);
+
+  uint64_t hour = 3600UL * 1000;
+  uint64_t until = HostClock::now() + hour;
+  uint32_t wakeups = 0;
+  while(HostClock::now() < until){
+    ESPUtils::loop();
+    ESPUtils::sleep(until - HostClock::now());
+    wakeups++;
+  }
+  printf("  %-44s %10zu (PING_INTERVAL %d)\n", "pings per virtual hour", LoRa.hostSent().size(), PING_INTERVAL);
+  printf("  %-44s %10u\n", "loop wakeups per virtual hour, sleep()", wakeups);
+}
+
+static int loraHandled = 0;
+static void onPacket(UtilMessageView message){ loraHandled++; sink += message.size() + LoRaMan.packet->rssi; }
+
+// Packets that arrive back to back, before loop() gets to them, each
+// played into the radio interrupt the way DIO0 would.
+static void simLoRaBurst(){
+  printf("lora receive ring (LORA_RX_SLOTS %d)\n", LORA_RX_SLOTS);
+  LoRaMan.isServer = true; // No ping back per packet
+  LoRaMan.callback = onPacket;
+
+  uint8_t packet[LORA_HEADER_SIZE + 32] = {LoRaMan.remoteAddress[0], LoRaMan.remoteAddress[1], LoRaMan.localAddress[0], LoRaMan.localAddress[1], 32};
+  bench("interrupt, 32 byte payload, and its loop()", 200000, [&](uint32_t i){
+    LoRa.hostReceive(packet, sizeof(packet));
+    LoRaMan.loop();
+  });
+
+  int bursts[] = {4, LORA_RX_SLOTS, 4 * LORA_RX_SLOTS};
+  for(int b = 0; b < 3; b++){
+    uint32_t overruns = LoRaMan.overruns();
+    loraHandled = 0;
+    for(int i = 0; i < bursts[b]; i++){
+      LoRa.hostSetSignal(-40 - i, 9.5 - i * 0.5);
+      LoRa.hostReceive(packet, sizeof(packet));
+    }
+    LoRaMan.loop();
+    char name[64];
+    snprintf(name, sizeof(name), "burst of %d packets", bursts[b]);
+    printf("  %-44s %10d handled %4u overruns\n", name, loraHandled, LoRaMan.overruns() - overruns);
+  }
+  printf("  %-44s %10d of %d slots\n", "high water", LoRaMan.highWater, LORA_RX_SLOTS);
+  LoRa.hostSetSignal(-60, 9.5);
+  LoRaMan.callback = onMessage;
+  LoRaMan.isServer = false;
+}
+#endif
+
+//------------------------------------------------------------------------------------
+
+int main(int argc, char **argv){
+  Serial.setEnabled(false);
+  setvbuf(stdout, NULL, _IONBF, 0);
+  HostHeap::tracked() = true;
+
+  #ifdef USE_TASKS
+  puts("build: USE_TASKS");
+  #elif defined(USE_MESSAGE_POOL)
+  puts("build: USE_MESSAGE_POOL");
+  #else
+  puts("build: loop task, heap messages");
+  #endif
+
+  if(selected(argc, argv, "message")) benchMessage();
+  if(selected(argc, argv, "framing")) benchFraming();
+  if(selected(argc, argv, "dispatch")) benchDispatch();
+  if(selected(argc, argv, "schema")) benchSchema();
+  if(selected(argc, argv, "parameters")) benchParameters();
+  if(selected(argc, argv, "scheduler")) benchScheduler();
+  if(selected(argc, argv, "queue")) benchQueue();
+  if(selected(argc, argv, "queue")) benchPriority();
+  if(selected(argc, argv, "spool")) benchSpool();
+  if(selected(argc, argv, "http")) benchHTTP();
+  if(selected(argc, argv, "http")) benchRequests();
+  if(selected(argc, argv, "deflate")) benchDeflate();
+
+  #ifdef USE_TASKS
+  puts("simulations skipped, manager tasks run on the real clock");
+  #else
+  if(selected(argc, argv, "wifi")) simWiFi();
+  if(selected(argc, argv, "sfra")) simSF();
+  if(selected(argc, argv, "sfra")) simSFKeepAlive();
+  if(selected(argc, argv, "sfra")) simSFBatch();
+  if(selected(argc, argv, "sfra")) simSFSpool();
+  if(selected(argc, argv, "sfra")) simSFToken();
+  if(selected(argc, argv, "sfra")) simSFWrites();
+  if(selected(argc, argv, "sfra")) simSFCompress();
+  if(selected(argc, argv, "load")) simSFLoad(argc, argv);
+  if(selected(argc, argv, "tls")) simTLS();
+  if(selected(argc, argv, "lora")) simLoRa();
+  if(selected(argc, argv, "lora")) simLoRaBurst();
+  #endif
+
+  return 0;
+}
@@ -0,0 +1,21 @@
+/*
+  Config.h - Host build configuration, enables every manager and then
+  continues with the library's own Config.h.
+*/
+
+#if !defined(HOST_CONFIG_H)
+#define HOST_CONFIG_H
+
+#define USE_BLE
+#define USE_LORA
+#define USE_OTA
+#define USE_SFRA
+#define USE_WIFI
+
+#define CS  18
+#define RST 14
+#define IRQ 26
+
+#endif
+
+#include_next <Config.h>
@@ -0,0 +1,446 @@
+/*
+  Arduino.h - Host stand-in for the Arduino core used by ESPUtils
+  Released into the public domain.
+
+  Only the subset of the Arduino/ESP32 API touched by the ESPUtils
+  managers is provided. Time is virtual by default so that timing
+  dependent paths are reproducible, see HostClock.
+*/
+
+#if !defined(HOST_ARDUINO_H)
+#define HOST_ARDUINO_H
+
+#define ESPUTILS_HOST
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#define F(string_literal) (string_literal)
+#define PROGMEM
+#define IRAM_ATTR
+
+//------------------------------------------------------------------------------------
+// Clock
+
+class HostClock {
+public:
+  static uint64_t now(){
+    if(realTime()) return realMillis();
+    return virtualTime().load();
+  }
+
+  static uint64_t nowMicros(){
+    if(realTime()) {
+      return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - epoch()).count();
+    }
+    return virtualTime().load() * 1000;
+  }
+
+  // Move the virtual clock forward, has no effect in real time mode.
+  static void advance(uint64_t ms){ virtualTime() += ms; }
+  static void set(uint64_t ms){ virtualTime() = ms; }
+
+  static void useRealTime(bool enabled){ realTime() = enabled; }
+  static bool isRealTime(){ return realTime(); }
+
+  static uint64_t realMillis(){
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - epoch()).count();
+  }
+
+private:
+  static std::atomic<uint64_t> &virtualTime(){ static std::atomic<uint64_t> t(0); return t; }
+  static std::atomic<bool> &realTime(){ static std::atomic<bool> r(false); return r; }
+  static std::chrono::steady_clock::time_point epoch(){
+    static std::chrono::steady_clock::time_point e = std::chrono::steady_clock::now();
+    return e;
+  }
+};
+
+inline unsigned long millis(){ return (unsigned long)(uint32_t)HostClock::now(); }
+inline unsigned long micros(){ return (unsigned long)(uint32_t)HostClock::nowMicros(); }
+
+inline void delay(uint32_t ms){
+  if(HostClock::isRealTime()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+  } else {
+    HostClock::advance(ms);
+  }
+}
+
+inline void delayMicroseconds(uint32_t us){
+  if(HostClock::isRealTime()) std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+inline void yield(){ std::this_thread::yield(); }
+
+//------------------------------------------------------------------------------------
+// WString
+
+class String {
+  typedef void (String::*StringIfHelperType)() const;
+  void StringIfHelper() const {}
+
+public:
+  String(){}
+  String(const char *cstr){ if(cstr) _str = cstr; }
+  String(const String &other) : _str(other._str){}
+  String(String &&other) : _str(std::move(other._str)){}
+  explicit String(char c) : _str(1, c){}
+  explicit String(unsigned char value, unsigned char base = 10){ fromUnsigned(value, base); }
+  explicit String(int value, unsigned char base = 10){ fromSigned(value, base); }
+  explicit String(unsigned int value, unsigned char base = 10){ fromUnsigned(value, base); }
+  explicit String(long value, unsigned char base = 10){ fromSigned(value, base); }
+  explicit String(unsigned long value, unsigned char base = 10){ fromUnsigned(value, base); }
+  explicit String(long long value, unsigned char base = 10){ fromSigned(value, base); }
+  explicit String(unsigned long long value, unsigned char base = 10){ fromUnsigned(value, base); }
+  explicit String(float value, unsigned char decimals = 2){ fromDouble(value, decimals); }
+  explicit String(double value, unsigned char decimals = 2){ fromDouble(value, decimals); }
+
+  String &operator=(const String &rhs){ _str = rhs._str; return *this; }
+  String &operator=(String &&rhs){ _str = std::move(rhs._str); return *this; }
+  String &operator=(const char *cstr){ _str = cstr ? cstr : ""; return *this; }
+
+  operator StringIfHelperType() const { return &String::StringIfHelper; }
+
+  unsigned char reserve(unsigned int size){ _str.reserve(size); return 1; }
+  unsigned int length() const { return _str.length(); }
+  bool isEmpty() const { return _str.empty(); }
+  const char *c_str() const { return _str.c_str(); }
+
+  bool concat(const String &s){ _str += s._str; return true; }
+  bool concat(const char *cstr){ if(cstr) _str += cstr; return true; }
+  bool concat(const char *cstr, unsigned int length){ _str.append(cstr, length); return true; }
+  bool concat(char c){ _str += c; return true; }
+  bool concat(unsigned char c){ return concat(String(c)); }
+  bool concat(int n){ return concat(String(n)); }
+  bool concat(unsigned int n){ return concat(String(n)); }
+  bool concat(long n){ return concat(String(n)); }
+  bool concat(unsigned long n){ return concat(String(n)); }
+  bool concat(long long n){ return concat(String(n)); }
+  bool concat(unsigned long long n){ return concat(String(n)); }
+  bool concat(float n){ return concat(String(n)); }
+  bool concat(double n){ return concat(String(n)); }
+
+  template<typename T> String &operator+=(const T &rhs){ concat(rhs); return *this; }
+  String &operator+=(const char *rhs){ concat(rhs); return *this; }
+
+  bool equals(const String &s) const { return _str == s._str; }
+  bool equals(const char *cstr) const { return _str == (cstr ? cstr : ""); }
+  bool operator==(const String &rhs) const { return equals(rhs); }
+  bool operator==(const char *cstr) const { return equals(cstr); }
+  bool operator!=(const String &rhs) const { return !equals(rhs); }
+  bool operator!=(const char *cstr) const { return !equals(cstr); }
+  bool operator<(const String &rhs) const { return _str < rhs._str; }
+  bool equalsIgnoreCase(const String &s) const {
+    if(s.length() != length()) return false;
+    for(size_t i = 0; i < _str.size(); i++){
+      if(tolower(_str[i]) != tolower(s._str[i])) return false;
+    }
+    return true;
+  }
+  bool startsWith(const String &prefix) const { return _str.compare(0, prefix._str.size(), prefix._str) == 0; }
+  bool endsWith(const String &suffix) const {
+    return _str.size() >= suffix._str.size() && _str.compare(_str.size() - suffix._str.size(), suffix._str.size(), suffix._str) == 0;
+  }
+
+  char charAt(unsigned int index) const { return index < _str.size() ? _str[index] : 0; }
+  char operator[](unsigned int index) const { return charAt(index); }
+  char &operator[](unsigned int index){ return _str[index]; }
+
+  int indexOf(char c, unsigned int from = 0) const { return toIndex(_str.find(c, from)); }
+  int indexOf(const char *s, unsigned int from = 0) const { return toIndex(_str.find(s, from)); }
+  int indexOf(const String &s, unsigned int from = 0) const { return toIndex(_str.find(s._str, from)); }
+  int lastIndexOf(char c) const { return toIndex(_str.rfind(c)); }
+  int lastIndexOf(const String &s) const { return toIndex(_str.rfind(s._str)); }
+
+  String substring(unsigned int left) const { return substring(left, length()); }
+  String substring(unsigned int left, unsigned int right) const {
+    if(left > right) { unsigned int t = left; left = right; right = t; }
+    if(left >= _str.size()) return String();
+    if(right > _str.size()) right = _str.size();
+    return String(_str.substr(left, right - left).c_str());
+  }
+
+  void replace(const String &find, const String &replace){
+    if(find._str.empty()) return;
+    size_t pos = 0;
+    while((pos = _str.find(find._str, pos)) != std::string::npos){
+      _str.replace(pos, find._str.size(), replace._str);
+      pos += replace._str.size();
+    }
+  }
+  void remove(unsigned int index){ if(index < _str.size()) _str.erase(index); }
+  void remove(unsigned int index, unsigned int count){ if(index < _str.size()) _str.erase(index, count); }
+  void toLowerCase(){ for(auto &c : _str) c = tolower(c); }
+  void toUpperCase(){ for(auto &c : _str) c = toupper(c); }
+  void trim(){
+    size_t b = _str.find_first_not_of(" \t\r\n");
+    size_t e = _str.find_last_not_of(" \t\r\n");
+    _str = b == std::string::npos ? std::string() : _str.substr(b, e - b + 1);
+  }
+
+  long toInt() const { return strtol(_str.c_str(), NULL, 10); }
+  float toFloat() const { return strtof(_str.c_str(), NULL); }
+
+private:
+  std::string _str;
+
+  static int toIndex(size_t pos){ return pos == std::string::npos ? -1 : (int)pos; }
+
+  void fromUnsigned(unsigned long long value, unsigned char base){
+    char buf[66];
+    char *p = buf + sizeof(buf) - 1;
+    *p = '\0';
+    do {
+      unsigned d = value % base;
+      *--p = d < 10 ? '0' + d : 'a' + d - 10;
+      value /= base;
+    } while(value);
+    _str = p;
+  }
+
+  void fromSigned(long long value, unsigned char base){
+    if(base == 10 && value < 0) {
+      fromUnsigned((unsigned long long)(-(value + 1)) + 1, base);
+      _str.insert(_str.begin(), '-');
+    } else {
+      fromUnsigned((unsigned long long)value, base);
+    }
+  }
+
+  void fromDouble(double value, unsigned char decimals){
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.*f", decimals, value);
+    _str = buf;
+  }
+};
+
+inline String operator+(const String &lhs, const String &rhs){ String s(lhs); s.concat(rhs); return s; }
+inline String operator+(const String &lhs, const char *rhs){ String s(lhs); s.concat(rhs); return s; }
+inline String operator+(const char *lhs, const String &rhs){ String s(lhs); s.concat(rhs); return s; }
+inline String operator+(const String &lhs, char rhs){ String s(lhs); s.concat(rhs); return s; }
+inline String operator+(const String &lhs, int rhs){ String s(lhs); s.concat(rhs); return s; }
+inline String operator+(const String &lhs, unsigned int rhs){ String s(lhs); s.concat(rhs); return s; }
+inline String operator+(const String &lhs, long rhs){ String s(lhs); s.concat(rhs); return s; }
+inline String operator+(const String &lhs, unsigned long rhs){ String s(lhs); s.concat(rhs); return s; }
+inline bool operator==(const char *lhs, const String &rhs){ return rhs == lhs; }
+
+//------------------------------------------------------------------------------------
+// Print and Stream
+
+class Print {
+public:
+  virtual ~Print(){}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size){
+    size_t n = 0;
+    while(size--) n += write(*buffer++);
+    return n;
+  }
+  size_t write(const char *str){ return str ? write((const uint8_t *)str, strlen(str)) : 0; }
+  size_t write(const char *buffer, size_t size){ return write((const uint8_t *)buffer, size); }
+
+  size_t print(const char *s){ return write(s); }
+  size_t print(const String &s){ return write((const uint8_t *)s.c_str(), s.length()); }
+  size_t print(const std::string &s){ return write((const uint8_t *)s.data(), s.size()); }
+  size_t print(char c){ return write((uint8_t)c); }
+  size_t print(unsigned char n, int base = DEC){ return print(String(n, base)); }
+  size_t print(int n, int base = DEC){ return print(String(n, base)); }
+  size_t print(unsigned int n, int base = DEC){ return print(String(n, base)); }
+  size_t print(long n, int base = DEC){ return print(String(n, base)); }
+  size_t print(unsigned long n, int base = DEC){ return print(String(n, base)); }
+  size_t print(long long n, int base = DEC){ return print(String(n, base)); }
+  size_t print(unsigned long long n, int base = DEC){ return print(String(n, base)); }
+  size_t print(double n, int digits = 2){ return print(String(n, digits)); }
+
+  size_t println(){ return write("\r\n"); }
+  template<typename T> size_t println(const T &value){ size_t n = print(value); return n + println(); }
+  template<typename T> size_t println(const T &value, int format){ size_t n = print(value, format); return n + println(); }
+
+  size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3))){
+    char buf[512];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    if(len < 0) return 0;
+    if((size_t)len >= sizeof(buf)) len = sizeof(buf) - 1;
+    return write((const uint8_t *)buf, len);
+  }
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual void flush(){}
+
+  void setTimeout(unsigned long timeout){ _timeout = timeout; }
+  unsigned long getTimeout(){ return _timeout; }
+
+  size_t readBytes(uint8_t *buffer, size_t length){
+    size_t count = 0;
+    while(count < length) {
+      int c = timedRead();
+      if(c < 0) break;
+      *buffer++ = (uint8_t)c;
+      count++;
+    }
+    return count;
+  }
+  size_t readBytes(char *buffer, size_t length){ return readBytes((uint8_t *)buffer, length); }
+
+  String readString(){
+    String ret;
+    int c = timedRead();
+    while(c >= 0) {
+      ret += (char)c;
+      c = timedRead();
+    }
+    return ret;
+  }
+
+  String readStringUntil(char terminator){
+    String ret;
+    int c = timedRead();
+    while(c >= 0 && c != terminator) {
+      ret += (char)c;
+      c = timedRead();
+    }
+    return ret;
+  }
+
+protected:
+  unsigned long _timeout = 1000;
+
+  // Stream timeouts always use wall time, a stalled peer never advances the virtual clock.
+  virtual int timedRead(){
+    uint64_t start = HostClock::realMillis();
+    do {
+      int c = read();
+      if(c >= 0) return c;
+      if(!waitForData()) std::this_thread::yield();
+    } while(HostClock::realMillis() - start < _timeout);
+    return -1;
+  }
+
+  // Block briefly until more data may be available, returns false if not supported.
+  virtual bool waitForData(){ return false; }
+};
+
+//------------------------------------------------------------------------------------
+// Serial
+
+class HardwareSerial : public Stream {
+public:
+  void begin(unsigned long){}
+  void end(){}
+  size_t write(uint8_t c) override { return enabled() ? fwrite(&c, 1, 1, stdout) : 1; }
+  size_t write(const uint8_t *buffer, size_t size) override {
+    return enabled() ? fwrite(buffer, 1, size, stdout) : size;
+  }
+  using Print::write;
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+
+  // Benchmarks silence the managers' logging so it does not dominate timings.
+  static void setEnabled(bool enabled){ enabledFlag() = enabled; }
+  static bool enabled(){ return enabledFlag(); }
+
+private:
+  static std::atomic<bool> &enabledFlag(){ static std::atomic<bool> e(true); return e; }
+};
+
+static HardwareSerial Serial __attribute__((unused));
+
+//------------------------------------------------------------------------------------
+// ESP32 system
+
+class HostRestart {};
+
+// Heap in use by the threads that set tracked(), the loop task and the
+// managers' tasks rather than the mock servers. Kept by a replacement
+// operator new where one is linked in (host/bench), else it stays at 0.
+class HostHeap {
+public:
+  static const uint32_t size = 320 * 1024;
+  static std::atomic<int64_t> &used(){ static std::atomic<int64_t> bytes(0); return bytes; }
+  static std::atomic<int64_t> &peak(){ static std::atomic<int64_t> bytes(0); return bytes; }
+  static bool &tracked(){ static thread_local bool on = false; return on; }
+
+  static void allocated(size_t bytes){
+    int64_t now = used() += bytes;
+    int64_t high = peak();
+    while(now > high && !peak().compare_exchange_weak(high, now)){
+    }
+  }
+  static void freed(size_t bytes){ used() -= bytes; }
+  static void resetPeak(){ peak() = used().load(); }
+};
+
+class EspClass {
+public:
+  // The host build has no device to reboot, unwind to the simulation harness instead.
+  void restart(){ throw HostRestart(); }
+  uint32_t getHeapSize(){ return HostHeap::size; }
+  uint32_t getFreeHeap(){ return HostHeap::size - HostHeap::used(); }
+  uint32_t getMinFreeHeap(){ return HostHeap::size - HostHeap::peak(); }
+  uint32_t getCpuFreqMHz(){ return 240; }
+};
+
+static EspClass ESP __attribute__((unused));
+
+typedef enum {
+  ESP_MAC_WIFI_STA,
+  ESP_MAC_WIFI_SOFTAP,
+  ESP_MAC_BT,
+  ESP_MAC_ETH
+} esp_mac_type_t;
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+class HostDevice {
+public:
+  static uint8_t *mac(){ static uint8_t m[6] = {0x24, 0x0A, 0xC4, 0x12, 0xAB, 0xCD}; return m; }
+};
+
+inline esp_err_t esp_read_mac(uint8_t *mac, esp_mac_type_t type){
+  memcpy(mac, HostDevice::mac(), 6);
+  mac[5] += (uint8_t)type;
+  return ESP_OK;
+}
+
+inline void configTime(long, int, const char *, const char * = nullptr, const char * = nullptr){}
+
+inline long random(long max){ return max > 0 ? rand() % max : 0; }
+inline long random(long min, long max){ return min + random(max - min); }
+inline uint32_t esp_random(){ return ((uint32_t)rand() << 16) ^ (uint32_t)rand(); }
+
+template<typename T> inline T constrain(T x, T a, T b){ return x < a ? a : (x > b ? b : x); }
+
+#endif // HOST_ARDUINO_H
@@ -0,0 +1,13 @@
+/*
+  BLE2902.h - Host stand-in, see BLEDevice.h
+  Released into the public domain.
+*/
+
+#if !defined(HOST_BLE2902_H)
+#define HOST_BLE2902_H
+
+#include <BLEDevice.h>
+
+class BLE2902 : public BLEDescriptor {};
+
+#endif // HOST_BLE2902_H
@@ -0,0 +1,142 @@
+/*
+  BLEDevice.h - Host stand-in for the ESP32 BLE library
+  Released into the public domain.
+
+  Enough of the GATT server API for BLEManager. hostConnect(),
+  hostDisconnect() and BLECharacteristic::hostWrite() raise the same
+  callbacks as a remote central would, notify() is recorded.
+*/
+
+#if !defined(HOST_BLE_DEVICE_H)
+#define HOST_BLE_DEVICE_H
+
+#include <Arduino.h>
+#include <mutex>
+
+class BLEServer;
+class BLECharacteristic;
+
+//------------------------------------------------------------------------------------
+class BLEUUID {
+public:
+  BLEUUID(){}
+  BLEUUID(const char *uuid) : _uuid(uuid){}
+  static BLEUUID fromString(std::string uuid){ return BLEUUID(uuid.c_str()); }
+  std::string toString() const { return _uuid; }
+
+private:
+  std::string _uuid;
+};
+
+//------------------------------------------------------------------------------------
+class BLEDescriptor {
+public:
+  virtual ~BLEDescriptor(){}
+};
+
+class BLEServerCallbacks {
+public:
+  virtual ~BLEServerCallbacks(){}
+  virtual void onConnect(BLEServer *pServer){}
+  virtual void onDisconnect(BLEServer *pServer){}
+};
+
+class BLECharacteristicCallbacks {
+public:
+  virtual ~BLECharacteristicCallbacks(){}
+  virtual void onWrite(BLECharacteristic *pCharacteristic){}
+  virtual void onRead(BLECharacteristic *pCharacteristic){}
+};
+
+//------------------------------------------------------------------------------------
+class BLECharacteristic {
+public:
+  static const uint32_t PROPERTY_READ   = 1 << 0;
+  static const uint32_t PROPERTY_WRITE  = 1 << 1;
+  static const uint32_t PROPERTY_NOTIFY = 1 << 2;
+
+  BLECharacteristic(const char *uuid, uint32_t properties) : _uuid(uuid), _properties(properties){}
+
+  void addDescriptor(BLEDescriptor *descriptor){}
+  void setCallbacks(BLECharacteristicCallbacks *callbacks){ _callbacks = callbacks; }
+  void setValue(std::string value){ std::lock_guard<std::mutex> guard(_mutex); _value = value; }
+  void setValue(uint8_t *data, size_t size){ std::lock_guard<std::mutex> guard(_mutex); _value.assign((const char *)data, size); }
+  std::string getValue(){ std::lock_guard<std::mutex> guard(_mutex); return _value; }
+
+  void notify(){
+    std::lock_guard<std::mutex> guard(_mutex);
+    _notified.push_back(_value);
+  }
+
+  // A remote central writing value.
+  void hostWrite(const std::string &value){
+    setValue(value);
+    if(_callbacks) _callbacks->onWrite(this);
+  }
+
+  std::vector<std::string> hostNotified(){ std::lock_guard<std::mutex> guard(_mutex); return _notified; }
+
+private:
+  std::string _uuid;
+  uint32_t _properties;
+  std::string _value;
+  std::vector<std::string> _notified;
+  std::mutex _mutex;
+  BLECharacteristicCallbacks *_callbacks = NULL;
+};
+
+//------------------------------------------------------------------------------------
+class BLEService {
+public:
+  BLEService(BLEUUID uuid) : _uuid(uuid){}
+  BLECharacteristic *createCharacteristic(const char *uuid, uint32_t properties){
+    BLECharacteristic *characteristic = new BLECharacteristic(uuid, properties);
+    _characteristics.push_back(characteristic);
+    return characteristic;
+  }
+  void start(){}
+  BLEUUID getUUID(){ return _uuid; }
+
+private:
+  BLEUUID _uuid;
+  std::vector<BLECharacteristic *> _characteristics;
+};
+
+//------------------------------------------------------------------------------------
+class BLEAdvertising {
+public:
+  void addServiceUUID(BLEUUID uuid){}
+  void start(){ _advertising = true; }
+  void stop(){ _advertising = false; }
+
+private:
+  bool _advertising = false;
+};
+
+//------------------------------------------------------------------------------------
+class BLEServer {
+public:
+  void setCallbacks(BLEServerCallbacks *callbacks){ _callbacks = callbacks; }
+  BLEService *createService(BLEUUID uuid){ _service = new BLEService(uuid); return _service; }
+  BLEAdvertising *getAdvertising(){ return &_advertising; }
+
+  void hostConnect(){ if(_callbacks) _callbacks->onConnect(this); }
+  void hostDisconnect(){ if(_callbacks) _callbacks->onDisconnect(this); }
+
+private:
+  BLEServerCallbacks *_callbacks = NULL;
+  BLEService *_service = NULL;
+  BLEAdvertising _advertising;
+};
+
+//------------------------------------------------------------------------------------
+class BLEDevice {
+public:
+  static void init(std::string deviceName){ name() = deviceName; }
+  static BLEServer *createServer(){ server() = new BLEServer(); return server(); }
+
+  static std::string &name(){ static std::string n; return n; }
+  static BLEServer *&server(){ static BLEServer *s = NULL; return s; }
+};
+
+#endif // HOST_BLE_DEVICE_H
@@ -0,0 +1,6 @@
+/*
+  BLEServer.h - Host stand-in, see BLEDevice.h
+  Released into the public domain.
+*/
+
+#include <BLEDevice.h>
@@ -0,0 +1,6 @@
+/*
+  BLEUtils.h - Host stand-in, see BLEDevice.h
+  Released into the public domain.
+*/
+
+#include <BLEDevice.h>
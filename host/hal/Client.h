@@ -0,0 +1,21 @@
+/*
+  Client.h - Host stand-in for the Arduino Client interface
+  Released into the public domain.
+*/
+
+#if !defined(HOST_CLIENT_H)
+#define HOST_CLIENT_H
+
+#include <Arduino.h>
+
+class Client : public Stream {
+public:
+  using Stream::read;
+
+  virtual int connect(const char *host, uint16_t port) = 0;
+  virtual int read(uint8_t *buffer, size_t size) = 0;
+  virtual uint8_t connected() = 0;
+  virtual void stop() = 0;
+};
+
+#endif // HOST_CLIENT_H
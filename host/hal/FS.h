@@ -0,0 +1,159 @@
+/*
+  FS.h - Host stand-in for the arduino-esp32 file system API
+  Released into the public domain.
+
+  Files live in HostFlash, a process wide in-memory store, so what was
+  written survives a new begin() the way flash survives a restart.
+  HostFlash counts writes and bytes written, and tearNext() cuts the next
+  write short to stand in for power lost in the middle of it.
+*/
+
+#if !defined(HOST_FS_H)
+#define HOST_FS_H
+
+#include <Arduino.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#define FILE_READ   "r"
+#define FILE_WRITE  "w"
+#define FILE_APPEND "a"
+
+class HostFlash {
+public:
+  typedef std::shared_ptr<std::string> Data;
+
+  size_t capacity = 0x170000; // spiffs in partitions/default.csv
+  uint32_t writes = 0;
+  uint64_t bytesWritten = 0;
+  uint32_t removes = 0;
+
+  static HostFlash &instance(){ static HostFlash flash; return flash; }
+  static std::recursive_mutex &lock(){ static std::recursive_mutex m; return m; }
+
+  std::map<std::string, Data> files;
+
+  size_t used(){
+    size_t total = 0;
+    for(auto &file : files) total += file.second->size();
+    return total;
+  }
+
+  // The next write only gets bytes through, as if power went at that point.
+  void tearNext(size_t bytes){ _tear = (long)bytes; }
+  long takeTear(){ long tear = _tear; _tear = -1; return tear; }
+
+  void resetStats(){ writes = removes = 0; bytesWritten = 0; }
+  void erase(){ files.clear(); }
+
+private:
+  long _tear = -1;
+};
+
+namespace fs {
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+//------------------------------------------------------------------------------------
+class File {
+public:
+  File(){}
+  File(HostFlash::Data data, bool append, bool readOnly) : _data(data), _append(append), _readOnly(readOnly){}
+
+  operator bool() const { return _data != nullptr; }
+
+  size_t write(const uint8_t *buf, size_t size){
+    if(!_data || _readOnly) return 0;
+    std::lock_guard<std::recursive_mutex> guard(HostFlash::lock());
+    HostFlash &flash = HostFlash::instance();
+    if(flash.used() + size > flash.capacity) return 0;
+    long tear = flash.takeTear();
+    size_t written = tear >= 0 && (size_t)tear < size ? (size_t)tear : size;
+    if(_append) _position = _data->size();
+    if(_position > _data->size()) _data->resize(_position);
+    _data->replace(_position, std::min(written, _data->size() - _position), (const char *)buf, written);
+    _position += written;
+    flash.writes++;
+    flash.bytesWritten += written;
+    return written;
+  }
+  size_t write(uint8_t c){ return write(&c, 1); }
+
+  size_t read(uint8_t *buf, size_t size){
+    if(!_data) return 0;
+    std::lock_guard<std::recursive_mutex> guard(HostFlash::lock());
+    size_t count = _position < _data->size() ? std::min(size, _data->size() - _position) : 0;
+    memcpy(buf, _data->data() + _position, count);
+    _position += count;
+    return count;
+  }
+
+  int available(){ return _data && _position < _data->size() ? (int)(_data->size() - _position) : 0; }
+  void flush(){}
+
+  bool seek(uint32_t pos, SeekMode mode = SeekSet){
+    if(!_data) return false;
+    size_t base = mode == SeekSet ? 0 : mode == SeekCur ? _position : _data->size();
+    if(base + pos > _data->size()) return false;
+    _position = base + pos;
+    return true;
+  }
+
+  size_t position() const { return _position; }
+  size_t size() const { return _data ? _data->size() : 0; }
+  void close(){ _data = nullptr; _position = 0; }
+
+private:
+  HostFlash::Data _data;
+  size_t _position = 0;
+  bool _append = false;
+  bool _readOnly = true;
+};
+
+//------------------------------------------------------------------------------------
+class FS {
+public:
+  File open(const char *path, const char *mode = FILE_READ){
+    std::lock_guard<std::recursive_mutex> guard(HostFlash::lock());
+    std::map<std::string, HostFlash::Data> &files = HostFlash::instance().files;
+    auto it = files.find(path);
+    if(mode[0] == 'r'){
+      return it == files.end() ? File() : File(it->second, false, true);
+    }
+    if(it == files.end()){
+      it = files.insert(std::make_pair(std::string(path), std::make_shared<std::string>())).first;
+    }
+    else if(mode[0] == 'w'){
+      it->second = std::make_shared<std::string>();
+    }
+    return File(it->second, mode[0] == 'a', false);
+  }
+  File open(const String &path, const char *mode = FILE_READ){ return open(path.c_str(), mode); }
+
+  bool exists(const char *path){
+    std::lock_guard<std::recursive_mutex> guard(HostFlash::lock());
+    return HostFlash::instance().files.count(path) > 0;
+  }
+  bool exists(const String &path){ return exists(path.c_str()); }
+
+  bool remove(const char *path){
+    std::lock_guard<std::recursive_mutex> guard(HostFlash::lock());
+    if(HostFlash::instance().files.erase(path) == 0) return false;
+    HostFlash::instance().removes++;
+    return true;
+  }
+  bool remove(const String &path){ return remove(path.c_str()); }
+};
+
+} // namespace fs
+
+using fs::FS;
+using fs::File;
+using fs::SeekMode;
+using fs::SeekSet;
+using fs::SeekCur;
+using fs::SeekEnd;
+
+#endif // HOST_FS_H
@@ -0,0 +1,26 @@
+/*
+  HTTPClient.h - Host stand-in for the ESP32 HTTPClient
+  Released into the public domain.
+*/
+
+#if !defined(HOST_HTTP_CLIENT_H)
+#define HOST_HTTP_CLIENT_H
+
+#include <WiFi.h>
+
+#define HTTP_CODE_OK 200
+
+class HTTPClient {
+public:
+  bool begin(WiFiClient &client, String url){ _url = url; return true; }
+  bool begin(String url){ _url = url; return true; }
+  int GET(){ return -1; }
+  int POST(String payload){ return -1; }
+  String getString(){ return String(); }
+  void end(){}
+
+private:
+  String _url;
+};
+
+#endif // HOST_HTTP_CLIENT_H
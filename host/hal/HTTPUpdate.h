@@ -0,0 +1,28 @@
+/*
+  HTTPUpdate.h - Host stand-in for the ESP32 HTTPUpdate
+  Released into the public domain.
+*/
+
+#if !defined(HOST_HTTP_UPDATE_H)
+#define HOST_HTTP_UPDATE_H
+
+#include <WiFi.h>
+
+enum HTTPUpdateResult {
+  HTTP_UPDATE_FAILED,
+  HTTP_UPDATE_NO_UPDATES,
+  HTTP_UPDATE_OK
+};
+
+typedef HTTPUpdateResult t_httpUpdate_return;
+
+class HTTPUpdate {
+public:
+  t_httpUpdate_return update(WiFiClient &client, const String &url){ return HTTP_UPDATE_NO_UPDATES; }
+  int getLastError(){ return 0; }
+  String getLastErrorString(){ return String(); }
+};
+
+static HTTPUpdate httpUpdate __attribute__((unused));
+
+#endif // HOST_HTTP_UPDATE_H
@@ -0,0 +1,93 @@
+/*
+  LoRa.h - Host stand-in for the arduino-LoRa library
+  Released into the public domain.
+
+  Transmitted packets are collected in hostSent(). hostReceive() plays a
+  packet into the receive buffer and calls the onReceive callback like the
+  DIO0 interrupt would. endPacket() can be made to take a time on air.
+*/
+
+#if !defined(HOST_LORA_H)
+#define HOST_LORA_H
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <mutex>
+
+class LoRaClass : public Stream {
+public:
+  void setPins(int ss, int reset, int dio0){}
+  int begin(long frequency){ return 1; }
+  void end(){}
+  void setTxPower(int level, int outputPin = 0){}
+  void onReceive(void (*callback)(int)){ _onReceive = callback; }
+  void receive(int size = 0){ _receiving = true; }
+  void idle(){ _receiving = false; }
+  void sleep(){ _receiving = false; }
+  void enableInvertIQ(){ _invertIQ = true; }
+  void disableInvertIQ(){ _invertIQ = false; }
+  int packetRssi(){ return _rssi; }
+  float packetSnr(){ return _snr; }
+
+  int beginPacket(int implicitHeader = false){ _tx.clear(); return 1; }
+  size_t write(uint8_t c) override { _tx.push_back(c); return 1; }
+  size_t write(const uint8_t *buffer, size_t size) override { _tx.insert(_tx.end(), buffer, buffer + size); return size; }
+  using Print::write;
+
+  int endPacket(bool async = false){
+    if(_airTime > 0) std::this_thread::sleep_for(std::chrono::milliseconds(_airTime));
+    std::lock_guard<std::mutex> guard(_mutex);
+    _sent.push_back(_tx);
+    return 1;
+  }
+
+  int available() override { return (int)(_rx.size() - _rxIndex); }
+  int read() override { return _rxIndex < _rx.size() ? _rx[_rxIndex++] : -1; }
+  int peek() override { return _rxIndex < _rx.size() ? _rx[_rxIndex] : -1; }
+
+  // Delivers a packet as if it had arrived over the air.
+  void hostReceive(const uint8_t *packet, size_t size){
+    _rx.assign(packet, packet + size);
+    _rxIndex = 0;
+    if(_onReceive) _onReceive((int)size);
+  }
+
+  // What packetRssi() and packetSnr() report for the packets that follow.
+  void hostSetSignal(int rssi, float snr){ _rssi = rssi; _snr = snr; }
+
+  // Blocks endPacket() for ms of wall time, like a real transmission.
+  void hostSetAirTime(uint32_t ms){ _airTime = ms; }
+
+  std::vector<std::vector<uint8_t> > hostSent(){
+    std::lock_guard<std::mutex> guard(_mutex);
+    return _sent;
+  }
+
+  void hostClearSent(){
+    std::lock_guard<std::mutex> guard(_mutex);
+    _sent.clear();
+  }
+
+  bool hostInvertIQ(){ return _invertIQ; }
+
+protected:
+  // Packets are read straight out of the FIFO, never wait for more.
+  int timedRead() override { return read(); }
+
+private:
+  void (*_onReceive)(int) = NULL;
+  std::vector<uint8_t> _tx;
+  std::vector<uint8_t> _rx;
+  size_t _rxIndex = 0;
+  std::vector<std::vector<uint8_t> > _sent;
+  std::mutex _mutex;
+  uint32_t _airTime = 0;
+  bool _receiving = false;
+  bool _invertIQ = false;
+  int _rssi = -60;
+  float _snr = 9.5;
+};
+
+static LoRaClass LoRa __attribute__((unused));
+
+#endif // HOST_LORA_H
@@ -0,0 +1,195 @@
+/*
+  Preferences.h - Host stand-in for the ESP32 NVS Preferences library
+  Released into the public domain.
+
+  Values live in a process wide in-memory store keyed by namespace.
+  HostNVS counts namespace opens, flash writes and commits so the cost of
+  parameter access can be compared between builds. Like the real library
+  every put and remove is committed on its own.
+*/
+
+#if !defined(HOST_PREFERENCES_H)
+#define HOST_PREFERENCES_H
+
+#include <Arduino.h>
+#include <map>
+#include <mutex>
+
+enum PreferenceType { PT_I8, PT_U8, PT_I16, PT_U16, PT_I32, PT_U32, PT_I64, PT_U64, PT_STR, PT_BLOB, PT_INVALID };
+
+struct HostNVSEntry {
+  PreferenceType type;
+  std::string bytes;
+};
+
+class HostNVS {
+public:
+  typedef std::map<std::string, HostNVSEntry> Namespace;
+
+  uint32_t opens = 0;
+  uint32_t writes = 0;
+  uint32_t commits = 0;
+  uint32_t reads = 0;
+
+  static HostNVS &instance(){ static HostNVS nvs; return nvs; }
+  static std::mutex &lock(){ static std::mutex m; return m; }
+
+  Namespace &space(const std::string &name){ return spaces[name]; }
+  void resetStats(){ opens = writes = commits = reads = 0; }
+  void erase(){ spaces.clear(); }
+
+private:
+  std::map<std::string, Namespace> spaces;
+};
+
+//------------------------------------------------------------------------------------
+class Preferences {
+public:
+  Preferences(){}
+  ~Preferences(){ end(); }
+
+  bool begin(const char *name, bool readOnly = false, const char * = NULL){
+    if(_open) return false;
+    std::lock_guard<std::mutex> guard(HostNVS::lock());
+    HostNVS::instance().opens++;
+    _name = name;
+    _readOnly = readOnly;
+    _open = true;
+    return true;
+  }
+
+  void end(){ _open = false; }
+
+  bool clear(){
+    if(!writable()) return false;
+    std::lock_guard<std::mutex> guard(HostNVS::lock());
+    HostNVS::instance().space(_name).clear();
+    HostNVS::instance().writes++;
+    HostNVS::instance().commits++;
+    return true;
+  }
+
+  bool remove(const char *key){
+    if(!writable()) return false;
+    std::lock_guard<std::mutex> guard(HostNVS::lock());
+    HostNVS::Namespace &ns = HostNVS::instance().space(_name);
+    if(!ns.erase(key)) return false;
+    HostNVS::instance().writes++;
+    HostNVS::instance().commits++;
+    return true;
+  }
+
+  bool isKey(const char *key){
+    if(!_open) return false;
+    std::lock_guard<std::mutex> guard(HostNVS::lock());
+    HostNVS::Namespace &ns = HostNVS::instance().space(_name);
+    return ns.find(key) != ns.end();
+  }
+
+  PreferenceType getType(const char *key){
+    if(!_open) return PT_INVALID;
+    std::lock_guard<std::mutex> guard(HostNVS::lock());
+    HostNVS::Namespace &ns = HostNVS::instance().space(_name);
+    auto it = ns.find(key);
+    return it == ns.end() ? PT_INVALID : it->second.type;
+  }
+
+  size_t putChar(const char *key, int8_t value){ return putValue(key, PT_I8, value); }
+  size_t putUChar(const char *key, uint8_t value){ return putValue(key, PT_U8, value); }
+  size_t putShort(const char *key, int16_t value){ return putValue(key, PT_I16, value); }
+  size_t putUShort(const char *key, uint16_t value){ return putValue(key, PT_U16, value); }
+  size_t putInt(const char *key, int32_t value){ return putValue(key, PT_I32, value); }
+  size_t putUInt(const char *key, uint32_t value){ return putValue(key, PT_U32, value); }
+  size_t putLong(const char *key, int32_t value){ return putValue(key, PT_I32, value); }
+  size_t putULong(const char *key, uint32_t value){ return putValue(key, PT_U32, value); }
+  size_t putLong64(const char *key, int64_t value){ return putValue(key, PT_I64, value); }
+  size_t putULong64(const char *key, uint64_t value){ return putValue(key, PT_U64, value); }
+  size_t putFloat(const char *key, float value){ return putValue(key, PT_BLOB, value); }
+  size_t putDouble(const char *key, double value){ return putValue(key, PT_BLOB, value); }
+  size_t putBool(const char *key, bool value){ return putValue(key, PT_U8, (uint8_t)value); }
+  size_t putString(const char *key, const char *value){ return putRaw(key, PT_STR, value, strlen(value)); }
+  size_t putString(const char *key, String value){ return putString(key, value.c_str()); }
+  size_t putBytes(const char *key, const void *value, size_t len){ return putRaw(key, PT_BLOB, value, len); }
+
+  int8_t getChar(const char *key, int8_t defaultValue = 0){ return getValue(key, defaultValue); }
+  uint8_t getUChar(const char *key, uint8_t defaultValue = 0){ return getValue(key, defaultValue); }
+  int16_t getShort(const char *key, int16_t defaultValue = 0){ return getValue(key, defaultValue); }
+  uint16_t getUShort(const char *key, uint16_t defaultValue = 0){ return getValue(key, defaultValue); }
+  int32_t getInt(const char *key, int32_t defaultValue = 0){ return getValue(key, defaultValue); }
+  uint32_t getUInt(const char *key, uint32_t defaultValue = 0){ return getValue(key, defaultValue); }
+  int32_t getLong(const char *key, int32_t defaultValue = 0){ return getValue(key, defaultValue); }
+  uint32_t getULong(const char *key, uint32_t defaultValue = 0){ return getValue(key, defaultValue); }
+  int64_t getLong64(const char *key, int64_t defaultValue = 0){ return getValue(key, defaultValue); }
+  uint64_t getULong64(const char *key, uint64_t defaultValue = 0){ return getValue(key, defaultValue); }
+  float getFloat(const char *key, float defaultValue = NAN){ return getValue(key, defaultValue); }
+  double getDouble(const char *key, double defaultValue = NAN){ return getValue(key, defaultValue); }
+  bool getBool(const char *key, bool defaultValue = false){ return getValue(key, (uint8_t)defaultValue) != 0; }
+
+  String getString(const char *key, String defaultValue = String()){
+    std::string bytes;
+    if(!getRaw(key, bytes)) return defaultValue;
+    return String(bytes.c_str());
+  }
+
+  size_t getString(const char *key, char *value, size_t maxLen){
+    std::string bytes;
+    if(!getRaw(key, bytes) || bytes.size() + 1 > maxLen) return 0;
+    memcpy(value, bytes.c_str(), bytes.size() + 1);
+    return bytes.size() + 1;
+  }
+
+  size_t getBytesLength(const char *key){
+    std::string bytes;
+    return getRaw(key, bytes) ? bytes.size() : 0;
+  }
+
+  size_t getBytes(const char *key, void *buf, size_t maxLen){
+    std::string bytes;
+    if(!getRaw(key, bytes) || bytes.size() > maxLen) return 0;
+    memcpy(buf, bytes.data(), bytes.size());
+    return bytes.size();
+  }
+
+private:
+  bool _open = false;
+  bool _readOnly = false;
+  std::string _name;
+
+  bool writable(){ return _open && !_readOnly; }
+
+  template<typename T> size_t putValue(const char *key, PreferenceType type, T value){
+    return putRaw(key, type, &value, sizeof(T));
+  }
+
+  size_t putRaw(const char *key, PreferenceType type, const void *value, size_t len){
+    if(!writable() || strlen(key) > 15) return 0;
+    std::lock_guard<std::mutex> guard(HostNVS::lock());
+    HostNVSEntry &entry = HostNVS::instance().space(_name)[key];
+    entry.type = type;
+    entry.bytes.assign((const char *)value, len);
+    HostNVS::instance().writes++;
+    HostNVS::instance().commits++;
+    return len;
+  }
+
+  template<typename T> T getValue(const char *key, T defaultValue){
+    std::string bytes;
+    if(!getRaw(key, bytes) || bytes.size() != sizeof(T)) return defaultValue;
+    T value;
+    memcpy(&value, bytes.data(), sizeof(T));
+    return value;
+  }
+
+  bool getRaw(const char *key, std::string &bytes){
+    if(!_open) return false;
+    std::lock_guard<std::mutex> guard(HostNVS::lock());
+    HostNVS::instance().reads++;
+    HostNVS::Namespace &ns = HostNVS::instance().space(_name);
+    auto it = ns.find(key);
+    if(it == ns.end()) return false;
+    bytes = it->second.bytes;
+    return true;
+  }
+};
+
+#endif // HOST_PREFERENCES_H
@@ -0,0 +1,19 @@
+/*
+  SPI.h - Host stand-in for the ESP32 SPI library
+  Released into the public domain.
+*/
+
+#if !defined(HOST_SPI_H)
+#define HOST_SPI_H
+
+#include <Arduino.h>
+
+class SPIClass {
+public:
+  void begin(int8_t sck = -1, int8_t miso = -1, int8_t mosi = -1, int8_t ss = -1){}
+  void end(){}
+};
+
+static SPIClass SPI __attribute__((unused));
+
+#endif // HOST_SPI_H
@@ -0,0 +1,45 @@
+/*
+  SPIFFS.h - Host stand-in for the arduino-esp32 SPIFFS library
+  Released into the public domain.
+
+  Mounts the HostFlash store from FS.h, sized like the spiffs partition
+  of partitions/default.csv.
+*/
+
+#if !defined(HOST_SPIFFS_H)
+#define HOST_SPIFFS_H
+
+#include <FS.h>
+
+namespace fs {
+
+class SPIFFSFS : public FS {
+public:
+  uint32_t mounts = 0;
+
+  bool begin(bool formatOnFail = false, const char *basePath = "/spiffs", uint8_t maxOpenFiles = 10, const char *partitionLabel = NULL){
+    mounts++;
+    return true;
+  }
+  void end(){}
+
+  bool format(){
+    std::lock_guard<std::recursive_mutex> guard(HostFlash::lock());
+    HostFlash::instance().erase();
+    return true;
+  }
+
+  size_t totalBytes(){ return HostFlash::instance().capacity; }
+  size_t usedBytes(){
+    std::lock_guard<std::recursive_mutex> guard(HostFlash::lock());
+    return HostFlash::instance().used();
+  }
+};
+
+} // namespace fs
+
+static fs::SPIFFSFS SPIFFS __attribute__((unused));
+
+using fs::SPIFFSFS;
+
+#endif // HOST_SPIFFS_H
@@ -0,0 +1,31 @@
+/*
+  Update.h - Host stand-in for the ESP32 Update library
+  Released into the public domain.
+
+  Firmware written here is only counted.
+*/
+
+#if !defined(HOST_UPDATE_H)
+#define HOST_UPDATE_H
+
+#include <Arduino.h>
+
+#define UPDATE_SIZE_UNKNOWN 0xFFFFFFFF
+
+class UpdateClass {
+public:
+  bool begin(size_t size = UPDATE_SIZE_UNKNOWN){ _written = 0; _active = true; return true; }
+  size_t write(uint8_t *data, size_t len){ _written += len; return len; }
+  bool end(bool evenIfRemaining = false){ _active = false; return true; }
+  bool hasError(){ return false; }
+  void printError(Print &out){ out.println("Update error"); }
+  size_t written(){ return _written; }
+
+private:
+  size_t _written = 0;
+  bool _active = false;
+};
+
+static UpdateClass Update __attribute__((unused));
+
+#endif // HOST_UPDATE_H
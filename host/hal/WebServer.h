@@ -0,0 +1,89 @@
+/*
+  WebServer.h - Host stand-in for the ESP32 WebServer
+  Released into the public domain.
+
+  No sockets, hostRequest() calls a registered route directly so OTA
+  uploads can be simulated.
+*/
+
+#if !defined(HOST_WEB_SERVER_H)
+#define HOST_WEB_SERVER_H
+
+#include <WiFi.h>
+#include <functional>
+
+enum HTTPMethod { HTTP_ANY, HTTP_GET, HTTP_POST };
+enum HTTPUploadStatus { UPLOAD_FILE_START, UPLOAD_FILE_WRITE, UPLOAD_FILE_END, UPLOAD_FILE_ABORTED };
+
+#define HTTP_UPLOAD_BUFLEN 1436
+
+struct HTTPUpload {
+  HTTPUploadStatus status;
+  String filename;
+  String name;
+  String type;
+  size_t totalSize;
+  size_t currentSize;
+  uint8_t buf[HTTP_UPLOAD_BUFLEN];
+};
+
+class WebServer {
+public:
+  typedef std::function<void(void)> THandlerFunction;
+
+  WebServer(int port = 80) : _port(port){}
+
+  void on(const String &uri, HTTPMethod method, THandlerFunction handler){ on(uri, method, handler, THandlerFunction()); }
+  void on(const String &uri, HTTPMethod method, THandlerFunction handler, THandlerFunction upload){
+    Route route = {uri, method, handler, upload};
+    _routes.push_back(route);
+  }
+
+  void begin(){ _running = true; }
+  void handleClient(){ _polls++; }
+  void sendHeader(const String &name, const String &value, bool first = false){}
+  void send(int code, const char *type, const String &content){ _lastCode = code; }
+  HTTPUpload &upload(){ return _upload; }
+
+  // Feeds a whole upload through the route, size bytes in HTTP_UPLOAD_BUFLEN chunks.
+  bool hostUpload(const String &uri, const char *filename, size_t size){
+    for(size_t i = 0; i < _routes.size(); i++){
+      if(!(_routes[i].uri == uri) || !_routes[i].upload) continue;
+      _upload.filename = filename;
+      _upload.totalSize = 0;
+      _upload.currentSize = 0;
+      _upload.status = UPLOAD_FILE_START;
+      _routes[i].upload();
+      while(_upload.totalSize < size){
+        _upload.currentSize = size - _upload.totalSize < HTTP_UPLOAD_BUFLEN ? size - _upload.totalSize : HTTP_UPLOAD_BUFLEN;
+        _upload.status = UPLOAD_FILE_WRITE;
+        _routes[i].upload();
+        _upload.totalSize += _upload.currentSize;
+      }
+      _upload.status = UPLOAD_FILE_END;
+      _routes[i].upload();
+      _routes[i].handler();
+      return true;
+    }
+    return false;
+  }
+
+  uint32_t hostPolls(){ return _polls; }
+  int hostLastCode(){ return _lastCode; }
+
+private:
+  struct Route {
+    String uri;
+    HTTPMethod method;
+    THandlerFunction handler;
+    THandlerFunction upload;
+  };
+  std::vector<Route> _routes;
+  HTTPUpload _upload;
+  int _port;
+  bool _running = false;
+  std::atomic<uint32_t> _polls{0};
+  int _lastCode = 0;
+};
+
+#endif // HOST_WEB_SERVER_H
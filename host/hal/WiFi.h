@@ -0,0 +1,445 @@
+/*
+  WiFi.h - Host stand-in for the ESP32 WiFi library used by ESPUtils
+  Released into the public domain.
+
+  The radio is simulated: begin() connects at once and raises the same
+  events as the ESP32. WiFiClient is a plain POSIX TCP socket, HostNetwork
+  can redirect a host name (e.g. login.salesforce.com:443) to a local mock
+  server.
+*/
+
+#if !defined(HOST_WIFI_H)
+#define HOST_WIFI_H
+
+#include <Arduino.h>
+#include <Client.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+//------------------------------------------------------------------------------------
+// Addresses
+
+class IPAddress {
+public:
+  IPAddress(uint8_t a = 0, uint8_t b = 0, uint8_t c = 0, uint8_t d = 0){ _a[0] = a; _a[1] = b; _a[2] = c; _a[3] = d; }
+  String toString() const {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%u.%u.%u.%u", _a[0], _a[1], _a[2], _a[3]);
+    return String(buf);
+  }
+  operator String() const { return toString(); }
+  uint8_t operator[](int i) const { return _a[i]; }
+
+private:
+  uint8_t _a[4];
+};
+
+inline String operator+(const char *lhs, const IPAddress &rhs){ return String(lhs) + rhs.toString(); }
+inline String operator+(const String &lhs, const IPAddress &rhs){ return lhs + rhs.toString(); }
+
+class IPv6Address {
+public:
+  String toString() const { return String("fe80::260a:c4ff:fe12:abcd"); }
+};
+
+//------------------------------------------------------------------------------------
+// Modes, states and events
+
+typedef enum {
+  WIFI_MODE_NULL = 0,
+  WIFI_MODE_STA,
+  WIFI_MODE_AP,
+  WIFI_MODE_APSTA,
+  WIFI_MODE_MAX
+} wifi_mode_t;
+
+#define WIFI_OFF    WIFI_MODE_NULL
+#define WIFI_STA    WIFI_MODE_STA
+#define WIFI_AP     WIFI_MODE_AP
+#define WIFI_AP_STA WIFI_MODE_APSTA
+
+typedef enum {
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_CONNECTION_LOST = 5,
+  WL_DISCONNECTED = 6
+} wl_status_t;
+
+typedef enum {
+  SYSTEM_EVENT_WIFI_READY = 0,
+  SYSTEM_EVENT_STA_START,
+  SYSTEM_EVENT_STA_STOP,
+  SYSTEM_EVENT_STA_CONNECTED,
+  SYSTEM_EVENT_STA_DISCONNECTED,
+  SYSTEM_EVENT_STA_GOT_IP,
+  SYSTEM_EVENT_AP_START,
+  SYSTEM_EVENT_AP_STOP,
+  SYSTEM_EVENT_AP_STA_GOT_IP6,
+  SYSTEM_EVENT_MAX
+} system_event_id_t;
+
+typedef system_event_id_t WiFiEvent_t;
+typedef void (*WiFiEventCb)(system_event_id_t event);
+
+//------------------------------------------------------------------------------------
+// WiFi
+
+class WiFiClass {
+public:
+  ~WiFiClass(){
+    {
+      std::lock_guard<std::mutex> guard(_eventMutex);
+      _stopping = true;
+      _eventReady.notify_all();
+    }
+    if(_eventTask.joinable()) _eventTask.join();
+  }
+
+  // Events are raised on a separate event thread, see hostSettle().
+  void onEvent(WiFiEventCb callback){
+    std::lock_guard<std::mutex> guard(_eventMutex);
+    for(size_t i = 0; i < _callbacks.size(); i++){
+      if(_callbacks[i] == callback) return;
+    }
+    _callbacks.push_back(callback);
+  }
+
+  bool mode(wifi_mode_t mode){
+    _mode = mode;
+    if(mode == WIFI_MODE_STA || mode == WIFI_MODE_APSTA) raise(SYSTEM_EVENT_STA_START);
+    if(mode == WIFI_MODE_AP || mode == WIFI_MODE_APSTA) raise(SYSTEM_EVENT_AP_START);
+    return true;
+  }
+  wifi_mode_t getMode(){ return _mode; }
+
+  wl_status_t begin(const char *ssid, const char *pass = NULL, int32_t channel = 0, const uint8_t *bssid = NULL, bool connect = true){
+    _ssid = ssid ? ssid : "";
+    _begins++;
+    if(!_available) {
+      _status = WL_DISCONNECTED;
+      raise(SYSTEM_EVENT_STA_DISCONNECTED);
+      return _status;
+    }
+    _status = WL_CONNECTED;
+    raise(SYSTEM_EVENT_STA_CONNECTED);
+    raise(SYSTEM_EVENT_STA_GOT_IP);
+    return _status;
+  }
+
+  bool disconnect(bool wifioff = false){
+    bool was = _status == WL_CONNECTED;
+    _status = WL_DISCONNECTED;
+    if(was) raise(SYSTEM_EVENT_STA_DISCONNECTED);
+    return true;
+  }
+
+  wl_status_t status(){ return _status; }
+  bool isConnected(){ return _status == WL_CONNECTED; }
+  String SSID(){ return String(_ssid.c_str()); }
+  IPAddress localIP(){ return IPAddress(192, 168, 1, 42); }
+  IPv6Address localIPv6(){ return IPv6Address(); }
+  bool setHostname(const char *){ return true; }
+  bool enableIpV6(){ return true; }
+
+  bool softAP(const char *ssid, const char *pass = NULL, int channel = 1, int hidden = 0, int maxConnection = 4){ return true; }
+  IPAddress softAPIP(){ return IPAddress(192, 168, 4, 1); }
+  bool softAPsetHostname(const char *){ return true; }
+  bool softAPenableIpV6(){ return true; }
+
+  // Simulates the access point going away (false) or coming back (true).
+  void hostSetAvailable(bool available){
+    _available = available;
+    if(!available) disconnect();
+  }
+  uint32_t hostBegins(){ return _begins; }
+
+private:
+  std::vector<WiFiEventCb> _callbacks;
+  wifi_mode_t _mode = WIFI_MODE_NULL;
+  wl_status_t _status = WL_IDLE_STATUS;
+  std::string _ssid;
+  bool _available = true;
+  uint32_t _begins = 0;
+
+  std::mutex _eventMutex;
+  std::condition_variable _eventReady;
+  std::deque<system_event_id_t> _events;
+  std::thread _eventTask;
+  bool _stopping = false;
+  int _busy = 0;
+
+  // Like the ESP32 event task, callbacks run on their own thread after the call returns.
+  void raise(system_event_id_t event){
+    std::lock_guard<std::mutex> guard(_eventMutex);
+    _events.push_back(event);
+    if(!_eventTask.joinable()){
+      _eventTask = std::thread(&WiFiClass::eventTask, this);
+    }
+    _eventReady.notify_all();
+  }
+
+  void eventTask(){
+    std::unique_lock<std::mutex> lock(_eventMutex);
+    while(true){
+      _eventReady.wait(lock, [this]{ return !_events.empty() || _stopping; });
+      if(_stopping) return;
+      system_event_id_t event = _events.front();
+      _events.pop_front();
+      _busy++;
+      std::vector<WiFiEventCb> callbacks = _callbacks;
+      lock.unlock();
+      for(size_t i = 0; i < callbacks.size(); i++) callbacks[i](event);
+      lock.lock();
+      _busy--;
+      _eventReady.notify_all();
+    }
+  }
+
+public:
+  // Waits until every raised event has been handled.
+  void hostSettle(){
+    std::unique_lock<std::mutex> lock(_eventMutex);
+    _eventReady.wait(lock, [this]{ return _events.empty() && _busy == 0; });
+  }
+};
+
+static WiFiClass WiFi __attribute__((unused));
+
+//------------------------------------------------------------------------------------
+// HostNetwork - Name redirection and counters for WiFiClient
+
+class HostNetwork {
+public:
+  // Connections to host:port go to toHost:toPort instead.
+  static void redirect(const char *host, uint16_t port, const char *toHost, uint16_t toPort){
+    std::lock_guard<std::mutex> guard(mutex());
+    Route route = {host, port, toHost, toPort};
+    routes().push_back(route);
+  }
+
+  static void clearRedirects(){
+    std::lock_guard<std::mutex> guard(mutex());
+    routes().clear();
+  }
+
+  static void resolve(const char *host, uint16_t port, std::string &toHost, uint16_t &toPort){
+    std::lock_guard<std::mutex> guard(mutex());
+    toHost = host;
+    toPort = port;
+    for(size_t i = 0; i < routes().size(); i++){
+      if(routes()[i].host == host && routes()[i].port == port){
+        toHost = routes()[i].toHost;
+        toPort = routes()[i].toPort;
+        return;
+      }
+    }
+  }
+
+  // ms a name lookup takes, on HostClock, for the clients that step through one
+  static std::atomic<int> &resolveTime(){ static std::atomic<int> ms(0); return ms; }
+
+  static std::atomic<uint32_t> &attempts(){ static std::atomic<uint32_t> a(0); return a; }
+  static std::atomic<uint32_t> &connects(){ static std::atomic<uint32_t> c(0); return c; }
+  static std::atomic<uint64_t> &bytesSent(){ static std::atomic<uint64_t> b(0); return b; }
+  static std::atomic<uint64_t> &bytesReceived(){ static std::atomic<uint64_t> b(0); return b; }
+
+private:
+  struct Route {
+    std::string host;
+    uint16_t port;
+    std::string toHost;
+    uint16_t toPort;
+  };
+  static std::vector<Route> &routes(){ static std::vector<Route> r; return r; }
+  static std::mutex &mutex(){ static std::mutex m; return m; }
+};
+
+//------------------------------------------------------------------------------------
+// WiFiClient - TCP over POSIX sockets, copies share the connection like on the ESP32
+
+class HostSocket {
+public:
+  explicit HostSocket(int fd) : fd(fd){}
+  ~HostSocket(){ close(); }
+  void close(){ if(fd >= 0){ ::close(fd); fd = -1; } }
+  int fd;
+};
+
+class WiFiClient : public Client {
+public:
+  WiFiClient(){}
+  virtual ~WiFiClient(){}
+
+  int connect(const char *host, uint16_t port) override {
+    stop();
+    HostNetwork::attempts()++;
+    std::string target;
+    uint16_t targetPort;
+    HostNetwork::resolve(host, port, target, targetPort);
+
+    struct addrinfo hints, *result = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    char service[8];
+    snprintf(service, sizeof(service), "%u", targetPort);
+    if(getaddrinfo(target.c_str(), service, &hints, &result) != 0 || result == NULL) return 0;
+
+    int fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if(fd < 0){ freeaddrinfo(result); return 0; }
+    if(::connect(fd, result->ai_addr, result->ai_addrlen) != 0){
+      ::close(fd);
+      freeaddrinfo(result);
+      return 0;
+    }
+    freeaddrinfo(result);
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    _socket = std::make_shared<HostSocket>(fd);
+    HostNetwork::connects()++;
+    return 1;
+  }
+  int connect(IPAddress ip, uint16_t port){ return connect(ip.toString().c_str(), port); }
+
+  // Not on the ESP32, stands in for the non-blocking lwIP connect that
+  // UtilTLSClient makes there. connectStart() returns at once, connectPoll()
+  // is 1 once connected, 0 while pending and -1 when the connect failed.
+  int connectStart(const char *host, uint16_t port){
+    stop();
+    HostNetwork::attempts()++;
+    std::string target;
+    uint16_t targetPort;
+    HostNetwork::resolve(host, port, target, targetPort);
+
+    struct addrinfo hints, *result = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    char service[8];
+    snprintf(service, sizeof(service), "%u", targetPort);
+    if(getaddrinfo(target.c_str(), service, &hints, &result) != 0 || result == NULL) return -1;
+
+    int fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if(fd < 0){ freeaddrinfo(result); return -1; }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    int connected = ::connect(fd, result->ai_addr, result->ai_addrlen);
+    freeaddrinfo(result);
+    if(connected != 0 && errno != EINPROGRESS){
+      ::close(fd);
+      return -1;
+    }
+    _socket = std::make_shared<HostSocket>(fd);
+    _pending = true;
+    return connectPoll();
+  }
+
+  int connectPoll(){
+    if(!_socket || _socket->fd < 0) return -1;
+    if(!_pending) return 1;
+    struct pollfd pfd = {_socket->fd, POLLOUT, 0};
+    if(poll(&pfd, 1, 0) == 0) return 0;
+
+    int error = 0;
+    socklen_t size = sizeof(error);
+    getsockopt(_socket->fd, SOL_SOCKET, SO_ERROR, &error, &size);
+    if(error != 0){
+      stop();
+      return -1;
+    }
+    // Blocking writes from here on, as after connect()
+    fcntl(_socket->fd, F_SETFL, fcntl(_socket->fd, F_GETFL) & ~O_NONBLOCK);
+    int one = 1;
+    setsockopt(_socket->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    _pending = false;
+    HostNetwork::connects()++;
+    return 1;
+  }
+
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) override {
+    if(!_socket || _socket->fd < 0) return 0;
+    size_t sent = 0;
+    while(sent < size){
+      ssize_t n = ::send(_socket->fd, buffer + sent, size - sent, MSG_NOSIGNAL);
+      if(n <= 0) break;
+      sent += n;
+    }
+    HostNetwork::bytesSent() += sent;
+    return sent;
+  }
+  using Print::write;
+
+  int available() override {
+    if(!_socket || _socket->fd < 0) return 0;
+    int count = 0;
+    if(ioctl(_socket->fd, FIONREAD, &count) < 0) return 0;
+    return count;
+  }
+
+  int read() override {
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+  }
+
+  int read(uint8_t *buffer, size_t size) override {
+    if(!_socket || _socket->fd < 0) return -1;
+    ssize_t n = ::recv(_socket->fd, buffer, size, MSG_DONTWAIT);
+    if(n <= 0) return -1;
+    HostNetwork::bytesReceived() += n;
+    return n;
+  }
+
+  int peek() override {
+    if(!_socket || _socket->fd < 0) return -1;
+    uint8_t c;
+    return ::recv(_socket->fd, &c, 1, MSG_DONTWAIT | MSG_PEEK) == 1 ? c : -1;
+  }
+
+  // Connected while the socket is open and the peer has not closed, or data is left.
+  uint8_t connected() override {
+    if(!_socket || _socket->fd < 0 || _pending) return 0;
+    uint8_t c;
+    ssize_t n = ::recv(_socket->fd, &c, 1, MSG_DONTWAIT | MSG_PEEK);
+    if(n > 0) return 1;
+    if(n == 0) return 0;
+    return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : 0;
+  }
+
+  void stop() override {
+    if(_socket) _socket->close();
+    _socket.reset();
+    _pending = false;
+  }
+
+  operator bool(){ return connected(); }
+
+protected:
+  std::shared_ptr<HostSocket> _socket;
+  bool _pending = false; // connectStart() not through yet
+
+  bool waitForData() override {
+    if(!_socket || _socket->fd < 0) return false;
+    struct pollfd pfd = {_socket->fd, POLLIN, 0};
+    poll(&pfd, 1, 10);
+    return true;
+  }
+};
+
+#endif // HOST_WIFI_H
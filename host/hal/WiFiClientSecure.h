@@ -0,0 +1,145 @@
+/*
+  WiFiClientSecure.h - Host stand-in for the ESP32 WiFiClientSecure
+  Released into the public domain.
+
+  No TLS on the host, the connection is plain TCP so a local mock server
+  can stand in for the real endpoint (see HostNetwork::redirect).
+
+  HostTLS stands in for the handshake instead: connect() sleeps for
+  fullHandshake ms, or resumedHandshake ms when the session passed to
+  setSession() was issued for the same host:port and the server still
+  takes it. revoke() makes the server forget every session, as a ticket
+  key rotation does. Every connect hands out a fresh session().
+
+  handshakeStart() and handshakePoll() step through the same handshake
+  without sleeping, it is done once its time has passed on HostClock.
+  They stand in for the mbedtls steps UtilTLSClient takes on the ESP32.
+*/
+
+#if !defined(HOST_WIFI_CLIENT_SECURE_H)
+#define HOST_WIFI_CLIENT_SECURE_H
+
+#include <WiFi.h>
+#include <chrono>
+#include <string>
+#include <thread>
+
+class HostTLS {
+public:
+  static std::atomic<int> &fullHandshake(){ static std::atomic<int> ms(0); return ms; }
+  static std::atomic<int> &resumedHandshake(){ static std::atomic<int> ms(0); return ms; }
+  static std::atomic<uint32_t> &fullHandshakes(){ static std::atomic<uint32_t> c(0); return c; }
+  static std::atomic<uint32_t> &resumedHandshakes(){ static std::atomic<uint32_t> c(0); return c; }
+
+  // What a write costs on air: records of up to recordSize() bytes, as the
+  // ESP32's mbedtls cuts them, each with 29 bytes of header, nonce and tag
+  // (AES-GCM). Nagle is off, so each record goes out at once, in segments
+  // of up to 1436 bytes with 40 bytes of IP and TCP header each. With
+  // uplink() set, in bytes/s, the write also takes as long as those bytes
+  // need on a link that slow, a cellular backhaul behind a WiFi bridge.
+  static std::atomic<int> &recordSize(){ static std::atomic<int> n(4096); return n; }
+  static std::atomic<uint32_t> &writes(){ static std::atomic<uint32_t> c(0); return c; }
+  static std::atomic<uint32_t> &records(){ static std::atomic<uint32_t> c(0); return c; }
+  static std::atomic<uint32_t> &segments(){ static std::atomic<uint32_t> c(0); return c; }
+  static std::atomic<uint64_t> &airBytes(){ static std::atomic<uint64_t> c(0); return c; }
+  static std::atomic<uint32_t> &uplink(){ static std::atomic<uint32_t> rate(0); return rate; }
+
+  static void sent(size_t size){
+    writes()++;
+    uint64_t air = airBytes();
+    while(size > 0){
+      size_t record = size < (size_t)recordSize() ? size : (size_t)recordSize();
+      size_t wire = record + 29;
+      uint32_t count = (wire + 1435) / 1436;
+      records()++;
+      segments() += count;
+      airBytes() += wire + 40 * count;
+      size -= record;
+    }
+    if(uplink() > 0){
+      std::this_thread::sleep_for(std::chrono::microseconds((airBytes() - air) * 1000000 / uplink()));
+    }
+  }
+
+  static void resetStats(){ writes() = records() = segments() = 0; airBytes() = 0; }
+
+  static void revoke(){ epoch()++; }
+
+  static std::string issue(const std::string &server){
+    return prefix(server) + std::to_string(++serial());
+  }
+
+  static bool accepts(const std::string &server, const std::string &session){
+    return session.compare(0, prefix(server).size(), prefix(server)) == 0;
+  }
+
+  // Counts a handshake, returns the ms it takes.
+  static int begin(bool resumed){
+    (resumed ? resumedHandshakes() : fullHandshakes())++;
+    return resumed ? resumedHandshake() : fullHandshake();
+  }
+
+  static void handshake(bool resumed){
+    int ms = begin(resumed);
+    if(ms > 0){
+      std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    }
+  }
+
+private:
+  static std::atomic<uint32_t> &epoch(){ static std::atomic<uint32_t> e(0); return e; }
+  static std::atomic<uint32_t> &serial(){ static std::atomic<uint32_t> s(0); return s; }
+  static std::string prefix(const std::string &server){ return server + "#" + std::to_string(epoch()) + "#"; }
+};
+
+class WiFiClientSecure : public WiFiClient {
+public:
+  using WiFiClient::connect;
+
+  int connect(const char *host, uint16_t port) override {
+    _resumed = false;
+    if(!WiFiClient::connect(host, port)) return 0;
+    std::string server = std::string(host) + ":" + std::to_string(port);
+    _resumed = !_session.empty() && HostTLS::accepts(server, _session);
+    HostTLS::handshake(_resumed);
+    _session = HostTLS::issue(server);
+    return 1;
+  }
+
+  void handshakeStart(const char *host, uint16_t port){
+    _server = std::string(host) + ":" + std::to_string(port);
+    _resumed = !_session.empty() && HostTLS::accepts(_server, _session);
+    _handshakeEnd = HostClock::now() + HostTLS::begin(_resumed);
+  }
+
+  int handshakePoll(){
+    if(!connected()) return -1;
+    if(HostClock::now() < _handshakeEnd) return 0;
+    _session = HostTLS::issue(_server);
+    return 1;
+  }
+
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) override {
+    size_t sent = WiFiClient::write(buffer, size);
+    HostTLS::sent(sent);
+    return sent;
+  }
+  using Print::write;
+
+  void setCACert(const char *rootCA){ _caCert = rootCA; }
+  void setInsecure(){ _caCert = NULL; }
+
+  void setSession(const std::string &session){ _session = session; }
+  const std::string &session() const { return _session; }
+  bool resumed() const { return _resumed; }
+
+private:
+  const char *_caCert = NULL;
+  std::string _session;
+  bool _resumed = false;
+  std::string _server;
+  uint64_t _handshakeEnd = 0;
+};
+
+#endif // HOST_WIFI_CLIENT_SECURE_H
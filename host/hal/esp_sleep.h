@@ -0,0 +1,22 @@
+/*
+  esp_sleep.h - Host stand-in for the ESP-IDF sleep API
+  Released into the public domain.
+
+  Light sleep advances the clock by the requested wake up time.
+*/
+
+#if !defined(HOST_ESP_SLEEP_H)
+#define HOST_ESP_SLEEP_H
+
+#include <Arduino.h>
+
+class HostSleep {
+public:
+  static uint64_t &wakeup(){ static uint64_t w = 0; return w; }
+  static uint32_t &sleeps(){ static uint32_t s = 0; return s; }
+};
+
+inline esp_err_t esp_sleep_enable_timer_wakeup(uint64_t time_in_us){ HostSleep::wakeup() = time_in_us; return ESP_OK; }
+inline esp_err_t esp_light_sleep_start(){ HostSleep::sleeps()++; delay(HostSleep::wakeup() / 1000); return ESP_OK; }
+
+#endif // HOST_ESP_SLEEP_H
@@ -0,0 +1,157 @@
+/*
+  nvs.h - Host stand-in for the ESP-IDF NVS API
+  Released into the public domain.
+
+  Works on the same store as the Preferences stand-in. As on the device,
+  nvs_set_*() writes at once and nvs_commit() is what HostNVS counts as
+  a commit. The iterator follows the ESP-IDF 5 signatures.
+*/
+
+#if !defined(HOST_NVS_H)
+#define HOST_NVS_H
+
+#include <Preferences.h>
+#include <vector>
+
+#define ESP_ERR_NVS_NOT_FOUND 0x1102
+#define ESP_ERR_NVS_INVALID_HANDLE 0x1107
+#define ESP_ERR_NVS_READ_ONLY 0x1104
+#define ESP_ERR_NVS_KEY_TOO_LONG 0x1108
+#define NVS_DEFAULT_PART_NAME "nvs"
+#define ESP_IDF_VERSION_MAJOR 5 // The iterator signatures below
+
+typedef uint32_t nvs_handle_t;
+typedef enum { NVS_READONLY, NVS_READWRITE } nvs_open_mode_t;
+
+typedef enum {
+  NVS_TYPE_U8 = 0x01, NVS_TYPE_I8 = 0x11, NVS_TYPE_U16 = 0x02, NVS_TYPE_I16 = 0x12,
+  NVS_TYPE_U32 = 0x04, NVS_TYPE_I32 = 0x14, NVS_TYPE_U64 = 0x08, NVS_TYPE_I64 = 0x18,
+  NVS_TYPE_STR = 0x21, NVS_TYPE_BLOB = 0x42, NVS_TYPE_ANY = 0xff
+} nvs_type_t;
+
+typedef struct {
+  char namespace_name[16];
+  char key[16];
+  nvs_type_t type;
+} nvs_entry_info_t;
+
+struct HostNVSIterator {
+  std::vector<nvs_entry_info_t> entries;
+  size_t index;
+};
+typedef HostNVSIterator *nvs_iterator_t;
+
+struct HostNVSHandle {
+  std::string name;
+  bool writable;
+};
+
+inline std::vector<HostNVSHandle> &hostNVSHandles(){ static std::vector<HostNVSHandle> handles; return handles; }
+
+inline HostNVSHandle *hostNVSHandle(nvs_handle_t handle){
+  return handle > 0 && handle <= hostNVSHandles().size() ? &hostNVSHandles()[handle - 1] : NULL;
+}
+
+inline esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle){
+  std::lock_guard<std::mutex> guard(HostNVS::lock());
+  HostNVS::instance().opens++;
+  hostNVSHandles().push_back({name, mode == NVS_READWRITE});
+  *handle = hostNVSHandles().size();
+  return ESP_OK;
+}
+
+inline void nvs_close(nvs_handle_t){}
+
+inline esp_err_t hostNVSSet(nvs_handle_t handle, const char *key, PreferenceType type, const void *value, size_t size){
+  HostNVSHandle *h = hostNVSHandle(handle);
+  if(h == NULL) return ESP_ERR_NVS_INVALID_HANDLE;
+  if(!h->writable) return ESP_ERR_NVS_READ_ONLY;
+  if(strlen(key) > 15) return ESP_ERR_NVS_KEY_TOO_LONG;
+  std::lock_guard<std::mutex> guard(HostNVS::lock());
+  HostNVSEntry &entry = HostNVS::instance().space(h->name)[key];
+  entry.type = type;
+  entry.bytes.assign((const char *)value, size);
+  HostNVS::instance().writes++;
+  return ESP_OK;
+}
+
+inline esp_err_t nvs_set_i32(nvs_handle_t h, const char *key, int32_t value){ return hostNVSSet(h, key, PT_I32, &value, sizeof(value)); }
+inline esp_err_t nvs_set_u8(nvs_handle_t h, const char *key, uint8_t value){ return hostNVSSet(h, key, PT_U8, &value, sizeof(value)); }
+inline esp_err_t nvs_set_u16(nvs_handle_t h, const char *key, uint16_t value){ return hostNVSSet(h, key, PT_U16, &value, sizeof(value)); }
+inline esp_err_t nvs_set_u32(nvs_handle_t h, const char *key, uint32_t value){ return hostNVSSet(h, key, PT_U32, &value, sizeof(value)); }
+inline esp_err_t nvs_set_u64(nvs_handle_t h, const char *key, uint64_t value){ return hostNVSSet(h, key, PT_U64, &value, sizeof(value)); }
+inline esp_err_t nvs_set_str(nvs_handle_t h, const char *key, const char *value){ return hostNVSSet(h, key, PT_STR, value, strlen(value)); }
+inline esp_err_t nvs_set_blob(nvs_handle_t h, const char *key, const void *value, size_t size){ return hostNVSSet(h, key, PT_BLOB, value, size); }
+
+inline esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key){
+  HostNVSHandle *h = hostNVSHandle(handle);
+  if(h == NULL) return ESP_ERR_NVS_INVALID_HANDLE;
+  std::lock_guard<std::mutex> guard(HostNVS::lock());
+  if(!HostNVS::instance().space(h->name).erase(key)) return ESP_ERR_NVS_NOT_FOUND;
+  HostNVS::instance().writes++;
+  return ESP_OK;
+}
+
+inline esp_err_t nvs_commit(nvs_handle_t handle){
+  if(hostNVSHandle(handle) == NULL) return ESP_ERR_NVS_INVALID_HANDLE;
+  std::lock_guard<std::mutex> guard(HostNVS::lock());
+  HostNVS::instance().commits++;
+  return ESP_OK;
+}
+
+inline nvs_type_t hostNVSType(PreferenceType type){
+  switch(type){
+    case PT_I8:  return NVS_TYPE_I8;
+    case PT_U8:  return NVS_TYPE_U8;
+    case PT_I16: return NVS_TYPE_I16;
+    case PT_U16: return NVS_TYPE_U16;
+    case PT_I32: return NVS_TYPE_I32;
+    case PT_U32: return NVS_TYPE_U32;
+    case PT_I64: return NVS_TYPE_I64;
+    case PT_U64: return NVS_TYPE_U64;
+    case PT_STR: return NVS_TYPE_STR;
+    default:     return NVS_TYPE_BLOB;
+  }
+}
+
+inline esp_err_t nvs_entry_find(const char *, const char *name, nvs_type_t type, nvs_iterator_t *iterator){
+  std::lock_guard<std::mutex> guard(HostNVS::lock());
+  HostNVSIterator *found = new HostNVSIterator();
+  found->index = 0;
+  for(auto &item : HostNVS::instance().space(name)){
+    nvs_entry_info_t info;
+    strncpy(info.namespace_name, name, sizeof(info.namespace_name) - 1);
+    info.namespace_name[sizeof(info.namespace_name) - 1] = 0;
+    strncpy(info.key, item.first.c_str(), sizeof(info.key) - 1);
+    info.key[sizeof(info.key) - 1] = 0;
+    info.type = hostNVSType(item.second.type);
+    if(type == NVS_TYPE_ANY || type == info.type){
+      found->entries.push_back(info);
+    }
+  }
+  if(found->entries.empty()){
+    delete found;
+    *iterator = NULL;
+    return ESP_ERR_NVS_NOT_FOUND;
+  }
+  *iterator = found;
+  return ESP_OK;
+}
+
+inline esp_err_t nvs_entry_next(nvs_iterator_t *iterator){
+  if(*iterator == NULL) return ESP_ERR_NVS_NOT_FOUND;
+  if(++(*iterator)->index < (*iterator)->entries.size()) return ESP_OK;
+  delete *iterator;
+  *iterator = NULL;
+  return ESP_ERR_NVS_NOT_FOUND;
+}
+
+inline esp_err_t nvs_entry_info(nvs_iterator_t iterator, nvs_entry_info_t *info){
+  if(iterator == NULL) return ESP_ERR_NVS_NOT_FOUND;
+  *info = iterator->entries[iterator->index];
+  return ESP_OK;
+}
+
+inline void nvs_release_iterator(nvs_iterator_t iterator){ delete iterator; }
+
+#endif // HOST_NVS_H
@@ -0,0 +1,36 @@
+/*
+  sketch.cpp - Runs an Arduino sketch (setup/loop) on the host build
+  Released into the public domain.
+
+  setup() runs once, then loop() until the virtual clock reaches the run
+  time. ESP.restart() boots the sketch again with NVS preserved, so
+  examples that restart can be followed over several boots.
+
+    device-properties [run ms] [boots]
+*/
+
+#include <Arduino.h>
+
+void setup();
+void loop();
+
+int main(int argc, char **argv){
+  uint64_t runTime = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000;
+  int boots = argc > 2 ? atoi(argv[2]) : 3;
+
+  for(int boot = 1; boot <= boots; boot++){
+    uint64_t until = HostClock::now() + runTime;
+    try {
+      setup();
+      while(HostClock::now() < until){
+        loop();
+        HostClock::advance(1);
+      }
+      return 0;
+    }
+    catch(HostRestart &){
+      Serial.printf("\n--- restart %d/%d ---\n", boot, boots);
+    }
+  }
+  return 0;
+}
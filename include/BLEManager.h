@@ -22,12 +22,14 @@ public:
 
     void onConnect(BLEServer* pServer) {
       Serial.println("Attach");
-      _callback({ESP_BLE_ATTACH});
+      byte key = ESP_BLE_ATTACH;
+      _callback(UtilMessageView(&key, 1));
     }
 
     void onDisconnect(BLEServer* pServer) {
         Serial.println("Detach");
-      _callback({ESP_BLE_DETACH});
+      byte key = ESP_BLE_DETACH;
+      _callback(UtilMessageView(&key, 1));
     }
 
 private:
@@ -45,7 +47,7 @@ public:
 
     void onWrite(BLECharacteristic *rxCharacteristic) {
       string rxValue = rxCharacteristic->getValue();
-      _callback(UtilMessage(rxValue));
+      _callback(UtilMessageView((const byte *)rxValue.data(), rxValue.length()));
     }
 
 private:
@@ -62,12 +64,20 @@ public:
     BLECharacteristic *rxCharacteristic;
     BLECharacteristic *txCharacteristic;
 
+    #ifdef USE_TASKS
+    UtilTask task;
+    UtilSPSCQueue<UtilMessage, UTIL_TASK_QUEUE_SIZE> inbox;  // BLE stack -> loop task
+    UtilSPSCQueue<UtilMessage, UTIL_TASK_QUEUE_SIZE> outbox; // loop task -> BLE task
+    #endif
+
     BLEManager(){};
-    void beginClient(UtilMessageCallback callback);
-    void beginServer(UtilMessageCallback callback);
+    void beginClient(UtilMessageCallback callback = ESPUtils::handleMessage);
+    void beginServer(UtilMessageCallback callback = ESPUtils::handleMessage);
     void sendMessage(string message);
-    void sendMessage(UtilMessage message);
-    static void handleDeviceCallback(UtilMessage message);
+    void sendMessage(const UtilMessage &message);
+    void loop();
+    static void handleDeviceCallback(UtilMessageView message);
+    static void taskLoop();
     
 private:
     long refreshTime = 0;
@@ -124,24 +134,46 @@ void BLEManager::begin(bool isServer, UtilMessageCallback callback) {
     Serial.println("Started Device: " + ESPUtils::getDeviceName() +" as " + isServer ? "server." : "client.");
     Serial.println("ServiceID: " + serviceTag);
     Serial.println("BLE - Waiting for connection...");
+
+    #ifdef USE_TASKS
+    task.start("BLE", BLEManager::taskLoop, BLE_TASK_CORE, BLE_TASK_PRIORITY);
+    #endif
 }
 
 //------------------------------------------------------------------------------------
 
 void BLEManager::sendMessage(string message) {
+    #ifdef USE_TASKS
+    if(!task.isCurrent()){
+        sendMessage(UtilMessage(message));
+        return;
+    }
+    #endif
+
     txCharacteristic->setValue(message);
     txCharacteristic->notify();
 }
 
 //------------------------------------------------------------------------------------
 
-void BLEManager::sendMessage(UtilMessage message) {
-    sendMessage(message.readCString());
+void BLEManager::sendMessage(const UtilMessage &message) {
+    #ifdef USE_TASKS
+    if(!task.isCurrent()){
+        if(!outbox.push(message)){
+            Serial.println("ERROR: BLEManager - Outbox full, message dropped");
+        }
+        return;
+    }
+    #endif
+
+    UtilMessageView payload(message);
+    txCharacteristic->setValue((uint8_t *)payload.data() + payload.position(), payload.bytesAvailable());
+    txCharacteristic->notify();
 }
 
 //------------------------------------------------------------------------------------
 
-void BLEManager::handleDeviceCallback(UtilMessage message) {
+void BLEManager::handleDeviceCallback(UtilMessageView message) {
     uint8_t key = message.front();
     
     if(key == ESP_BLE_ATTACH){
@@ -154,8 +186,39 @@ void BLEManager::handleDeviceCallback(UtilMessage message) {
     } 
     else {
         Serial.println("BLE - Pass");
+        #ifdef USE_TASKS
+        // Runs on the BLE stack task, the loop task delivers it.
+        if(!BLEMan.inbox.push(UtilMessage(message))){
+            Serial.println("ERROR: BLEManager - Inbox full, message dropped");
+        }
+        #else
         BLEMan.callback(message);
+        #endif
+    }
+}
+
+//------------------------------------------------------------------------------------
+
+void BLEManager::loop() {
+    #ifdef USE_TASKS
+    UtilMessage message;
+    while(inbox.pop(message)){
+        callback(message);
+    }
+    #endif
+}
+
+//------------------------------------------------------------------------------------
+
+// Body of the BLE task with USE_TASKS, notifies queued messages.
+void BLEManager::taskLoop() {
+    #ifdef USE_TASKS
+    UtilMessage message;
+    while(BLEMan.outbox.pop(message)){
+        BLEMan.sendMessage(message);
     }
+    UtilTask::pause(1);
+    #endif
 }
 
 #endif
\ No newline at end of file
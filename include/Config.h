@@ -22,6 +22,40 @@ table helps give apps a little extra space.
 //#define USE_OTA   // OTAMan   - Over the Air updates
 //#define USE_SFRA  // SFMan    - Salesforce Auth and Remote Access
 //#define USE_WIFI  // Static   - Non blocking stable WiFi access
+//#define USE_TASKS // Run every manager above in its own FreeRTOS task, see UtilTask.h
+
+// UtilMessage is included ahead of this file, so its options have to be
+// passed as build flags (build_flags in platformio.ini) instead.
+// -DUSE_MESSAGE_POOL            // Store messages in a static block pool, see UtilMessagePool.h
+// -DUTIL_POOL_BLOCK_SIZE=256    // Largest message a pooled block can hold
+// -DUTIL_POOL_BLOCK_COUNT=16    // Number of pooled blocks
+// -DUTIL_MESSAGE_HEADROOM=8     // Bytes reserved in front of each message for transport headers
+
+//#define UTIL_LIGHT_SLEEP // ESPUtils::sleep() light sleeps the CPU instead of calling delay()
+
+//---------------------------------------------------------------------
+
+#ifdef USE_TASKS // Every manager in its own task
+// The Arduino loop task runs on core 1 at priority 1, the WiFi and BLE
+// stacks on core 0. Cores are 0, 1 or UTIL_ANY_CORE.
+#define UTIL_TASK_QUEUE_SIZE 8 // Messages in flight between a manager task and the loop task
+#define UTIL_TASK_STACK 4096
+
+#define BLE_TASK_CORE 0
+#define BLE_TASK_PRIORITY 2
+#define LORA_TASK_CORE 0
+#define LORA_TASK_PRIORITY 2
+#define OTA_TASK_CORE 0
+#define OTA_TASK_PRIORITY 1
+#define OTA_TASK_STACK 8192
+#define SFRA_TASK_CORE 0
+#define SFRA_TASK_PRIORITY 1
+#define SFRA_TASK_STACK 8192 // TLS handshakes need the room
+#define WIFI_TASK_CORE 0
+#define WIFI_TASK_PRIORITY 1
+
+#include <UtilTask.h>
+#endif
 
 //---------------------------------------------------------------------
 
@@ -38,6 +72,7 @@ table helps give apps a little extra space.
 //---------------------------------------------------------------------
 
 #ifdef USE_LORA // LoRa communication
+#define LORA_RX_SLOTS 8 // Packets the radio interrupt can hold for loop(), 260 bytes each
 #include <LoRaManager.h>
 #endif
 
@@ -55,6 +90,10 @@ const char *WIFI_PASS = "CHANGE_ME";
 #define CLOCK_SERVER_1 "pool.ntp.org"
 #define CLOCK_SERVER_2 "time.nist.gov"
 
+#define UTIL_TLS_CACHE_SIZE 4  // Hosts whose TLS session is kept for an abbreviated handshake
+#define UTIL_TLS_LIFETIME 3600 // Seconds a session is offered again, 0 turns resumption off
+//#define UTIL_TLS_PERSIST     // Keep sessions in NVS across restarts and deep sleep, see UtilTLSCache.h
+
 #include <WiFiManager.h>
 #endif
 
@@ -81,8 +120,27 @@ const char* SFRA_CERT = \
 #define SFRA_PASS "YOUR_SF_ORG_PASS"
 
 #define SFRA_RETRY_DELAY 500 // Time between requests
-#define SFRA_REFRESH_DELAY 10000 // Refresh Token request time < 15 min
+#define SFRA_SESSION_TIMEOUT 7200 // s, the org's session timeout (Setup > Session Settings)
+#define SFRA_REFRESH_MARGIN 300 // s before expiry the token is fetched again, while no request waits
+//#define SFRA_REFRESH_TOKEN "YOUR_REFRESH_TOKEN" // refresh_token grant instead of the password grant
+//#define SFRA_TOKEN_PERSIST // Keep the token in NVS so a restart skips auth, stored in the clear unless NVS encryption is on
 #define SFRA_API "v49.0"
+#define UTILS_SF_CAPACITY 20 // Requests queued at most, see SFMan.requests for lanes and overflow policies
+#define SFRA_PIPELINE_DEPTH 4 // Requests sent ahead on the kept alive connection, 1 waits for each response
+#define SFRA_BATCH_SIZE 10 // Queued events or flow calls sent as one request (Composite API, max 25), 1 turns batching off
+#define SFRA_POLL_INTERVAL 5 // ms between steps while a request is under way
+#define SFRA_RESOLVE_TIMEOUT 5000 // ms each phase of a request may take before it is given up
+#define SFRA_CONNECT_TIMEOUT 5000
+#define SFRA_HANDSHAKE_TIMEOUT 10000
+#define SFRA_RECEIVE_TIMEOUT 5000
+#define SFRA_PAYLOAD_SIZE 1024 // Longest result handed to a callback, longer ones are cut short
+//#define SFRA_COMPRESS // gzip request bodies of SFRA_COMPRESS_MIN bytes or more, Content-Encoding: gzip
+#define SFRA_COMPRESS_MIN 256
+#define UTIL_DEFLATE_WINDOW 1024 // Bytes the compressor looks back for repeats, it takes about 4x this plus 2 KB of RAM
+//#define SFRA_SPOOL // Requests wait out a lost uplink or a restart on the spiffs partition, see SFManager.h
+#define SFRA_SPOOL_SEGMENT 16384 // Bytes per spool file, SFRA_SPOOL_SEGMENTS files at most (768 KB, fits default.csv)
+#define SFRA_SPOOL_SEGMENTS 48
+#define SFRA_SPOOL_GRACE 10000 // ms without a usable token before requests spill to the spool
 
 #include <SFManager.h>
 #endif
@@ -20,7 +20,9 @@ in the README.md and in the Config.h file.
 
 #include <UtilCommon.h>
 #include <UtilMessage.h>
-#include <Preferences.h>
+#include <UtilDispatcher.h>
+#include <UtilScheduler.h>
+#include <UtilParameters.h>
 
 struct UtilButton {
   const uint8_t pin;
@@ -36,6 +38,8 @@ struct UtilButton {
 
 class ESPUtils {
 public:
+  static UtilDispatcher dispatcher;
+
   static void clearPreferences(void);
   static int getParameterI(String key, int defaultValue = 0);
   static void setParameter(String key, int value);
@@ -44,24 +48,33 @@ public:
   static String getAddress();
   static String getShortAddress();
   static String getDeviceName();
-  static void handleMessage(UtilMessage message);
+  static void handleMessage(UtilMessageView message);
+  static uint32_t idleTime(uint32_t maxTime = UINT32_MAX);
   static void loop();
   static void restart();
+  static void sleep(uint32_t maxTime);
 
 private:
-  
+  static const UtilCommandHandler espHandlers[UTIL_RANGE_SIZE];
+
+  static void handleOTA(byte key, UtilMessageView &message);
+  static void handleParameter(byte key, UtilMessageView &message);
+  static void handleParameters(byte key, UtilMessageView &message);
+  static void handleSnapshot(byte key, UtilMessageView &message);
+  static void handleRestart(byte key, UtilMessageView &message);
 };
 
 #include <Config.h>
 
+#ifdef UTIL_LIGHT_SLEEP
+#include <esp_sleep.h>
+#endif
+
 
 //---------------------------------------------------------------------
 
 void ESPUtils::clearPreferences(void){
-  static Preferences p;
-  p.begin(UTIL_PREF_KEY, false);
-  p.clear();
-  p.end();
+  UtilParameters::clear();
 } 
 
 //---------------------------------------------------------------------
@@ -93,81 +106,133 @@ String ESPUtils::getDeviceName(){
 //---------------------------------------------------------------------
 
 int ESPUtils::getParameterI(String key, int defaultValue) {
-  static Preferences p;
-  p.begin(UTIL_PREF_KEY, false);
-  int value = p.getInt(key.c_str(), defaultValue);
-  p.end();
-  return value;
+  int32_t value;
+  return UtilParameters::getInt(key.c_str(), value) ? value : defaultValue;
 }
 
 //---------------------------------------------------------------------
 
 void ESPUtils::setParameter(String key, int value){
-  static Preferences p;
-  p.begin(UTIL_PREF_KEY, false);
-  p.putInt(key.c_str(), value);
-  p.end();
+  UtilParameters::putInt(key.c_str(), value);
 }
 
 //---------------------------------------------------------------------
 
 String ESPUtils::getParameterS(String key, String defaultValue) {
-  static Preferences p;
-  p.begin(UTIL_PREF_KEY, false);
-  String value = p.getString(key.c_str(), defaultValue.c_str());
-  p.end();
-  return value;
+  String value;
+  return UtilParameters::getString(key.c_str(), value) ? value : defaultValue;
 }
 
 //---------------------------------------------------------------------
 
 void ESPUtils::setParameter(String key, String value){
-  static Preferences p;
-  p.begin(UTIL_PREF_KEY, false);
-  p.putString(key.c_str(), value.c_str());
-  p.end();
+  UtilParameters::putString(key.c_str(), value);
 }
 
 //---------------------------------------------------------------------
 void ESPUtils::restart(){
+  UtilParameters::flush();
   ESP.restart();
 }
 
 //---------------------------------------------------------------------
 
-void ESPUtils::handleMessage(UtilMessage message){
-  byte key = message.read();
+// Built in handlers for the ESP_KEY range, indexed by key - ESP_KEY.
+// Register a handler on ESPUtils::dispatcher to override any of them.
+#ifdef USE_OTA
+#define ESP_OTA_HANDLER ESPUtils::handleOTA
+#else
+#define ESP_OTA_HANDLER NULL
+#endif
+
+const UtilCommandHandler ESPUtils::espHandlers[UTIL_RANGE_SIZE] = {
+  NULL,                       // 0xE0 ESP_KEY
+  NULL,                       // 0xE1
+  ESPUtils::handleParameter,  // 0xE2 ESP_SSID
+  ESPUtils::handleParameter,  // 0xE3 ESP_PASS
+  NULL,                       // 0xE4 ESP_BLE_ATTACH, handled by BLEManager
+  NULL,                       // 0xE5 ESP_BLE_DETACH, handled by BLEManager
+  ESP_OTA_HANDLER,            // 0xE6 ESP_OTA_LOCAL
+  ESP_OTA_HANDLER,            // 0xE7 ESP_OTA_REMOTE
+  ESPUtils::handleParameter,  // 0xE8 ESP_LORA_REMOTE
+  ESPUtils::handleParameters, // 0xE9 ESP_PARAMS
+  ESPUtils::handleSnapshot,   // 0xEA ESP_SNAPSHOT
+  NULL,                       // 0xEB
+  NULL,                       // 0xEC
+  NULL,                       // 0xED
+  NULL,                       // 0xEE
+  ESPUtils::handleRestart     // 0xEF ESP_RESTART
+};
+
+UtilDispatcher ESPUtils::dispatcher(ESP_KEY, ESPUtils::espHandlers);
+
+//---------------------------------------------------------------------
+
+void ESPUtils::handleMessage(UtilMessageView message){
+  dispatcher.dispatch(message);
+}
+
+//---------------------------------------------------------------------
 
+void ESPUtils::handleOTA(byte key, UtilMessageView &message){
   #ifdef USE_OTA
+  Serial.println("NFO: Repeatedly call ESPUtils::loop() to complete OTA.");
+  OTAMan = new OTAManager();
   if(key == ESP_OTA_LOCAL){
-    Serial.println("NFO: Repeatedly call ESPUtils::loop() to complete OTA.");
-    otaManager = new OTAManager();
-    otaManager->begin(handleMessage);
-  } 
-  else if(key == ESP_OTA_REMOTE){
-    Serial.println("NFO: Repeatedly call ESPUtils::loop() to complete OTA.");
-    otaManager = new OTAManager();
-    otaManager->begin(handleMessage,message.readString());
+    OTAMan->begin(handleMessage);
   } 
-  else
-  #endif 
+  else {
+    OTAMan->begin(handleMessage,message.readString());
+  }
+  #endif
+}
+
+//---------------------------------------------------------------------
+
+void ESPUtils::handleParameter(byte key, UtilMessageView &message){
   if(key == ESP_SSID){
-    setParameter(UTIL_SSID_KEY,message.readString());
+    UtilParameters::put(UTIL_PARAM_SSID, message.readString());
   }
   else if(key == ESP_PASS){
-    setParameter(UTIL_PASS_KEY,message.readString());
+    UtilParameters::put(UTIL_PARAM_PASS, message.readString());
   }
   else if(key == ESP_LORA_REMOTE){
-    setParameter(UTIL_REMOTE_ADDRESS,message.readString());
-  }
-  else if(key == ESP_RESTART){
-    restart();
+    UtilParameters::put(UTIL_PARAM_REMOTE, message.readString());
   }
 }
 
+//---------------------------------------------------------------------
+
+// Several key/value pairs in one message, applied as one transaction.
+// See UtilParameters::writeInt() / writeString() for the format.
+void ESPUtils::handleParameters(byte key, UtilMessageView &message){
+  UtilParameters::apply(message);
+}
+
+//---------------------------------------------------------------------
+
+// A chunk of a parameter snapshot, restored once the last one is in.
+// See UtilParameters::snapshot() / writeChunk().
+void ESPUtils::handleSnapshot(byte key, UtilMessageView &message){
+  UtilParameters::receiveChunk(message);
+}
+
+//---------------------------------------------------------------------
+
+void ESPUtils::handleRestart(byte key, UtilMessageView &message){
+  restart();
+}
+
 //------------------------------------------------------------------------------------
 void ESPUtils::loop(void) {
 
+  // Run everything that has come due
+  UtilScheduler::run();
+
+  #ifdef USE_BLE
+  BLEMan.loop();
+  #endif
+
   // Maintain the WiFi connection
   #ifdef USE_WIFI
   WiFiManager::loop();
@@ -191,4 +256,30 @@ void ESPUtils::loop(void) {
   yield();
 }
 
+//------------------------------------------------------------------------------------
+
+// Milliseconds until the next scheduled deadline, capped at maxTime.
+uint32_t ESPUtils::idleTime(uint32_t maxTime){
+  return UtilScheduler::idleTime(maxTime);
+}
+
+//------------------------------------------------------------------------------------
+
+// Sleeps until the next scheduled deadline, but no longer than maxTime.
+// Messages arriving meanwhile are picked up by the following loop() call.
+// Define UTIL_LIGHT_SLEEP to light sleep the CPU instead of delay().
+void ESPUtils::sleep(uint32_t maxTime){
+  uint32_t idle = idleTime(maxTime);
+  if(idle == 0){
+    return;
+  }
+
+  #ifdef UTIL_LIGHT_SLEEP
+  esp_sleep_enable_timer_wakeup((uint64_t)idle * 1000);
+  esp_light_sleep_start();
+  #else
+  delay(idle);
+  #endif
+}
+
 #endif
\ No newline at end of file
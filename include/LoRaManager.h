@@ -10,37 +10,77 @@
 #include <LoRa.h>
 #include <SPI.h>
 #include <ESPUtils.h>
+#include <UtilQueue.h>
 
 // TODO : Rename and move to Config.h
 #define PING_INTERVAL 10000
 
+#ifndef LORA_RX_SLOTS
+#define LORA_RX_SLOTS 8 // Packets received and not yet handled by loop()
+#endif
+
+#define LORA_HEADER_SIZE 5 // Sender address (2), receiver address (2), payload length (1)
+#define LORA_PACKET_SIZE 255 // Largest packet the radio takes, header included
+
+// A packet as the radio interrupt left it for loop()
+struct UtilLoRaPacket {
+  uint8_t size;   // Payload bytes
+  int16_t rssi;   // dBm
+  float snr;      // dB
+  uint32_t time;  // micros() when it came in
+  uint8_t payload[LORA_PACKET_SIZE - LORA_HEADER_SIZE];
+};
+
 //------------------------------------------------------------------------------------
+// onReceive() runs in the radio interrupt. It reads the packet straight
+// into a free slot of received, a lock free ring of LORA_RX_SLOTS packets,
+// with its RSSI, SNR and time. Nothing is allocated and nothing printed.
+// loop() hands the packets to callback in the order they came in, so a
+// burst is kept as long as there are slots, packet tells the callback
+// which one it has. When the ring is full further packets are dropped and
+// counted by overruns(), highWater shows how close it came.
 class LoRaManager{
 public:
   bool isServer = true;
-  unsigned long lastPing;
+  uint64_t lastPing = 0;
   uint8_t localAddress[2];
   uint8_t remoteAddress[2];
-  UtilMessage loraMessage;
   UtilMessageCallback callback;
 
+  UtilSPSCQueue<UtilLoRaPacket, LORA_RX_SLOTS> received; // radio interrupt -> loop()
+  const UtilLoRaPacket *packet = NULL; // The one callback is handling
+  volatile uint32_t packets = 0;       // Taken in by the interrupt
+  volatile uint32_t ignored = 0;       // For another device, or cut short
+  int highWater = 0;                   // Most slots in use at once
+
+  #ifdef USE_TASKS
+  UtilTask task;
+  UtilSPSCQueue<UtilMessage, UTIL_TASK_QUEUE_SIZE> outbox; // loop task -> LoRa task
+  #endif
+
   LoRaManager(){};
   void initAddresses();
-  void beginClient(UtilMessageCallback callback);
-  void beginServer(UtilMessageCallback callback);
+  void beginClient(UtilMessageCallback callback = ESPUtils::handleMessage);
+  void beginServer(UtilMessageCallback callback = ESPUtils::handleMessage);
   
   static void onReceive(int packetSize);
+  static void ping();
   bool connected();
+  uint32_t overruns();
   void sendMessage(byte data);
   void sendMessage(string message);
-  void sendMessage(UtilMessage message);
+  void sendMessage(const UtilMessage &message);
+  void sendMessage(UtilMessage &&message);
+  void frameMessage(UtilMessage &message);
   void loop();
+  static void taskLoop();
 
 private:
   bool sendResponse = false;
   void beginAs(bool isServer, UtilMessageCallback callback);
-  void handleMessage();
-  void readMessage();
+  void handlePacket(const UtilLoRaPacket &received);
+  void queueMessage(UtilMessage &&message);
+  void writeHeader(byte *header, int payloadSize);
   void rxMode();
   void txMode();
 };
@@ -63,7 +103,7 @@ void LoRaManager::initAddresses(){
   LoRaMan.localAddress[0] = strtol(mac.substring(0,2).c_str(), NULL, 16);
   LoRaMan.localAddress[1] = strtol(mac.substring(2,4).c_str(), NULL, 16);
 
-  mac = ESPUtils::getParameterS(UTIL_REMOTE_ADDRESS, "0000");
+  mac = UtilParameters::get(UTIL_PARAM_REMOTE);
   LoRaMan.remoteAddress[0] = strtol(mac.substring(0,2).c_str(), NULL, 16);
   LoRaMan.remoteAddress[1] = strtol(mac.substring(2,4).c_str(), NULL, 16);
 }
@@ -84,12 +124,34 @@ void LoRaManager::beginAs(bool isServer, UtilMessageCallback callback){
   LoRa.onReceive(onReceive);
   Serial.println("LoRa init succeeded.");
   rxMode();
+
+  #ifdef USE_TASKS
+  LoRaMan.task.start("LoRa", LoRaManager::taskLoop, LORA_TASK_CORE, LORA_TASK_PRIORITY);
+  #endif
+
+  // Clients keep the link alive so the server can tell it is still connected.
+  if(!isServer){
+    UtilScheduler::schedule(LoRaManager::ping, PING_INTERVAL, PING_INTERVAL);
+  }
 }
 
 //------------------------------------------------------------------------------------
 
 bool LoRaManager::connected(){
-  return lastPing + (PING_INTERVAL*3) > millis();
+  return lastPing != 0 && !UtilClock::reached(lastPing + (PING_INTERVAL*3));
+}
+
+//------------------------------------------------------------------------------------
+
+// Packets lost because every slot was taken.
+uint32_t LoRaManager::overruns(){
+  return received.dropped();
+}
+
+//------------------------------------------------------------------------------------
+
+void LoRaManager::ping(){
+  LoRaMan.sendMessage(NFO_PING);
 }
 
 //------------------------------------------------------------------------------------
@@ -106,54 +168,120 @@ void LoRaManager::sendMessage(string message) {
 
 //------------------------------------------------------------------------------------
 
-void LoRaManager::sendMessage(UtilMessage message) {
+void LoRaManager::writeHeader(byte *header, int payloadSize) {
+  header[0] = localAddress[0];
+  header[1] = localAddress[1];
+  header[2] = remoteAddress[0];
+  header[3] = remoteAddress[1];
+  header[4] = payloadSize;
+}
+
+//------------------------------------------------------------------------------------
+
+// Prepends the LoRa header into the message headroom, afterwards the message
+// holds the complete packet as one contiguous span.
+void LoRaManager::frameMessage(UtilMessage &message) {
+  byte header[LORA_HEADER_SIZE];
+  writeHeader(header, message.size());
+  message.writeFront(header, LORA_HEADER_SIZE);
+}
+
+//------------------------------------------------------------------------------------
+
+void LoRaManager::sendMessage(const UtilMessage &message) {
+  #ifdef USE_TASKS
+  if(!task.isCurrent()){
+    queueMessage(UtilMessage(message));
+    return;
+  }
+  #endif
+
+  byte header[LORA_HEADER_SIZE];
+  writeHeader(header, message.size());
+
   txMode();
   LoRa.beginPacket();              
-  LoRa.write(localAddress,2);
-  LoRa.write(remoteAddress,2);            
-  LoRa.write(message.size());
-  while(message.bytesAvailable()){
-    LoRa.write(message.read());
-  }
+  LoRa.write(header, LORA_HEADER_SIZE);
+  LoRa.write(message.data(), message.size());
   LoRa.endPacket();
   rxMode();
 }
 
 //------------------------------------------------------------------------------------
-void LoRaManager::onReceive(int packetSize) {
-  byte buffer[2];
 
-  LoRa.readBytes(buffer,2);
-  if (buffer[0] != LoRaMan.remoteAddress[0] || buffer[1] != LoRaMan.remoteAddress[1]){
-    Serial.println("Ignore: unknown sender.");
+// Temporaries are framed in place and handed to the radio in a single write.
+void LoRaManager::sendMessage(UtilMessage &&message) {
+  #ifdef USE_TASKS
+  if(!task.isCurrent()){
+    queueMessage(std::move(message));
     return;
   }
+  #endif
 
-  LoRa.readBytes(buffer,2); 
-  if (buffer[0] != LoRaMan.localAddress[0] || buffer[1] != LoRaMan.localAddress[1]){
-    Serial.println("Ignore: wrong address.");
+  frameMessage(message);
+
+  txMode();
+  LoRa.beginPacket();              
+  LoRa.write(message.data(), message.size());
+  LoRa.endPacket();
+  rxMode();
+}
+
+//------------------------------------------------------------------------------------
+
+// Hands a message to the LoRa task, which transmits it while the caller moves on.
+void LoRaManager::queueMessage(UtilMessage &&message) {
+  #ifdef USE_TASKS
+  if(!outbox.push(std::move(message))){
+    Serial.println("ERROR: LoRaManager - Outbox full, message dropped");
+  }
+  #endif
+}
+
+//------------------------------------------------------------------------------------
+
+// Runs in the radio interrupt, see the class comment.
+void LoRaManager::onReceive(int packetSize) {
+  uint32_t time = micros();
+  if(packetSize < LORA_HEADER_SIZE){
+    LoRaMan.ignored++; // Too short for a header
     return;
   }
+  byte header[LORA_HEADER_SIZE];
 
-  // Read payload
-  byte expectedLength = LoRa.read(); // incoming msg length
-  LoRaMan.loraMessage.clear();
-  while (LoRa.available()) {
-    LoRaMan.loraMessage.write(LoRa.read());
+  LoRa.readBytes(header, LORA_HEADER_SIZE);
+  if (header[0] != LoRaMan.remoteAddress[0] || header[1] != LoRaMan.remoteAddress[1] ||
+      header[2] != LoRaMan.localAddress[0] || header[3] != LoRaMan.localAddress[1]){
+    LoRaMan.ignored++; // Unknown sender or wrong address
+    return;
   }
 
   // Valid payload?
-  if (expectedLength != LoRaMan.loraMessage.bytesAvailable()) {
-    Serial.println("Ignore: size.");
-    LoRaMan.loraMessage.clear();
+  int size = packetSize - LORA_HEADER_SIZE;
+  if (header[4] != size || size > (int)sizeof(UtilLoRaPacket::payload)) {
+    LoRaMan.ignored++;
     return;
   }
+
+  UtilLoRaPacket *packet = LoRaMan.received.claim();
+  if(packet == NULL){
+    return; // Counted by overruns()
+  }
+  packet->size = size;
+  packet->rssi = LoRa.packetRssi();
+  packet->snr = LoRa.packetSnr();
+  packet->time = time;
+  LoRa.readBytes(packet->payload, size);
+  LoRaMan.received.publish();
+  LoRaMan.packets++;
 }
 
 //------------------------------------------------------------------------------------
-void LoRaManager::handleMessage() {
-  callback(loraMessage);
-  loraMessage.clear();
+void LoRaManager::handlePacket(const UtilLoRaPacket &received) {
+  lastPing = UtilClock::now();
+  packet = &received;
+  callback(UtilMessageView(received.payload, received.size));
+  packet = NULL;
   if(!isServer){
     sendMessage(NFO_PING);
   }
@@ -174,10 +302,31 @@ void LoRaManager::txMode(){
 }
 
 //------------------------------------------------------------------------------------
+// Hands on what the radio interrupt received, with or without USE_TASKS.
 void LoRaManager::loop(){
-  if(loraMessage.available()){
-    handleMessage();
+  int waiting = received.size();
+  highWater = waiting > highWater ? waiting : highWater;
+
+  UtilLoRaPacket *next;
+  while((next = received.front()) != NULL){
+    handlePacket(*next);
+    received.pop();
   }
 }
 
+//------------------------------------------------------------------------------------
+
+// Body of the LoRa task with USE_TASKS, transmits queued messages. Received
+// ones go from the radio interrupt to the loop task, see loop().
+void LoRaManager::taskLoop(){
+  #ifdef USE_TASKS
+  UtilMessage message;
+  while(LoRaMan.outbox.pop(message)){
+    LoRaMan.sendMessage(std::move(message));
+  }
+
+  UtilTask::pause(1);
+  #endif
+}
+
 #endif
@@ -9,6 +9,7 @@
 
 #include <UtilCommon.h>
 #include <UtilMessage.h>
+#include <UtilScheduler.h>
 
 #include <WiFi.h>
 #include <WebServer.h>
@@ -56,19 +57,30 @@ const char* serverIndex =
 class OTAManager {
 public:
   WebServer *otaServer;
+  const char *remoteCert = NULL; // Root CA for https update paths
   UtilMessageCallback otaCallback;
   unsigned long updateInterval = 5000;
+
+  #ifdef USE_TASKS
+  UtilTask task;
+  UtilSPSCQueue<UtilMessage, UTIL_TASK_QUEUE_SIZE> inbox; // OTA task -> loop task
+  #endif
   
   OTAManager(){};
   void begin(UtilMessageCallback callback);
   void begin(UtilMessageCallback callback, String updatePath);
   void loop(void);
+  static void taskLoop();
 
 private:
   bool otaActive = false;
-  unsigned long update = 0;
+  bool otaStarted = false;
+  uint64_t update = 0;
+  String otaPath;
 
   void beginOTA(UtilMessageCallback callback, String updatePath = "");
+  void startUpdate();
+  void notify(UtilMessage &&message);
   void localUpdate();
   void remoteUpdate(String updatePath);
   String getHost();
@@ -97,16 +109,43 @@ void OTAManager::begin(UtilMessageCallback callback, String updatePath){
 //------------------------------------------------------------------------------------
 void OTAManager::beginOTA(UtilMessageCallback callback, String updatePath) {
   otaCallback = callback;
+  otaPath = updatePath;
+
+  #ifdef USE_TASKS
+  task.start("OTA", OTAManager::taskLoop, OTA_TASK_CORE, OTA_TASK_PRIORITY, OTA_TASK_STACK);
+  #else
+  startUpdate();
+  #endif
+}
+
+//------------------------------------------------------------------------------------
+void OTAManager::startUpdate() {
+  otaStarted = true;
 
-  if( updatePath.isEmpty() ){
+  if( otaPath.isEmpty() ){
     Serial.println("Starting local OTA update.");
     localUpdate();
   } else {
     Serial.println("Starting remote OTA update.");
-    remoteUpdate(updatePath);
+    remoteUpdate(otaPath);
   }
 }
 
+//------------------------------------------------------------------------------------
+
+// Progress and results go to otaCallback on the loop task.
+void OTAManager::notify(UtilMessage &&message) {
+  #ifdef USE_TASKS
+  if(task.isCurrent()){
+    if(!inbox.push(std::move(message))){
+      Serial.println("ERROR: OTAManager - Inbox full, message dropped");
+    }
+    return;
+  }
+  #endif
+  otaCallback(message);
+}
+
 //------------------------------------------------------------------------------------
 void OTAManager::localUpdate(){
   // Make the access point
@@ -128,15 +167,15 @@ void OTAManager::localUpdate(){
   otaServer->on("/update", HTTP_POST, [&]() {
     otaServer->sendHeader("Connection", "close");
     otaServer->send(200, "text/plain", (Update.hasError()) ? "FAIL" : "OK");
-    otaCallback({NFO_KEY, "Success"});
+    notify(UtilMessage(NFO_KEY, "Success"));
 
     delay(5000);
-    otaCallback({ESP_RESTART});
+    notify(UtilMessage(ESP_RESTART));
   }, [&]() {
     HTTPUpload& upload = otaServer->upload();
     if (upload.status == UPLOAD_FILE_START) 
     {
-      otaCallback({NFO_KEY, upload.filename.c_str()});
+      notify(UtilMessage(NFO_KEY, upload.filename.c_str()));
       if (!Update.begin(UPDATE_SIZE_UNKNOWN)) //start with max available size
       { 
         Update.printError(Serial);
@@ -144,9 +183,9 @@ void OTAManager::localUpdate(){
     } 
     else if (upload.status == UPLOAD_FILE_WRITE) {
       /* flashing firmware to ESP*/
-      if(update < millis()){
-        update = millis() + updateInterval;
-        otaCallback({NFO_KEY, String(upload.totalSize/upload.currentSize).c_str()});
+      if(UtilClock::reached(update)){
+        update = UtilClock::now() + updateInterval;
+        notify(UtilMessage(NFO_KEY, String(upload.totalSize/upload.currentSize).c_str()));
       }
       if (Update.write(upload.buf, upload.currentSize) != upload.currentSize) {
         Update.printError(Serial);
@@ -154,7 +193,7 @@ void OTAManager::localUpdate(){
     } 
     else if (upload.status == UPLOAD_FILE_END) {
       if (Update.end(true)) { //true to set the size to the current progress
-        otaCallback({NFO_KEY, String(upload.totalSize).c_str()});
+        notify(UtilMessage(NFO_KEY, String(upload.totalSize).c_str()));
       } 
       else {
         Update.printError(Serial);
@@ -164,7 +203,7 @@ void OTAManager::localUpdate(){
 
   otaServer->begin();
   otaActive = true;
-  otaCallback({NFO_KEY, WiFi.softAPIP().toString().c_str()});
+  notify(UtilMessage(NFO_KEY, WiFi.softAPIP().toString().c_str()));
   Serial.println("OTA Server Running");
 }
 
@@ -180,7 +219,11 @@ void OTAManager::remoteUpdate(String updatePath){
   }
 
   Serial.print("IP address: "+ String(WiFi.localIP()));
-  WiFiClient client;
+  // https resumes the last TLS session with the update server, see UtilTLSCache.h
+  WiFiClient plainClient;
+  UtilTLSClient secureClient;
+  secureClient.setCACert(remoteCert);
+  WiFiClient &client = updatePath.startsWith("https") ? secureClient : plainClient;
   t_httpUpdate_return ret = httpUpdate.update(client, updatePath);
   // Or:
   //t_httpUpdate_return ret = httpUpdate.update(client, "server", 80, "file.bin");
@@ -204,9 +247,33 @@ void OTAManager::remoteUpdate(String updatePath){
 
 //------------------------------------------------------------------------------------
 void OTAManager::loop(void) {
+  #ifdef USE_TASKS
+  // The OTA task serves the update, deliver what it reported.
+  if(!task.isCurrent()){
+    UtilMessage message;
+    while(inbox.pop(message)){
+      otaCallback(message);
+    }
+    return;
+  }
+  #endif
+
   if(otaActive){
     otaServer->handleClient();
   }
 }
 
+//------------------------------------------------------------------------------------
+
+// Body of the OTA task with USE_TASKS, runs the update off the loop task.
+void OTAManager::taskLoop(void) {
+  #ifdef USE_TASKS
+  if(!OTAMan->otaStarted){
+    OTAMan->startUpdate();
+  }
+  OTAMan->loop();
+  UtilTask::pause(1);
+  #endif
+}
+
 #endif
\ No newline at end of file
@@ -8,8 +8,101 @@
 */
 
 #include <WiFiManager.h>
+#include <UtilQueue.h>
+#include <UtilJSON.h>
+#include <UtilHTTP.h>
+#include <UtilDeflate.h>
+#include <UtilSpool.h>
+#include <UtilScheduler.h>
+#include <Preferences.h>
+#include <new>
+
+#ifndef UTILS_SF_CAPACITY
 #define UTILS_SF_CAPACITY 20
-#define UTILS_SF_READ_TIME 2000
+#endif
+
+#ifndef SFRA_PIPELINE_DEPTH
+#define SFRA_PIPELINE_DEPTH 4
+#endif
+
+#ifndef SFRA_BATCH_SIZE
+#define SFRA_BATCH_SIZE 10
+#endif
+
+#ifndef SFRA_POLL_INTERVAL
+#define SFRA_POLL_INTERVAL 5
+#endif
+
+#ifndef SFRA_PAYLOAD_SIZE
+#define SFRA_PAYLOAD_SIZE 1024
+#endif
+
+#ifndef SFRA_RESOLVE_TIMEOUT
+#define SFRA_RESOLVE_TIMEOUT 5000
+#endif
+
+#ifndef SFRA_CONNECT_TIMEOUT
+#define SFRA_CONNECT_TIMEOUT 5000
+#endif
+
+#ifndef SFRA_HANDSHAKE_TIMEOUT
+#define SFRA_HANDSHAKE_TIMEOUT 10000
+#endif
+
+#ifndef SFRA_RECEIVE_TIMEOUT
+#define SFRA_RECEIVE_TIMEOUT 5000
+#endif
+
+#ifndef SFRA_SESSION_TIMEOUT
+#define SFRA_SESSION_TIMEOUT 7200 // s, the org's session timeout, 2 hours unless changed in Setup
+#endif
+
+#ifndef SFRA_REFRESH_MARGIN
+#define SFRA_REFRESH_MARGIN 300 // s before expiry the token is refreshed
+#endif
+
+#ifndef SFRA_REFRESH_TOKEN
+#define SFRA_REFRESH_TOKEN ""
+#endif
+
+#ifdef SFRA_TOKEN_PERSIST
+#define SFRA_TOKEN_PERSIST_DEFAULT true
+#else
+#define SFRA_TOKEN_PERSIST_DEFAULT false
+#endif
+
+#ifdef SFRA_SPOOL
+#define SFRA_SPOOL_DEFAULT true
+#else
+#define SFRA_SPOOL_DEFAULT false
+#endif
+
+#ifdef SFRA_COMPRESS
+#define SFRA_COMPRESS_DEFAULT true
+#else
+#define SFRA_COMPRESS_DEFAULT false
+#endif
+
+#ifndef SFRA_COMPRESS_MIN
+#define SFRA_COMPRESS_MIN 256 // Bodies shorter than this go out as they are
+#endif
+
+#ifndef SFRA_SPOOL_SEGMENT
+#define SFRA_SPOOL_SEGMENT 16384
+#endif
+
+#ifndef SFRA_SPOOL_SEGMENTS
+#define SFRA_SPOOL_SEGMENTS 48
+#endif
+
+#ifndef SFRA_SPOOL_GRACE
+#define SFRA_SPOOL_GRACE 10000 // ms without a usable token before requests spill to the spool
+#endif
+
+#define SFRA_SPOOL_HEADER 15    // type, lane, boot id, callback and target length of a spooled request
+#define SFRA_COMPOSITE_LIMIT 25 // Subrequests the Composite API takes at once
+#define UTILS_SF_TOKEN_SIZE 256 // Longest access token taken
+#define SFRA_NAMESPACE "sfra"   // NVS namespace of the stored token
 
 enum UtilSFRATokenState { 
   sf_token_empty, 
@@ -23,76 +116,385 @@ enum UtilSFRARequestType {
   sf_type_event
 };
 
+// Where the request state machine is, see advance()
+enum UtilSFRAPhase {
+  sf_phase_idle,
+  sf_phase_resolve,
+  sf_phase_connect,
+  sf_phase_handshake,
+  sf_phase_send,
+  sf_phase_receive,
+  sf_phase_count
+};
+
+// ms each phase took, the last time and over all times it completed
+struct UtilSFRAPhaseTime {
+  uint32_t count = 0;
+  uint32_t timeouts = 0;
+  unsigned long last = 0;
+  unsigned long max = 0;
+  unsigned long total = 0;
+};
+
+// Lanes of the request queue, high goes out first
+enum UtilSFRAPriority {
+  sf_priority_high,
+  sf_priority_normal,
+  sf_priority_low,
+  sf_priority_count
+};
+
 typedef void (*UtilSFRACallback)(bool success, String payload);
 
+// What is read from the body of a response, see expectResponse()
+enum UtilSFRAResponse {
+  sf_response_none,
+  sf_response_token,
+  sf_response_single,
+  sf_response_events,
+  sf_response_flows
+};
+
+enum UtilSFRAField {
+  sf_field_item,      // Ends with each result
+  sf_field_payload,   // What its callback gets
+  sf_field_success,
+  sf_field_status,
+  sf_field_error,
+  sf_field_count
+};
+
 struct UtilSFRARequest {
   UtilSFRARequestType type;
   String targetName; 
   String requestBody;
   UtilSFRACallback callback;
+  uint32_t spooled;         // Read back from the spool, 0 when it never left RAM
 } ;
 
+struct UtilSFRAResult {
+  UtilSFRACallback callback;
+  bool success;
+  String payload;
+};
+
 //------------------------------------------------------------------------------------
+// Requests to the instance share one HTTP/1.1 keep-alive connection, so the
+// TLS handshake is paid once rather than per request. Up to pipelineDepth
+// queued requests are written back to back and their responses read in
+// order. When the server closes the connection it is reopened on the next
+// request, a request only leaves the queue once its response is in.
+//
+// Nothing here waits on the network. Each call to loop(), or each turn of
+// the SF task, takes the steps that can be taken: resolve the host,
+// connect, handshake, send, read what has arrived. On the loop task the
+// next step is a UtilScheduler deadline, poll(), so ESPUtils::sleep()
+// wakes for it. The SF task waits for it instead, or for a new request. Every phase gives up
+// after its entry in timeouts[] ms, and phaseTimes[] keeps how long each
+// one took.
+//
+// Up to batchSize queued requests also share one round trip: consecutive
+// platform events go out as a single Composite API request, consecutive
+// calls to the same flow as one call with all their inputs. Each callback
+// still gets its own result.
+//
+// Requests wait in one of three priority lanes, see UtilPriorityQueue.
+// A full queue gives up the oldest request of a lower lane for a new one,
+// and requests.policy[] says what happens otherwise: reject it, drop the
+// oldest of its lane, or let it replace a waiting request to the same
+// target. A request that leaves the queue that way gets a failed callback.
+//
+// With spooling on, requests that cannot go out now move from RAM to an
+// append only UtilSpool on flash, and come back in order, as many as the
+// queue has room for, once WiFi and the token are there. They outlive a
+// restart: callbacks do not, those requests report to spoolCallback. A
+// request leaves the spool once its result is in, so after a restart it
+// may go out twice. High priority requests stay in RAM.
+//
+// The token is good for sessionTimeout seconds from issued_at, and is
+// fetched again refreshMargin seconds before that, while the queue is
+// empty, so requests do not wait for it. With a refresh token, from
+// SFRA_REFRESH_TOKEN or the token response, that is a refresh_token
+// grant, else the password grant. With SFRA_TOKEN_PERSIST the token and
+// instance are kept in NVS, and a restart goes straight to the instance.
+//
+// With compressing on, a request body of compressMin bytes or more goes
+// out gzipped, with Content-Encoding: gzip, when that makes it shorter.
+// UtilDeflate codes it on the way into the request, twice like every body
+// (see UtilHTTPRequest). Its fixed window, about 6 KB, is allocated with
+// the first body compressed and kept from then on. compressedIn and
+// compressedOut give the ratio, compressTime what it cost.
+//
+// Bodies are not kept. The parts that matter are picked out as the bytes
+// come in, by UtilJSONExtractor, and each request completes as soon as
+// its result has gone by.
 class SFManager{
 public:
-  unsigned long retryTime = millis();
-  unsigned long refreshTime = 0;
+  uint64_t refreshTime = 0;       // UtilClock time the token is fetched again, 0 for never
+  uint64_t issuedAt = 0;    // ms since 1970 when the org issued the token
+  uint32_t tokenExpires = 0;      // now() seconds the token is good until
+  uint32_t sessionTimeout = SFRA_SESSION_TIMEOUT;
+  uint32_t refreshMargin = SFRA_REFRESH_MARGIN;
+  bool persistToken = SFRA_TOKEN_PERSIST_DEFAULT;
+  String refreshGrant = SFRA_REFRESH_TOKEN; // refresh_token, the password grant is used without one
   UtilSFRATokenState    tokenState = sf_token_empty;
 
-  int pushIndex = 0;
-  int popIndex = 0;
-  UtilSFRARequest requestList[UTILS_SF_CAPACITY];
+  UtilPriorityQueue<UtilSFRARequest, UTILS_SF_CAPACITY, sf_priority_count> requests;
+
+  #ifdef USE_TASKS
+  UtilTask task;
+  UtilSPSCQueue<UtilSFRAResult, UTILS_SF_CAPACITY> results; // SF task -> loop task
+  #endif
 
   String token = "";
   String instance = "";
 
   int  hostPort = 443;
   String authHost = "login.salesforce.com";
-
+  int  pipelineDepth = SFRA_PIPELINE_DEPTH;
+  int  batchSize = SFRA_BATCH_SIZE;
+
+  uint32_t connects = 0;  // Connections opened to the instance
+  uint32_t responses = 0; // Responses read from the instance
+  uint32_t grants = 0;    // Tokens received
+  uint32_t refreshes = 0; // Of those, by the refresh_token grant
+  uint32_t restored = 0;  // Tokens taken from NVS
+
+  bool compressing = SFRA_COMPRESS_DEFAULT;
+  size_t compressMin = SFRA_COMPRESS_MIN;
+  uint32_t compressed = 0;    // Bodies sent gzipped
+  uint32_t compressedIn = 0;  // Their bytes before
+  uint32_t compressedOut = 0; // and after
+  uint32_t compressTime = 0;  // us spent compressing, both passes, bodies that did not shrink too
+
+  UtilSFRAPhase phase = sf_phase_idle;
+  unsigned long timeouts[sf_phase_count] = {0, SFRA_RESOLVE_TIMEOUT, SFRA_CONNECT_TIMEOUT, SFRA_HANDSHAKE_TIMEOUT, 0, SFRA_RECEIVE_TIMEOUT};
+  UtilSFRAPhaseTime phaseTimes[sf_phase_count];
+
+  bool spooling = SFRA_SPOOL_DEFAULT;
+  UtilSpool spool;
+  UtilSFRACallback spoolCallback = NULL; // Results of requests spooled before a restart
+
+  SFManager();
   bool pendingRequests();
+  bool advance();
   void requestToken();
   void refreshToken();
-  void eventRequest(String eventName, String requestBody, UtilSFRACallback callback);
-  void flowRequest(String flowName, String requestBody, UtilSFRACallback callback);
+  void clearToken(bool stored = true);
+  UtilQueueResult eventRequest(String eventName, String requestBody, UtilSFRACallback callback, UtilSFRAPriority priority = sf_priority_normal);
+  UtilQueueResult flowRequest(String flowName, String requestBody, UtilSFRACallback callback, UtilSFRAPriority priority = sf_priority_normal);
+  void disconnect();
   void loop();
+  static void poll();
+  static void taskLoop();
 
 //protected:
 
 private:
-  WiFiClientSecure getAuthClient();
-  WiFiClientSecure getInstanceClient();
-  int nextIndex(int index);
+  UtilTLSClient client;     // Kept alive to the instance between requests
+  String clientHost = "";
+  bool reused = false;      // The requests in flight went out on an older connection
+  bool authorizing = false; // The connection is for the token request
+  bool failed = false;      // Waiting SFRA_RETRY_DELAY after a failure
+  uint64_t retryTime = 0;   // UtilClock time the wait is over
+  unsigned long phaseStart = 0;
+
+  UtilHTTPParser parser;
+  UtilHTTPRequest writer;   // Requests on their way out, one write per round
+  UtilDeflate *deflate = NULL; // Bodies on their way into writer, from the first one compressed
+  int batches[UTILS_SF_CAPACITY]; // Queued requests covered by each request in flight
+  int inFlight = 0;
+  int answered = 0;
+  unsigned long readTime = 0;     // Last response or send
+
+  UtilJSONExtractor json;
+  UtilJSONField fields[sf_field_count];
+  UtilSFRAResponse response = sf_response_none;
+  char payload[SFRA_PAYLOAD_SIZE];
+  char success[8];
+  char itemStatus[8];
+  char error[40];
+  int  batchDone = 0;       // Requests of the answered batch completed so far
+  int  passed = 0;          // success values true and not, for the current request
+  int  failures = 0;
+  int  inputsLeft = 0;      // Flow results the current request still waits for
+  String flowResults = "";  // Flow results gathered for the current request
+  char accessToken[UTILS_SF_TOKEN_SIZE];
+  char instanceURL[128];
+  char issued[24];
+  char refreshValue[UTILS_SF_TOKEN_SIZE];
+  UtilJSONField tokenFields[4];
+  bool tokenLoaded = false; // NVS was looked at since clearToken()
+  bool refreshing = false;  // The token request is a refresh_token grant
+
+  uint32_t bootId = 0;      // Tells the requests spooled since this start
+  UtilSpoolMark spoolMarks[UTILS_SF_CAPACITY];  // Where each request read back ends
+  volatile bool spoolDone[UTILS_SF_CAPACITY];
+  uint32_t spoolRead = 0;   // Requests read back
+  uint32_t spoolOldest = 0; // Of those, the first not committed
+  uint64_t graceEnd = 0;    // UtilClock time SFRA_SPOOL_GRACE is up, 0 while the token is usable
+
   bool verifyConnection();
-  bool verifyToken();
-  void setNeedsRetry();
   void setNeedsRefresh();
-  
-  void executeRequest();
-  bool executeEventRequest(String eventName, String requestBody, UtilSFRACallback callback);
-  bool executeFlowRequest(String flowName, String requestBody, UtilSFRACallback callback);
-  void scheduleRequest(UtilSFRARequestType type, String flowName, String requestBody, UtilSFRACallback callback);
+  bool refreshDue();
+  void loadToken();
+  void saveToken();
+  static uint32_t now();
+
+  void start();
+  void open(String host);
+  void connecting();
+  void enterPhase(UtilSFRAPhase next);
+  void fail(String reason);
+  void scheduleStep(uint32_t delay);
+  void scheduleNext();
+  void sendToken();
+  void receiveToken();
+  void sendPipeline();
+  void receive();
+  int  batchCount(int index);
+  void complete(UtilSFRACallback callback, bool success, String payload);
+  void dropped(UtilSFRARequest &request);
+  bool online();
+  void spoolStep();
+  bool spill(UtilSFRARequest &request, int lane);
+  void replay();
+  void commitSpool();
+  void spoolFinished(uint32_t spooled);
+  void expectResponse();
+  void readResult(int field);
+  void nextFlow();
+  void finishRequest(bool success, const String &result);
+  void finishResponse();
+  static void readBody(const uint8_t *data, size_t size);
+  static void readField(int field);
+  void sendBatch(int index, int count);
+  void sendRequest(const char *path, const String &target, int index, int count);
+  void writeBody(Print &out, int index, int count);
+  static void writeTokenBody(Print &out, const String &refresh);
+  UtilQueueResult scheduleRequest(UtilSFRARequestType type, String flowName, String requestBody, UtilSFRACallback callback, UtilSFRAPriority priority);
+  static bool sameTarget(const UtilSFRARequest &waiting, const UtilSFRARequest &request);
 };
 
 SFManager SFMan;
 
+//------------------------------------------------------------------------------------
+SFManager::SFManager(){
+  requests.match = SFManager::sameTarget;
+  parser.onBody = SFManager::readBody;
+  json.callback = SFManager::readField;
+  fields[sf_field_item] = {NULL, NULL, 0, 0, false, false};
+  fields[sf_field_payload] = {NULL, payload, sizeof(payload), 0, false, false};
+  fields[sf_field_success] = {NULL, success, sizeof(success), 0, false, false};
+  fields[sf_field_status] = {NULL, itemStatus, sizeof(itemStatus), 0, false, false};
+  fields[sf_field_error] = {NULL, error, sizeof(error), 0, false, false};
+  tokenFields[0] = {"access_token", accessToken, sizeof(accessToken), 0, false, false};
+  tokenFields[1] = {"instance_url", instanceURL, sizeof(instanceURL), 0, false, false};
+  tokenFields[2] = {"issued_at", issued, sizeof(issued), 0, false, false};
+  tokenFields[3] = {"refresh_token", refreshValue, sizeof(refreshValue), 0, false, false};
+}
+
 //------------------------------------------------------------------------------------
 bool SFManager::pendingRequests(){
-  return nextIndex(popIndex) == pushIndex;
+  return !requests.isEmpty() || (spooling && !spool.isEmpty());
 }
 
 //------------------------------------------------------------------------------------
-int SFManager::nextIndex(int index){
-  return ++index == UTILS_SF_CAPACITY ? 0 : index;
+// Schedules the next token refresh, refreshMargin seconds before tokenExpires.
+void SFManager::setNeedsRefresh(){
+  uint32_t seconds = now();
+  uint32_t left = tokenExpires > seconds ? tokenExpires - seconds : 0;
+  uint32_t wait = left > refreshMargin ? left - refreshMargin : 0;
+  refreshTime = UtilClock::now() + wait * 1000ULL;
+  refreshTime = refreshTime == 0 ? 1 : refreshTime;
 }
 
 //------------------------------------------------------------------------------------
-void SFManager::setNeedsRetry(){
-  retryTime = SFRA_RETRY_DELAY + millis();
+bool SFManager::refreshDue(){
+  return tokenState == sf_token_valid && refreshTime != 0 && UtilClock::reached(refreshTime);
 }
 
 //------------------------------------------------------------------------------------
-void SFManager::setNeedsRefresh(){
-  refreshTime = SFRA_REFRESH_DELAY + millis();
+// A token stored by an earlier start, taken while it has time left. After
+// a power cycle the clock starts over and its age is unknown, it is taken
+// anyway and fetched again at the first chance. The org answers 401 when
+// it is too old.
+void SFManager::loadToken(){
+  tokenLoaded = true;
+  if(!persistToken || tokenState != sf_token_empty){
+    return;
+  }
+
+  Preferences preferences;
+  preferences.begin(SFRA_NAMESPACE, true);
+  String stored = preferences.getString("token", "");
+  String host = preferences.getString("instance", "");
+  String grant = preferences.getString("refresh", "");
+  uint64_t issued = preferences.getULong64("issued", 0);
+  uint32_t since = preferences.getUInt("since", 0);
+  uint32_t expires = preferences.getUInt("expires", 0);
+  preferences.end();
+
+  refreshGrant = grant.length() > 0 ? grant : refreshGrant;
+  uint32_t seconds = now();
+  bool restarted = seconds < since;
+  if(stored.length() == 0 || host.length() == 0 || (!restarted && seconds + refreshMargin >= expires)){
+    return;
+  }
+
+  token = stored;
+  instance = host;
+  issuedAt = issued;
+  tokenExpires = restarted ? seconds + refreshMargin : expires;
+  tokenState = sf_token_valid;
+  setNeedsRefresh();
+  restored++;
+  Serial.println("SFManager : Token restored, good for "+ String(tokenExpires - seconds) +" s");
+}
+
+//------------------------------------------------------------------------------------
+void SFManager::saveToken(){
+  if(!persistToken){
+    return;
+  }
+  Preferences preferences;
+  preferences.begin(SFRA_NAMESPACE, false);
+  if(preferences.putString("token", token) == 0){
+    Serial.println("ERROR: SFManager - Unable to store token");
+  }
+  preferences.putString("instance", instance);
+  preferences.putString("refresh", refreshGrant);
+  preferences.putULong64("issued", issuedAt);
+  preferences.putUInt("since", now());
+  preferences.putUInt("expires", tokenExpires);
+  preferences.end();
+}
+
+//------------------------------------------------------------------------------------
+// Drops the token in RAM, and the one in NVS unless stored is false. The
+// next request fetches a new one, or takes the stored one.
+void SFManager::clearToken(bool stored){
+  token = "";
+  tokenState = sf_token_empty;
+  tokenExpires = 0;
+  refreshTime = 0;
+  tokenLoaded = false;
+  if(stored){
+    Preferences preferences;
+    preferences.begin(SFRA_NAMESPACE, false);
+    preferences.clear();
+    preferences.end();
+  }
+}
+
+//------------------------------------------------------------------------------------
+// Seconds by time(), the clock issued_at and the stored token go by.
+uint32_t SFManager::now(){
+  #ifdef ESPUTILS_HOST
+  return HostClock::now() / 1000;
+  #else
+  return time(NULL);
+  #endif
 }
 
 //------------------------------------------------------------------------------------
@@ -106,339 +508,943 @@ bool SFManager::verifyConnection(){
     Serial.println("WiFi : Connected");
     return true;
   }
-  
+
   Serial.println("WiFi : Not Ready.");
-  if( WiFiManager::state == idle ){ 
+  if( WiFiManager::state == idle ){
     WiFiManager::beginStation();
   }
-
-  //setNeedsRetry();
   return false;
 }
 
 //------------------------------------------------------------------------------------
-bool SFManager::verifyToken(){
-  Serial.println("Verify Token");
+// Closes the connection, requests that were in flight stay queued.
+void SFManager::disconnect(){
+  requests.release(0);
+  client.stop();
+  clientHost = "";
+  authorizing = false;
+  inFlight = answered = 0;
+  response = sf_response_none;
+  phase = sf_phase_idle;
+}
 
-  if( tokenState == sf_token_valid){
-    Serial.println("SFManager : Valid token.");
-    return true;
+//------------------------------------------------------------------------------------
+// Fetches a new token on the next step the state machine takes from idle.
+void SFManager::requestToken(){
+  Serial.println("Request Token");
+  tokenState = sf_token_request;
+}
+
+//------------------------------------------------------------------------------------
+// Fetches a new token on the next step from idle, queued requests wait for it.
+void SFManager::refreshToken(){
+  Serial.println("Refresh");
+  tokenState = tokenState == sf_token_valid || tokenState == sf_token_refresh ? sf_token_refresh : sf_token_request;
+}
+
+//------------------------------------------------------------------------------------
+UtilQueueResult SFManager::eventRequest(String eventName, String requestBody, UtilSFRACallback callback, UtilSFRAPriority priority){
+  return scheduleRequest(sf_type_event, eventName, requestBody, callback, priority);
+}
+
+//------------------------------------------------------------------------------------
+UtilQueueResult SFManager::flowRequest(String flowName, String requestBody, UtilSFRACallback callback, UtilSFRAPriority priority){
+  return scheduleRequest(sf_type_flow, flowName, requestBody, callback, priority);
+}
+
+//------------------------------------------------------------------------------------
+// Queues the request and returns, loop() or the SF task send it. Anything
+// other than queue_added means the caller is ahead of the connection.
+UtilQueueResult SFManager::scheduleRequest(UtilSFRARequestType type, String targetName, String requestBody, UtilSFRACallback callback, UtilSFRAPriority priority){
+  UtilSFRARequest request = {type, targetName, requestBody, callback};
+  UtilQueueResult result = requests.push(request, priority);
+  if(result == queue_rejected){
+    Serial.println("ERROR: SFManager - Request queue full, raise UTILS_SF_CAPACITY");
+    dropped(request);
+    return result;
   }
-    
-  if(tokenState == sf_token_empty)
-  {
-    Serial.println("SFManager : Requesting token");
+  if(result == queue_coalesced){
+    Serial.println("SFManager : Replaced the waiting request to "+ request.targetName);
+    dropped(request);
   }
-
-  if(tokenState == sf_token_request || tokenState == sf_token_refresh){
-    Serial.println("SFManager : Waiting for token");
+  else if(result == queue_displaced){
+    Serial.println("SFManager : Queue full, dropped a request to "+ request.targetName);
+    dropped(request);
   }
 
-  requestToken();
-  return false;
+  #ifdef USE_TASKS
+  task.start("SFRA", SFManager::taskLoop, SFRA_TASK_CORE, SFRA_TASK_PRIORITY, SFRA_TASK_STACK);
+  task.wake();
+  #else
+  scheduleStep(0);
+  #endif
+  return result;
 }
 
 //------------------------------------------------------------------------------------
-WiFiClientSecure SFManager::getAuthClient(){
-  WiFiClientSecure client;
-  Serial.println("GetAuthClient");
-  
-  if(!verifyConnection()){
-     return client;
-  }
+// What queue_coalesce takes as the same request, a newer one replaces it.
+bool SFManager::sameTarget(const UtilSFRARequest &waiting, const UtilSFRARequest &request){
+  return waiting.type == request.type && waiting.targetName == request.targetName;
+}
+
+//------------------------------------------------------------------------------------
+// One step of the request state machine, it never waits on the network.
+// Returns true when it moved to another phase, which can start at once.
+bool SFManager::advance(){
+  UtilSFRAPhase current = phase;
+  switch(phase){
+    case sf_phase_idle:
+      start();
+      break;
 
-  Serial.printf("Connecting to %s... ", authHost.c_str());
-  
-  if (!client.connect(authHost.c_str(), hostPort)) {
-    Serial.println("Failed.");
-    client.stop();
-    return client;
-  } 
+    case sf_phase_resolve:
+    case sf_phase_connect:
+    case sf_phase_handshake:
+      connecting();
+      break;
+
+    case sf_phase_send:
+      if(authorizing){
+        sendToken();
+      } else {
+        sendPipeline();
+      }
+      enterPhase(sf_phase_receive);
+      break;
+
+    case sf_phase_receive:
+      if(authorizing){
+        receiveToken();
+      } else {
+        receive();
+      }
+      break;
 
-  Serial.printf("Success.");
-  return client;
+    default:
+      break;
+  }
+  return phase != current;
 }
 
 //------------------------------------------------------------------------------------
-WiFiClientSecure SFManager::getInstanceClient(){
-  WiFiClientSecure client;
-  Serial.println("GetInstanceClient");
+// Opens the connection the queue needs next: authHost while there is no
+// token, the instance once there is. A kept alive connection to the
+// instance goes straight to sending.
+void SFManager::start(){
+  if(!tokenLoaded){
+    loadToken();
+  }
+  if(refreshDue() && (requests.isEmpty() || now() >= tokenExpires)){
+    refreshToken(); // Ahead of expiry while nothing waits, at the latest once it expired
+  }
+  if(spooling){
+    spoolStep();
+  }
+  bool tokenWanted = tokenState == sf_token_request || tokenState == sf_token_refresh;
+  bool spooled = spooling && !spool.isEmpty();
+  if(requests.isEmpty() && !tokenWanted && !spooled){
+    return;
+  }
+  if(failed && !UtilClock::reached(retryTime)){
+    return;
+  }
+  failed = false;
 
   if(!verifyConnection()){
-     return client;
+    failed = true;
+    retryTime = UtilClock::now() + SFRA_RETRY_DELAY;
+    return;
+  }
+
+  if(tokenState != sf_token_valid){
+    if(tokenState == sf_token_empty){
+      tokenState = sf_token_request;
+    }
+    open(authHost);
+    authorizing = true;
+    return;
   }
 
-  if(!verifyToken()){
-    return client;
+  if(requests.isEmpty()){
+    replay(); // Back online, the spool goes first
+    if(requests.isEmpty()){
+      return;
+    }
   }
-  
-  Serial.printf("Connecting to %s... ", instance.c_str());
-  
-  if (!client.connect(instance.c_str(), hostPort)) {
-    Serial.println("Failed.");
-    client.stop();
-    return client;
-  } 
 
-  Serial.printf("Success.");
-  return client;
+  reused = client.connected() && clientHost == instance;
+  if(reused){
+    enterPhase(sf_phase_send);
+    return;
+  }
+  open(instance);
 }
 
 //------------------------------------------------------------------------------------
-void SFManager::requestToken(){
-  Serial.println("Request Token");
-  tokenState = sf_token_request;
-  
-  WiFiClientSecure client = getAuthClient();
-  if( !client.connected() ){
+void SFManager::open(String host){
+  disconnect();
+  Serial.printf("Connecting to %s...\n", host.c_str());
+  if(!client.begin(host.c_str(), hostPort)){
+    fail("Connecting to "+ host +" failed.");
     return;
   }
+  clientHost = host;
+  enterPhase(sf_phase_resolve);
+}
 
-  String requestBody = "grant_type=password&client_id=" + String(SFRA_CLIENT_ID) + 
-    "&client_secret=" + String(SFRA_CLIENT_SECRET) + 
-    "&username=" + String(SFRA_USER) + 
-    "&password=" + String(SFRA_PASS);
-  Serial.println(requestBody);
-
-  client.println("POST /services/oauth2/token HTTP/1.1");
-  client.println("Host: "+ authHost);
-  client.println("Content-Type: application/x-www-form-urlencoded");
-  client.println("Content-Length: "+ String(requestBody.length(), DEC));
-  client.println();
-  client.println(requestBody);
-
-  Serial.print("Authentication result... ");
-  while (client.connected()) {
-    String line = client.readStringUntil('\n');
-    if (line == "\r") {
-      Serial.println("Valid.");
-      break;
+//------------------------------------------------------------------------------------
+// Resolve, connect and handshake, as far as the client got without waiting.
+void SFManager::connecting(){
+  UtilTLSState state = client.advance();
+  if(state == tls_failed){
+    fail("Connecting to "+ clientHost +" failed.");
+    return;
+  }
+
+  UtilSFRAPhase next = state == tls_resolving ? sf_phase_resolve :
+    state == tls_connecting ? sf_phase_connect :
+    state == tls_handshaking ? sf_phase_handshake : sf_phase_send;
+  if(next == phase){
+    if(millis() - phaseStart > timeouts[phase]){
+      phaseTimes[phase].timeouts++;
+      fail("Connecting to "+ clientHost +" timed out.");
     }
+    return;
   }
-  Serial.println("");
 
-  Serial.println("Reading token.");
-  String line = client.readString();
-  if (line.indexOf("\"access_token\":\"") != -1) {
-    setNeedsRefresh();
-    tokenState = sf_token_valid;
-    token = line.substring(line.indexOf("\"access_token\":\"") + 16, line.indexOf("\",\"instance_url\""));
-    instance = line.substring(line.indexOf("\"instance_url\":\"") + 16 + 8, line.indexOf("\",\"id\""));
-    Serial.println("Auth Token: " + token);
-    Serial.println("Org Instance: " + instance);
-  } else {
-    Serial.println("Failed to parse token.");
+  if(next == sf_phase_send){
+    Serial.println("Connected to "+ clientHost +".");
+    parser.discard();
+    if(!authorizing){
+      connects++;
+    }
   }
+  enterPhase(next);
+}
 
-  client.stop();  
+//------------------------------------------------------------------------------------
+// Moves to next, the phase left behind completed and its time is kept.
+void SFManager::enterPhase(UtilSFRAPhase next){
+  unsigned long now = millis();
+  if(phase != sf_phase_idle){
+    UtilSFRAPhaseTime &time = phaseTimes[phase];
+    time.last = now - phaseStart;
+    time.max = time.last > time.max ? time.last : time.max;
+    time.total += time.last;
+    time.count++;
+  }
+  phase = next;
+  phaseStart = now;
 }
 
 //------------------------------------------------------------------------------------
-void SFManager::refreshToken(){
-  token = "";
-  Serial.println("Refresh");
-  //revokeToken();
-  requestToken();
-  /*
-  state = refreshing;
+// Gives up the connection, the queue is tried again after SFRA_RETRY_DELAY.
+void SFManager::fail(String reason){
+  Serial.println("SFManager : "+ reason);
+  if(authorizing){
+    // A token with time left stays in use, it is refreshed again later.
+    tokenState = token.length() > 0 && now() < tokenExpires ? sf_token_valid : sf_token_empty;
+  }
+  disconnect();
+  failed = true;
+  retryTime = UtilClock::now() + SFRA_RETRY_DELAY;
+  scheduleStep(SFRA_RETRY_DELAY);
+}
 
-  if(!verifyConnection()){
+//------------------------------------------------------------------------------------
+// Has UtilScheduler call poll() in delay ms. Only on the loop task, the SF
+// task keeps its own time.
+void SFManager::scheduleStep(uint32_t delay){
+  #ifndef USE_TASKS
+  UtilScheduler::schedule(SFManager::poll, delay);
+  #endif
+}
+
+//------------------------------------------------------------------------------------
+// The deadline of the next step: soon while a request is under way, when
+// the retry delay is up after a failure, or when the token is due.
+void SFManager::scheduleNext(){
+  if(phase != sf_phase_idle){
+    scheduleStep(SFRA_POLL_INTERVAL);
+  }
+  else if(failed && pendingRequests()){
+    uint64_t time = UtilClock::now();
+    scheduleStep(retryTime > time ? (uint32_t)(retryTime - time) : 0);
+  }
+  else if(pendingRequests()){
+    scheduleStep(SFRA_POLL_INTERVAL);
+  }
+  else if(tokenState == sf_token_valid && refreshTime != 0){
+    uint64_t time = UtilClock::now();
+    scheduleStep(refreshTime > time ? (uint32_t)(refreshTime - time) : 0);
+  }
+  else {
+    UtilScheduler::cancel(SFManager::poll);
+  }
+}
+
+//------------------------------------------------------------------------------------
+void SFManager::sendToken(){
+  refreshing = refreshGrant.length() > 0;
+  UtilHTTPLength length;
+  writeTokenBody(length, refreshGrant);
+
+  writer.begin(client);
+  writer.print("POST /services/oauth2/token HTTP/1.1\r\n");
+  writer.header("Host", authHost);
+  writer.header("Content-Type", "application/x-www-form-urlencoded");
+  writer.header("Content-Length", (unsigned long)length.length);
+  writer.header("Connection", "close");
+  writer.end();
+  writeTokenBody(writer, refreshGrant);
+  writer.send();
+
+  response = sf_response_token;
+  json.begin(tokenFields, 4);
+  readTime = millis();
+}
+
+//------------------------------------------------------------------------------------
+// Takes in the token response as it arrives. The instance is opened on
+// the next step.
+void SFManager::receiveToken(){
+  UtilHTTPState state = parser.read(client);
+  if(state != http_complete && !client.connected()){
+    state = parser.close();
+  }
+  if(state != http_complete && state != http_error){
+    if(millis() - readTime > timeouts[sf_phase_receive]){
+      phaseTimes[sf_phase_receive].timeouts++;
+      fail("No token response.");
+    }
+    return;
+  }
+
+  int status = state == http_complete ? parser.status : 0;
+  Serial.println("Authentication result... "+ String(status));
+  Serial.println("Reading token.");
+  if(refreshing && (status == 400 || status == 401)){
+    Serial.println("SFManager : Refresh token rejected, using the password grant.");
+    refreshGrant = "";
+  }
+  if (status != 200 || !tokenFields[0].found || tokenFields[0].truncated || !tokenFields[1].found || tokenFields[1].truncated) {
+    fail("Failed to parse token.");
     return;
   }
 
-  if(token.isEmpty()){
-    requestToken();
-    state = refreshing;
+  tokenState = sf_token_valid;
+  token = accessToken;
+  instance = strncmp(instanceURL, "https://", 8) == 0 ? instanceURL + 8 : instanceURL;
+  issuedAt = tokenFields[2].found ? strtoull(issued, NULL, 10) : 0;
+  if(tokenFields[3].found && !tokenFields[3].truncated){
+    refreshGrant = refreshValue;
+  }
+
+  // issued_at only counts once the clock is set, before that the session starts now.
+  uint32_t seconds = now();
+  uint32_t issuedSeconds = issuedAt / 1000;
+  bool synced = seconds > 1577836800 && issuedSeconds > 0 && issuedSeconds <= seconds + 60;
+  tokenExpires = (synced ? issuedSeconds : seconds) + sessionTimeout;
+  setNeedsRefresh();
+  grants++;
+  refreshes += refreshing;
+  saveToken();
+  Serial.println("Auth Token: " + token);
+  Serial.println("Org Instance: " + instance);
+
+  enterPhase(sf_phase_idle);
+  disconnect();
+}
+
+//------------------------------------------------------------------------------------
+// Sends up to pipelineDepth requests, each covering one batch of the queue.
+void SFManager::sendPipeline(){
+  requests.hold();
+  int queued = 0;
+  writer.begin(client);
+  while(inFlight < pipelineDepth && requests.at(queued) != NULL){
+    batches[inFlight] = batchCount(queued);
+    sendBatch(queued, batches[inFlight]);
+    queued += batches[inFlight];
+    inFlight++;
+  }
+  writer.send(); // All of them in one write, as far as the buffer goes
+  requests.release(queued); // Whatever arrives meanwhile may go ahead of the rest
+  answered = 0;
+  readTime = millis();
+  expectResponse();
+}
+
+//------------------------------------------------------------------------------------
+// Takes in the responses that have arrived, in order. A 2xx or a 4xx answer
+// completes its batch, anything else leaves it and those behind it queued
+// for the next attempt. Back to idle once all are in.
+void SFManager::receive(){
+  int queued = requests.size();
+  while(answered < inFlight){
+    UtilHTTPState state = parser.read(client);
+    if(state != http_complete && !client.connected()){
+      state = parser.close();
+    }
+
+    bool timedOut = state != http_complete && state != http_error && millis() - readTime > timeouts[sf_phase_receive];
+    if(state == http_error || timedOut){
+      phaseTimes[sf_phase_receive].timeouts += timedOut;
+      // A reused connection the server has just closed fails the first
+      // round without a response, send it again at once on a fresh one.
+      if(answered == 0 && reused && !timedOut){
+        Serial.println("SFManager : Kept alive connection closed, sending again.");
+        disconnect();
+      } else {
+        fail("No response, connection closed.");
+      }
+      break;
+    }
+
+    if(state != http_complete){
+      break; // More to come
+    }
+    responses++;
+    readTime = millis();
+
+    if(parser.status == 401){
+      Serial.println("SFManager : Token rejected.");
+      token = "";
+      tokenState = sf_token_empty;
+      disconnect();
+      break;
+    }
+
+    if(parser.status >= 500){
+      fail("Server error "+ String(parser.status));
+      break;
+    }
+
+    bool keepAlive = parser.keepAlive;
+    finishResponse();
+    answered++;
+    parser.reset();
+    expectResponse();
+
+    if(!keepAlive || answered == inFlight){
+      enterPhase(sf_phase_idle);
+      inFlight = answered = 0;
+    }
+    if(!keepAlive){
+      // Whatever was pipelined behind it is sent again on the next connection.
+      disconnect();
+    }
+  }
+
+  if(requests.size() < queued){
+    Serial.println("Pop: "+ String(requests.size()) +" pending");
+  }
+}
+
+//------------------------------------------------------------------------------------
+// Number of queued requests from index on that share one round trip.
+// Flows only batch when their body is an inputs array.
+int SFManager::batchCount(int index){
+  UtilSFRARequest *first = requests.at(index);
+  int limit = batchSize < SFRA_COMPOSITE_LIMIT ? batchSize : SFRA_COMPOSITE_LIMIT;
+  int begin, end;
+  if(first->type == sf_type_flow && !utilJSONMember(first->requestBody, 0, "inputs", begin, end)){
+    return 1;
+  }
+
+  int count = 1;
+  UtilSFRARequest *next;
+  while(count < limit && (next = requests.at(index + count)) != NULL && next->type == first->type){
+    if(next->type == sf_type_flow && (next->targetName != first->targetName || !utilJSONMember(next->requestBody, 0, "inputs", begin, end))){
+      break;
+    }
+    count++;
+  }
+  return count;
+}
+
+//------------------------------------------------------------------------------------
+// Callbacks always run on the loop task, with USE_TASKS they are queued for loop().
+void SFManager::complete(UtilSFRACallback callback, bool success, String payload){
+  if(callback == NULL){
     return;
   }
+  #ifdef USE_TASKS
+  if(task.isCurrent()){
+    if(!results.push({callback, success, payload})){
+      Serial.println("ERROR: SFManager - Result queue full, result dropped");
+    }
+    return;
+  }
+  #endif
+  callback(success, payload);
+}
 
-  WiFiClientSecure client;
-  String requestBody = "grant_type=refresh_token&client_id=" + String(SFRA_CLIENT_ID) + 
-    "&client_secret=" + String(SFRA_CLIENT_SECRET) + 
-    "&refresh_token=" + token;
-  */
+//------------------------------------------------------------------------------------
+// A request that left the queue without going out, it failed.
+void SFManager::dropped(UtilSFRARequest &request){
+  spoolFinished(request.spooled);
+  complete(request.callback, false, "");
 }
- 
+
 //------------------------------------------------------------------------------------
-void SFManager::eventRequest(String eventName, String requestBody, UtilSFRACallback callback){
-  scheduleRequest(sf_type_event, eventName, requestBody, callback);
+// Requests can go out now, as far as can be told without trying. A token
+// being fetched, on the first start or after it was rejected, counts for
+// SFRA_SPOOL_GRACE, and a failed request only waits for its retry.
+bool SFManager::online(){
+  bool usable = tokenState == sf_token_valid || (tokenState == sf_token_refresh && now() < tokenExpires);
+  if(usable){
+    graceEnd = 0;
+  }
+  else if(graceEnd == 0){
+    graceEnd = UtilClock::now() + SFRA_SPOOL_GRACE;
+  }
+  return WiFiManager::state == connected && (usable || !UtilClock::reached(graceEnd));
 }
 
 //------------------------------------------------------------------------------------
-void SFManager::flowRequest(String flowName, String requestBody, UtilSFRACallback callback){
-  scheduleRequest(sf_type_flow, flowName, requestBody, callback);
+// Keeps the spool and the queue in step, from start() only, so one task
+// does all the flash access. Offline, requests move out to the spool. As
+// long as anything is spooled new ones follow it there, to keep their
+// order, and it is read back as the queue has room.
+void SFManager::spoolStep(){
+  if(!spool.isOpen()){
+    if(!spool.begin("sfra", SFRA_SPOOL_SEGMENT, SFRA_SPOOL_SEGMENTS)){
+      Serial.println("ERROR: SFManager - No spool, requests stay in RAM");
+      spooling = false;
+      return;
+    }
+    bootId = esp_random();
+  }
+  commitSpool();
+
+  bool up = online();
+  if(!up || !spool.isEmpty()){
+    int held = requests.hold();
+    UtilSFRARequest request;
+    for(int i = 0; i < held; i++){
+      UtilSFRARequest *queued = requests.at(i);
+      int lane = requests.lane(i);
+      if(lane != sf_priority_high && queued->spooled == 0 && spill(*queued, lane)){
+        requests.take(i--, request);
+        held--;
+      }
+    }
+    requests.release(0);
+  }
+  if(up){
+    replay();
+  }
 }
 
 //------------------------------------------------------------------------------------
-void SFManager::scheduleRequest(UtilSFRARequestType type, String targetName, String requestBody, UtilSFRACallback callback){
-  requestList[pushIndex] = {type, targetName, requestBody, callback};
-  pushIndex = nextIndex(pushIndex);
+// Appends request to the spool, false when it has to stay in RAM.
+//   type, lane, boot id, callback, target length, target, body
+bool SFManager::spill(UtilSFRARequest &request, int lane){
+  size_t target = request.targetName.length();
+  size_t body = request.requestBody.length();
+  size_t size = SFRA_SPOOL_HEADER + target + body;
+  if(target > 255 || size > UTIL_SPOOL_RECORD_SIZE - UTIL_SPOOL_HEADER){
+    return false;
+  }
 
-  //pushIndex = ++pushIndex == UTILS_SF_CAPACITY ? 0 : pushIndex;
-  Serial.println("Push: "+ String(pushIndex) +" - "+ String(popIndex));
-  executeRequest();
+  uint8_t record[UTIL_SPOOL_RECORD_SIZE];
+  uint64_t callback = (uintptr_t)request.callback;
+  record[0] = request.type;
+  record[1] = lane;
+  for(int i = 0; i < 4; i++){
+    record[2 + i] = bootId >> (8 * i);
+  }
+  for(int i = 0; i < 8; i++){
+    record[6 + i] = callback >> (8 * i);
+  }
+  record[14] = target;
+  memcpy(record + SFRA_SPOOL_HEADER, request.targetName.c_str(), target);
+  memcpy(record + SFRA_SPOOL_HEADER + target, request.requestBody.c_str(), body);
+  return spool.append(record, size);
 }
 
 //------------------------------------------------------------------------------------
-void SFManager::executeRequest(){  
-  UtilSFRARequest request = requestList[popIndex];
-  bool success = false;
+// Reads spooled requests back into the queue, oldest first, while it has
+// room. A callback only counts in a record spooled since this start.
+void SFManager::replay(){
+  size_t size;
+  UtilSpoolMark mark;
+  const uint8_t *record;
+  while(requests.available() > 0 && spoolRead - spoolOldest < UTILS_SF_CAPACITY && (record = spool.read(size, mark)) != NULL){
+    uint32_t id = spoolRead++;
+    spoolMarks[id % UTILS_SF_CAPACITY] = mark;
+    spoolDone[id % UTILS_SF_CAPACITY] = false;
+    if(size < SFRA_SPOOL_HEADER || size < SFRA_SPOOL_HEADER + (size_t)record[14] || record[0] > sf_type_event || record[1] >= sf_priority_count){
+      spoolFinished(id + 1); // Not a request, nothing to send
+      continue;
+    }
 
-  if(request.type == sf_type_event){
-    success = executeEventRequest(request.targetName, request.requestBody, request.callback);
-  } 
-  else if(request.type == sf_type_flow){
-    success = executeFlowRequest(request.targetName, request.requestBody, request.callback);
+    uint32_t boot = 0;
+    uint64_t callback = 0;
+    for(int i = 3; i >= 0; i--){
+      boot = boot << 8 | record[2 + i];
+    }
+    for(int i = 7; i >= 0; i--){
+      callback = callback << 8 | record[6 + i];
+    }
+    size_t target = record[14];
+    UtilSFRARequest request = {(UtilSFRARequestType)record[0], "", "", boot == bootId ? (UtilSFRACallback)(uintptr_t)callback : spoolCallback, id + 1};
+    request.targetName.concat((const char *)record + SFRA_SPOOL_HEADER, target);
+    request.requestBody.concat((const char *)record + SFRA_SPOOL_HEADER + target, size - SFRA_SPOOL_HEADER - target);
+
+    UtilQueueResult result = requests.push(request, record[1]);
+    if(result != queue_added){
+      dropped(request);
+    }
   }
+}
 
-  if( success ){
-    //popIndex = ++popIndex == UTILS_SF_CAPACITY ? 0 : popIndex;
-    popIndex = nextIndex(popIndex);
-    Serial.println("Pop: "+ String(pushIndex) +" - "+ String(popIndex));
+//------------------------------------------------------------------------------------
+// Commits the spool up to the last of the requests read back that are all
+// done, in one write.
+void SFManager::commitSpool(){
+  bool done = false;
+  UtilSpoolMark mark;
+  while(spoolOldest < spoolRead && spoolDone[spoolOldest % UTILS_SF_CAPACITY]){
+    mark = spoolMarks[spoolOldest % UTILS_SF_CAPACITY];
+    spoolOldest++;
+    done = true;
+  }
+  if(done){
+    spool.commit(mark);
   }
 }
 
 //------------------------------------------------------------------------------------
-bool SFManager::executeEventRequest(String eventName, String requestBody, UtilSFRACallback callback){
+// The request read back as number spooled is done with, it leaves the
+// spool on the next commitSpool().
+void SFManager::spoolFinished(uint32_t spooled){
+  if(spooled != 0){
+    spoolDone[(spooled - 1) % UTILS_SF_CAPACITY] = true;
+  }
+}
 
-  WiFiClientSecure client = getInstanceClient();
-  if( !client.connected() ){
-    return false;
+//------------------------------------------------------------------------------------
+// Points the extractor at the results in the next response in flight.
+//   single  {"id":...,"success":true,"errors":[]} or [{"isSuccess":true,...}]
+//   events  {"compositeResponse":[{"body":{...},"httpStatusCode":201,...},...]}
+//   flows   [{"errors":null,"isSuccess":true,"outputValues":{...}},...], one per input
+void SFManager::expectResponse(){
+  batchDone = passed = failures = 0;
+  if(answered >= inFlight){
+    response = sf_response_none;
+    return;
   }
 
-  client.println("POST /services/data/"+ String(SFRA_API) +"/sobjects/"+ eventName +" HTTP/1.1");
-  client.println("Host: "+ instance);
-  client.println("Content-Type: application/json");
-  client.println("Content-Length: "+ String(requestBody.length(), DEC));
-  client.println("Authorization: Bearer "+ token);
-  client.println();
-  client.println(requestBody);
+  bool event = requests.front()->type == sf_type_event;
+  const char *item = "", *result = "", *status = NULL;
+  const char *succeeded = event ? "success" : "[].isSuccess";
+  const char *failed = event ? "[].errorCode" : "[].errors[].statusCode";
+  response = sf_response_single;
+  if(batches[answered] > 1 && event){
+    response = sf_response_events;
+    item = "compositeResponse[]";
+    result = "compositeResponse[].body";
+    succeeded = "compositeResponse[].body.success";
+    status = "compositeResponse[].httpStatusCode";
+    failed = "compositeResponse[].body[].errorCode";
+  }
+  else if(batches[answered] > 1){
+    response = sf_response_flows;
+    item = result = "[]";
+  }
 
-  Serial.print("Platform Event result... ");
-  unsigned long readTime = millis() + UTILS_SF_READ_TIME;
+  fields[sf_field_item].path = item;
+  fields[sf_field_payload].path = result;
+  fields[sf_field_success].path = succeeded;
+  fields[sf_field_status].path = status;
+  fields[sf_field_error].path = failed;
+  json.begin(fields, sf_field_count);
 
-  while (client.connected() && readTime < millis()) {
-    String line = client.readStringUntil('\n');
-    Serial.print(line);
-    if (line == "\r") {
-      Serial.println("Done.");
-      break;
+  if(response == sf_response_flows){
+    nextFlow();
+  }
+}
+
+//------------------------------------------------------------------------------------
+// Body bytes of the response being read. Those of a rejected token or a
+// server error complete nothing, the requests are sent again.
+void SFManager::readBody(const uint8_t *data, size_t size){
+  if(SFMan.parser.status != 401 && SFMan.parser.status < 500){
+    SFMan.json.feed(data, size);
+  }
+}
+
+//------------------------------------------------------------------------------------
+void SFManager::readField(int field){
+  SFMan.readResult(field);
+}
+
+//------------------------------------------------------------------------------------
+// A field of the response ended, at the end of each result the request it
+// belongs to completes.
+void SFManager::readResult(int field){
+  if(response < sf_response_single || batchDone >= batches[answered]){
+    return;
+  }
+
+  if(field == sf_field_success){
+    if(strcmp(success, "true") == 0){
+      passed++;
+    } else {
+      failures++;
+    }
+    return;
+  }
+
+  if(field != sf_field_item){
+    return;
+  }
+
+  if(response == sf_response_flows){
+    flowResults += (flowResults.length() > 1 ? "," : "") + String(payload);
+    if(--inputsLeft == 0){
+      flowResults += "]";
+      finishRequest(failures == 0, flowResults);
+      nextFlow();
     }
+    return;
   }
-  
-  String line = client.readString();
-  client.stop(); 
 
-  //Serial.println(line);
-  
-  Serial.print("\nParsing result... ");
-  if (line.indexOf("\"success\":true") != -1) {
+  int code = response == sf_response_events ? atoi(itemStatus) : parser.status;
+  finishRequest(code / 100 == 2 && passed > 0 && failures == 0, payload);
+}
+
+//------------------------------------------------------------------------------------
+// The flow answers with one result per input, in order. Each request gets
+// the results of its own inputs, as if it went out alone. Salesforce
+// answers 400 when some inputs failed, the rest still succeeded.
+void SFManager::nextFlow(){
+  while(batchDone < batches[answered]){
+    UtilSFRARequest *request = requests.front();
+    int begin, end;
+    utilJSONMember(request->requestBody, 0, "inputs", begin, end);
+    inputsLeft = utilJSONCount(request->requestBody, begin);
+    flowResults = "[";
+    if(inputsLeft > 0){
+      return;
+    }
+    finishRequest(false, "");
+  }
+}
+
+//------------------------------------------------------------------------------------
+// Hands the request at the front its result and takes it off the queue.
+void SFManager::finishRequest(bool succeeded, const String &result){
+  UtilSFRARequest *request = requests.front();
+  if(!succeeded){
+    Serial.println("Failed: "+ String(response == sf_response_events ? atoi(itemStatus) : parser.status) +" "+ String(error));
+  }
+  else if(response == sf_response_single){
     Serial.println("Success.");
-    callback(true,line);
-    return true;
-  } 
-  
-  Serial.println("Failed.");
-  callback(false,"");
-  return false;
+  }
+  if(succeeded && fields[sf_field_payload].truncated){
+    Serial.println("ERROR: SFManager - Result larger than SFRA_PAYLOAD_SIZE, cut short");
+  }
+  complete(request->callback, succeeded, succeeded ? result : "");
+  spoolFinished(request->spooled);
+  requests.pop();
+
+  batchDone++;
+  passed = failures = 0;
+  json.clear(sf_field_status);
+  json.clear(sf_field_error);
 }
 
 //------------------------------------------------------------------------------------
-bool SFManager::executeFlowRequest(String flowName, String requestBody, UtilSFRACallback callback){
+// The response ended. Requests of its batch it held no result for failed.
+void SFManager::finishResponse(){
+  int count = batches[answered];
+  if(batchDone < count && !json.complete()){
+    Serial.println("SFManager : Response without results for "+ String(count - batchDone) +" requests.");
+  }
+  while(batchDone < count){
+    finishRequest(false, "");
+  }
 
-  WiFiClientSecure client = getInstanceClient();
-  if( !client.connected() ){
-    return false;
+  if(response == sf_response_events){
+    Serial.println("SFManager : Composite of "+ String(count) +" events done.");
+  }
+  else if(response == sf_response_flows){
+    Serial.println("SFManager : "+ String(count) +" flow calls done, status "+ String(parser.status));
   }
+}
 
-  client.println("POST /services/data/"+ String(SFRA_API) +"/actions/custom/flow/"+ flowName +" HTTP/1.1");
-  client.println("Host: "+ instance);
-  client.println("Content-Type: application/json");
-  client.println("Content-Length: "+ String(requestBody.length(), DEC));
-  client.println("Authorization: Bearer "+ token);
-  client.println();
-  client.println(requestBody);
+//------------------------------------------------------------------------------------
+// Writes the count requests from index on as one HTTP request.
+void SFManager::sendBatch(int index, int count){
+  UtilSFRARequest *request = requests.at(index);
+  if(request->type == sf_type_flow){
+    sendRequest("/actions/custom/flow/", request->targetName, index, count);
+  }
+  else if(count == 1){
+    sendRequest("/sobjects/", request->targetName, index, count);
+  }
+  else {
+    sendRequest("/composite", "", index, count);
+  }
+}
 
-  Serial.print("Flow result... ");
-  unsigned long readTime = millis() + UTILS_SF_READ_TIME;
+//------------------------------------------------------------------------------------
+// Adds the request to the writer, the body is written once to count it
+// and once to send it. Gzipped the same goes for the compressed body.
+void SFManager::sendRequest(const char *path, const String &target, int index, int count){
+  UtilHTTPLength length;
+  writeBody(length, index, count);
+
+  bool gzip = compressing && length.length >= compressMin;
+  if(gzip && deflate == NULL){
+    deflate = new (std::nothrow) UtilDeflate();
+    if(deflate == NULL){
+      Serial.println("ERROR: SFManager - No memory to compress, bodies go out raw");
+      compressing = false;
+      gzip = false;
+    }
+  }
+  if(gzip){
+    unsigned long started = micros();
+    UtilHTTPLength packed;
+    deflate->begin(packed);
+    writeBody(*deflate, index, count);
+    deflate->end();
+    compressTime += micros() - started;
+    gzip = packed.length < length.length;
+    if(gzip){
+      compressed++;
+      compressedIn += length.length;
+      compressedOut += packed.length;
+      length.length = packed.length;
+    }
+  }
 
-  while (client.connected() && readTime < millis()) {
-    String line = client.readStringUntil('\n');
-    Serial.print(line);
-    if (line == "\r") {
-      Serial.println("Done.");
-      break;
+  writer.print("POST /services/data/" SFRA_API);
+  writer.print(path);
+  writer.print(target);
+  writer.print(" HTTP/1.1\r\n");
+  writer.header("Host", instance);
+  writer.header("Content-Type", "application/json");
+  writer.header("Content-Length", (unsigned long)length.length);
+  if(gzip){
+    writer.header("Content-Encoding", "gzip");
+  }
+  writer.print("Authorization: Bearer ");
+  writer.print(token);
+  writer.print("\r\n\r\n");
+
+  if(!gzip){
+    writeBody(writer, index, count);
+    return;
+  }
+  unsigned long started = micros();
+  deflate->begin(writer);
+  writeBody(*deflate, index, count);
+  deflate->end();
+  compressTime += micros() - started;
+}
+
+//------------------------------------------------------------------------------------
+// The body of the count requests from index on: the request's own, a
+// Composite API request of events, or one flow call with all their inputs.
+void SFManager::writeBody(Print &out, int index, int count){
+  UtilSFRARequest *request = requests.at(index);
+  if(count == 1){
+    out.print(request->requestBody);
+    return;
+  }
+
+  if(request->type == sf_type_event){
+    out.print("{\"allOrNone\":false,\"compositeRequest\":[");
+    for(int i = 0; i < count; i++){
+      request = requests.at(index + i);
+      out.print(i > 0 ? ",{\"method\":\"POST\",\"url\":\"/services/data/" SFRA_API "/sobjects/" : "{\"method\":\"POST\",\"url\":\"/services/data/" SFRA_API "/sobjects/");
+      out.print(request->targetName);
+      out.print("\",\"referenceId\":\"r");
+      out.print(i);
+      out.print("\",\"body\":");
+      out.print(request->requestBody);
+      out.print("}");
     }
+    out.print("]}");
+    return;
   }
-  
-  String line = client.readString();
-  client.stop();
 
-  Serial.println("\nParsing result.");
-  if (line.indexOf("isSuccess\":true") != -1) {
-    Serial.println("Success.");
-    callback(true,line);
-    return true;
-  } 
-  
-  Serial.println("Failed: " + line);
-  callback(false,"");
-  return false;
-  
-  //{"message":"Unexpected character ('j' (code 106)): was expecting a colon to separate field name and value at [line:1, column:18]","errorCode":"JSON_PARSER_ERROR"}
-  //{"id":"e09xx0000000001AAA","success":true,"errors":[{"statusCode":"OPERATION_ENQUEUED","message":"48eedfc5-f9eb-4fbb-8cba-2d49f9f98022","fields":[]}]}
-
-  // if (line.indexOf("\"access_token\":\"") != -1) {
-  //   Serial.println("Success.");
-  //   setNeedsRefresh();
-  //   token = line.substring(line.indexOf("\"access_token\":\"") + 16, line.indexOf("\",\"instance_url\""));
-  //   Serial.println("Auth Token: " + token);
-  //   instance = line.substring(line.indexOf("\"instance_url\":\"") + 16 + 8, line.indexOf("\",\"id\""));
-  //   Serial.println("Org Instance: " + instance);
-  // } else {
-  //   Serial.println("Failed.");
-  //   setNeedsRetry();
-  // }
-
-  // client.stop(); 
-  // requestState = sf_state_idle;
-  //flowCallback = nullptr;
-}
-
-//------------------------------------------------------------------------------------
-void SFManager::loop(){  
-  // if (refreshTime != 0 && refreshTime < millis()){
-  //   refreshTime = 0;
-  //   refreshToken();
-  //   return;
-  // }
-
-  // Attempt delayed requests at a resonable interval. 
-  if (retryTime != 0 && retryTime < millis()){
-    
-    // If there are outstanding requests, attempt to execute one.
-    if( pendingRequests() ){
-      executeRequest();
+  out.print("{\"inputs\":[");
+  bool first = true;
+  for(int i = 0; i < count; i++){
+    request = requests.at(index + i);
+    int begin, end;
+    utilJSONMember(request->requestBody, 0, "inputs", begin, end);
+    // What is inside the brackets, without the space around it
+    const char *text = request->requestBody.c_str();
+    begin++;
+    end--;
+    while(begin < end && isspace((unsigned char)text[begin])){
+      begin++;
     }
+    while(end > begin && isspace((unsigned char)text[end - 1])){
+      end--;
+    }
+    if(end > begin){
+      out.print(first ? "" : ",");
+      out.write((const uint8_t *)text + begin, end - begin);
+      first = false;
+    }
+  }
+  out.print("]}");
+}
 
-    // Set the delay for the next execution cycle.
-    setNeedsRetry();
-  }
-
-  // if (retryTime != 0 && retryTime < millis()){
-  //   retryTime = 0;
-  //   switch(requestState) {
-  //     case sf_state_flow:
-  //       Serial.println("SFManager : Flow Request");
-  //       flowRequest();
-  //       break;
-  //     case sf_state_platform:
-  //       Serial.println("SFManager : Platform Request");
-  //       platformRequest();
-  //       break;
-  //     default:
-  //     break;
-  //   }
-  // }
-}
-#endif
\ No newline at end of file
+//------------------------------------------------------------------------------------
+// The form of the token request, the refresh_token grant when there is one.
+void SFManager::writeTokenBody(Print &out, const String &refresh){
+  out.print("grant_type=");
+  out.print(refresh.length() > 0 ? "refresh_token" : "password");
+  out.print("&client_id=" SFRA_CLIENT_ID "&client_secret=" SFRA_CLIENT_SECRET);
+  if(refresh.length() > 0){
+    out.print("&refresh_token=");
+    out.print(refresh);
+  }
+  else {
+    out.print("&username=" SFRA_USER "&password=" SFRA_PASS);
+  }
+}
+
+//------------------------------------------------------------------------------------
+void SFManager::loop(){
+  #ifdef USE_TASKS
+  // Deliver what the SF task completed
+  UtilSFRAResult result;
+  while(results.pop(result)){
+    result.callback(result.success, result.payload);
+  }
+  #else
+  // A few steps at most, each phase can follow the last straight away
+  for(int i = 0; i < sf_phase_count && advance(); i++){
+  }
+  scheduleNext();
+  #endif
+}
+
+//------------------------------------------------------------------------------------
+// The UtilScheduler deadline of the next step, see scheduleNext().
+void SFManager::poll(){
+  SFMan.loop();
+}
+
+//------------------------------------------------------------------------------------
+// Body of the SF task with USE_TASKS, works through the queued requests.
+void SFManager::taskLoop(){
+  #ifdef USE_TASKS
+  if( SFMan.advance() ){
+    return; // Straight on to the next phase
+  }
+  // Until the next step, or until a request comes in, see scheduleRequest()
+  SFMan.task.wait(SFMan.phase != sf_phase_idle ? SFRA_POLL_INTERVAL : SFRA_RETRY_DELAY);
+  #endif
+}
+#endif
@@ -7,6 +7,8 @@
 #if !defined(UTIL_COMMON_H)
 #define UTIL_COMMON_H
 
+#include <stdint.h>
+
 #define CMD_KEY 0xC0
 
 #define NFO_KEY     0xF0
@@ -24,6 +26,8 @@
 #define ESP_OTA_LOCAL   0xE6
 #define ESP_OTA_REMOTE  0xE7
 #define ESP_LORA_REMOTE 0xE8
+#define ESP_PARAMS      0xE9
+#define ESP_SNAPSHOT    0xEA
 #define ESP_RESTART     0xEF
 
 #define UTIL_DEVICE_PREFIX "ESP" // Set this to something project relevant
@@ -42,4 +46,18 @@
 #define IS_KEY_ESP(key) (IS_KEY_FOR(key,ESP_KEY))
 #define IS_KEY_NFO(key) (IS_KEY_FOR(key,NFO_KEY))
 
+//------------------------------------------------------------------------------------
+
+// CRC-32 as used by zip and gzip, pass the previous result to continue a running CRC.
+uint32_t utilCRC32(const uint8_t *data, int size, uint32_t crc = 0){
+  crc = ~crc;
+  for(int i = 0; i < size; i++){
+    crc ^= data[i];
+    for(int bit = 0; bit < 8; bit++){
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,328 @@
+/*
+  UtilDeflate.h - ESPUtils Library for development on the ESP32 Platform
+  Created by Joe Andolina, April 1, 2020.
+  Released into the public domain.
+
+---------------------------------------------------------------------
+
+UtilDeflate is a Print that gzips what is written to it and passes the
+result on to another Print as it goes (RFC 1951 and 1952). It looks back
+UTIL_DEFLATE_WINDOW bytes for repeats, so its RAM is fixed: twice the
+window for the bytes themselves and two tables of 16 bit positions, about
+6 KB with the defaults. Nothing else is allocated.
+
+  UtilDeflate deflate;
+  ...
+  deflate.begin(request);   // any Print, UtilHTTPRequest, UtilHTTPLength...
+  deflate.print(body);
+  deflate.end();            // the last bits and the gzip trailer
+
+The output is always the same for the same input, so it can be written
+to a UtilHTTPLength first for the Content-Length and then to the request.
+
+Matches are looked up through a hash of their first three bytes, up to
+UTIL_DEFLATE_CHAIN earlier positions each, and coded with the fixed
+Huffman codes of the format. That leaves out the per block code tables
+zlib builds, which cost more than they save on bodies of a few KB.
+Repetitive JSON, the same keys over and over, still comes out at a
+quarter to a third of its size. Data that does not repeat grows by a
+few percent, see in and out.
+
+---------------------------------------------------------------------*/
+
+#if !defined(UTIL_DEFLATE_H)
+#define UTIL_DEFLATE_H
+
+#include <Arduino.h>
+#include <UtilCommon.h>
+
+#ifndef UTIL_DEFLATE_WINDOW
+#define UTIL_DEFLATE_WINDOW 1024 // Bytes back a repeat is looked for, a power of two from 512 to 32768
+#endif
+
+#ifndef UTIL_DEFLATE_HASH_BITS
+#define UTIL_DEFLATE_HASH_BITS 10
+#endif
+
+#ifndef UTIL_DEFLATE_CHAIN
+#define UTIL_DEFLATE_CHAIN 16 // Earlier positions tried per match, more is smaller and slower
+#endif
+
+#define UTIL_DEFLATE_MIN_MATCH 3
+#define UTIL_DEFLATE_MAX_MATCH 258
+#define UTIL_DEFLATE_OUT_SIZE 64 // Bytes handed to the output at a time
+
+class UtilDeflate : public Print {
+public:
+  uint32_t in = 0;  // Bytes taken since begin()
+  uint32_t out = 0; // Bytes written on, header and trailer included
+
+  void begin(Print &output);
+  void end();
+
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t *data, size_t size) override;
+  using Print::write;
+
+private:
+  Print *_output = NULL;
+  uint8_t _window[2 * UTIL_DEFLATE_WINDOW];
+  uint16_t _head[1 << UTIL_DEFLATE_HASH_BITS]; // Last position + 1 of each hash, 0 for none
+  uint16_t _prev[UTIL_DEFLATE_WINDOW];         // The one before it, by position in the window
+  int _pos = 0;   // Next byte to code
+  int _end = 0;   // Bytes in the window
+  uint32_t _crc = 0;
+  uint32_t _bits = 0;
+  int _count = 0; // Bits waiting in _bits
+  uint8_t _out[UTIL_DEFLATE_OUT_SIZE];
+  int _outSize = 0;
+
+  void compress(bool finish);
+  void slide();
+  void insert(int pos);
+  int  match(int pos, int &distance);
+  void symbol(int value);
+  void copy(int length, int distance);
+  void code(uint32_t value, int count);
+  void bits(uint32_t value, int count);
+  void byte(uint8_t value);
+  void flush();
+};
+
+//------------------------------------------------------------------------------------
+
+static const uint16_t utilDeflateLengths[29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const uint8_t utilDeflateLengthBits[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+static const uint16_t utilDeflateDistances[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+static const uint8_t utilDeflateDistanceBits[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+//------------------------------------------------------------------------------------
+
+// Starts a gzip stream to output: its header and the one block it holds.
+void UtilDeflate::begin(Print &output){
+  _output = &output;
+  memset(_head, 0, sizeof(_head));
+  memset(_prev, 0, sizeof(_prev));
+  _pos = _end = 0;
+  _crc = 0;
+  _bits = _count = 0;
+  _outSize = 0;
+  in = out = 0;
+
+  static const uint8_t header[10] = {0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF};
+  for(unsigned i = 0; i < sizeof(header); i++){
+    byte(header[i]);
+  }
+  bits(1, 1); // Last block
+  bits(1, 2); // Fixed Huffman codes
+}
+
+//------------------------------------------------------------------------------------
+
+// Codes what is left, ends the block and writes the trailer.
+void UtilDeflate::end(){
+  compress(true);
+  symbol(256);
+  if(_count > 0){
+    byte(_bits);
+    _bits = _count = 0;
+  }
+  for(int i = 0; i < 32; i += 8){
+    byte(_crc >> i);
+  }
+  for(int i = 0; i < 32; i += 8){
+    byte(in >> i);
+  }
+  flush();
+}
+
+//------------------------------------------------------------------------------------
+
+size_t UtilDeflate::write(uint8_t c){
+  return write(&c, 1);
+}
+
+//------------------------------------------------------------------------------------
+
+// Bytes are coded once UTIL_DEFLATE_MAX_MATCH more are in behind them,
+// the rest wait for the next write or end().
+size_t UtilDeflate::write(const uint8_t *data, size_t size){
+  _crc = utilCRC32(data, size, _crc);
+  in += size;
+  size_t taken = 0;
+  while(taken < size){
+    if(_end == 2 * UTIL_DEFLATE_WINDOW){
+      slide();
+    }
+    size_t count = size - taken < (size_t)(2 * UTIL_DEFLATE_WINDOW - _end) ? size - taken : 2 * UTIL_DEFLATE_WINDOW - _end;
+    memcpy(_window + _end, data + taken, count);
+    _end += count;
+    taken += count;
+    compress(false);
+  }
+  return size;
+}
+
+//------------------------------------------------------------------------------------
+
+// Greedy: the longest match at each position is taken as it is found.
+void UtilDeflate::compress(bool finish){
+  int keep = finish ? 0 : UTIL_DEFLATE_MAX_MATCH;
+  while(_end - _pos > keep){
+    int distance = 0;
+    int length = _end - _pos >= UTIL_DEFLATE_MIN_MATCH ? match(_pos, distance) : 0;
+    if(length < UTIL_DEFLATE_MIN_MATCH){
+      symbol(_window[_pos]);
+      length = 1;
+    }
+    else {
+      copy(length, distance);
+    }
+    for(int i = 0; i < length; i++){
+      insert(_pos + i);
+    }
+    _pos += length;
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+// Drops the older half of the window, positions in the tables move with it.
+void UtilDeflate::slide(){
+  memmove(_window, _window + UTIL_DEFLATE_WINDOW, UTIL_DEFLATE_WINDOW);
+  _pos -= UTIL_DEFLATE_WINDOW;
+  _end -= UTIL_DEFLATE_WINDOW;
+  for(unsigned i = 0; i < ARRAY_SIZE(_head); i++){
+    _head[i] = _head[i] > UTIL_DEFLATE_WINDOW ? _head[i] - UTIL_DEFLATE_WINDOW : 0;
+  }
+  for(unsigned i = 0; i < ARRAY_SIZE(_prev); i++){
+    _prev[i] = _prev[i] > UTIL_DEFLATE_WINDOW ? _prev[i] - UTIL_DEFLATE_WINDOW : 0;
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilDeflate::insert(int pos){
+  if(_end - pos < UTIL_DEFLATE_MIN_MATCH){
+    return;
+  }
+  uint32_t key = (_window[pos] << 16 | _window[pos + 1] << 8 | _window[pos + 2]) * 2654435761u;
+  uint16_t &head = _head[key >> (32 - UTIL_DEFLATE_HASH_BITS)];
+  _prev[pos & (UTIL_DEFLATE_WINDOW - 1)] = head;
+  head = pos + 1;
+}
+
+//------------------------------------------------------------------------------------
+
+// The longest earlier repeat of the bytes at pos, 0 when there is none.
+// A position further back than the window may have had its _prev entry
+// taken by a later one, the chain ends there.
+int UtilDeflate::match(int pos, int &distance){
+  int limit = _end - pos < UTIL_DEFLATE_MAX_MATCH ? _end - pos : UTIL_DEFLATE_MAX_MATCH;
+  uint32_t key = (_window[pos] << 16 | _window[pos + 1] << 8 | _window[pos + 2]) * 2654435761u;
+  uint16_t candidate = _head[key >> (32 - UTIL_DEFLATE_HASH_BITS)];
+  int best = 0;
+  for(int chain = UTIL_DEFLATE_CHAIN; candidate != 0 && chain > 0; chain--){
+    int from = candidate - 1;
+    if(from >= pos || pos - from > UTIL_DEFLATE_WINDOW){
+      break;
+    }
+    if(_window[from + best] == _window[pos + best]){
+      int length = 0;
+      while(length < limit && _window[from + length] == _window[pos + length]){
+        length++;
+      }
+      if(length > best){
+        best = length;
+        distance = pos - from;
+        if(best == limit){
+          break;
+        }
+      }
+    }
+    candidate = _prev[from & (UTIL_DEFLATE_WINDOW - 1)];
+  }
+  return best;
+}
+
+//------------------------------------------------------------------------------------
+
+// A literal byte, 256 for the end of the block, or a length code.
+void UtilDeflate::symbol(int value){
+  if(value < 144){
+    code(0x30 + value, 8);
+  }
+  else if(value < 256){
+    code(0x190 + value - 144, 9);
+  }
+  else if(value < 280){
+    code(value - 256, 7);
+  }
+  else {
+    code(0xC0 + value - 280, 8);
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilDeflate::copy(int length, int distance){
+  int i = ARRAY_SIZE(utilDeflateLengths) - 1;
+  while(utilDeflateLengths[i] > length){
+    i--;
+  }
+  symbol(257 + i);
+  bits(length - utilDeflateLengths[i], utilDeflateLengthBits[i]);
+
+  i = ARRAY_SIZE(utilDeflateDistances) - 1;
+  while(utilDeflateDistances[i] > distance){
+    i--;
+  }
+  code(i, 5);
+  bits(distance - utilDeflateDistances[i], utilDeflateDistanceBits[i]);
+}
+
+//------------------------------------------------------------------------------------
+
+// Huffman codes go out from their most significant bit, everything else
+// from the least.
+void UtilDeflate::code(uint32_t value, int count){
+  uint32_t reversed = 0;
+  for(int i = 0; i < count; i++){
+    reversed = reversed << 1 | (value & 1);
+    value >>= 1;
+  }
+  bits(reversed, count);
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilDeflate::bits(uint32_t value, int count){
+  _bits |= value << _count;
+  _count += count;
+  while(_count >= 8){
+    byte(_bits);
+    _bits >>= 8;
+    _count -= 8;
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilDeflate::byte(uint8_t value){
+  _out[_outSize++] = value;
+  out++;
+  if(_outSize == UTIL_DEFLATE_OUT_SIZE){
+    flush();
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilDeflate::flush(){
+  if(_outSize > 0 && _output != NULL){
+    _output->write(_out, _outSize);
+  }
+  _outSize = 0;
+}
+
+#endif
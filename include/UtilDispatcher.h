@@ -0,0 +1,133 @@
+/*
+  UtilDispatcher.h - ESPUtils Library for development on the ESP32 Platform
+  Created by Joe Andolina, April 1, 2020.
+  Released into the public domain.
+
+---------------------------------------------------------------------
+
+Routes a message to a handler by its first (key) byte with a single table
+lookup. A dispatcher can be given a constant table of built in handlers for
+one key range (e.g. ESP_KEY), it lives in flash and costs nothing to set up.
+Handlers registered at runtime take precedence over the built in ones.
+
+  ESPUtils::dispatcher.onKey(NFO_PING, handlePing);
+  ESPUtils::dispatcher.onRange(CMD_KEY, handleCommand); // 0xC0 - 0xCF
+
+Handlers receive the key and a view positioned just after it.
+
+---------------------------------------------------------------------*/
+
+#if !defined(UTIL_DISPATCHER_H)
+#define UTIL_DISPATCHER_H
+
+#include <UtilCommon.h>
+#include <UtilMessage.h>
+
+#define UTIL_RANGE_SIZE 0x10
+
+typedef void (*UtilCommandHandler)(byte key, UtilMessageView &message);
+
+//------------------------------------------------------------------------------------
+class UtilDispatcher {
+public:
+  UtilDispatcher(){};
+  UtilDispatcher(byte builtinRange, const UtilCommandHandler *builtins) : _builtinRange(builtinRange), _builtins(builtins){};
+
+  bool dispatch(UtilMessageView message);
+  UtilCommandHandler handlerFor(byte key);
+
+  void onKey(byte key, UtilCommandHandler handler);
+  void onRange(byte range, UtilCommandHandler handler);
+  void onUnhandled(UtilCommandHandler handler);
+
+  uint32_t hits(byte key);
+  uint32_t unhandled();
+  void resetStats();
+
+private:
+  byte _builtinRange = 0;
+  const UtilCommandHandler *_builtins = NULL;
+  UtilCommandHandler _fallback = NULL;
+  UtilCommandHandler _handlers[256] = {};
+  uint32_t _hits[256] = {};
+  uint32_t _unhandled = 0;
+};
+
+//------------------------------------------------------------------------------------
+
+UtilCommandHandler UtilDispatcher::handlerFor(byte key){
+  if(_handlers[key] != NULL){
+    return _handlers[key];
+  }
+  if(_builtins != NULL && IS_KEY_FOR(key, _builtinRange)){
+    return _builtins[key - _builtinRange];
+  }
+  return NULL;
+}
+
+//------------------------------------------------------------------------------------
+
+// Returns false when no handler (including the fallback) took the message.
+bool UtilDispatcher::dispatch(UtilMessageView message){
+  if(message.bytesAvailable() <= 0){
+    return false;
+  }
+
+  byte key = message.read();
+  _hits[key]++;
+
+  UtilCommandHandler handler = handlerFor(key);
+  if(handler == NULL){
+    _unhandled++;
+    if(_fallback == NULL){
+      return false;
+    }
+    handler = _fallback;
+  }
+
+  handler(key, message);
+  return true;
+}
+
+//------------------------------------------------------------------------------------
+
+// Pass NULL to fall back to the built in handler again.
+void UtilDispatcher::onKey(byte key, UtilCommandHandler handler){
+  _handlers[key] = handler;
+}
+
+//------------------------------------------------------------------------------------
+
+// Registers handler for every key of a 16 key range, see IS_KEY_FOR in UtilCommon.h.
+void UtilDispatcher::onRange(byte range, UtilCommandHandler handler){
+  for(int i = 0; i < UTIL_RANGE_SIZE && range + i < 256; i++){
+    _handlers[range + i] = handler;
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilDispatcher::onUnhandled(UtilCommandHandler handler){
+  _fallback = handler;
+}
+
+//------------------------------------------------------------------------------------
+
+uint32_t UtilDispatcher::hits(byte key){
+  return _hits[key];
+}
+
+//------------------------------------------------------------------------------------
+
+uint32_t UtilDispatcher::unhandled(){
+  return _unhandled;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilDispatcher::resetStats(){
+  memset(_hits, 0, sizeof(_hits));
+  _unhandled = 0;
+}
+
+#endif
@@ -0,0 +1,526 @@
+/*
+  UtilHTTP.h - ESPUtils Library for development on the ESP32 Platform
+  Created by Joe Andolina, April 1, 2020.
+  Released into the public domain.
+
+---------------------------------------------------------------------
+
+UtilHTTPParser reads an HTTP/1.1 response a piece at a time: status line,
+headers, then a body framed by Content-Length, chunked transfer encoding
+or the end of the connection. read() takes whatever the client already
+has and returns straight away, so it can be called from loop() until the
+response is complete.
+
+  char body[UTIL_HTTP_BODY_SIZE + 1];
+  UtilHTTPParser parser(body, sizeof(body));
+  ...
+  if(parser.read(client) == http_complete){
+    handle(parser.status, parser.body());
+    parser.reset();   // ready for the next response on the connection
+  }
+
+The body lands in the buffer given to the constructor, zero terminated.
+A longer body is still read to its end, so the connection stays usable,
+but only its start is kept and truncated() is set. Header lines are
+looked at up to UTIL_HTTP_LINE_SIZE bytes.
+
+With onBody set the body is handed to it as it arrives instead, nothing
+is kept and bodyLength() counts what went by. Such a parser needs no
+buffer:
+
+  UtilHTTPParser parser;
+  parser.onBody = [](const uint8_t *data, size_t size){ json.feed(data, size); };
+
+Bytes read past the end of one response belong to the next one on the
+connection (pipelining). The parser holds on to them across reset().
+
+UtilHTTPRequest goes the other way. It is a Print that collects requests
+in one buffer of UTIL_HTTP_REQUEST_SIZE bytes and hands them to the client
+in as few writes as that allows. Over WiFiClientSecure each write is at
+least one TLS record and, with Nagle off, one TCP segment, where println()
+costs two of each per line. Requests pipelined on one connection can
+share a write. A body is written twice, first to a UtilHTTPLength for its
+Content-Length, so it never has to be held in a String:
+
+  UtilHTTPLength length;
+  writeBody(length);
+
+  request.begin(client);
+  request.print("POST /path HTTP/1.1\r\n");
+  request.header("Host", host);
+  request.header("Content-Length", length.length);
+  request.end();
+  writeBody(request);
+  request.send();     // whatever the buffer still holds
+
+---------------------------------------------------------------------*/
+
+#if !defined(UTIL_HTTP_H)
+#define UTIL_HTTP_H
+
+#include <Arduino.h>
+#include <Client.h>
+
+#ifndef UTIL_HTTP_BODY_SIZE
+#define UTIL_HTTP_BODY_SIZE 4096 // A body buffer to give the parser, when one is kept
+#endif
+
+#ifndef UTIL_HTTP_LINE_SIZE
+#define UTIL_HTTP_LINE_SIZE 128
+#endif
+
+#ifndef UTIL_HTTP_REQUEST_SIZE
+#define UTIL_HTTP_REQUEST_SIZE 4096 // The ESP32's TLS record, CONFIG_MBEDTLS_SSL_OUT_CONTENT_LEN
+#endif
+
+#define UTIL_HTTP_READ_SIZE 128 // Bytes taken from the client at a time
+
+typedef void (*UtilHTTPBodyCallback)(const uint8_t *data, size_t size);
+
+enum UtilHTTPState {
+  http_status,
+  http_headers,
+  http_body,
+  http_chunk_size,
+  http_chunk_data,
+  http_chunk_end,
+  http_trailers,
+  http_until_close,
+  http_complete,
+  http_error
+};
+
+//------------------------------------------------------------------------------------
+class UtilHTTPParser {
+public:
+  int status = 0;
+  bool keepAlive = true;
+  bool chunked = false;
+  long contentLength = -1;
+  UtilHTTPBodyCallback onBody = NULL; // Takes the body instead of body() when set
+
+  UtilHTTPParser(char *body = NULL, size_t size = 0) : _body(body), _bodySize(body != NULL && size > 0 ? size - 1 : 0) { reset(); };
+
+  void reset();
+  void discard();
+  UtilHTTPState read(Client &client);
+  size_t feed(const uint8_t *data, size_t size);
+  UtilHTTPState close();
+
+  UtilHTTPState state();
+  bool complete();
+  const char *body();
+  size_t bodyLength();
+  bool truncated();
+
+private:
+  UtilHTTPState _state;
+  char _line[UTIL_HTTP_LINE_SIZE];
+  size_t _lineLength;
+  char *_body;       // The caller's, NULL when nothing is kept
+  size_t _bodySize;  // Bytes it holds, the terminating zero not counted
+  size_t _bodyLength;
+  bool _truncated;
+  long _remaining;
+
+  uint8_t _input[UTIL_HTTP_READ_SIZE];
+  size_t _inputStart = 0;
+  size_t _inputEnd = 0;
+
+  bool line(char c);
+  void parseLine();
+  void parseStatus();
+  void parseHeader();
+  void endHeaders();
+  void append(const uint8_t *data, size_t size);
+};
+
+//------------------------------------------------------------------------------------
+// Counts what is printed to it, the length of a body before it is written.
+class UtilHTTPLength : public Print {
+public:
+  size_t length = 0;
+
+  size_t write(uint8_t c) override { length++; return 1; }
+  size_t write(const uint8_t *data, size_t size) override { length += size; return size; }
+  using Print::write;
+};
+
+//------------------------------------------------------------------------------------
+class UtilHTTPRequest : public Print {
+public:
+  uint32_t writes = 0;      // Writes to the client, over all requests
+  size_t bytes = 0;
+
+  void begin(Client &client);
+  void header(const char *name, const char *value);
+  void header(const char *name, const String &value);
+  void header(const char *name, unsigned long value);
+  void end();
+  bool send();
+  bool failed();
+
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t *data, size_t size) override;
+  using Print::write;
+
+private:
+  Client *_client = NULL;
+  uint8_t _buffer[UTIL_HTTP_REQUEST_SIZE];
+  size_t _size = 0;
+  bool _failed = false;
+};
+
+//------------------------------------------------------------------------------------
+
+// Gets ready for the next response, keeping bytes already read for it.
+void UtilHTTPParser::reset(){
+  status = 0;
+  keepAlive = true;
+  chunked = false;
+  contentLength = -1;
+
+  _state = http_status;
+  _lineLength = 0;
+  _bodyLength = 0;
+  if(_body != NULL){
+    _body[0] = 0;
+  }
+  _truncated = false;
+  _remaining = 0;
+}
+
+//------------------------------------------------------------------------------------
+
+// reset() for a new connection, whatever was left over is dropped.
+void UtilHTTPParser::discard(){
+  _inputStart = _inputEnd = 0;
+  reset();
+}
+
+//------------------------------------------------------------------------------------
+
+// Parses what client has available without waiting for more.
+UtilHTTPState UtilHTTPParser::read(Client &client){
+  while(_state != http_complete && _state != http_error){
+    if(_inputStart == _inputEnd){
+      int available = client.available();
+      if(available <= 0){
+        break;
+      }
+      int count = client.read(_input, available < UTIL_HTTP_READ_SIZE ? available : UTIL_HTTP_READ_SIZE);
+      if(count <= 0){
+        break;
+      }
+      _inputStart = 0;
+      _inputEnd = count;
+    }
+    _inputStart += feed(_input + _inputStart, _inputEnd - _inputStart);
+  }
+  return _state;
+}
+
+//------------------------------------------------------------------------------------
+
+// Parses up to size bytes and returns how many belong to this response.
+size_t UtilHTTPParser::feed(const uint8_t *data, size_t size){
+  size_t used = 0;
+  while(used < size && _state != http_complete && _state != http_error){
+    switch(_state){
+      case http_body:
+      case http_chunk_data: {
+        size_t count = size - used;
+        if((long)count > _remaining){
+          count = _remaining;
+        }
+        append(data + used, count);
+        used += count;
+        _remaining -= count;
+        if(_remaining == 0){
+          _state = _state == http_body ? http_complete : http_chunk_end;
+        }
+        break;
+      }
+
+      case http_until_close:
+        append(data + used, size - used);
+        used = size;
+        break;
+
+      default:
+        if(line(data[used++])){
+          parseLine();
+        }
+        break;
+    }
+  }
+  return used;
+}
+
+//------------------------------------------------------------------------------------
+
+// The server closed the connection. That ends a body without a length,
+// anything else cut short is an error.
+UtilHTTPState UtilHTTPParser::close(){
+  if(_state == http_until_close){
+    _state = http_complete;
+  }
+  else if(_state != http_complete){
+    _state = http_error;
+  }
+  return _state;
+}
+
+//------------------------------------------------------------------------------------
+
+UtilHTTPState UtilHTTPParser::state(){
+  return _state;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilHTTPParser::complete(){
+  return _state == http_complete;
+}
+
+//------------------------------------------------------------------------------------
+
+// The body, zero terminated. Only what fit the buffer when truncated(),
+// empty without one.
+const char *UtilHTTPParser::body(){
+  return _body != NULL ? _body : "";
+}
+
+//------------------------------------------------------------------------------------
+
+size_t UtilHTTPParser::bodyLength(){
+  return _bodyLength;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilHTTPParser::truncated(){
+  return _truncated;
+}
+
+//------------------------------------------------------------------------------------
+
+// Collects a line, true once it is complete. The CR is dropped, anything
+// past UTIL_HTTP_LINE_SIZE too.
+bool UtilHTTPParser::line(char c){
+  if(c == '\n'){
+    _line[_lineLength] = 0;
+    _lineLength = 0;
+    return true;
+  }
+  if(c != '\r' && _lineLength < UTIL_HTTP_LINE_SIZE - 1){
+    _line[_lineLength++] = c;
+  }
+  return false;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilHTTPParser::parseLine(){
+  switch(_state){
+    case http_status:
+      parseStatus();
+      break;
+
+    case http_headers:
+      if(_line[0] == 0){
+        endHeaders();
+      } else {
+        parseHeader();
+      }
+      break;
+
+    case http_chunk_size:
+      _remaining = strtol(_line, NULL, 16);
+      _state = _remaining > 0 ? http_chunk_data : http_trailers;
+      break;
+
+    case http_chunk_end:
+      _state = http_chunk_size;
+      break;
+
+    case http_trailers:
+      if(_line[0] == 0){
+        _state = http_complete;
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilHTTPParser::parseStatus(){
+  if(_line[0] == 0){
+    return; // Stray CRLF between responses
+  }
+  if(strncmp(_line, "HTTP/1.", 7) != 0 || strlen(_line) < 12){
+    _state = http_error;
+    return;
+  }
+  keepAlive = _line[7] != '0';
+  status = atoi(_line + 9);
+  _state = http_headers;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilHTTPParser::parseHeader(){
+  if(strncasecmp(_line, "Content-Length:", 15) == 0){
+    contentLength = atol(_line + 15);
+  }
+  else if(strncasecmp(_line, "Transfer-Encoding:", 18) == 0){
+    chunked = strstr(_line + 18, "chunked") != NULL;
+  }
+  else if(strncasecmp(_line, "Connection:", 11) == 0){
+    const char *value = _line + 11;
+    while(*value == ' '){
+      value++;
+    }
+    keepAlive = strncasecmp(value, "close", 5) != 0;
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilHTTPParser::endHeaders(){
+  if(status >= 100 && status < 200){
+    reset(); // 100 Continue and friends, the real response follows
+    return;
+  }
+
+  if(status == 204 || status == 304){
+    _state = http_complete;
+  }
+  else if(chunked){
+    _state = http_chunk_size;
+  }
+  else if(contentLength >= 0){
+    _remaining = contentLength;
+    _state = contentLength > 0 ? http_body : http_complete;
+  }
+  else {
+    keepAlive = false;
+    _state = http_until_close;
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilHTTPParser::append(const uint8_t *data, size_t size){
+  if(onBody != NULL){
+    _bodyLength += size;
+    if(size > 0){
+      onBody(data, size);
+    }
+    return;
+  }
+
+  size_t room = _bodySize - _bodyLength;
+  if(size > room){
+    _truncated = true;
+    size = room;
+  }
+  if(size == 0){
+    return;
+  }
+  memcpy(_body + _bodyLength, data, size);
+  _bodyLength += size;
+  _body[_bodyLength] = 0;
+}
+
+//------------------------------------------------------------------------------------
+
+// Starts collecting for client, dropping anything not sent.
+void UtilHTTPRequest::begin(Client &client){
+  _client = &client;
+  _size = 0;
+  _failed = false;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilHTTPRequest::header(const char *name, const char *value){
+  print(name);
+  print(": ");
+  print(value);
+  print("\r\n");
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilHTTPRequest::header(const char *name, const String &value){
+  print(name);
+  print(": ");
+  print(value);
+  print("\r\n");
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilHTTPRequest::header(const char *name, unsigned long value){
+  print(name);
+  print(": ");
+  print(value);
+  print("\r\n");
+}
+
+//------------------------------------------------------------------------------------
+
+// The blank line after the headers.
+void UtilHTTPRequest::end(){
+  print("\r\n");
+}
+
+//------------------------------------------------------------------------------------
+
+// Writes out what the buffer holds, false when the client took less at
+// some point since begin().
+bool UtilHTTPRequest::send(){
+  if(_size > 0 && _client != NULL){
+    size_t written = _client->write(_buffer, _size);
+    writes++;
+    bytes += written;
+    _failed = _failed || written != _size;
+  }
+  _size = 0;
+  return !_failed;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilHTTPRequest::failed(){
+  return _failed;
+}
+
+//------------------------------------------------------------------------------------
+
+size_t UtilHTTPRequest::write(uint8_t c){
+  return write(&c, 1);
+}
+
+//------------------------------------------------------------------------------------
+
+// Fills the buffer, a full one goes out before taking more.
+size_t UtilHTTPRequest::write(const uint8_t *data, size_t size){
+  size_t taken = 0;
+  while(taken < size){
+    if(_size == UTIL_HTTP_REQUEST_SIZE){
+      send();
+    }
+    size_t count = size - taken < UTIL_HTTP_REQUEST_SIZE - _size ? size - taken : UTIL_HTTP_REQUEST_SIZE - _size;
+    memcpy(_buffer + _size, data + taken, count);
+    _size += count;
+    taken += count;
+  }
+  return size;
+}
+
+#endif
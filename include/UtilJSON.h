@@ -0,0 +1,645 @@
+/*
+  UtilJSON.h - ESPUtils Library for development on the ESP32 Platform
+  Created by Joe Andolina, April 1, 2020.
+  Released into the public domain.
+
+---------------------------------------------------------------------
+
+Finds values in a JSON text without building a document. Every call
+takes an index into the text and hands back begin/end indices of what it
+found, so a value is only copied when the caller asks for it with
+substring().
+
+  int begin, end, pos;
+  if(utilJSONMember(json, 0, "compositeResponse", begin, end)){
+    pos = begin;
+    while(utilJSONElement(json, pos, begin, end)){
+      String element = json.substring(begin, end);
+    }
+  }
+
+Strings are returned with their quotes. Nothing is validated beyond
+what it takes to find the end of a value.
+
+UtilJSONExtractor does the same for a text that is still arriving. It is
+fed a piece at a time and copies the values at the paths asked for into
+the caller's buffers, the text itself is never kept. Members are joined
+with '.', array elements are "[]":
+
+  char token[256], code[32];
+  UtilJSONField fields[] = {
+    {"access_token", token, sizeof(token)},
+    {"errors[].statusCode", code, sizeof(code)}
+  };
+  UtilJSONExtractor json;
+  json.begin(fields, 2);
+  json.feed(data, size);   // as often as data comes in
+  if(fields[0].found) ...
+
+Strings are stored without their quotes and escapes, anything else as
+written, objects and arrays included. A value longer than its buffer is
+cut short and flagged truncated. A path that matches again, as one in an
+array does, overwrites the last value, callback is called at the end of
+every match so each can be handled in turn. Memory stays the same for
+any length of text, nesting deeper than UTIL_JSON_DEPTH fails it.
+
+---------------------------------------------------------------------*/
+
+#if !defined(UTIL_JSON_H)
+#define UTIL_JSON_H
+
+#include <Arduino.h>
+
+#ifndef UTIL_JSON_DEPTH
+#define UTIL_JSON_DEPTH 12
+#endif
+
+#ifndef UTIL_JSON_PATH_SIZE
+#define UTIL_JSON_PATH_SIZE 64
+#endif
+
+#define UTIL_JSON_FIELDS 8 // Fields one extractor looks for at most
+
+int utilJSONSkip(const String &json, int pos);
+int utilJSONValueEnd(const String &json, int begin);
+bool utilJSONElement(const String &json, int &pos, int &begin, int &end);
+bool utilJSONMember(const String &json, int object, const char *key, int &begin, int &end);
+int utilJSONCount(const String &json, int array);
+
+//------------------------------------------------------------------------------------
+
+// First index at or after pos that is not whitespace.
+int utilJSONSkip(const String &json, int pos){
+  int length = json.length();
+  while(pos < length && isspace((unsigned char)json[pos])){
+    pos++;
+  }
+  return pos;
+}
+
+//------------------------------------------------------------------------------------
+
+// Index just past the value that starts at begin, -1 when it does not end.
+int utilJSONValueEnd(const String &json, int begin){
+  int length = json.length();
+  if(begin >= length){
+    return -1;
+  }
+
+  int depth = 0;
+  bool text = false;
+  for(int i = begin; i < length; i++){
+    char c = json[i];
+    if(text){
+      if(c == '\\'){
+        i++;
+      }
+      else if(c == '"'){
+        text = false;
+        if(depth == 0){
+          return i + 1;
+        }
+      }
+      continue;
+    }
+
+    if(c == '"'){
+      text = true;
+    }
+    else if(c == '{' || c == '['){
+      depth++;
+    }
+    else if(c == '}' || c == ']'){
+      if(depth == 0){
+        return i; // Scalar closed by its container
+      }
+      if(--depth == 0){
+        return i + 1;
+      }
+    }
+    else if(depth == 0 && (c == ',' || isspace((unsigned char)c))){
+      return i;
+    }
+  }
+  return depth == 0 && !text ? length : -1;
+}
+
+//------------------------------------------------------------------------------------
+
+// Steps through an array. Start with pos on the '[', every call moves
+// begin/end to the next element and returns false after the last one.
+bool utilJSONElement(const String &json, int &pos, int &begin, int &end){
+  pos = utilJSONSkip(json, pos);
+  if(pos >= (int)json.length() || (json[pos] != '[' && json[pos] != ',')){
+    return false;
+  }
+
+  begin = utilJSONSkip(json, pos + 1);
+  if(begin >= (int)json.length() || json[begin] == ']'){
+    pos = begin;
+    return false;
+  }
+
+  end = utilJSONValueEnd(json, begin);
+  if(end < 0){
+    pos = json.length();
+    return false;
+  }
+  pos = utilJSONSkip(json, end);
+  return true;
+}
+
+//------------------------------------------------------------------------------------
+
+// The value of key in the object at object (its '{' or whitespace before
+// it). Only the object's own members are looked at, not nested ones.
+bool utilJSONMember(const String &json, int object, const char *key, int &begin, int &end){
+  int pos = utilJSONSkip(json, object);
+  if(pos >= (int)json.length() || json[pos] != '{'){
+    return false;
+  }
+
+  int keyLength = strlen(key);
+  while(true){
+    int name = utilJSONSkip(json, pos + 1);
+    if(name >= (int)json.length() || json[name] != '"'){
+      return false;
+    }
+    int nameEnd = utilJSONValueEnd(json, name);
+    int colon = nameEnd < 0 ? -1 : utilJSONSkip(json, nameEnd);
+    if(colon < 0 || colon >= (int)json.length() || json[colon] != ':'){
+      return false;
+    }
+
+    int value = utilJSONSkip(json, colon + 1);
+    int valueEnd = utilJSONValueEnd(json, value);
+    if(valueEnd < 0){
+      return false;
+    }
+
+    if(nameEnd - name - 2 == keyLength && strncmp(json.c_str() + name + 1, key, keyLength) == 0){
+      begin = value;
+      end = valueEnd;
+      return true;
+    }
+
+    pos = utilJSONSkip(json, valueEnd);
+    if(pos >= (int)json.length() || json[pos] != ','){
+      return false;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+// Number of elements in the array at array, -1 when there is no array.
+int utilJSONCount(const String &json, int array){
+  int pos = utilJSONSkip(json, array);
+  if(pos >= (int)json.length() || json[pos] != '['){
+    return -1;
+  }
+
+  int count = 0, begin, end;
+  while(utilJSONElement(json, pos, begin, end)){
+    count++;
+  }
+  return count;
+}
+
+//------------------------------------------------------------------------------------
+
+enum UtilJSONState {
+  json_value,
+  json_key,
+  json_colon,
+  json_next,
+  json_string,
+  json_key_string,
+  json_escape,
+  json_unicode,
+  json_literal,
+  json_done,
+  json_error
+};
+
+typedef void (*UtilJSONCallback)(int field);
+
+struct UtilJSONField {
+  const char *path; // NULL matches nothing
+  char *value;      // NULL when only found and the callback matter
+  size_t size;      // of value, terminator included
+  size_t length;
+  bool found;
+  bool truncated;
+};
+
+//------------------------------------------------------------------------------------
+class UtilJSONExtractor {
+public:
+  UtilJSONCallback callback = NULL;
+
+  void begin(UtilJSONField *fields, int count);
+  void reset();
+  void clear(int field);
+  void feed(const uint8_t *data, size_t size);
+
+  UtilJSONState state();
+  bool complete();
+  bool failed();
+
+private:
+  UtilJSONField *_fields = NULL;
+  int _count = 0;
+  UtilJSONState _state = json_value;
+  UtilJSONState _escaped = json_string; // String state an escape returns to
+
+  char _path[UTIL_JSON_PATH_SIZE];
+  size_t _pathLength = 0;               // UTIL_JSON_PATH_SIZE once the path does not fit
+  char _stack[UTIL_JSON_DEPTH];         // '{' or '[' of every open container
+  size_t _pathAt[UTIL_JSON_DEPTH];      // Path length of every open container
+  int _depth = 0;
+
+  uint32_t _active = 0;                 // Fields matched by a value that has not ended
+  uint32_t _raw = 0;                    // Fields taking an object or array as written
+  uint32_t _text = 0;                   // Fields taking the string or literal being read
+  int _fieldDepth[UTIL_JSON_FIELDS];
+  uint32_t _unicode = 0;
+  int _digits = 0;
+
+  void parse(char c);
+  void startValue(char c);
+  void endValue();
+  void open(char c);
+  void close();
+  void decoded(const char *text, size_t length);
+  void decoded(char c);
+  void decodedUnicode();
+  void append(UtilJSONField &field, const char *text, size_t length);
+  void pathAppend(const char *text, size_t length);
+  void pathTruncate(size_t length);
+};
+
+//------------------------------------------------------------------------------------
+
+// Looks for count fields in the text fed from now on.
+void UtilJSONExtractor::begin(UtilJSONField *fields, int count){
+  _fields = fields;
+  _count = count < UTIL_JSON_FIELDS ? count : UTIL_JSON_FIELDS;
+  reset();
+}
+
+//------------------------------------------------------------------------------------
+
+// Starts over on a new text, the fields lose what they held.
+void UtilJSONExtractor::reset(){
+  _state = json_value;
+  _path[0] = 0;
+  _pathLength = 0;
+  _depth = 0;
+  _active = _raw = _text = 0;
+  for(int i = 0; i < _count; i++){
+    clear(i);
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+// Forgets the value of field, to tell the next match of its path from the last.
+void UtilJSONExtractor::clear(int field){
+  UtilJSONField &f = _fields[field];
+  f.length = 0;
+  f.found = false;
+  f.truncated = false;
+  if(f.value != NULL && f.size > 0){
+    f.value[0] = 0;
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+// Takes the next size bytes of the text. Anything after its outermost
+// value is ignored.
+void UtilJSONExtractor::feed(const uint8_t *data, size_t size){
+  const char *text = (const char *)data;
+  size_t i = 0;
+  while(i < size && _state != json_done && _state != json_error){
+    // Plain string characters go by a run at a time
+    size_t run = i;
+    if(_state == json_string || _state == json_key_string){
+      while(run < size && text[run] != '"' && text[run] != '\\'){
+        run++;
+      }
+    }
+    size_t length = run > i ? run - i : 1;
+
+    // Objects and arrays being taken whole see every character
+    for(uint32_t raw = _raw; raw != 0; raw &= raw - 1){
+      append(_fields[__builtin_ctz(raw)], text + i, length);
+    }
+
+    if(run > i){
+      decoded(text + i, length);
+    } else {
+      parse(text[i]);
+    }
+    i += length;
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+UtilJSONState UtilJSONExtractor::state(){
+  return _state;
+}
+
+//------------------------------------------------------------------------------------
+
+// The outermost value has ended.
+bool UtilJSONExtractor::complete(){
+  return _state == json_done;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilJSONExtractor::failed(){
+  return _state == json_error;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilJSONExtractor::parse(char c){
+  bool space = isspace((unsigned char)c);
+  switch(_state){
+    case json_value:
+      if(c == ']' && _depth > 0 && _stack[_depth - 1] == '['){
+        close(); // Empty array
+      }
+      else if(c == '}' || c == ']' || c == ',' || c == ':'){
+        _state = json_error;
+      }
+      else if(!space){
+        startValue(c);
+      }
+      break;
+
+    case json_key:
+      if(c == '"'){
+        pathTruncate(_pathAt[_depth - 1]);
+        if(_pathLength > 0){
+          pathAppend(".", 1);
+        }
+        _state = json_key_string;
+      }
+      else if(c == '}'){
+        close(); // Empty object
+      }
+      else if(!space){
+        _state = json_error;
+      }
+      break;
+
+    case json_colon:
+      if(c == ':'){
+        _state = json_value;
+      }
+      else if(!space){
+        _state = json_error;
+      }
+      break;
+
+    case json_next:
+      if(c == ','){
+        _state = _stack[_depth - 1] == '{' ? json_key : json_value;
+      }
+      else if((c == '}' && _stack[_depth - 1] == '{') || (c == ']' && _stack[_depth - 1] == '[')){
+        close();
+      }
+      else if(!space){
+        _state = json_error;
+      }
+      break;
+
+    case json_string:
+    case json_key_string:
+      if(c == '\\'){
+        _escaped = _state;
+        _state = json_escape;
+      }
+      else if(c == '"'){
+        if(_state == json_key_string){
+          _state = json_colon;
+        } else {
+          endValue();
+        }
+      }
+      else {
+        decoded(c);
+      }
+      break;
+
+    case json_escape:
+      _state = _escaped;
+      switch(c){
+        case 'b': decoded('\b'); break;
+        case 'f': decoded('\f'); break;
+        case 'n': decoded('\n'); break;
+        case 'r': decoded('\r'); break;
+        case 't': decoded('\t'); break;
+        case 'u':
+          _unicode = 0;
+          _digits = 0;
+          _state = json_unicode;
+          break;
+        default: decoded(c); break; // \" \\ \/
+      }
+      break;
+
+    case json_unicode:
+      if(!isxdigit((unsigned char)c)){
+        _state = json_error;
+        break;
+      }
+      _unicode = (_unicode << 4) | (isdigit((unsigned char)c) ? c - '0' : tolower(c) - 'a' + 10);
+      if(++_digits == 4){
+        _state = _escaped;
+        decodedUnicode();
+      }
+      break;
+
+    case json_literal:
+      if(c == ',' || c == '}' || c == ']' || space){
+        endValue();
+        parse(c); // The delimiter belongs to the container
+        break;
+      }
+      for(uint32_t text = _text; text != 0; text &= text - 1){
+        append(_fields[__builtin_ctz(text)], &c, 1);
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+// c is the first character of a value, looks for fields at its path.
+void UtilJSONExtractor::startValue(char c){
+  bool container = c == '{' || c == '[';
+  if(_pathLength < UTIL_JSON_PATH_SIZE){
+    for(int i = 0; i < _count; i++){
+      if(_fields[i].path == NULL || strcmp(_fields[i].path, _path) != 0){
+        continue;
+      }
+      clear(i);
+      _fieldDepth[i] = _depth;
+      _active |= 1UL << i;
+      if(container){
+        _raw |= 1UL << i;
+        append(_fields[i], &c, 1);
+      } else {
+        _text |= 1UL << i;
+      }
+    }
+  }
+
+  if(container){
+    open(c);
+  }
+  else if(c == '"'){
+    _state = json_string;
+  }
+  else {
+    _state = json_literal;
+    for(uint32_t text = _text; text != 0; text &= text - 1){
+      append(_fields[__builtin_ctz(text)], &c, 1);
+    }
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+// The value at the current depth ended, the fields that matched it are found.
+void UtilJSONExtractor::endValue(){
+  uint32_t ended = 0;
+  for(uint32_t active = _active; active != 0; active &= active - 1){
+    int i = __builtin_ctz(active);
+    if(_fieldDepth[i] == _depth){
+      ended |= 1UL << i;
+      _fields[i].found = true;
+    }
+  }
+  _active &= ~ended;
+  _raw &= ~ended;
+  _text &= ~ended;
+  _state = _depth == 0 ? json_done : json_next;
+
+  if(callback != NULL){
+    for(; ended != 0; ended &= ended - 1){
+      callback(__builtin_ctz(ended));
+    }
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilJSONExtractor::open(char c){
+  if(_depth == UTIL_JSON_DEPTH){
+    _state = json_error;
+    return;
+  }
+  _stack[_depth] = c;
+  _pathAt[_depth] = _pathLength;
+  _depth++;
+  if(c == '['){
+    pathAppend("[]", 2);
+    _state = json_value;
+  } else {
+    _state = json_key;
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilJSONExtractor::close(){
+  _depth--;
+  pathTruncate(_pathAt[_depth]);
+  endValue();
+}
+
+//------------------------------------------------------------------------------------
+
+// String characters after escapes, part of a key or of a value.
+void UtilJSONExtractor::decoded(const char *text, size_t length){
+  if(_state == json_key_string){
+    pathAppend(text, length);
+    return;
+  }
+  for(uint32_t fields = _text; fields != 0; fields &= fields - 1){
+    append(_fields[__builtin_ctz(fields)], text, length);
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilJSONExtractor::decoded(char c){
+  decoded(&c, 1);
+}
+
+//------------------------------------------------------------------------------------
+
+// \uXXXX as UTF-8.
+void UtilJSONExtractor::decodedUnicode(){
+  if(_unicode < 0x80){
+    decoded(_unicode);
+  }
+  else if(_unicode < 0x800){
+    decoded(0xC0 | (_unicode >> 6));
+    decoded(0x80 | (_unicode & 0x3F));
+  }
+  else {
+    decoded(0xE0 | (_unicode >> 12));
+    decoded(0x80 | ((_unicode >> 6) & 0x3F));
+    decoded(0x80 | (_unicode & 0x3F));
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilJSONExtractor::append(UtilJSONField &field, const char *text, size_t length){
+  if(field.value == NULL || field.size == 0){
+    return;
+  }
+  if(field.length + length >= field.size){
+    field.truncated = true;
+    length = field.size - 1 - field.length;
+  }
+  memcpy(field.value + field.length, text, length);
+  field.length += length;
+  field.value[field.length] = 0;
+}
+
+//------------------------------------------------------------------------------------
+
+// A path too long for UTIL_JSON_PATH_SIZE matches nothing until it is truncated again.
+void UtilJSONExtractor::pathAppend(const char *text, size_t length){
+  if(_pathLength + length >= UTIL_JSON_PATH_SIZE){
+    _pathLength = UTIL_JSON_PATH_SIZE;
+    return;
+  }
+  memcpy(_path + _pathLength, text, length);
+  _pathLength += length;
+  _path[_pathLength] = 0;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilJSONExtractor::pathTruncate(size_t length){
+  _pathLength = length;
+  if(length < UTIL_JSON_PATH_SIZE){
+    _path[length] = 0;
+  }
+}
+
+#endif
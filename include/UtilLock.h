@@ -0,0 +1,91 @@
+/*
+  UtilLock.h - ESPUtils Library for development on the ESP32 Platform
+  Created by Joe Andolina, April 1, 2020.
+  Released into the public domain.
+
+---------------------------------------------------------------------
+
+A very short critical section for state shared between tasks (and ISRs),
+e.g. the message pool free list or the UtilClock wrap counter. On the ESP32
+it is a FreeRTOS spinlock that also keeps the other core out, on the host
+build a plain spinning std::atomic_flag.
+
+  static UtilLock lock;
+  UtilLockGuard guard(lock); // Released at the end of the scope
+
+Never hold it across anything that blocks, logs or allocates.
+
+---------------------------------------------------------------------*/
+
+#if !defined(UTIL_LOCK_H)
+#define UTIL_LOCK_H
+
+#include <Arduino.h>
+
+#ifdef ESPUTILS_HOST
+#include <atomic>
+#else
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#endif
+
+//------------------------------------------------------------------------------------
+class UtilLock {
+public:
+  UtilLock(){};
+  void lock();
+  void unlock();
+
+private:
+  #ifdef ESPUTILS_HOST
+  std::atomic_flag _flag = ATOMIC_FLAG_INIT;
+  #else
+  portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+  #endif
+
+  UtilLock(const UtilLock &);
+  UtilLock &operator=(const UtilLock &);
+};
+
+//------------------------------------------------------------------------------------
+class UtilLockGuard {
+public:
+  UtilLockGuard(UtilLock &lock) : _lock(lock){ _lock.lock(); };
+  ~UtilLockGuard(){ _lock.unlock(); };
+
+private:
+  UtilLock &_lock;
+
+  UtilLockGuard(const UtilLockGuard &);
+  UtilLockGuard &operator=(const UtilLockGuard &);
+};
+
+//------------------------------------------------------------------------------------
+
+void UtilLock::lock(){
+  #ifdef ESPUTILS_HOST
+  while(_flag.test_and_set(std::memory_order_acquire)){}
+  #else
+  if(xPortInIsrContext()){
+    portENTER_CRITICAL_ISR(&_mux);
+  } else {
+    portENTER_CRITICAL(&_mux);
+  }
+  #endif
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilLock::unlock(){
+  #ifdef ESPUTILS_HOST
+  _flag.clear(std::memory_order_release);
+  #else
+  if(xPortInIsrContext()){
+    portEXIT_CRITICAL_ISR(&_mux);
+  } else {
+    portEXIT_CRITICAL(&_mux);
+  }
+  #endif
+}
+
+#endif
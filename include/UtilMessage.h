@@ -8,27 +8,72 @@
 #define UTIL_MESSAGE_h
 
 #include <Arduino.h>
-#include <sstream>
-#include <iomanip>
+#include <string>
+#include <vector>
 
 using namespace std;
 
+// Bytes kept free in front of every message so transport layers can prepend
+// their headers (address, length, sequence, CRC...) without moving the payload.
+#ifndef UTIL_MESSAGE_HEADROOM
+#define UTIL_MESSAGE_HEADROOM 8
+#endif
+
+//------------------------------------------------------------------------------------
+// UtilHeapBuffer - Default message storage, a growable heap vector.
+// The payload starts at _head, the bytes in front of it are headroom.
+//------------------------------------------------------------------------------------
+class UtilHeapBuffer {
+public:
+    const byte *data() const;
+    int size() const;
+    int headroom() const;
+    bool append(const byte *data, int size);
+    bool prepend(const byte *data, int size);
+    bool reserve(int size);
+    bool reserveFront(int size);
+    void clear();
+
+private:
+    int _head = 0;
+    int _reserved = UTIL_MESSAGE_HEADROOM;
+    vector<byte> _data;
+};
+
+#ifdef USE_MESSAGE_POOL
+#include <UtilMessagePool.h>
+typedef UtilPoolBuffer UtilMessageBuffer;
+#else
+typedef UtilHeapBuffer UtilMessageBuffer;
+#endif
+
 class UtilMessage;
-typedef void (*UtilMessageCallback)(UtilMessage message);
+class UtilMessageView;
+
+// Callbacks receive a view so a message travels from the transport to the
+// handler without copying its payload. A view is only valid for the duration
+// of the callback, copy it into a UtilMessage to keep the data around.
+typedef void (*UtilMessageCallback)(UtilMessageView message);
 
 //------------------------------------------------------------------------------------
 class UtilMessage {
 public:
     UtilMessage(){};
     UtilMessage(byte data){ write(data); };
-    UtilMessage(vector<byte> data){ _data = data; };
+    UtilMessage(vector<byte> data){ write(data.data(), data.size()); };
     UtilMessage(string data){ write(data); };
     UtilMessage(byte command, string payload){ write(command); write(payload); };
+    explicit UtilMessage(UtilMessageView view);
 
     bool available();
+    bool overflow() const;
+    bool underflow() const;
     int bytesAvailable();
 
-    int size();
+    int size() const;
+    int headroom() const;
+    int position() const;
+    const byte *data() const;
     byte back();
     byte front();
     byte peek();
@@ -40,76 +85,289 @@ public:
     string readCString();
     vector<byte> readColorValue();
 
+    // Typed fields, see UtilMessageView for the wire format
+    uint64_t readVarint();
+    int64_t readZigZag();
+    uint16_t readUInt16();
+    uint32_t readUInt32();
+    uint64_t readUInt64();
+    float readFloat();
+    double readDouble();
+    int readBlob(const byte **data);
+    int readText(char *buffer, int size);
+    String readText();
+
     void clear();
     void next();
     void reset();
+    void reserve(int size);
+    void reserveFront(int size);
     void write(byte data);
     void write(string data);
+    void write(const byte *data, int size);
     void writeFront(byte data);
+    void writeFront(const byte *data, int size);
     void writeColor(string color);
     void writeColor(byte r, byte g, byte b);
 
+    void writeVarint(uint64_t value);
+    void writeZigZag(int64_t value);
+    void writeUInt16(uint16_t value);
+    void writeUInt32(uint32_t value);
+    void writeUInt64(uint64_t value);
+    void writeFloat(float value);
+    void writeDouble(double value);
+    void writeBlob(const byte *data, int size);
+    void writeText(const char *text);
+
 private:
     int _dataIndex = 0;
-    vector<byte> _data;
-  
+    bool _overflow = false;
+    bool _underflow = false;
+    UtilMessageBuffer _data;
+
+    void writeFixed(uint64_t value, int size);
+    void endRead(const UtilMessageView &view);
 };
 
 //------------------------------------------------------------------------------------
+// UtilMessageView - Non owning, read only window onto the bytes of a message.
+// Copying a view copies a pointer, a length and a read position, never the payload.
+//------------------------------------------------------------------------------------
+class UtilMessageView {
+public:
+    UtilMessageView(){};
+    UtilMessageView(const byte *data, int size) : _data(data), _size(size){};
+    UtilMessageView(const UtilMessage &message) : _data(message.data()), _size(message.size()), _dataIndex(message.position()){};
+
+    bool available();
+    bool underflow() const;
+    int bytesAvailable();
+
+    int size() const;
+    int position() const;
+    const byte *data() const;
+    byte back();
+    byte front();
+    byte peek();
+    byte read();
+    unsigned char readChar();
+    int readInt();
+    String readString();
+    string readCString();
+
+    // Typed fields. Varints are LEB128, fixed width values are little endian
+    // and blobs/texts carry a varint length prefix. Reading past the end
+    // returns zero/empty values and sets underflow().
+    uint64_t readVarint();
+    int64_t readZigZag();
+    uint16_t readUInt16();
+    uint32_t readUInt32();
+    uint64_t readUInt64();
+    float readFloat();
+    double readDouble();
+    bool readBytes(byte *buffer, int size);
+    int readBlob(const byte **data);
+    int readText(char *buffer, int size);
+    String readText();
+
+    void next();
+    void reset();
+
+private:
+    const byte *_data = NULL;
+    int _size = 0;
+    int _dataIndex = 0;
+    bool _underflow = false;
+
+    uint64_t readFixed(int size);
+};
+
+//------------------------------------------------------------------------------------
+
+const byte *UtilHeapBuffer::data() const {
+    return _data.data() + _head;
+}
+
+//------------------------------------------------------------------------------------
+
+int UtilHeapBuffer::size() const {
+    return _data.size() - _head;
+}
+
+//------------------------------------------------------------------------------------
+
+int UtilHeapBuffer::headroom() const {
+    return _head;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilHeapBuffer::append(const byte *data, int size){
+    if(_data.empty()){
+        reserveFront(_reserved);
+    }
+    _data.insert(_data.end(), data, data + size);
+    return true;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilHeapBuffer::prepend(const byte *data, int size){
+    if(_head < size){
+        // Out of headroom, grow it by at least the payload size so repeated
+        // prepends stay amortized O(1).
+        int payload = this->size();
+        reserveFront(size + (payload > _reserved ? payload : _reserved));
+    }
+    _head -= size;
+    memcpy(_data.data() + _head, data, size);
+    return true;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilHeapBuffer::reserve(int size){
+    _data.reserve(_reserved + size);
+    return true;
+}
 
-int UtilMessage::size(){
+//------------------------------------------------------------------------------------
+
+bool UtilHeapBuffer::reserveFront(int size){
+    if(size > _reserved){
+        _reserved = size;
+    }
+    if(_head < size){
+        _data.insert(_data.begin(), size - _head, 0);
+        _head = size;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilHeapBuffer::clear(){
+    if(_data.empty()){
+        return;
+    }
+    _data.resize(_reserved);
+    _head = _reserved;
+}
+
+//------------------------------------------------------------------------------------
+
+UtilMessage::UtilMessage(UtilMessageView view){
+    write(view.data(), view.size());
+    _dataIndex = view.position();
+}
+
+//------------------------------------------------------------------------------------
+
+int UtilMessage::size() const {
     return _data.size();
 }
 
 //------------------------------------------------------------------------------------
 
+// Bytes that can be added with writeFront without moving the payload.
+int UtilMessage::headroom() const {
+    return _data.headroom();
+}
+
+//------------------------------------------------------------------------------------
+
+int UtilMessage::position() const {
+    return _dataIndex;
+}
+
+//------------------------------------------------------------------------------------
+
+const byte *UtilMessage::data() const {
+    return _data.data();
+}
+
+//------------------------------------------------------------------------------------
+
 bool UtilMessage::available(){
     return _data.size() > 0;
 }
 
 //------------------------------------------------------------------------------------
 
+// True when a write was dropped because the message storage could not grow.
+bool UtilMessage::overflow() const {
+    return _overflow;
+}
+
+//------------------------------------------------------------------------------------
+
+// True when a typed read ran past the end of the message.
+bool UtilMessage::underflow() const {
+    return _underflow;
+}
+
+//------------------------------------------------------------------------------------
+
 int UtilMessage::bytesAvailable(){
     return _data.size() - _dataIndex;
 }
 
 //------------------------------------------------------------------------------------
 
-void UtilMessage::clear(){ 
+void UtilMessage::clear(){
     _dataIndex = 0;
+    _overflow = false;
+    _underflow = false;
     _data.clear();
 }
 
 //------------------------------------------------------------------------------------
 
-void UtilMessage::next(){ 
+void UtilMessage::next(){
     _dataIndex++;
 }
 
 //------------------------------------------------------------------------------------
 
-void UtilMessage::reset(){ 
+void UtilMessage::reset(){
     _dataIndex = 0;
+    _underflow = false;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilMessage::reserve(int size){
+    _data.reserve(size);
+}
+
+//------------------------------------------------------------------------------------
+
+// Makes room for size bytes of headers in front of the payload, kept across clear().
+void UtilMessage::reserveFront(int size){
+    if(!_data.reserveFront(size)){
+        _overflow = true;
+    }
 }
 
 //------------------------------------------------------------------------------------
 
 byte UtilMessage::front(){
-    return _data.front();
+    return UtilMessageView(*this).front();
     //return _data.at(_dataIndex);
 }
 
 //------------------------------------------------------------------------------------
 
 byte UtilMessage::back(){
-    return *_data.end();
+    return UtilMessageView(*this).back();
 }
 
 //------------------------------------------------------------------------------------
 
 byte UtilMessage::peek(){
-    if(_dataIndex < _data.size()){
-        return _data.at(_dataIndex);
+    if(_dataIndex < size()){
+        return _data.data()[_dataIndex];
     }
     return '\0';
 }
@@ -117,8 +375,8 @@ byte UtilMessage::peek(){
 //------------------------------------------------------------------------------------
 
 byte UtilMessage::read(){
-    if(_dataIndex < _data.size()){
-        return _data.at(_dataIndex++);
+    if(_dataIndex < size()){
+        return _data.data()[_dataIndex++];
     }
     return '\0';
 }
@@ -138,13 +396,13 @@ int UtilMessage::readInt(){
 //------------------------------------------------------------------------------------
 
 string UtilMessage::readCString(){
-    return string(_data.begin()+_dataIndex, _data.end());
+    return UtilMessageView(*this).readCString();
 }
 
 //------------------------------------------------------------------------------------
 
 String UtilMessage::readString(){
-    return readCString().c_str();
+    return UtilMessageView(*this).readString();
 }
 
 //------------------------------------------------------------------------------------
@@ -152,23 +410,21 @@ String UtilMessage::readString(){
 string UtilMessage::readColor(){
     if(bytesAvailable() < 3) return "";
 
-    ostringstream str;
-    str << hex << uppercase << setfill('0');
-    
-    for( int i = 0; i < 3; i++ ) {
-        str << std::setw( 2 ) << readInt();
-    }
-
-    return str.str();
+    char color[7];
+    byte r = read();
+    byte g = read();
+    byte b = read();
+    snprintf(color, sizeof(color), "%02X%02X%02X", r, g, b);
+    return color;
 }
 
 //------------------------------------------------------------------------------------
 
 vector<byte> UtilMessage::readColorValue(){
-    vector<byte> data(3); 
-    
+    vector<byte> data(3);
+
     // Length of 3 = R + G + B
-    if(bytesAvailable()>2){    
+    if(bytesAvailable()>2){
         data.push_back(read()); // R
         data.push_back(read()); // G
         data.push_back(read()); // B
@@ -179,19 +435,36 @@ vector<byte> UtilMessage::readColorValue(){
 //------------------------------------------------------------------------------------
 
 void UtilMessage::write(byte data){
-    _data.push_back(data);
+    write(&data, 1);
 }
 
 //------------------------------------------------------------------------------------
 
 void UtilMessage::write(string data){
-    _data.insert(_data.end(), data.begin(), data.end());
+    write((const byte *)data.data(), data.size());
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilMessage::write(const byte *data, int size){
+    if(!_data.append(data, size)){
+        _overflow = true;
+    }
 }
 
 //------------------------------------------------------------------------------------
 
 void UtilMessage::writeFront(byte data){
-    _data.insert(_data.begin(),data);
+    writeFront(&data, 1);
+}
+
+//------------------------------------------------------------------------------------
+
+// Prepends a header, O(1) while it fits the headroom.
+void UtilMessage::writeFront(const byte *data, int size){
+    if(!_data.prepend(data, size)){
+        _overflow = true;
+    }
 }
 
 //------------------------------------------------------------------------------------
@@ -203,7 +476,7 @@ void UtilMessage::writeColor(string color){
 //     bytes.push_back(byte);
 //   }
 }
-//------------------------------------------------------------------------------------ 
+//------------------------------------------------------------------------------------
 
 void UtilMessage::writeColor(byte r, byte g, byte b){
     write(r);
@@ -211,4 +484,428 @@ void UtilMessage::writeColor(byte r, byte g, byte b){
     write(b);
 }
 
-#endif
\ No newline at end of file
+//------------------------------------------------------------------------------------
+
+void UtilMessage::endRead(const UtilMessageView &view){
+    _dataIndex = view.position();
+    _underflow = _underflow || view.underflow();
+}
+
+//------------------------------------------------------------------------------------
+
+uint64_t UtilMessage::readVarint(){
+    UtilMessageView view(*this);
+    uint64_t value = view.readVarint();
+    endRead(view);
+    return value;
+}
+
+//------------------------------------------------------------------------------------
+
+int64_t UtilMessage::readZigZag(){
+    UtilMessageView view(*this);
+    int64_t value = view.readZigZag();
+    endRead(view);
+    return value;
+}
+
+//------------------------------------------------------------------------------------
+
+uint16_t UtilMessage::readUInt16(){
+    UtilMessageView view(*this);
+    uint16_t value = view.readUInt16();
+    endRead(view);
+    return value;
+}
+
+//------------------------------------------------------------------------------------
+
+uint32_t UtilMessage::readUInt32(){
+    UtilMessageView view(*this);
+    uint32_t value = view.readUInt32();
+    endRead(view);
+    return value;
+}
+
+//------------------------------------------------------------------------------------
+
+uint64_t UtilMessage::readUInt64(){
+    UtilMessageView view(*this);
+    uint64_t value = view.readUInt64();
+    endRead(view);
+    return value;
+}
+
+//------------------------------------------------------------------------------------
+
+float UtilMessage::readFloat(){
+    UtilMessageView view(*this);
+    float value = view.readFloat();
+    endRead(view);
+    return value;
+}
+
+//------------------------------------------------------------------------------------
+
+double UtilMessage::readDouble(){
+    UtilMessageView view(*this);
+    double value = view.readDouble();
+    endRead(view);
+    return value;
+}
+
+//------------------------------------------------------------------------------------
+
+int UtilMessage::readBlob(const byte **data){
+    UtilMessageView view(*this);
+    int size = view.readBlob(data);
+    endRead(view);
+    return size;
+}
+
+//------------------------------------------------------------------------------------
+
+int UtilMessage::readText(char *buffer, int size){
+    UtilMessageView view(*this);
+    int length = view.readText(buffer, size);
+    endRead(view);
+    return length;
+}
+
+//------------------------------------------------------------------------------------
+
+String UtilMessage::readText(){
+    UtilMessageView view(*this);
+    String value = view.readText();
+    endRead(view);
+    return value;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilMessage::writeVarint(uint64_t value){
+    byte buffer[10];
+    int size = 0;
+    do {
+        buffer[size] = value & 0x7F;
+        value >>= 7;
+        if(value){
+            buffer[size] |= 0x80;
+        }
+        size++;
+    } while(value);
+    write(buffer, size);
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilMessage::writeZigZag(int64_t value){
+    writeVarint(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilMessage::writeFixed(uint64_t value, int size){
+    byte buffer[8];
+    for(int i = 0; i < size; i++){
+        buffer[i] = value >> (8 * i);
+    }
+    write(buffer, size);
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilMessage::writeUInt16(uint16_t value){
+    writeFixed(value, 2);
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilMessage::writeUInt32(uint32_t value){
+    writeFixed(value, 4);
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilMessage::writeUInt64(uint64_t value){
+    writeFixed(value, 8);
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilMessage::writeFloat(float value){
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    writeFixed(bits, 4);
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilMessage::writeDouble(double value){
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    writeFixed(bits, 8);
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilMessage::writeBlob(const byte *data, int size){
+    writeVarint(size);
+    write(data, size);
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilMessage::writeText(const char *text){
+    writeBlob((const byte *)text, strlen(text));
+}
+
+//------------------------------------------------------------------------------------
+
+int UtilMessageView::size() const {
+    return _size;
+}
+
+//------------------------------------------------------------------------------------
+
+int UtilMessageView::position() const {
+    return _dataIndex;
+}
+
+//------------------------------------------------------------------------------------
+
+const byte *UtilMessageView::data() const {
+    return _data;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilMessageView::available(){
+    return _size > 0;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilMessageView::underflow() const {
+    return _underflow;
+}
+
+//------------------------------------------------------------------------------------
+
+int UtilMessageView::bytesAvailable(){
+    return _size - _dataIndex;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilMessageView::next(){
+    _dataIndex++;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilMessageView::reset(){
+    _dataIndex = 0;
+    _underflow = false;
+}
+
+//------------------------------------------------------------------------------------
+
+byte UtilMessageView::front(){
+    return _size > 0 ? _data[0] : '\0';
+}
+
+//------------------------------------------------------------------------------------
+
+byte UtilMessageView::back(){
+    return _size > 0 ? _data[_size - 1] : '\0';
+}
+
+//------------------------------------------------------------------------------------
+
+byte UtilMessageView::peek(){
+    if(_dataIndex < _size){
+        return _data[_dataIndex];
+    }
+    return '\0';
+}
+
+//------------------------------------------------------------------------------------
+
+byte UtilMessageView::read(){
+    if(_dataIndex < _size){
+        return _data[_dataIndex++];
+    }
+    return '\0';
+}
+
+//------------------------------------------------------------------------------------
+
+unsigned char UtilMessageView::readChar(){
+    return (unsigned char)read();
+}
+
+//------------------------------------------------------------------------------------
+
+int UtilMessageView::readInt(){
+    return (int)read();
+}
+
+//------------------------------------------------------------------------------------
+
+string UtilMessageView::readCString(){
+    if(bytesAvailable() <= 0) return string();
+    return string((const char *)_data + _dataIndex, bytesAvailable());
+}
+
+//------------------------------------------------------------------------------------
+
+String UtilMessageView::readString(){
+    // Fill the String straight from the payload, one copy and no temporary string.
+    String value;
+    value.reserve(bytesAvailable());
+    for(int i = _dataIndex; i < _size && _data[i] != '\0'; i++){
+        value += (char)_data[i];
+    }
+    return value;
+}
+
+//------------------------------------------------------------------------------------
+
+uint64_t UtilMessageView::readVarint(){
+    uint64_t value = 0;
+    for(int shift = 0; shift < 64; shift += 7){
+        if(_dataIndex >= _size){
+            break;
+        }
+        byte b = _data[_dataIndex++];
+        value |= (uint64_t)(b & 0x7F) << shift;
+        if(!(b & 0x80)){
+            return value;
+        }
+    }
+    _underflow = true;
+    return 0;
+}
+
+//------------------------------------------------------------------------------------
+
+int64_t UtilMessageView::readZigZag(){
+    uint64_t value = readVarint();
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+//------------------------------------------------------------------------------------
+
+uint64_t UtilMessageView::readFixed(int size){
+    if(bytesAvailable() < size){
+        _dataIndex = _size;
+        _underflow = true;
+        return 0;
+    }
+
+    uint64_t value = 0;
+    for(int i = 0; i < size; i++){
+        value |= (uint64_t)_data[_dataIndex++] << (8 * i);
+    }
+    return value;
+}
+
+//------------------------------------------------------------------------------------
+
+uint16_t UtilMessageView::readUInt16(){
+    return readFixed(2);
+}
+
+//------------------------------------------------------------------------------------
+
+uint32_t UtilMessageView::readUInt32(){
+    return readFixed(4);
+}
+
+//------------------------------------------------------------------------------------
+
+uint64_t UtilMessageView::readUInt64(){
+    return readFixed(8);
+}
+
+//------------------------------------------------------------------------------------
+
+float UtilMessageView::readFloat(){
+    uint32_t bits = readFixed(4);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+//------------------------------------------------------------------------------------
+
+double UtilMessageView::readDouble(){
+    uint64_t bits = readFixed(8);
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilMessageView::readBytes(byte *buffer, int size){
+    if(bytesAvailable() < size){
+        _dataIndex = _size;
+        _underflow = true;
+        return false;
+    }
+    memcpy(buffer, _data + _dataIndex, size);
+    _dataIndex += size;
+    return true;
+}
+
+//------------------------------------------------------------------------------------
+
+// Points data at the blob inside the message, no bytes are copied.
+int UtilMessageView::readBlob(const byte **data){
+    uint64_t size = readVarint();
+    if(size > (uint64_t)bytesAvailable()){
+        _dataIndex = _size;
+        _underflow = true;
+        size = 0;
+    }
+
+    *data = _data + _dataIndex;
+    _dataIndex += size;
+    return size;
+}
+
+//------------------------------------------------------------------------------------
+
+// Copies the text into buffer, always null terminated. Returns the full length
+// of the text so callers can tell when it was truncated to fit the buffer.
+int UtilMessageView::readText(char *buffer, int size){
+    const byte *text;
+    int length = readBlob(&text);
+    int count = length < size - 1 ? length : size - 1;
+
+    if(count > 0){
+        memcpy(buffer, text, count);
+    }
+    if(size > 0){
+        buffer[count > 0 ? count : 0] = '\0';
+    }
+    return length;
+}
+
+//------------------------------------------------------------------------------------
+
+String UtilMessageView::readText(){
+    const byte *text;
+    int length = readBlob(&text);
+
+    String value;
+    value.reserve(length);
+    for(int i = 0; i < length; i++){
+        value += (char)text[i];
+    }
+    return value;
+}
+
+#endif
@@ -0,0 +1,411 @@
+/*
+  UtilMessagePool.h - ESPUtils Library for development on the ESP32 Platform
+  Created by Joe Andolina, April 1, 2020.
+  Released into the public domain.
+
+---------------------------------------------------------------------
+
+When USE_MESSAGE_POOL is defined (add -DUSE_MESSAGE_POOL to build_flags)
+every UtilMessage stores its bytes in a fixed size block drawn from a
+statically allocated pool instead of a heap allocated vector. Steady state
+message traffic then never touches malloc and cannot fragment the heap.
+
+Copies of a message share their block through a reference count, the
+block is only duplicated when a shared message is written to. The free list
+and reference counts are guarded by a UtilLock, so messages can be created
+and handed over on any task (see UtilTask.h).
+
+When the pool is exhausted, or a message outgrows its block, the write is
+dropped, UtilMessage::overflow() turns true and the matching counter below
+is incremented. Size the pool with UTIL_POOL_BLOCK_SIZE/UTIL_POOL_BLOCK_COUNT
+and watch highWater() to see how close a build gets to the limits.
+
+---------------------------------------------------------------------*/
+
+#if !defined(UTIL_MESSAGE_POOL_H)
+#define UTIL_MESSAGE_POOL_H
+
+#include <Arduino.h>
+#include <UtilLock.h>
+
+#ifndef UTIL_POOL_BLOCK_SIZE
+#define UTIL_POOL_BLOCK_SIZE 256 // Fits a full LoRa packet or a default BLE write
+#endif
+
+#ifndef UTIL_POOL_BLOCK_COUNT
+#define UTIL_POOL_BLOCK_COUNT 16
+#endif
+
+//------------------------------------------------------------------------------------
+struct UtilMessageBlock {
+    uint16_t refs;
+    int16_t next;
+    byte data[UTIL_POOL_BLOCK_SIZE];
+};
+
+//------------------------------------------------------------------------------------
+class UtilMessagePool {
+public:
+    static UtilMessageBlock *acquire();
+    static void retain(UtilMessageBlock *block);
+    static void release(UtilMessageBlock *block);
+    static bool isShared(UtilMessageBlock *block);
+
+    static int blockSize();
+    static int capacity();
+    static int inUse();
+    static int highWater();
+    static uint32_t exhausted();
+    static uint32_t oversized();
+    static void noteOversized();
+    static void resetStats();
+
+private:
+    static UtilMessageBlock _blocks[UTIL_POOL_BLOCK_COUNT];
+    static UtilLock _lock;
+    static bool _initialized;
+    static int16_t _free;
+    static int _inUse;
+    static int _highWater;
+    static uint32_t _exhausted;
+    static uint32_t _oversized;
+
+    static void init();
+};
+
+UtilMessageBlock UtilMessagePool::_blocks[UTIL_POOL_BLOCK_COUNT];
+UtilLock UtilMessagePool::_lock;
+bool UtilMessagePool::_initialized = false;
+int16_t UtilMessagePool::_free = -1;
+int UtilMessagePool::_inUse = 0;
+int UtilMessagePool::_highWater = 0;
+uint32_t UtilMessagePool::_exhausted = 0;
+uint32_t UtilMessagePool::_oversized = 0;
+
+//------------------------------------------------------------------------------------
+// UtilPoolBuffer - Message storage backed by a shared pool block
+//------------------------------------------------------------------------------------
+class UtilPoolBuffer {
+public:
+    UtilPoolBuffer(){};
+    UtilPoolBuffer(const UtilPoolBuffer &other);
+    UtilPoolBuffer(UtilPoolBuffer &&other);
+    ~UtilPoolBuffer();
+
+    UtilPoolBuffer &operator=(const UtilPoolBuffer &other);
+    UtilPoolBuffer &operator=(UtilPoolBuffer &&other);
+
+    const byte *data() const;
+    int size() const;
+    int headroom() const;
+    bool append(const byte *data, int size);
+    bool prepend(const byte *data, int size);
+    bool reserve(int size);
+    bool reserveFront(int size);
+    void clear();
+
+private:
+    UtilMessageBlock *_block = NULL;
+    uint16_t _head = UTIL_MESSAGE_HEADROOM;
+    uint16_t _reserved = UTIL_MESSAGE_HEADROOM;
+    uint16_t _size = 0;
+
+    bool makeWritable();
+    void moveTo(int head);
+};
+
+//------------------------------------------------------------------------------------
+
+void UtilMessagePool::init(){
+    for(int i = 0; i < UTIL_POOL_BLOCK_COUNT; i++){
+        _blocks[i].refs = 0;
+        _blocks[i].next = i + 1 < UTIL_POOL_BLOCK_COUNT ? i + 1 : -1;
+    }
+    _free = 0;
+    _initialized = true;
+}
+
+//------------------------------------------------------------------------------------
+
+UtilMessageBlock *UtilMessagePool::acquire(){
+    UtilLockGuard guard(_lock);
+    if(!_initialized){
+        init();
+    }
+
+    if(_free < 0){
+        _exhausted++;
+        return NULL;
+    }
+
+    UtilMessageBlock *block = &_blocks[_free];
+    _free = block->next;
+    block->refs = 1;
+
+    if(++_inUse > _highWater){
+        _highWater = _inUse;
+    }
+    return block;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilMessagePool::retain(UtilMessageBlock *block){
+    UtilLockGuard guard(_lock);
+    block->refs++;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilMessagePool::release(UtilMessageBlock *block){
+    UtilLockGuard guard(_lock);
+    if(--block->refs > 0){
+        return;
+    }
+    block->next = _free;
+    _free = block - _blocks;
+    _inUse--;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilMessagePool::isShared(UtilMessageBlock *block){
+    UtilLockGuard guard(_lock);
+    return block->refs > 1;
+}
+
+//------------------------------------------------------------------------------------
+
+int UtilMessagePool::blockSize(){
+    return UTIL_POOL_BLOCK_SIZE;
+}
+
+//------------------------------------------------------------------------------------
+
+int UtilMessagePool::capacity(){
+    return UTIL_POOL_BLOCK_COUNT;
+}
+
+//------------------------------------------------------------------------------------
+
+int UtilMessagePool::inUse(){
+    return _inUse;
+}
+
+//------------------------------------------------------------------------------------
+
+int UtilMessagePool::highWater(){
+    return _highWater;
+}
+
+//------------------------------------------------------------------------------------
+
+uint32_t UtilMessagePool::exhausted(){
+    return _exhausted;
+}
+
+//------------------------------------------------------------------------------------
+
+uint32_t UtilMessagePool::oversized(){
+    return _oversized;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilMessagePool::noteOversized(){
+    _oversized++;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilMessagePool::resetStats(){
+    _highWater = _inUse;
+    _exhausted = 0;
+    _oversized = 0;
+}
+
+//------------------------------------------------------------------------------------
+
+UtilPoolBuffer::UtilPoolBuffer(const UtilPoolBuffer &other) : _block(other._block), _head(other._head), _reserved(other._reserved), _size(other._size){
+    if(_block){
+        UtilMessagePool::retain(_block);
+    }
+}
+
+//------------------------------------------------------------------------------------
+
+UtilPoolBuffer::UtilPoolBuffer(UtilPoolBuffer &&other) : _block(other._block), _head(other._head), _reserved(other._reserved), _size(other._size){
+    other._block = NULL;
+    other._size = 0;
+}
+
+//------------------------------------------------------------------------------------
+
+UtilPoolBuffer::~UtilPoolBuffer(){
+    if(_block){
+        UtilMessagePool::release(_block);
+    }
+}
+
+//------------------------------------------------------------------------------------
+
+UtilPoolBuffer &UtilPoolBuffer::operator=(const UtilPoolBuffer &other){
+    if(other._block){
+        UtilMessagePool::retain(other._block);
+    }
+    if(_block){
+        UtilMessagePool::release(_block);
+    }
+    _block = other._block;
+    _head = other._head;
+    _reserved = other._reserved;
+    _size = other._size;
+    return *this;
+}
+
+//------------------------------------------------------------------------------------
+
+UtilPoolBuffer &UtilPoolBuffer::operator=(UtilPoolBuffer &&other){
+    if(this != &other){
+        if(_block){
+            UtilMessagePool::release(_block);
+        }
+        _block = other._block;
+        _head = other._head;
+        _reserved = other._reserved;
+        _size = other._size;
+        other._block = NULL;
+        other._size = 0;
+    }
+    return *this;
+}
+
+//------------------------------------------------------------------------------------
+
+const byte *UtilPoolBuffer::data() const {
+    return _block ? _block->data + _head : NULL;
+}
+
+//------------------------------------------------------------------------------------
+
+int UtilPoolBuffer::size() const {
+    return _size;
+}
+
+//------------------------------------------------------------------------------------
+
+int UtilPoolBuffer::headroom() const {
+    return _head;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilPoolBuffer::makeWritable(){
+    if(_block && !UtilMessagePool::isShared(_block)){
+        return true;
+    }
+
+    // Unallocated or shared with another message, take a private block.
+    UtilMessageBlock *block = UtilMessagePool::acquire();
+    if(block == NULL){
+        return false;
+    }
+
+    if(_block){
+        memcpy(block->data + _head, _block->data + _head, _size);
+        UtilMessagePool::release(_block);
+    }
+    _block = block;
+    return true;
+}
+
+//------------------------------------------------------------------------------------
+
+// Slides the payload so it starts at head, only used once the headroom no longer fits.
+void UtilPoolBuffer::moveTo(int head){
+    if(_block && _size > 0){
+        memmove(_block->data + head, _block->data + _head, _size);
+    }
+    _head = head;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilPoolBuffer::append(const byte *data, int size){
+    if(size <= 0){
+        return true;
+    }
+    if(_size + size > UTIL_POOL_BLOCK_SIZE){
+        UtilMessagePool::noteOversized();
+        return false;
+    }
+    if(!makeWritable()){
+        return false;
+    }
+    if(_head + _size + size > UTIL_POOL_BLOCK_SIZE){
+        moveTo(UTIL_POOL_BLOCK_SIZE - _size - size);
+    }
+    memcpy(_block->data + _head + _size, data, size);
+    _size += size;
+    return true;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilPoolBuffer::prepend(const byte *data, int size){
+    if(size <= 0){
+        return true;
+    }
+    if(_size + size > UTIL_POOL_BLOCK_SIZE){
+        UtilMessagePool::noteOversized();
+        return false;
+    }
+    if(!makeWritable()){
+        return false;
+    }
+    if(_head < size){
+        moveTo(size);
+    }
+    _head -= size;
+    memcpy(_block->data + _head, data, size);
+    _size += size;
+    return true;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilPoolBuffer::reserve(int size){
+    return _reserved + size <= UTIL_POOL_BLOCK_SIZE;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilPoolBuffer::reserveFront(int size){
+    if(size + _size > UTIL_POOL_BLOCK_SIZE){
+        return false;
+    }
+    if(size > _reserved){
+        _reserved = size;
+    }
+    if(_head < size){
+        if(_size > 0 && !makeWritable()){
+            return false;
+        }
+        moveTo(size);
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilPoolBuffer::clear(){
+    // Keep a private block for reuse, let go of a shared one.
+    if(_block && UtilMessagePool::isShared(_block)){
+        UtilMessagePool::release(_block);
+        _block = NULL;
+    }
+    _head = _reserved;
+    _size = 0;
+}
+
+#endif
@@ -0,0 +1,1292 @@
+/*
+  UtilParameters.h - ESPUtils Library for development on the ESP32 Platform
+  Created by Joe Andolina, April 1, 2020.
+  Released into the public domain.
+
+---------------------------------------------------------------------
+
+RAM cache in front of the ESPUTILS Preferences namespace, used by the
+ESPUtils::getParameter / setParameter calls. The NVS handle is opened once
+and kept open, reads are served from the cache after the first one (a
+missing key is remembered too) and writes are marked dirty and written
+back according to the flush policy, every write back with a single
+nvs_commit():
+
+  util_flush_immediate  Every set is written to flash right away (default)
+  util_flush_explicit   Only UtilParameters::flush() writes
+  util_flush_timer      Written once the interval has passed since the first set
+  util_flush_restart    Written by ESPUtils::restart(), or an explicit flush()
+
+  UtilParameters::setPolicy(util_flush_timer, 5000);
+
+Setting a key several times before a flush costs a single flash write.
+With any policy other than immediate, dirty values are lost on a crash or
+power cut, call flush() after values that must survive one.
+
+Parameters are best declared once, with their type and default. The key
+is hashed at compile time and checked against the NVS key length, a read
+is then a cache lookup without any String handling:
+
+  UTIL_PARAM(PARAM_BRIGHTNESS, "BRIGHT", uint8_t, 128);
+  UTIL_PARAM(PARAM_GAIN,       "GAIN",   float, 1.0f);
+  UTIL_PARAM(PARAM_NAME,       "NAME",   const char *, "ESPUtils");
+  UTIL_PARAM(PARAM_CAL,        "CAL",    UtilBlob, UtilBlob());
+
+  uint8_t level = UtilParameters::get(PARAM_BRIGHTNESS);
+  UtilParameters::put(PARAM_GAIN, 1.5f);
+  String name = UtilParameters::get(PARAM_NAME);
+  int size = UtilParameters::get(PARAM_CAL, buffer, sizeof(buffer));
+
+Supported types are int32_t, uint8_t, uint16_t, uint32_t, uint64_t,
+float, bool, const char * (read back as String) and UtilBlob. Declare
+them at namespace scope.
+
+Writes between begin() and commit() are applied together, in the same
+nvs_commit() when they are written back. A group that would not fit one
+NVS page (UTIL_PARAM_PAGE_ENTRIES entries of 32 bytes) is first recorded
+in a journal, with one commit of its own. A journal left behind by a
+reset is replayed the next time the namespace is opened, so either every
+value of the group makes it to flash or none does. abort() drops the
+group.
+
+  UtilParameters::begin();
+  UtilParameters::put(UTIL_PARAM_SSID, ssid);
+  UtilParameters::put(UTIL_PARAM_PASS, pass);
+  UtilParameters::commit();
+
+The ESP_PARAMS command carries a group of key/value pairs in one message,
+written with writeInt() / writeString() and applied as one transaction.
+
+snapshot() serializes the whole namespace, or with a generation only the
+keys written after it, into a versioned binary snapshot with a CRC32.
+restore() checks it and applies it through the journal, all or nothing.
+Large snapshots travel in ESP_SNAPSHOT chunks over any transport:
+
+  UtilMessage snapshot;
+  UtilParameters::snapshot(snapshot);              // or snapshot(snapshot, since)
+  for(int i = 0; i < UtilParameters::chunkCount(snapshot, 200); i++){
+    UtilMessage chunk;
+    UtilParameters::writeChunk(chunk, snapshot, i, 200);
+    LoRaMan.sendMessage(std::move(chunk));
+  }
+
+Every value written bumps generation(). The generation that last changed
+each key is kept in RAM. Once snapshot() or generation() has been used
+the index goes to NVS as well, in the commit of the values it covers, so
+a device that never asks for deltas never writes it. A full snapshot
+enumerates the namespace itself.
+
+The cache holds UTIL_PARAM_CACHE_SIZE keys (a build flag, as this file is
+included ahead of Config.h), clean entries are evicted when it runs full.
+Use it from the loop task only.
+
+---------------------------------------------------------------------*/
+
+#if !defined(UTIL_PARAMETERS_H)
+#define UTIL_PARAMETERS_H
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <nvs.h>
+#ifndef ESPUTILS_HOST
+#include <esp_idf_version.h>
+#endif
+#include <UtilCommon.h>
+#include <UtilMessage.h>
+#include <UtilScheduler.h>
+
+#ifndef UTIL_PARAM_CACHE_SIZE
+#define UTIL_PARAM_CACHE_SIZE 16
+#endif
+
+#ifndef UTIL_PARAM_SNAPSHOT_MAX
+#define UTIL_PARAM_SNAPSHOT_MAX 8192 // Bytes of a snapshot received in chunks, larger ones are refused
+#endif
+
+#define UTIL_PARAM_KEY_SIZE 16 // NVS keys are at most 15 characters
+#define UTIL_PARAM_PAGE_ENTRIES 126 // 32 byte entries in a 4 KB NVS page
+#define UTIL_PARAM_JOURNAL "_TXN"
+#define UTIL_PARAM_INDEX "_IDX"
+
+#define UTIL_SNAPSHOT_MAGIC 0x53505345 // "ESPS"
+#define UTIL_SNAPSHOT_VERSION 1
+#define UTIL_SNAPSHOT_DELTA 0x01
+
+#define UTIL_PARAM(name, key, type, defaultValue) \
+  static_assert(sizeof(key) <= UTIL_PARAM_KEY_SIZE, "NVS keys are at most 15 characters: " key); \
+  constexpr UtilParam<type> name(key, defaultValue)
+
+enum UtilFlushPolicy { util_flush_immediate, util_flush_explicit, util_flush_timer, util_flush_restart };
+
+// Values are part of the ESP_PARAMS wire format, append only.
+enum UtilParamType {
+  util_param_none,    // Caches a key missing from NVS
+  util_param_int,
+  util_param_string,
+  util_param_uint8,
+  util_param_uint16,
+  util_param_uint32,
+  util_param_uint64,
+  util_param_float,
+  util_param_bool,
+  util_param_blob
+};
+
+// FNV-1a, evaluated by the compiler for UTIL_PARAM keys.
+constexpr uint32_t utilHash(const char *key, uint32_t value = 2166136261u){
+  return *key ? utilHash(key + 1, (value ^ (uint8_t)*key) * 16777619u) : value;
+}
+
+//------------------------------------------------------------------------------------
+struct UtilBlob {
+  const void *data;
+  int size;
+
+  constexpr UtilBlob(const void *_data = NULL, int _size = 0) : data(_data), size(_size){};
+};
+
+//------------------------------------------------------------------------------------
+template<typename T>
+struct UtilParam {
+  const char *key;
+  uint32_t hash;
+  T defaultValue;
+
+  constexpr UtilParam(const char *_key, T _defaultValue) : key(_key), hash(utilHash(_key)), defaultValue(_defaultValue){};
+};
+
+//------------------------------------------------------------------------------------
+// UtilParamTraits - Maps the scalar C++ types onto UtilParamType
+//------------------------------------------------------------------------------------
+template<typename T> struct UtilParamTraits {};
+template<> struct UtilParamTraits<int32_t>  { typedef int32_t Value;  static const UtilParamType type = util_param_int; };
+template<> struct UtilParamTraits<uint8_t>  { typedef uint8_t Value;  static const UtilParamType type = util_param_uint8; };
+template<> struct UtilParamTraits<uint16_t> { typedef uint16_t Value; static const UtilParamType type = util_param_uint16; };
+template<> struct UtilParamTraits<uint32_t> { typedef uint32_t Value; static const UtilParamType type = util_param_uint32; };
+template<> struct UtilParamTraits<uint64_t> { typedef uint64_t Value; static const UtilParamType type = util_param_uint64; };
+template<> struct UtilParamTraits<float>    { typedef float Value;    static const UtilParamType type = util_param_float; };
+template<> struct UtilParamTraits<bool>     { typedef bool Value;     static const UtilParamType type = util_param_bool; };
+
+//------------------------------------------------------------------------------------
+struct UtilParamEntry {
+  uint32_t hash;
+  char key[UTIL_PARAM_KEY_SIZE];
+  UtilParamType type;
+  PreferenceType stored; // Type of the key in NVS, PT_INVALID when missing
+  bool dirty;
+  uint64_t bits;         // Scalar values
+  std::string bytes;     // Strings and blobs
+};
+
+//------------------------------------------------------------------------------------
+struct UtilParamIndex {
+  char key[UTIL_PARAM_KEY_SIZE];
+  uint32_t generation;
+};
+
+//------------------------------------------------------------------------------------
+class UtilParameters {
+public:
+  template<typename T> static typename UtilParamTraits<T>::Value get(const UtilParam<T> &param);
+  template<typename T> static void put(const UtilParam<T> &param, typename UtilParamTraits<T>::Value value);
+  static String get(const UtilParam<const char *> &param);
+  static void put(const UtilParam<const char *> &param, const String &value);
+  static int get(const UtilParam<UtilBlob> &param, void *buffer, int size);
+  static void put(const UtilParam<UtilBlob> &param, const void *data, int size);
+
+  static bool getInt(const char *key, int32_t &value);
+  static bool getString(const char *key, String &value);
+  static void putInt(const char *key, int32_t value);
+  static void putString(const char *key, const String &value);
+
+  static void begin();
+  static bool commit();
+  static void abort();
+  static bool inTransaction();
+
+  static void writeInt(UtilMessage &message, const char *key, int32_t value);
+  static void writeString(UtilMessage &message, const char *key, const String &value);
+  static bool apply(UtilMessageView &message);
+
+  static uint32_t generation();
+  static bool snapshot(UtilMessage &message, uint32_t since = 0);
+  static bool restore(UtilMessageView snapshot);
+  static int chunkCount(const UtilMessage &snapshot, int chunkSize);
+  static void writeChunk(UtilMessage &message, const UtilMessage &snapshot, int index, int chunkSize);
+  static bool receiveChunk(UtilMessageView &message);
+
+  static void setPolicy(UtilFlushPolicy policy, uint32_t interval = 5000);
+  static UtilFlushPolicy policy();
+  static void flush();
+  static void clear();
+  static int dirty();
+  static void resetStats();
+
+  static uint32_t hits;
+  static uint32_t misses;
+  static uint32_t writes;
+  static uint32_t commits;
+
+private:
+  static UtilParamEntry _entries[UTIL_PARAM_CACHE_SIZE];
+  static int _count;
+  static int _evict;
+  static UtilFlushPolicy _policy;
+  static uint32_t _interval;
+  static UtilParamEntry _staged[UTIL_PARAM_CACHE_SIZE];
+  static int _stagedCount;
+  static bool _transaction;
+  static bool _journaled;
+  static vector<UtilParamIndex> _index;
+  static uint32_t _generation;
+  static bool _indexDirty;
+  static bool _tracking;     // The index is kept in NVS
+  static vector<byte> _incoming;
+  static int _nextChunk;
+  static int _chunkCount;
+  static Preferences _prefs;
+  static nvs_handle_t _nvs;  // Writes, committed together by save()
+  static bool _pending;      // Set since the last save()
+  static bool _open;
+
+  static bool open();
+  static bool save();
+  static int span(const UtilParamEntry &entry);
+  static PreferenceType nvsType(UtilParamType type);
+  static UtilParamEntry *find(const char *key, uint32_t keyHash);
+  static UtilParamEntry *load(const char *key, uint32_t keyHash, UtilParamType type);
+  static void read(UtilParamEntry &entry, UtilParamType type);
+  static UtilParamEntry *slot(const char *key, uint32_t keyHash);
+  static void set(const char *key, uint32_t keyHash, UtilParamType type, uint64_t bits, const void *data = NULL, int size = 0);
+  static void store(UtilParamEntry &entry);
+  static void written(UtilParamEntry &entry);
+  static bool stage(const UtilParamEntry &value);
+  static void encode(UtilMessage &message, const UtilParamEntry &entry);
+  static bool decode(UtilMessageView &message, UtilParamEntry &entry);
+  static void replay();
+  static void loadIndex();
+  static void writeIndex();
+  static void track();
+  static void indexKey(const char *key, uint32_t generation);
+  static UtilParamType paramType(PreferenceType type);
+  static void snapshotKey(UtilMessage &message, UtilParamEntry &entry);
+};
+
+UtilParamEntry UtilParameters::_entries[UTIL_PARAM_CACHE_SIZE];
+int UtilParameters::_count = 0;
+int UtilParameters::_evict = 0;
+UtilFlushPolicy UtilParameters::_policy = util_flush_immediate;
+uint32_t UtilParameters::_interval = 5000;
+UtilParamEntry UtilParameters::_staged[UTIL_PARAM_CACHE_SIZE];
+int UtilParameters::_stagedCount = 0;
+bool UtilParameters::_transaction = false;
+bool UtilParameters::_journaled = false;
+vector<UtilParamIndex> UtilParameters::_index;
+uint32_t UtilParameters::_generation = 0;
+bool UtilParameters::_indexDirty = false;
+bool UtilParameters::_tracking = false;
+vector<byte> UtilParameters::_incoming;
+int UtilParameters::_nextChunk = 0;
+int UtilParameters::_chunkCount = 0;
+Preferences UtilParameters::_prefs;
+nvs_handle_t UtilParameters::_nvs = 0;
+bool UtilParameters::_pending = false;
+bool UtilParameters::_open = false;
+uint32_t UtilParameters::hits = 0;
+uint32_t UtilParameters::misses = 0;
+uint32_t UtilParameters::writes = 0;
+uint32_t UtilParameters::commits = 0;
+
+// Parameters used by the library itself
+UTIL_PARAM(UTIL_PARAM_SSID,   UTIL_SSID_KEY,       const char *, "");
+UTIL_PARAM(UTIL_PARAM_PASS,   UTIL_PASS_KEY,       const char *, "");
+UTIL_PARAM(UTIL_PARAM_REMOTE, UTIL_REMOTE_ADDRESS, const char *, "0000");
+
+//------------------------------------------------------------------------------------
+
+template<typename T>
+typename UtilParamTraits<T>::Value UtilParameters::get(const UtilParam<T> &param){
+  UtilParamEntry *entry = load(param.key, param.hash, UtilParamTraits<T>::type);
+  if(entry == NULL){
+    return param.defaultValue;
+  }
+  T value;
+  memcpy(&value, &entry->bits, sizeof(T));
+  return value;
+}
+
+//------------------------------------------------------------------------------------
+
+template<typename T>
+void UtilParameters::put(const UtilParam<T> &param, typename UtilParamTraits<T>::Value value){
+  uint64_t bits = 0;
+  memcpy(&bits, &value, sizeof(T));
+  set(param.key, param.hash, UtilParamTraits<T>::type, bits);
+}
+
+//------------------------------------------------------------------------------------
+
+String UtilParameters::get(const UtilParam<const char *> &param){
+  UtilParamEntry *entry = load(param.key, param.hash, util_param_string);
+  return entry == NULL ? String(param.defaultValue) : String(entry->bytes.c_str());
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilParameters::put(const UtilParam<const char *> &param, const String &value){
+  set(param.key, param.hash, util_param_string, 0, value.c_str(), value.length());
+}
+
+//------------------------------------------------------------------------------------
+
+// Copies up to size bytes into buffer, returns the size of the stored blob.
+int UtilParameters::get(const UtilParam<UtilBlob> &param, void *buffer, int size){
+  UtilParamEntry *entry = load(param.key, param.hash, util_param_blob);
+  const void *data = entry == NULL ? param.defaultValue.data : entry->bytes.data();
+  int length = entry == NULL ? param.defaultValue.size : entry->bytes.size();
+
+  if(data != NULL && length > 0){
+    memcpy(buffer, data, length < size ? length : size);
+  }
+  return length;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilParameters::put(const UtilParam<UtilBlob> &param, const void *data, int size){
+  set(param.key, param.hash, util_param_blob, 0, data, size);
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilParameters::getInt(const char *key, int32_t &value){
+  UtilParamEntry *entry = load(key, utilHash(key), util_param_int);
+  if(entry == NULL){
+    return false;
+  }
+  memcpy(&value, &entry->bits, sizeof(value));
+  return true;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilParameters::getString(const char *key, String &value){
+  UtilParamEntry *entry = load(key, utilHash(key), util_param_string);
+  if(entry == NULL){
+    return false;
+  }
+  value = entry->bytes.c_str();
+  return true;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilParameters::putInt(const char *key, int32_t value){
+  uint64_t bits = 0;
+  memcpy(&bits, &value, sizeof(value));
+  set(key, utilHash(key), util_param_int, bits);
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilParameters::putString(const char *key, const String &value){
+  set(key, utilHash(key), util_param_string, 0, value.c_str(), value.length());
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilParameters::open(){
+  if(!_open){
+    _open = _prefs.begin(UTIL_PREF_KEY, false) && nvs_open(UTIL_PREF_KEY, NVS_READWRITE, &_nvs) == ESP_OK;
+    if(!_open){
+      Serial.println("ERROR: UtilParameters - Unable to open " + String(UTIL_PREF_KEY));
+    }
+    else {
+      loadIndex();
+      replay();
+    }
+  }
+  return _open;
+}
+
+//------------------------------------------------------------------------------------
+
+// Preferences stores floats as 4 byte blobs and bools as bytes.
+PreferenceType UtilParameters::nvsType(UtilParamType type){
+  switch(type){
+    case util_param_int:    return PT_I32;
+    case util_param_string: return PT_STR;
+    case util_param_uint8:  return PT_U8;
+    case util_param_uint16: return PT_U16;
+    case util_param_uint32: return PT_U32;
+    case util_param_uint64: return PT_U64;
+    case util_param_float:  return PT_BLOB;
+    case util_param_bool:   return PT_U8;
+    case util_param_blob:   return PT_BLOB;
+    default:                return PT_INVALID;
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+UtilParamEntry *UtilParameters::find(const char *key, uint32_t keyHash){
+  for(int i = 0; i < _count; i++){
+    if(_entries[i].hash == keyHash && strcmp(_entries[i].key, key) == 0){
+      return &_entries[i];
+    }
+  }
+  return NULL;
+}
+
+//------------------------------------------------------------------------------------
+
+// Returns a free entry for key, evicting a clean one when the cache is full.
+UtilParamEntry *UtilParameters::slot(const char *key, uint32_t keyHash){
+  if(strlen(key) >= UTIL_PARAM_KEY_SIZE){
+    Serial.println("ERROR: UtilParameters - Key too long " + String(key));
+    return NULL;
+  }
+
+  UtilParamEntry *entry = NULL;
+  if(_count < UTIL_PARAM_CACHE_SIZE){
+    entry = &_entries[_count++];
+  }
+  else {
+    for(int i = 0; i < UTIL_PARAM_CACHE_SIZE && entry == NULL; i++){
+      _evict = (_evict + 1) % UTIL_PARAM_CACHE_SIZE;
+      if(!_entries[_evict].dirty){
+        entry = &_entries[_evict];
+      }
+    }
+    if(entry == NULL){
+      flush();
+      entry = &_entries[_evict];
+    }
+  }
+
+  entry->hash = keyHash;
+  strcpy(entry->key, key);
+  entry->type = util_param_none;
+  entry->stored = PT_INVALID;
+  entry->dirty = false;
+  entry->bits = 0;
+  entry->bytes.clear();
+  return entry;
+}
+
+//------------------------------------------------------------------------------------
+
+// Returns the cached entry for key if it holds a value of type, NULL otherwise.
+UtilParamEntry *UtilParameters::load(const char *key, uint32_t keyHash, UtilParamType type){
+  UtilParamEntry *entry = find(key, keyHash);
+  if(entry != NULL){
+    hits++;
+    // Types sharing an NVS type (uint8/bool, float/blob) are read again
+    if(entry->type != type && !entry->dirty && entry->stored == nvsType(type)){
+      read(*entry, type);
+    }
+    return entry->type == type ? entry : NULL;
+  }
+
+  misses++;
+  if(!open() || (entry = slot(key, keyHash)) == NULL){
+    return NULL;
+  }
+  entry->stored = _prefs.isKey(key) ? _prefs.getType(key) : PT_INVALID;
+  read(*entry, type);
+  return entry->type == type ? entry : NULL;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilParameters::read(UtilParamEntry &entry, UtilParamType type){
+  entry.type = util_param_none;
+  entry.bits = 0;
+  entry.bytes.clear();
+  if(entry.stored != nvsType(type)){
+    return;
+  }
+
+  entry.type = type;
+  switch(type){
+    case util_param_int:    entry.bits = (uint32_t)_prefs.getInt(entry.key); break;
+    case util_param_uint8:  entry.bits = _prefs.getUChar(entry.key); break;
+    case util_param_uint16: entry.bits = _prefs.getUShort(entry.key); break;
+    case util_param_uint32: entry.bits = _prefs.getUInt(entry.key); break;
+    case util_param_uint64: entry.bits = _prefs.getULong64(entry.key); break;
+    case util_param_bool:   entry.bits = _prefs.getBool(entry.key); break;
+    case util_param_string: entry.bytes = _prefs.getString(entry.key).c_str(); break;
+    case util_param_float:
+    case util_param_blob: {
+      size_t length = _prefs.getBytesLength(entry.key);
+      entry.bytes.resize(length);
+      _prefs.getBytes(entry.key, &entry.bytes[0], length);
+      if(type == util_param_float){
+        if(length != sizeof(float)){
+          entry.type = util_param_none;
+        }
+        memcpy(&entry.bits, entry.bytes.data(), length == sizeof(float) ? sizeof(float) : 0);
+        entry.bytes.clear();
+      }
+      break;
+    }
+    default: break;
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilParameters::set(const char *key, uint32_t keyHash, UtilParamType type, uint64_t bits, const void *data, int size){
+  UtilParamEntry value;
+  value.hash = keyHash;
+  value.type = type;
+  value.bits = bits;
+  if(data != NULL){
+    value.bytes.assign((const char *)data, size);
+  }
+
+  if(_transaction){
+    if(strlen(key) >= UTIL_PARAM_KEY_SIZE){
+      Serial.println("ERROR: UtilParameters - Key too long " + String(key));
+      return;
+    }
+    strcpy(value.key, key);
+    stage(value);
+    return;
+  }
+
+  UtilParamEntry *entry = find(key, keyHash);
+  if(entry == NULL && (entry = slot(key, keyHash)) == NULL){
+    return;
+  }
+  if(entry->type == type && entry->bits == bits && entry->bytes == value.bytes){
+    return;
+  }
+
+  entry->type = type;
+  entry->bits = bits;
+  entry->bytes.swap(value.bytes);
+  written(*entry);
+}
+
+//------------------------------------------------------------------------------------
+
+// A cached value changed, write it back according to the policy.
+void UtilParameters::written(UtilParamEntry &entry){
+  entry.dirty = true;
+  if(_policy == util_flush_immediate){
+    store(entry);
+    save();
+  }
+  else if(_policy == util_flush_timer && !UtilScheduler::isScheduled(UtilParameters::flush)){
+    UtilScheduler::schedule(UtilParameters::flush, _interval);
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+// Records the generation key was last written at, in RAM. save() writes
+// the index with the values once it is tracked.
+void UtilParameters::indexKey(const char *key, uint32_t generation){
+  UtilParamIndex *item = NULL;
+  for(size_t i = 0; i < _index.size() && item == NULL; i++){
+    if(strcmp(_index[i].key, key) == 0){
+      item = &_index[i];
+    }
+  }
+
+  if(item == NULL){
+    UtilParamIndex added;
+    strcpy(added.key, key);
+    added.generation = generation;
+    _index.push_back(added);
+  }
+  else if(generation > item->generation){
+    item->generation = generation;
+  }
+  else {
+    return;
+  }
+
+  _indexDirty = true;
+}
+
+//------------------------------------------------------------------------------------
+
+// Index format: generation (varint), then key (text) and generation (varint) per key.
+// Set from save() only, it is committed with the values.
+void UtilParameters::writeIndex(){
+  if(!_indexDirty || !_tracking){
+    return;
+  }
+
+  UtilMessage index;
+  index.writeVarint(_generation);
+  for(size_t i = 0; i < _index.size(); i++){
+    index.writeText(_index[i].key);
+    index.writeVarint(_index[i].generation);
+  }
+  nvs_set_blob(_nvs, UTIL_PARAM_INDEX, index.data(), index.size());
+  _indexDirty = false;
+  writes++;
+}
+
+//------------------------------------------------------------------------------------
+
+// Generations are asked for, from now on the index is kept in NVS.
+void UtilParameters::track(){
+  if(_tracking || !open()){
+    return;
+  }
+  _tracking = true;
+  _indexDirty = true;
+  _pending = true;
+  save();
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilParameters::loadIndex(){
+  _index.clear();
+  size_t length = _prefs.getBytesLength(UTIL_PARAM_INDEX);
+  _tracking = length > 0;
+  if(length == 0){
+    return;
+  }
+
+  vector<byte> data(length);
+  _prefs.getBytes(UTIL_PARAM_INDEX, data.data(), length);
+  UtilMessageView view(data.data(), length);
+
+  _generation = view.readVarint();
+  UtilParamIndex item;
+  while(view.bytesAvailable() > 0){
+    int size = view.readText(item.key, UTIL_PARAM_KEY_SIZE);
+    item.generation = view.readVarint();
+    if(view.underflow() || size <= 0 || size >= UTIL_PARAM_KEY_SIZE){
+      Serial.println("ERROR: UtilParameters - Damaged key index");
+      break;
+    }
+    _index.push_back(item);
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+// Sets entry in NVS, it is committed by the next save().
+void UtilParameters::store(UtilParamEntry &entry){
+  if(!open()){
+    return;
+  }
+
+  // NVS keeps the type with the key, drop the old one when it changes.
+  PreferenceType type = nvsType(entry.type);
+  PreferenceType stored = _prefs.isKey(entry.key) ? _prefs.getType(entry.key) : PT_INVALID;
+  if(stored != PT_INVALID && stored != type){
+    nvs_erase_key(_nvs, entry.key);
+  }
+
+  esp_err_t result;
+  switch(entry.type){
+    case util_param_int:    result = nvs_set_i32(_nvs, entry.key, (int32_t)entry.bits); break;
+    case util_param_uint8:  result = nvs_set_u8(_nvs, entry.key, entry.bits); break;
+    case util_param_uint16: result = nvs_set_u16(_nvs, entry.key, entry.bits); break;
+    case util_param_uint32: result = nvs_set_u32(_nvs, entry.key, entry.bits); break;
+    case util_param_uint64: result = nvs_set_u64(_nvs, entry.key, entry.bits); break;
+    case util_param_bool:   result = nvs_set_u8(_nvs, entry.key, entry.bits != 0); break;
+    case util_param_string: result = nvs_set_str(_nvs, entry.key, entry.bytes.c_str()); break;
+    case util_param_blob:   result = nvs_set_blob(_nvs, entry.key, entry.bytes.data(), entry.bytes.size()); break;
+    case util_param_float:  result = nvs_set_blob(_nvs, entry.key, &entry.bits, sizeof(float)); break; // As Preferences::putFloat()
+    default:                result = ESP_OK; break;
+  }
+  if(result != ESP_OK){
+    Serial.println("ERROR: UtilParameters - Unable to write " + String(entry.key));
+  }
+
+  _pending = true;
+  entry.stored = type;
+  entry.dirty = false;
+  writes++;
+  indexKey(entry.key, ++_generation);
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilParameters::flush(){
+  for(int i = 0; i < _count; i++){
+    if(_entries[i].dirty){
+      store(_entries[i]);
+    }
+  }
+
+  // Every journaled value is in place now
+  if(_journaled && open()){
+    nvs_erase_key(_nvs, UTIL_PARAM_JOURNAL);
+    _pending = true;
+    _journaled = false;
+    writes++;
+  }
+  save();
+  UtilScheduler::cancel(UtilParameters::flush);
+}
+
+//------------------------------------------------------------------------------------
+
+// Commits what was set since the last save() with one nvs_commit().
+bool UtilParameters::save(){
+  if(!_pending){
+    return true;
+  }
+  writeIndex();
+  _pending = false;
+  commits++;
+  if(nvs_commit(_nvs) != ESP_OK){
+    Serial.println("ERROR: UtilParameters - Unable to commit " + String(UTIL_PREF_KEY));
+    return false;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------------
+
+// NVS entries value takes: one for the key, strings and blobs a blob
+// index and 32 byte entries for their data on top.
+int UtilParameters::span(const UtilParamEntry &entry){
+  switch(entry.type){
+    case util_param_string: return 1 + (entry.bytes.size() + 1 + 31) / 32;
+    case util_param_float:  return 3;
+    case util_param_blob:   return 2 + (entry.bytes.size() + 31) / 32;
+    default:                return 1;
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+// Erases the namespace and forgets every cached value, dirty or not.
+void UtilParameters::clear(){
+  if(open()){
+    _prefs.clear();
+  }
+  for(int i = 0; i < _count; i++){
+    _entries[i].bytes.clear();
+  }
+  _count = 0;
+  _journaled = false;
+  _index.clear();
+  _indexDirty = false;
+  _tracking = false;
+  abort();
+  UtilScheduler::cancel(UtilParameters::flush);
+}
+
+//------------------------------------------------------------------------------------
+
+// Starts collecting writes, reads keep returning the committed values.
+void UtilParameters::begin(){
+  if(_transaction){
+    Serial.println("ERROR: UtilParameters - Transaction already open");
+    return;
+  }
+  _transaction = true;
+  _stagedCount = 0;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilParameters::stage(const UtilParamEntry &value){
+  UtilParamEntry *entry = NULL;
+  for(int i = 0; i < _stagedCount && entry == NULL; i++){
+    if(_staged[i].hash == value.hash && strcmp(_staged[i].key, value.key) == 0){
+      entry = &_staged[i];
+    }
+  }
+
+  if(entry == NULL){
+    if(_stagedCount == UTIL_PARAM_CACHE_SIZE){
+      Serial.println("ERROR: UtilParameters - Transaction full, dropped " + String(value.key));
+      return false;
+    }
+    entry = &_staged[_stagedCount++];
+  }
+
+  *entry = value;
+  return true;
+}
+
+//------------------------------------------------------------------------------------
+
+// Hands the group to the cache, its values are written back together.
+// A group too large for one NVS page is journaled first. Returns false if
+// nothing was applied.
+bool UtilParameters::commit(){
+  if(!_transaction){
+    return false;
+  }
+  _transaction = false;
+
+  // A single key is written atomically anyway
+  if(_stagedCount <= 1){
+    if(_stagedCount == 1){
+      UtilParamEntry &single = _staged[0];
+      set(single.key, single.hash, single.type, single.bits, single.bytes.data(), single.bytes.size());
+    }
+    abort();
+    return true;
+  }
+
+  // Make sure the group fits next to what is still dirty, dirty entries stay cached
+  if(dirty() + _stagedCount > UTIL_PARAM_CACHE_SIZE){
+    flush();
+  }
+
+  // Written back with the group, the dirty entries count towards the page
+  int entries = 0;
+  for(int i = 0; i < _count; i++){
+    entries += _entries[i].dirty ? span(_entries[i]) : 0;
+  }
+  for(int i = 0; i < _stagedCount; i++){
+    entries += span(_staged[i]);
+  }
+
+  if(entries > UTIL_PARAM_PAGE_ENTRIES){
+    UtilMessage journal;
+    for(int i = 0; i < _count; i++){
+      if(_entries[i].dirty){
+        encode(journal, _entries[i]);
+      }
+    }
+    for(int i = 0; i < _stagedCount; i++){
+      encode(journal, _staged[i]);
+    }
+
+    if(!open() || nvs_set_blob(_nvs, UTIL_PARAM_JOURNAL, journal.data(), journal.size()) != ESP_OK){
+      Serial.println("ERROR: UtilParameters - Unable to write the journal");
+      abort();
+      return false;
+    }
+    _pending = true;
+    if(!save()){
+      abort();
+      return false;
+    }
+    _journaled = true;
+    writes++;
+  }
+
+  for(int i = 0; i < _stagedCount; i++){
+    UtilParamEntry *entry = find(_staged[i].key, _staged[i].hash);
+    if(entry == NULL){
+      entry = slot(_staged[i].key, _staged[i].hash);
+    }
+    entry->type = _staged[i].type;
+    entry->bits = _staged[i].bits;
+    entry->bytes.swap(_staged[i].bytes);
+    entry->dirty = true;
+  }
+  abort();
+
+  if(_policy == util_flush_immediate){
+    flush();
+  }
+  else if(_policy == util_flush_timer && !UtilScheduler::isScheduled(UtilParameters::flush)){
+    UtilScheduler::schedule(UtilParameters::flush, _interval);
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilParameters::abort(){
+  for(int i = 0; i < _stagedCount; i++){
+    _staged[i].bytes.clear();
+  }
+  _stagedCount = 0;
+  _transaction = false;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilParameters::inTransaction(){
+  return _transaction;
+}
+
+//------------------------------------------------------------------------------------
+
+// Wire format of ESP_PARAMS and of the journal, per pair: key (text),
+// type (byte), value (zig-zag varint for int, float, varint for the other
+// scalars, blob for strings and blobs).
+void UtilParameters::encode(UtilMessage &message, const UtilParamEntry &entry){
+  message.writeText(entry.key);
+  message.write((byte)entry.type);
+
+  float value;
+  switch(entry.type){
+    case util_param_int:
+      message.writeZigZag((int32_t)entry.bits);
+      break;
+    case util_param_float:
+      memcpy(&value, &entry.bits, sizeof(value));
+      message.writeFloat(value);
+      break;
+    case util_param_string:
+    case util_param_blob:
+      message.writeBlob((const byte *)entry.bytes.data(), entry.bytes.size());
+      break;
+    default:
+      message.writeVarint(entry.bits);
+      break;
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilParameters::decode(UtilMessageView &message, UtilParamEntry &entry){
+  int length = message.readText(entry.key, UTIL_PARAM_KEY_SIZE);
+  byte type = message.read();
+  if(type == util_param_none || type > util_param_blob){
+    return false;
+  }
+
+  const byte *data;
+  int size;
+  float value;
+  entry.type = (UtilParamType)type;
+  entry.bits = 0;
+  entry.bytes.clear();
+  switch(entry.type){
+    case util_param_int:
+      entry.bits = (uint32_t)(int32_t)message.readZigZag();
+      break;
+    case util_param_float:
+      value = message.readFloat();
+      memcpy(&entry.bits, &value, sizeof(value));
+      break;
+    case util_param_string:
+    case util_param_blob:
+      size = message.readBlob(&data);
+      if(size > 0){
+        entry.bytes.assign((const char *)data, size);
+      }
+      break;
+    default:
+      entry.bits = message.readVarint();
+      break;
+  }
+
+  entry.hash = utilHash(entry.key);
+  return !message.underflow() && length > 0 && length < UTIL_PARAM_KEY_SIZE;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilParameters::writeInt(UtilMessage &message, const char *key, int32_t value){
+  UtilParamEntry entry;
+  strncpy(entry.key, key, UTIL_PARAM_KEY_SIZE - 1);
+  entry.key[UTIL_PARAM_KEY_SIZE - 1] = '\0';
+  entry.type = util_param_int;
+  entry.bits = (uint32_t)value;
+  encode(message, entry);
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilParameters::writeString(UtilMessage &message, const char *key, const String &value){
+  UtilParamEntry entry;
+  strncpy(entry.key, key, UTIL_PARAM_KEY_SIZE - 1);
+  entry.key[UTIL_PARAM_KEY_SIZE - 1] = '\0';
+  entry.type = util_param_string;
+  entry.bytes = value.c_str();
+  encode(message, entry);
+}
+
+//------------------------------------------------------------------------------------
+
+// Applies every pair in message as one transaction, nothing if one is malformed.
+bool UtilParameters::apply(UtilMessageView &message){
+  UtilParamEntry entry;
+  begin();
+  while(message.bytesAvailable() > 0){
+    if(!decode(message, entry) || !stage(entry)){
+      Serial.println("ERROR: UtilParameters - Malformed parameter message");
+      abort();
+      return false;
+    }
+  }
+  return commit();
+}
+
+//------------------------------------------------------------------------------------
+
+// Finishes a commit interrupted by a reset, called when the namespace is opened.
+void UtilParameters::replay(){
+  size_t length = _prefs.getBytesLength(UTIL_PARAM_JOURNAL);
+  if(length == 0){
+    return;
+  }
+
+  vector<byte> journal(length);
+  _prefs.getBytes(UTIL_PARAM_JOURNAL, journal.data(), length);
+  UtilMessageView view(journal.data(), length);
+
+  UtilParamEntry entry;
+  int count = 0;
+  while(view.bytesAvailable() > 0 && decode(view, entry)){
+    store(entry);
+    count++;
+  }
+
+  nvs_erase_key(_nvs, UTIL_PARAM_JOURNAL);
+  _pending = true;
+  writes++;
+  save();
+  Serial.println("NFO: UtilParameters - Replayed " + String(count) + " journaled values");
+}
+
+//------------------------------------------------------------------------------------
+
+uint32_t UtilParameters::generation(){
+  track();
+  return _generation;
+}
+
+//------------------------------------------------------------------------------------
+
+UtilParamType UtilParameters::paramType(PreferenceType type){
+  switch(type){
+    case PT_I32:  return util_param_int;
+    case PT_STR:  return util_param_string;
+    case PT_U8:   return util_param_uint8;
+    case PT_U16:  return util_param_uint16;
+    case PT_U32:  return util_param_uint32;
+    case PT_U64:  return util_param_uint64;
+    case PT_BLOB: return util_param_blob;
+    default:      return util_param_none;
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+// Snapshot format:
+//   magic (uint32), version (byte), flags (byte), generation (varint),
+//   since (varint), pairs as in ESP_PARAMS, CRC32 of all of the above (uint32)
+// Keys written after generation since only, all keys when since is 0.
+bool UtilParameters::snapshot(UtilMessage &message, uint32_t since){
+  flush();
+  track();
+  if(!open()){
+    return false;
+  }
+
+  int start = message.size();
+  message.writeUInt32(UTIL_SNAPSHOT_MAGIC);
+  message.write(UTIL_SNAPSHOT_VERSION);
+  message.write(since > 0 ? UTIL_SNAPSHOT_DELTA : 0);
+  message.writeVarint(_generation);
+  message.writeVarint(since);
+
+  // A delta has every key it needs in the index, the full snapshot takes
+  // what NVS holds, keys not read or written since the start too.
+  UtilParamEntry entry;
+  if(since > 0){
+    for(size_t i = 0; i < _index.size(); i++){
+      if(_index[i].generation > since){
+        strcpy(entry.key, _index[i].key);
+        snapshotKey(message, entry);
+      }
+    }
+  }
+  else {
+    nvs_iterator_t iterator = NULL;
+    #if ESP_IDF_VERSION_MAJOR >= 5
+    esp_err_t result = nvs_entry_find(NVS_DEFAULT_PART_NAME, UTIL_PREF_KEY, NVS_TYPE_ANY, &iterator);
+    #else
+    iterator = nvs_entry_find(NVS_DEFAULT_PART_NAME, UTIL_PREF_KEY, NVS_TYPE_ANY);
+    esp_err_t result = iterator != NULL ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+    #endif
+    while(result == ESP_OK){
+      nvs_entry_info_t info;
+      nvs_entry_info(iterator, &info);
+      if(strcmp(info.key, UTIL_PARAM_JOURNAL) != 0 && strcmp(info.key, UTIL_PARAM_INDEX) != 0){
+        strcpy(entry.key, info.key);
+        snapshotKey(message, entry);
+      }
+      #if ESP_IDF_VERSION_MAJOR >= 5
+      result = nvs_entry_next(&iterator);
+      #else
+      iterator = nvs_entry_next(iterator);
+      result = iterator != NULL ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+      #endif
+    }
+    nvs_release_iterator(iterator);
+  }
+
+  message.writeUInt32(utilCRC32(message.data() + start, message.size() - start));
+  return !message.overflow();
+}
+
+//------------------------------------------------------------------------------------
+
+// Adds the pair of entry.key as NVS holds it.
+void UtilParameters::snapshotKey(UtilMessage &message, UtilParamEntry &entry){
+  entry.stored = _prefs.isKey(entry.key) ? _prefs.getType(entry.key) : PT_INVALID;
+  read(entry, paramType(entry.stored));
+  if(entry.type != util_param_none){
+    encode(message, entry);
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+// Checks and applies a snapshot in one transaction.
+bool UtilParameters::restore(UtilMessageView snapshot){
+  int size = snapshot.size();
+  const byte *data = snapshot.data();
+  if(size < 12 || snapshot.readUInt32() != UTIL_SNAPSHOT_MAGIC){
+    Serial.println("ERROR: UtilParameters - Not a parameter snapshot");
+    return false;
+  }
+
+  UtilMessageView trailer(data + size - 4, 4);
+  if(trailer.readUInt32() != utilCRC32(data, size - 4)){
+    Serial.println("ERROR: UtilParameters - Snapshot checksum mismatch");
+    return false;
+  }
+
+  byte version = snapshot.read();
+  snapshot.read(); // flags
+  snapshot.readVarint(); // generation
+  snapshot.readVarint(); // since
+  if(version != UTIL_SNAPSHOT_VERSION || snapshot.underflow()){
+    Serial.println("ERROR: UtilParameters - Unsupported snapshot version " + String(version));
+    return false;
+  }
+
+  // The pairs are in journal format already, check every one before using them
+  int offset = snapshot.position();
+  UtilMessageView pairs(data + offset, size - 4 - offset);
+  UtilParamEntry entry;
+  while(pairs.bytesAvailable() > 0){
+    if(!decode(pairs, entry)){
+      Serial.println("ERROR: UtilParameters - Malformed snapshot");
+      return false;
+    }
+  }
+
+  flush();
+  if(!open() || nvs_set_blob(_nvs, UTIL_PARAM_JOURNAL, data + offset, size - 4 - offset) != ESP_OK){
+    Serial.println("ERROR: UtilParameters - Unable to write the journal");
+    return false;
+  }
+  _pending = true;
+  if(!save()){
+    return false;
+  }
+  writes++;
+  replay();
+
+  // Nothing is dirty after the flush, start over with an empty cache
+  for(int i = 0; i < _count; i++){
+    _entries[i].bytes.clear();
+  }
+  _count = 0;
+  return true;
+}
+
+//------------------------------------------------------------------------------------
+
+int UtilParameters::chunkCount(const UtilMessage &snapshot, int chunkSize){
+  return (snapshot.size() + chunkSize - 1) / chunkSize;
+}
+
+//------------------------------------------------------------------------------------
+
+// ESP_SNAPSHOT chunk: key, index (varint), count (varint), up to chunkSize snapshot bytes.
+void UtilParameters::writeChunk(UtilMessage &message, const UtilMessage &snapshot, int index, int chunkSize){
+  int offset = index * chunkSize;
+  int size = snapshot.size() - offset < chunkSize ? snapshot.size() - offset : chunkSize;
+
+  message.write(ESP_SNAPSHOT);
+  message.writeVarint(index);
+  message.writeVarint(chunkCount(snapshot, chunkSize));
+  if(size > 0){
+    message.write(snapshot.data() + offset, size);
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+// Collects ESP_SNAPSHOT chunks (positioned after the key) in order and
+// restores the snapshot with the last one. The chunks come from a peer,
+// a snapshot that would grow past UTIL_PARAM_SNAPSHOT_MAX is refused.
+bool UtilParameters::receiveChunk(UtilMessageView &message){
+  uint32_t index = message.readVarint();
+  uint32_t count = message.readVarint();
+  size_t size = message.bytesAvailable();
+  if(message.underflow() || index != (index == 0 ? 0 : (uint32_t)_nextChunk) || index >= count ||
+     (index > 0 && count != (uint32_t)_chunkCount)){
+    Serial.println("ERROR: UtilParameters - Unexpected snapshot chunk " + String(index));
+    vector<byte>().swap(_incoming);
+    _nextChunk = 0;
+    return false;
+  }
+
+  // Every chunk but the last is as large as the first
+  if(count > UTIL_PARAM_SNAPSHOT_MAX || (index == 0 && (uint64_t)(count - 1) * size >= UTIL_PARAM_SNAPSHOT_MAX) ||
+     _incoming.size() + size > UTIL_PARAM_SNAPSHOT_MAX){
+    Serial.println("ERROR: UtilParameters - Snapshot larger than " + String(UTIL_PARAM_SNAPSHOT_MAX) + " bytes");
+    vector<byte>().swap(_incoming);
+    _nextChunk = 0;
+    return false;
+  }
+
+  if(index == 0){
+    _incoming.clear();
+    _chunkCount = count;
+  }
+  _incoming.insert(_incoming.end(), message.data() + message.position(), message.data() + message.position() + size);
+  _nextChunk = index + 1;
+
+  if((uint32_t)_nextChunk < count){
+    return true;
+  }
+
+  bool restored = restore(UtilMessageView(_incoming.data(), _incoming.size()));
+  vector<byte>().swap(_incoming);
+  _nextChunk = 0;
+  return restored;
+}
+
+//------------------------------------------------------------------------------------
+
+// Switching policy writes back whatever the old one left dirty.
+void UtilParameters::setPolicy(UtilFlushPolicy policy, uint32_t interval){
+  _interval = interval;
+  if(policy != _policy){
+    _policy = policy;
+    flush();
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+UtilFlushPolicy UtilParameters::policy(){
+  return _policy;
+}
+
+//------------------------------------------------------------------------------------
+
+int UtilParameters::dirty(){
+  int count = 0;
+  for(int i = 0; i < _count; i++){
+    count += _entries[i].dirty;
+  }
+  return count;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilParameters::resetStats(){
+  hits = misses = writes = commits = 0;
+}
+
+#endif
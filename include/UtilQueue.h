@@ -0,0 +1,635 @@
+/*
+  UtilQueue.h - ESPUtils Library for development on the ESP32 Platform
+  Created by Joe Andolina, April 1, 2020.
+  Released into the public domain.
+
+---------------------------------------------------------------------
+
+UtilSPSCQueue is a fixed size, lock free ring for handing items from
+exactly one producer task to exactly one consumer task, e.g. messages from
+the LoRa task to the loop task. Items are moved in and out, so a queued
+UtilMessage keeps its buffer (or pool block) and nothing is copied.
+
+  UtilSPSCQueue<UtilMessage, 8> inbox;
+
+  inbox.push(std::move(message));     // producer, false when full
+  while(inbox.pop(message)){ ... }    // consumer
+
+The consumer can also look at the oldest item with front() and only pop()
+it once it is done with it, e.g. to retry a request later. at(i) looks
+further back, e.g. to send several requests before the first is answered.
+
+The producer can fill a slot in place instead, with no move and no
+allocation, e.g. from an interrupt. claim() hands out the next free slot,
+or NULL when full (counted in dropped()), and publish() passes it on.
+Until then the consumer does not see it, a claimed slot that is not
+published is simply claimed again next time.
+
+  UtilLoRaPacket *packet = received.claim();   // ISR
+  if(packet != NULL){ ...fill it...; received.publish(); }
+
+UtilPriorityQueue holds requests waiting to go out, e.g. those of
+SFManager. Each item goes into one of L lanes, lane 0 first. Within a lane
+items keep the order they were pushed in. When the queue is full an item
+displaces the oldest of a lower lane, otherwise its lane's policy decides:
+queue_reject turns it away, queue_drop_oldest displaces the oldest of its
+own lane, queue_coalesce replaces the waiting item match() finds equal.
+push() says which happened, and hands back the item that left the queue.
+
+  UtilPriorityQueue<Request, 20, 3> requests;
+  requests.policy[2] = queue_drop_oldest;
+
+  if(requests.push(request, 0) != queue_added){ ... }   // request holds what left
+  requests.hold();                                     // consumer, about to send
+  ... requests.at(i) ...
+  requests.release(sent);                              // the sent ones stay held
+  requests.pop();                                      // front one answered
+
+take() moves a held item out of turn, e.g. into a UtilSpool.
+
+Held items are never displaced, coalesced or overtaken, whatever arrives
+while they are out. A short UtilLock guards each call, so one task can
+push while another works through the queue.
+
+---------------------------------------------------------------------*/
+
+#if !defined(UTIL_QUEUE_H)
+#define UTIL_QUEUE_H
+
+#include <Arduino.h>
+#include <UtilLock.h>
+#include <atomic>
+#include <utility>
+
+//------------------------------------------------------------------------------------
+template<typename T, int N>
+class UtilSPSCQueue {
+public:
+  UtilSPSCQueue(){};
+
+  // Producer side
+  bool push(const T &item);
+  bool push(T &&item);
+  T *claim();
+  void publish();
+  uint32_t dropped() const;
+
+  // Consumer side
+  T *front();
+  T *at(int index);
+  bool pop();
+  bool pop(T &item);
+
+  bool isEmpty() const;
+  bool isFull() const;
+  int size() const;
+  static constexpr int capacity(){ return N; }
+
+private:
+  // One slot stays empty so a full ring can be told apart from an empty one.
+  T _items[N + 1];
+  std::atomic<int> _head{0}; // Next item to pop, written by the consumer only
+  std::atomic<int> _tail{0}; // Next slot to fill, written by the producer only
+  uint32_t _dropped = 0;
+
+  static int next(int index){ return index == N ? 0 : index + 1; }
+
+  UtilSPSCQueue(const UtilSPSCQueue &);
+  UtilSPSCQueue &operator=(const UtilSPSCQueue &);
+};
+
+//------------------------------------------------------------------------------------
+
+template<typename T, int N>
+bool UtilSPSCQueue<T, N>::push(const T &item){
+  T copy(item);
+  return push(std::move(copy));
+}
+
+//------------------------------------------------------------------------------------
+
+template<typename T, int N>
+bool UtilSPSCQueue<T, N>::push(T &&item){
+  int tail = _tail.load(std::memory_order_relaxed);
+  int following = next(tail);
+  if(following == _head.load(std::memory_order_acquire)){
+    _dropped++;
+    return false;
+  }
+
+  // Fill the slot first, then publish it to the consumer.
+  _items[tail] = std::move(item);
+  _tail.store(following, std::memory_order_release);
+  return true;
+}
+
+//------------------------------------------------------------------------------------
+
+// The slot the next item goes into, NULL when the queue is full. Safe from
+// an interrupt as long as it is the only producer.
+template<typename T, int N>
+T *UtilSPSCQueue<T, N>::claim(){
+  int tail = _tail.load(std::memory_order_relaxed);
+  if(next(tail) == _head.load(std::memory_order_acquire)){
+    _dropped++;
+    return NULL;
+  }
+  return &_items[tail];
+}
+
+//------------------------------------------------------------------------------------
+
+// Hands the slot claim() returned to the consumer.
+template<typename T, int N>
+void UtilSPSCQueue<T, N>::publish(){
+  _tail.store(next(_tail.load(std::memory_order_relaxed)), std::memory_order_release);
+}
+
+//------------------------------------------------------------------------------------
+
+// Number of pushes and claims rejected because the queue was full.
+template<typename T, int N>
+uint32_t UtilSPSCQueue<T, N>::dropped() const {
+  return _dropped;
+}
+
+//------------------------------------------------------------------------------------
+
+// The oldest item, or NULL when empty. Stays valid until pop().
+template<typename T, int N>
+T *UtilSPSCQueue<T, N>::front(){
+  int head = _head.load(std::memory_order_relaxed);
+  if(head == _tail.load(std::memory_order_acquire)){
+    return NULL;
+  }
+  return &_items[head];
+}
+
+//------------------------------------------------------------------------------------
+
+// The item index places behind the oldest, or NULL past the newest. Stays
+// valid until it is popped.
+template<typename T, int N>
+T *UtilSPSCQueue<T, N>::at(int index){
+  int head = _head.load(std::memory_order_relaxed);
+  int count = _tail.load(std::memory_order_acquire) - head;
+  if(count < 0){
+    count += N + 1;
+  }
+  if(index < 0 || index >= count){
+    return NULL;
+  }
+  int slot = head + index;
+  return &_items[slot > N ? slot - N - 1 : slot];
+}
+
+//------------------------------------------------------------------------------------
+
+// Discards the oldest item.
+template<typename T, int N>
+bool UtilSPSCQueue<T, N>::pop(){
+  int head = _head.load(std::memory_order_relaxed);
+  if(head == _tail.load(std::memory_order_acquire)){
+    return false;
+  }
+
+  // Let go of whatever the item holds before handing the slot back.
+  _items[head] = T();
+  _head.store(next(head), std::memory_order_release);
+  return true;
+}
+
+//------------------------------------------------------------------------------------
+
+// Moves the oldest item into item.
+template<typename T, int N>
+bool UtilSPSCQueue<T, N>::pop(T &item){
+  int head = _head.load(std::memory_order_relaxed);
+  if(head == _tail.load(std::memory_order_acquire)){
+    return false;
+  }
+
+  item = std::move(_items[head]);
+  _items[head] = T();
+  _head.store(next(head), std::memory_order_release);
+  return true;
+}
+
+//------------------------------------------------------------------------------------
+
+template<typename T, int N>
+bool UtilSPSCQueue<T, N>::isEmpty() const {
+  return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+}
+
+//------------------------------------------------------------------------------------
+
+template<typename T, int N>
+bool UtilSPSCQueue<T, N>::isFull() const {
+  return next(_tail.load(std::memory_order_acquire)) == _head.load(std::memory_order_acquire);
+}
+
+//------------------------------------------------------------------------------------
+
+// Approximate when called while the other side is active.
+template<typename T, int N>
+int UtilSPSCQueue<T, N>::size() const {
+  int count = _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire);
+  return count < 0 ? count + N + 1 : count;
+}
+
+//------------------------------------------------------------------------------------
+
+enum UtilQueuePolicy {
+  queue_reject,
+  queue_drop_oldest,
+  queue_coalesce
+};
+
+enum UtilQueueResult {
+  queue_added,
+  queue_coalesced, // Took the place of an equal item, which is handed back
+  queue_displaced, // Took the place of an older item, which is handed back
+  queue_rejected
+};
+
+//------------------------------------------------------------------------------------
+template<typename T, int N, int L>
+class UtilPriorityQueue {
+  static_assert(N > 0 && N <= 256, "Slots are kept as uint8_t, N is at most 256");
+  static_assert(L > 0 && L <= 256, "Lanes are kept as uint8_t, L is at most 256");
+
+public:
+  typedef bool (*Match)(const T &waiting, const T &item);
+
+  UtilQueuePolicy policy[L];
+  Match match = NULL;       // Items queue_coalesce treats as one
+  int limit = N;            // Items taken before the queue is full, up to N
+
+  uint32_t added = 0;
+  uint32_t coalesced = 0;
+  uint32_t displaced = 0;
+  uint32_t rejected = 0;
+  int highWater = 0;        // Most items queued at once
+  unsigned long maxWait = 0;// Longest ms an item waited before pop()
+
+  UtilPriorityQueue();
+
+  // Producer side
+  UtilQueueResult push(T &item, int lane);
+  UtilQueueResult push(T &&item, int lane);
+
+  // Consumer side
+  T *front();
+  T *at(int index);
+  int lane(int index);
+  bool pop();
+  bool pop(T &item);
+  bool take(int index, T &item);
+  int hold();
+  void release(int keep);
+
+  bool isEmpty();
+  bool isFull();
+  int size();
+  int size(int lane);
+  int available();
+  unsigned long age();
+  unsigned long age(int lane);
+  static constexpr int capacity(){ return N; }
+
+private:
+  T _items[N];
+  uint8_t _order[N];        // Slots of the queued items, in the order they go out
+  uint8_t _free[N];
+  uint8_t _lane[N];
+  uint32_t _seq[N];
+  unsigned long _time[N];   // millis() when pushed
+  int _count = 0;
+  int _freeCount = N;
+  int _held = 0;            // Items at the front that stay where they are
+  uint32_t _next = 0;
+  UtilLock _lock;
+
+  int insert(int slot);
+  void unlink(int index);
+  int victim(int lane);
+  bool before(int a, int b);
+
+  UtilPriorityQueue(const UtilPriorityQueue &);
+  UtilPriorityQueue &operator=(const UtilPriorityQueue &);
+};
+
+//------------------------------------------------------------------------------------
+
+template<typename T, int N, int L>
+UtilPriorityQueue<T, N, L>::UtilPriorityQueue(){
+  for(int i = 0; i < L; i++){
+    policy[i] = queue_reject;
+  }
+  for(int i = 0; i < N; i++){
+    _free[i] = N - 1 - i;
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+// Queues item in lane, 0 goes out first. Whatever left the queue in its
+// place, a coalesced or displaced item, is moved into item. Items are
+// swapped rather than assigned so nothing is freed under the lock.
+template<typename T, int N, int L>
+UtilQueueResult UtilPriorityQueue<T, N, L>::push(T &item, int lane){
+  lane = lane < 0 ? 0 : lane >= L ? L - 1 : lane;
+  UtilLockGuard guard(_lock);
+
+  if(policy[lane] == queue_coalesce && match != NULL){
+    for(int i = _held; i < _count; i++){
+      int slot = _order[i];
+      if(_lane[slot] == lane && match(_items[slot], item)){
+        std::swap(_items[slot], item);
+        coalesced++;
+        return queue_coalesced;
+      }
+    }
+  }
+
+  UtilQueueResult result = queue_added;
+  int slot;
+  if(_count < limit && _freeCount > 0){
+    slot = _free[--_freeCount];
+    added++;
+  }
+  else {
+    int index = victim(lane);
+    if(index < 0){
+      rejected++;
+      return queue_rejected;
+    }
+    slot = _order[index];
+    unlink(index);
+    displaced++;
+    result = queue_displaced;
+  }
+
+  std::swap(_items[slot], item);
+  _lane[slot] = lane;
+  _seq[slot] = _next++;
+  _time[slot] = millis();
+  insert(slot);
+  highWater = _count > highWater ? _count : highWater;
+  return result;
+}
+
+//------------------------------------------------------------------------------------
+
+template<typename T, int N, int L>
+UtilQueueResult UtilPriorityQueue<T, N, L>::push(T &&item, int lane){
+  T copy(std::move(item));
+  return push(copy, lane);
+}
+
+//------------------------------------------------------------------------------------
+
+// The item that goes out next, or NULL when empty. Stays valid until pop(),
+// and while it is held.
+template<typename T, int N, int L>
+T *UtilPriorityQueue<T, N, L>::front(){
+  return at(0);
+}
+
+//------------------------------------------------------------------------------------
+
+// The item index places behind the front, or NULL past the last. Stays
+// valid while it is held.
+template<typename T, int N, int L>
+T *UtilPriorityQueue<T, N, L>::at(int index){
+  UtilLockGuard guard(_lock);
+  if(index < 0 || index >= _count){
+    return NULL;
+  }
+  return &_items[_order[index]];
+}
+
+//------------------------------------------------------------------------------------
+
+// Lane of the item index places behind the front, -1 past the last.
+template<typename T, int N, int L>
+int UtilPriorityQueue<T, N, L>::lane(int index){
+  UtilLockGuard guard(_lock);
+  if(index < 0 || index >= _count){
+    return -1;
+  }
+  return _lane[_order[index]];
+}
+
+//------------------------------------------------------------------------------------
+
+// Discards the front item.
+template<typename T, int N, int L>
+bool UtilPriorityQueue<T, N, L>::pop(){
+  T item;
+  return pop(item);
+}
+
+//------------------------------------------------------------------------------------
+
+// Moves the front item into item.
+template<typename T, int N, int L>
+bool UtilPriorityQueue<T, N, L>::pop(T &item){
+  T gone;
+  {
+    UtilLockGuard guard(_lock);
+    if(_count == 0){
+      return false;
+    }
+    int slot = _order[0];
+    unsigned long wait = millis() - _time[slot];
+    maxWait = wait > maxWait ? wait : maxWait;
+    std::swap(gone, _items[slot]);
+    unlink(0);
+    _free[_freeCount++] = slot;
+  }
+  item = std::move(gone);
+  return true;
+}
+
+//------------------------------------------------------------------------------------
+
+// Moves the item index places behind the front into item, out of turn.
+// Only while it is held, so it is the one looked at.
+template<typename T, int N, int L>
+bool UtilPriorityQueue<T, N, L>::take(int index, T &item){
+  T gone;
+  {
+    UtilLockGuard guard(_lock);
+    if(index < 0 || index >= _held){
+      return false;
+    }
+    int slot = _order[index];
+    std::swap(gone, _items[slot]);
+    unlink(index);
+    _free[_freeCount++] = slot;
+  }
+  item = std::move(gone);
+  return true;
+}
+
+//------------------------------------------------------------------------------------
+
+// Holds every queued item where it is, before the consumer looks them over.
+// Returns how many that is.
+template<typename T, int N, int L>
+int UtilPriorityQueue<T, N, L>::hold(){
+  UtilLockGuard guard(_lock);
+  _held = _count;
+  return _held;
+}
+
+//------------------------------------------------------------------------------------
+
+// Keeps only the keep items at the front held. The rest take their place
+// by lane again, behind anything that arrived for a lane before theirs.
+template<typename T, int N, int L>
+void UtilPriorityQueue<T, N, L>::release(int keep){
+  UtilLockGuard guard(_lock);
+  _held = keep < 0 ? 0 : keep < _held ? keep : _held;
+  for(int i = _held + 1; i < _count; i++){
+    uint8_t slot = _order[i];
+    int j = i;
+    for(; j > _held && before(slot, _order[j - 1]); j--){
+      _order[j] = _order[j - 1];
+    }
+    _order[j] = slot;
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+template<typename T, int N, int L>
+bool UtilPriorityQueue<T, N, L>::isEmpty(){
+  return size() == 0;
+}
+
+//------------------------------------------------------------------------------------
+
+template<typename T, int N, int L>
+bool UtilPriorityQueue<T, N, L>::isFull(){
+  return available() == 0;
+}
+
+//------------------------------------------------------------------------------------
+
+template<typename T, int N, int L>
+int UtilPriorityQueue<T, N, L>::size(){
+  UtilLockGuard guard(_lock);
+  return _count;
+}
+
+//------------------------------------------------------------------------------------
+
+template<typename T, int N, int L>
+int UtilPriorityQueue<T, N, L>::size(int lane){
+  UtilLockGuard guard(_lock);
+  int count = 0;
+  for(int i = 0; i < _count; i++){
+    count += _lane[_order[i]] == lane;
+  }
+  return count;
+}
+
+//------------------------------------------------------------------------------------
+
+// Items that can still be pushed before a push displaces or is rejected,
+// what a producer should slow down on.
+template<typename T, int N, int L>
+int UtilPriorityQueue<T, N, L>::available(){
+  UtilLockGuard guard(_lock);
+  int space = (limit < N ? limit : N) - _count;
+  return space > 0 ? space : 0;
+}
+
+//------------------------------------------------------------------------------------
+
+// ms the oldest queued item has waited, 0 when empty.
+template<typename T, int N, int L>
+unsigned long UtilPriorityQueue<T, N, L>::age(){
+  return age(-1);
+}
+
+//------------------------------------------------------------------------------------
+
+// ms the oldest item queued in lane has waited, 0 when it is empty.
+template<typename T, int N, int L>
+unsigned long UtilPriorityQueue<T, N, L>::age(int lane){
+  UtilLockGuard guard(_lock);
+  unsigned long now = millis(), oldest = 0;
+  for(int i = 0; i < _count; i++){
+    int slot = _order[i];
+    if(lane < 0 || _lane[slot] == lane){
+      oldest = now - _time[slot] > oldest ? now - _time[slot] : oldest;
+    }
+  }
+  return oldest;
+}
+
+//------------------------------------------------------------------------------------
+
+// Places slot behind the held items, after every item of its lane or a
+// lane before it. Returns where it went.
+template<typename T, int N, int L>
+int UtilPriorityQueue<T, N, L>::insert(int slot){
+  int index = _count;
+  while(index > _held && before(slot, _order[index - 1])){
+    _order[index] = _order[index - 1];
+    index--;
+  }
+  _order[index] = slot;
+  _count++;
+  return index;
+}
+
+//------------------------------------------------------------------------------------
+
+template<typename T, int N, int L>
+void UtilPriorityQueue<T, N, L>::unlink(int index){
+  for(int i = index; i < _count - 1; i++){
+    _order[i] = _order[i + 1];
+  }
+  _count--;
+  _held = index < _held ? _held - 1 : _held;
+}
+
+//------------------------------------------------------------------------------------
+
+// Index of the item a full queue gives up for one in lane: the oldest of
+// the last lane after it, else with queue_drop_oldest the oldest of its
+// own lane. -1 when there is none, held items are never given up.
+template<typename T, int N, int L>
+int UtilPriorityQueue<T, N, L>::victim(int lane){
+  int found = -1;
+  for(int i = _held; i < _count; i++){
+    int other = _lane[_order[i]];
+    if(other > lane && (found < 0 || other > _lane[_order[found]])){
+      found = i; // The first of a lane is its oldest
+    }
+  }
+  if(found >= 0 || policy[lane] != queue_drop_oldest){
+    return found;
+  }
+  for(int i = _held; i < _count; i++){
+    if(_lane[_order[i]] == lane){
+      return i;
+    }
+  }
+  return -1;
+}
+
+//------------------------------------------------------------------------------------
+
+// Slot a goes out before slot b.
+template<typename T, int N, int L>
+bool UtilPriorityQueue<T, N, L>::before(int a, int b){
+  return _lane[a] != _lane[b] ? _lane[a] < _lane[b] : _seq[a] < _seq[b];
+}
+
+#endif
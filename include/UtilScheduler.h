@@ -0,0 +1,299 @@
+/*
+  UtilScheduler.h - ESPUtils Library for development on the ESP32 Platform
+  Created by Joe Andolina, April 1, 2020.
+  Released into the public domain.
+
+---------------------------------------------------------------------
+
+UtilClock extends millis() to 64 bits so deadlines survive the 49 day
+wrap of the 32 bit counter. It only needs to be read at least once per
+wrap, which ESPUtils::loop() takes care of. It can be read from any task.
+
+UtilScheduler keeps the pending deadlines of all managers in a min-heap.
+ESPUtils::loop() runs whatever is due and ESPUtils::idleTime() tells how
+long the application may sleep before the next deadline. The scheduler
+itself belongs to the loop task, don't schedule from other tasks.
+
+  UtilScheduler::schedule(checkSensor, 1000, 1000); // every second
+  UtilScheduler::schedule(timeout, 5000);           // once, in 5 seconds
+  UtilScheduler::cancel(timeout);
+
+A callback has at most one pending deadline, scheduling it again moves it.
+
+---------------------------------------------------------------------*/
+
+#if !defined(UTIL_SCHEDULER_H)
+#define UTIL_SCHEDULER_H
+
+#include <Arduino.h>
+#include <UtilLock.h>
+
+#ifndef UTIL_SCHEDULER_CAPACITY
+#define UTIL_SCHEDULER_CAPACITY 16
+#endif
+
+#define UTIL_NEVER UINT64_MAX
+
+typedef void (*UtilTaskCallback)();
+typedef uint32_t (*UtilClockSource)();
+
+//------------------------------------------------------------------------------------
+class UtilClock {
+public:
+  static uint64_t now();
+  static bool reached(uint64_t deadline);
+  static void setSource(UtilClockSource source);
+
+private:
+  static UtilClockSource _source;
+  static UtilLock _lock;
+  static uint32_t _last;
+  static uint32_t _wraps;
+
+  static uint32_t readMillis();
+};
+
+UtilClockSource UtilClock::_source = UtilClock::readMillis;
+UtilLock UtilClock::_lock;
+uint32_t UtilClock::_last = 0;
+uint32_t UtilClock::_wraps = 0;
+
+//------------------------------------------------------------------------------------
+struct UtilTimer {
+  uint64_t deadline;
+  uint32_t period;
+  UtilTaskCallback callback;
+};
+
+//------------------------------------------------------------------------------------
+class UtilScheduler {
+public:
+  static bool schedule(UtilTaskCallback callback, uint32_t delay, uint32_t period = 0);
+  static bool scheduleAt(UtilTaskCallback callback, uint64_t deadline, uint32_t period = 0);
+  static void cancel(UtilTaskCallback callback);
+  static bool isScheduled(UtilTaskCallback callback);
+
+  static int pending();
+  static uint64_t nextDeadline();
+  static uint32_t idleTime(uint32_t maxTime = UINT32_MAX);
+  static int run();
+
+  static uint32_t runs;
+  static uint32_t maxLateness;
+
+private:
+  static UtilTimer _timers[UTIL_SCHEDULER_CAPACITY];
+  static int _count;
+
+  static int find(UtilTaskCallback callback);
+  static void removeAt(int index);
+  static void siftUp(int index);
+  static void siftDown(int index);
+  static void swap(int a, int b);
+};
+
+UtilTimer UtilScheduler::_timers[UTIL_SCHEDULER_CAPACITY];
+int UtilScheduler::_count = 0;
+uint32_t UtilScheduler::runs = 0;
+uint32_t UtilScheduler::maxLateness = 0;
+
+//------------------------------------------------------------------------------------
+
+uint32_t UtilClock::readMillis(){
+  return millis();
+}
+
+//------------------------------------------------------------------------------------
+
+uint64_t UtilClock::now(){
+  UtilLockGuard guard(_lock);
+  uint32_t ms = _source();
+  if(ms < _last){
+    _wraps++;
+  }
+  _last = ms;
+  return ((uint64_t)_wraps << 32) | ms;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilClock::reached(uint64_t deadline){
+  return now() >= deadline;
+}
+
+//------------------------------------------------------------------------------------
+
+// Replaces millis() as the time source, e.g. with a virtual clock for benchmarks.
+void UtilClock::setSource(UtilClockSource source){
+  _source = source == NULL ? readMillis : source;
+  _last = _source();
+  _wraps = 0;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilScheduler::schedule(UtilTaskCallback callback, uint32_t delay, uint32_t period){
+  return scheduleAt(callback, UtilClock::now() + delay, period);
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilScheduler::scheduleAt(UtilTaskCallback callback, uint64_t deadline, uint32_t period){
+  int index = find(callback);
+  if(index < 0){
+    if(_count == UTIL_SCHEDULER_CAPACITY){
+      Serial.println("ERROR: UtilScheduler - Out of timers, raise UTIL_SCHEDULER_CAPACITY");
+      return false;
+    }
+    index = _count++;
+    _timers[index].callback = callback;
+  }
+
+  _timers[index].deadline = deadline;
+  _timers[index].period = period;
+  siftUp(index);
+  siftDown(index);
+  return true;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilScheduler::cancel(UtilTaskCallback callback){
+  int index = find(callback);
+  if(index >= 0){
+    removeAt(index);
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilScheduler::isScheduled(UtilTaskCallback callback){
+  return find(callback) >= 0;
+}
+
+//------------------------------------------------------------------------------------
+
+int UtilScheduler::pending(){
+  return _count;
+}
+
+//------------------------------------------------------------------------------------
+
+uint64_t UtilScheduler::nextDeadline(){
+  return _count > 0 ? _timers[0].deadline : UTIL_NEVER;
+}
+
+//------------------------------------------------------------------------------------
+
+// Milliseconds until the next deadline, capped at maxTime.
+uint32_t UtilScheduler::idleTime(uint32_t maxTime){
+  uint64_t next = nextDeadline();
+  uint64_t now = UtilClock::now();
+  if(next <= now){
+    return 0;
+  }
+  return next - now < maxTime ? next - now : maxTime;
+}
+
+//------------------------------------------------------------------------------------
+
+// Runs every callback that is due, returns how many ran.
+int UtilScheduler::run(){
+  int count = 0;
+  uint64_t now = UtilClock::now();
+
+  // Bounded so a zero period timer can not starve the caller.
+  while(_count > 0 && _timers[0].deadline <= now && count < UTIL_SCHEDULER_CAPACITY){
+    UtilTimer timer = _timers[0];
+
+    if(now - timer.deadline > maxLateness){
+      maxLateness = now - timer.deadline;
+    }
+
+    if(timer.period > 0){
+      // Keep the cadence, skip periods that were missed entirely.
+      uint64_t next = timer.deadline + timer.period;
+      if(next <= now){
+        next = now + timer.period;
+      }
+      _timers[0].deadline = next;
+      siftDown(0);
+    }
+    else {
+      removeAt(0);
+    }
+
+    timer.callback();
+    count++;
+    runs++;
+  }
+  return count;
+}
+
+//------------------------------------------------------------------------------------
+
+int UtilScheduler::find(UtilTaskCallback callback){
+  for(int i = 0; i < _count; i++){
+    if(_timers[i].callback == callback){
+      return i;
+    }
+  }
+  return -1;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilScheduler::removeAt(int index){
+  _count--;
+  if(index == _count){
+    return;
+  }
+  _timers[index] = _timers[_count];
+  siftUp(index);
+  siftDown(index);
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilScheduler::siftUp(int index){
+  while(index > 0){
+    int parent = (index - 1) / 2;
+    if(_timers[parent].deadline <= _timers[index].deadline){
+      return;
+    }
+    swap(parent, index);
+    index = parent;
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilScheduler::siftDown(int index){
+  while(true){
+    int smallest = index;
+    int left = 2 * index + 1;
+    int right = left + 1;
+
+    if(left < _count && _timers[left].deadline < _timers[smallest].deadline){
+      smallest = left;
+    }
+    if(right < _count && _timers[right].deadline < _timers[smallest].deadline){
+      smallest = right;
+    }
+    if(smallest == index){
+      return;
+    }
+    swap(smallest, index);
+    index = smallest;
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilScheduler::swap(int a, int b){
+  UtilTimer timer = _timers[a];
+  _timers[a] = _timers[b];
+  _timers[b] = timer;
+}
+
+#endif
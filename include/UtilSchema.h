@@ -0,0 +1,157 @@
+/*
+  UtilSchema.h - ESPUtils Library for development on the ESP32 Platform
+  Created by Joe Andolina, April 1, 2020.
+  Released into the public domain.
+
+---------------------------------------------------------------------
+
+Describe how the members of a struct map onto typed UtilMessage fields
+once, then encode or decode the whole struct in a single call. Fields are
+written straight into the message, nothing is allocated along the way.
+
+  struct Reading {
+    uint32_t sensor;
+    int16_t temperature;
+    float humidity;
+    char label[12];
+  };
+
+  typedef UtilSchema<
+    UTIL_FIELD(Reading, sensor,      UtilVarint),
+    UTIL_FIELD(Reading, temperature, UtilZigZag),
+    UTIL_FIELD(Reading, humidity,    UtilFloat),
+    UTIL_FIELD(Reading, label,       UtilText)
+  > ReadingSchema;
+
+  static_assert(ReadingSchema::maxSize() <= 250, "Reading must fit a LoRa frame");
+
+  ReadingSchema::encode(message, reading);  // sender
+  ReadingSchema::decode(view, reading);     // UtilMessageCallback
+
+---------------------------------------------------------------------*/
+
+#if !defined(UTIL_SCHEMA_H)
+#define UTIL_SCHEMA_H
+
+#include <UtilMessage.h>
+
+#define UTIL_FIELD(Struct, member, Codec) UtilField<Struct, decltype(Struct::member), &Struct::member, Codec>
+
+//------------------------------------------------------------------------------------
+// Codecs - How a single member is put on the wire
+//------------------------------------------------------------------------------------
+
+// Unsigned integers as LEB128 varints, small values take a single byte.
+struct UtilVarint {
+    template<typename T> static void encode(UtilMessage &message, const T &value){ message.writeVarint(value); }
+    template<typename T> static void decode(UtilMessageView &view, T &value){ value = (T)view.readVarint(); }
+    template<typename T> static constexpr int maxSize(){ return (sizeof(T) * 8 + 6) / 7; }
+};
+
+// Signed integers as zig-zag varints, small negative values stay small.
+struct UtilZigZag {
+    template<typename T> static void encode(UtilMessage &message, const T &value){ message.writeZigZag(value); }
+    template<typename T> static void decode(UtilMessageView &view, T &value){ value = (T)view.readZigZag(); }
+    template<typename T> static constexpr int maxSize(){ return (sizeof(T) * 8 + 6) / 7; }
+};
+
+// Integers as little endian values of their own width.
+struct UtilFixed {
+    template<typename T> static void encode(UtilMessage &message, const T &value){
+        switch(sizeof(T)){
+            case 1: message.write((byte)value); break;
+            case 2: message.writeUInt16((uint16_t)value); break;
+            case 4: message.writeUInt32((uint32_t)value); break;
+            default: message.writeUInt64((uint64_t)value); break;
+        }
+    }
+    template<typename T> static void decode(UtilMessageView &view, T &value){
+        switch(sizeof(T)){
+            case 1: value = (T)view.read(); break;
+            case 2: value = (T)view.readUInt16(); break;
+            case 4: value = (T)view.readUInt32(); break;
+            default: value = (T)view.readUInt64(); break;
+        }
+    }
+    template<typename T> static constexpr int maxSize(){ return sizeof(T); }
+};
+
+// float and double as little endian IEEE 754.
+struct UtilFloat {
+    static void encode(UtilMessage &message, const float &value){ message.writeFloat(value); }
+    static void encode(UtilMessage &message, const double &value){ message.writeDouble(value); }
+    static void decode(UtilMessageView &view, float &value){ value = view.readFloat(); }
+    static void decode(UtilMessageView &view, double &value){ value = view.readDouble(); }
+    template<typename T> static constexpr int maxSize(){ return sizeof(T); }
+};
+
+// char arrays as length prefixed text, decoding truncates to the array.
+struct UtilText {
+    template<size_t N> static void encode(UtilMessage &message, const char (&text)[N]){
+        message.writeBlob((const byte *)text, strnlen(text, N));
+    }
+    template<size_t N> static void decode(UtilMessageView &view, char (&text)[N]){ view.readText(text, N); }
+    template<typename T> static constexpr int maxSize(){ return sizeof(T) + UtilVarint::maxSize<uint16_t>(); }
+};
+
+// byte arrays as raw bytes, the length is implied by the array.
+struct UtilBytes {
+    template<size_t N> static void encode(UtilMessage &message, const byte (&data)[N]){ message.write(data, N); }
+    template<size_t N> static void decode(UtilMessageView &view, byte (&data)[N]){ view.readBytes(data, N); }
+    template<typename T> static constexpr int maxSize(){ return sizeof(T); }
+};
+
+//------------------------------------------------------------------------------------
+// UtilField - Binds a struct member to a codec
+//------------------------------------------------------------------------------------
+template<typename S, typename T, T S::*Member, typename Codec>
+struct UtilField {
+    static void encode(UtilMessage &message, const S &value){ Codec::encode(message, value.*Member); }
+    static void decode(UtilMessageView &view, S &value){ Codec::decode(view, value.*Member); }
+    static constexpr int maxSize(){ return Codec::template maxSize<T>(); }
+};
+
+//------------------------------------------------------------------------------------
+// UtilSchema - An ordered list of fields
+//------------------------------------------------------------------------------------
+template<typename... Fields>
+struct UtilSchema;
+
+template<>
+struct UtilSchema<> {
+    template<typename S> static void encodeFields(UtilMessage &, const S &){}
+    template<typename S> static void decodeFields(UtilMessageView &, S &){}
+    static constexpr int maxSize(){ return 0; }
+};
+
+template<typename Field, typename... Rest>
+struct UtilSchema<Field, Rest...> {
+
+    // Appends every field to message. Returns false if the message could not hold them.
+    template<typename S> static bool encode(UtilMessage &message, const S &value){
+        message.reserve(message.size() + maxSize());
+        encodeFields(message, value);
+        return !message.overflow();
+    }
+
+    // Reads every field from view. Returns false if the view ran out of bytes.
+    template<typename S> static bool decode(UtilMessageView &view, S &value){
+        decodeFields(view, value);
+        return !view.underflow();
+    }
+
+    // Upper bound of the encoded size in bytes, usable in static_assert.
+    static constexpr int maxSize(){ return Field::maxSize() + UtilSchema<Rest...>::maxSize(); }
+
+    template<typename S> static void encodeFields(UtilMessage &message, const S &value){
+        Field::encode(message, value);
+        UtilSchema<Rest...>::encodeFields(message, value);
+    }
+
+    template<typename S> static void decodeFields(UtilMessageView &view, S &value){
+        Field::decode(view, value);
+        UtilSchema<Rest...>::decodeFields(view, value);
+    }
+};
+
+#endif
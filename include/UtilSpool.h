@@ -0,0 +1,437 @@
+/*
+  UtilSpool.h - ESPUtils Library for development on the ESP32 Platform
+  Created by Joe Andolina, April 1, 2020.
+  Released into the public domain.
+
+---------------------------------------------------------------------
+
+UtilSpool is an append only log of records on the SPIFFS partition (see
+partitions/), for data that has to wait out a lost uplink or a restart,
+e.g. the requests of SFManager.
+
+  UtilSpool spool;
+  spool.begin("sf", 16384, 64);          // 64 segments of 16 KB
+
+  spool.append(data, size);              // producer
+  const uint8_t *record = spool.read(size, mark);
+  ... once the record is dealt with ...
+  spool.commit(mark);                    // it and those before it are gone
+
+Records go to the end of the newest segment file, /<name>.<number>, each
+with its length and a CRC-32. Appending costs the same however much is
+spooled, nothing written is ever rewritten. A full segment is closed and
+the next one started, so writes move on through the partition and SPIFFS
+can level them. Segments are removed whole once every record in them is
+committed. When all segments are full the oldest one goes, dropped counts
+those.
+
+read() goes through the records in order, commit() says how far they are
+done with. The commit point is kept in a small log of its own,
+/<name>.c0 or .c1, compacted into the other one once it grows past
+UTIL_SPOOL_CURSOR_LOG bytes. After a restart reading starts over from the
+last commit, so a record can be read twice but is never skipped. A record
+cut short by power loss fails its CRC and is passed over, corrupt counts
+those.
+
+Not safe to use from two tasks at once.
+
+---------------------------------------------------------------------*/
+
+#if !defined(UTIL_SPOOL_H)
+#define UTIL_SPOOL_H
+
+#include <Arduino.h>
+#include <FS.h>
+#include <SPIFFS.h>
+#include <UtilCommon.h>
+
+#ifndef UTIL_SPOOL_RECORD_SIZE
+#define UTIL_SPOOL_RECORD_SIZE 1024 // Longest record, its header included
+#endif
+
+#ifndef UTIL_SPOOL_CURSOR_LOG
+#define UTIL_SPOOL_CURSOR_LOG 4096
+#endif
+
+#define UTIL_SPOOL_HEADER 6 // uint16 length, uint32 CRC-32 of length and data
+
+//------------------------------------------------------------------------------------
+
+// Where a record ends: the segment number and the offset in it.
+struct UtilSpoolMark {
+  uint32_t segment;
+  uint32_t offset;
+};
+
+//------------------------------------------------------------------------------------
+class UtilSpool {
+public:
+  uint32_t appended = 0;
+  uint32_t replayed = 0;      // Records read
+  uint32_t committed = 0;     // Commit points written
+  uint32_t compactions = 0;   // Of the commit log
+  uint32_t dropped = 0;       // Segments given up to make room
+  uint32_t corrupt = 0;       // Records that failed their CRC
+
+  UtilSpool(){};
+  bool begin(const char *name, size_t segmentSize, int segments);
+  void end();
+  bool isOpen();
+
+  bool append(const uint8_t *data, size_t size);
+  const uint8_t *read(size_t &size, UtilSpoolMark &mark);
+  void commit(const UtilSpoolMark &mark);
+  void rewind();
+
+  bool isEmpty();             // Nothing left to read
+  bool isCommitted();         // Nothing left to commit
+  size_t bytes();             // Spooled past the commit point, about
+  int segments();
+
+private:
+  String _name;
+  size_t _segmentSize = 0;
+  int _segments = 0;
+  bool _open = false;
+
+  uint32_t _first = 0;        // Oldest segment on flash
+  uint32_t _head = 0;         // Segment appended to
+  uint32_t _headSize = 0;
+  bool _torn = false;         // The head ends in a partial record
+  UtilSpoolMark _cursor = {0, 0};
+  UtilSpoolMark _read = {0, 0};
+  int _log = 0;               // Commit log in use, .c0 or .c1
+
+  File _writer;
+  File _reader;
+  uint8_t _record[UTIL_SPOOL_RECORD_SIZE];
+
+  String segment(uint32_t number);
+  String cursorLog(int log);
+  bool loadCursor(int log, UtilSpoolMark &mark);
+  void saveCursor();
+  void rotate();
+  uint32_t scan(uint32_t number);
+  int next(File &file, size_t limit);
+  static bool before(const UtilSpoolMark &a, const UtilSpoolMark &b);
+};
+
+//------------------------------------------------------------------------------------
+
+// Mounts SPIFFS and picks up where the last run left off. false when the
+// partition could not be mounted.
+bool UtilSpool::begin(const char *name, size_t segmentSize, int segments){
+  end();
+  if(!SPIFFS.begin(true)){
+    Serial.println("ERROR: UtilSpool - SPIFFS mount failed, is there a spiffs partition?");
+    return false;
+  }
+  _name = name;
+  _segmentSize = segmentSize < UTIL_SPOOL_RECORD_SIZE ? UTIL_SPOOL_RECORD_SIZE : segmentSize;
+  _segments = segments < 2 ? 2 : segments;
+
+  UtilSpoolMark marks[2];
+  bool found[2] = {loadCursor(0, marks[0]), loadCursor(1, marks[1])};
+  _log = found[1] && (!found[0] || before(marks[0], marks[1])) ? 1 : 0;
+  _cursor = found[_log] ? marks[_log] : UtilSpoolMark{0, 0};
+
+  _first = _head = _cursor.segment;
+  while(SPIFFS.exists(segment(_head + 1))){
+    _head++;
+  }
+  _headSize = scan(_head);
+  _read = _cursor;
+  _open = true;
+  return true;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilSpool::end(){
+  _writer.close();
+  _reader.close();
+  _open = false;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilSpool::isOpen(){
+  return _open;
+}
+
+//------------------------------------------------------------------------------------
+
+// Adds a record of size bytes, false when it did not make it to flash.
+bool UtilSpool::append(const uint8_t *data, size_t size){
+  if(!_open || size == 0 || size > UTIL_SPOOL_RECORD_SIZE - UTIL_SPOOL_HEADER){
+    return false;
+  }
+
+  size_t length = UTIL_SPOOL_HEADER + size;
+  if(_torn || (_headSize > 0 && _headSize + length > _segmentSize)){
+    rotate();
+  }
+  if(!_writer){
+    _writer = SPIFFS.open(segment(_head), FILE_APPEND);
+  }
+
+  // One write, a record is either all there or fails its CRC.
+  _record[0] = size;
+  _record[1] = size >> 8;
+  uint32_t crc = utilCRC32(data, size, utilCRC32(_record, 2));
+  for(int i = 0; i < 4; i++){
+    _record[2 + i] = crc >> (8 * i);
+  }
+  memcpy(_record + UTIL_SPOOL_HEADER, data, size);
+  size_t written = _writer.write(_record, length);
+  _writer.flush();
+  _headSize += written;
+  if(written != length){
+    Serial.println("ERROR: UtilSpool - Write failed, is the partition full?");
+    _torn = written > 0;
+    return false;
+  }
+  appended++;
+  return true;
+}
+
+//------------------------------------------------------------------------------------
+
+// The next record, NULL when there is none. Its bytes stay valid until the
+// next call, mark is where it ends, for commit().
+const uint8_t *UtilSpool::read(size_t &size, UtilSpoolMark &mark){
+  while(_open && before(_read, UtilSpoolMark{_head, _headSize})){
+    if(!_reader){
+      _reader = SPIFFS.open(segment(_read.segment), FILE_READ);
+      if(!_reader || !_reader.seek(_read.offset)){
+        _reader.close();
+        _read = {_read.segment + 1, 0}; // Lost, move on to the next one
+        continue;
+      }
+    }
+
+    size_t limit = (_read.segment == _head ? _headSize : _reader.size()) - _read.offset;
+    int length = next(_reader, limit);
+    if(length <= 0){
+      // The end of the segment, or a record that did not make it. Nothing
+      // after it in the segment can be trusted.
+      corrupt += length < 0;
+      _reader.close();
+      _read = _read.segment == _head ? UtilSpoolMark{_head, _headSize} : UtilSpoolMark{_read.segment + 1, 0};
+      continue;
+    }
+
+    _read.offset += UTIL_SPOOL_HEADER + length;
+    replayed++;
+    size = length;
+    mark = _read;
+    return _record + UTIL_SPOOL_HEADER;
+  }
+  return NULL;
+}
+
+//------------------------------------------------------------------------------------
+
+// Everything up to mark is done with, segments that held only that go.
+void UtilSpool::commit(const UtilSpoolMark &mark){
+  if(!_open || !before(_cursor, mark)){
+    return;
+  }
+  _cursor = mark;
+
+  // All read and done, start the next segment so the last one can go too.
+  bool done = _cursor.segment == _head && _cursor.offset >= _headSize && _headSize > 0;
+  if(done){
+    _writer.close();
+    _head++;
+    _headSize = 0;
+    _torn = false;
+    _cursor = {_head, 0};
+    _reader.close();
+    _read = _cursor;
+  }
+
+  saveCursor();
+  while(_first < _cursor.segment){
+    SPIFFS.remove(segment(_first++));
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+// Reads again from the last commit.
+void UtilSpool::rewind(){
+  _reader.close();
+  _read = _cursor;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilSpool::isEmpty(){
+  return !_open || !before(_read, UtilSpoolMark{_head, _headSize});
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilSpool::isCommitted(){
+  return !_open || !before(_cursor, UtilSpoolMark{_head, _headSize});
+}
+
+//------------------------------------------------------------------------------------
+
+size_t UtilSpool::bytes(){
+  if(!_open){
+    return 0;
+  }
+  return (_head - _cursor.segment) * _segmentSize + _headSize - _cursor.offset;
+}
+
+//------------------------------------------------------------------------------------
+
+int UtilSpool::segments(){
+  return _open ? _head - _first + 1 : 0;
+}
+
+//------------------------------------------------------------------------------------
+
+String UtilSpool::segment(uint32_t number){
+  return "/"+ _name +"."+ String(number);
+}
+
+//------------------------------------------------------------------------------------
+
+String UtilSpool::cursorLog(int log){
+  return "/"+ _name +".c"+ String(log);
+}
+
+//------------------------------------------------------------------------------------
+
+// The last intact commit point in log.
+bool UtilSpool::loadCursor(int log, UtilSpoolMark &mark){
+  File file = SPIFFS.open(cursorLog(log), FILE_READ);
+  bool found = false;
+  uint8_t entry[12];
+  while(file && file.read(entry, sizeof(entry)) == sizeof(entry)){
+    uint32_t crc = entry[8] | entry[9] << 8 | entry[10] << 16 | (uint32_t)entry[11] << 24;
+    if(crc != utilCRC32(entry, 8)){
+      break;
+    }
+    mark.segment = entry[0] | entry[1] << 8 | entry[2] << 16 | (uint32_t)entry[3] << 24;
+    mark.offset = entry[4] | entry[5] << 8 | entry[6] << 16 | (uint32_t)entry[7] << 24;
+    found = true;
+  }
+  file.close();
+  return found;
+}
+
+//------------------------------------------------------------------------------------
+
+// Appends the commit point to its log. A full log is started over in the
+// other one, the old one only goes once the new one holds the point.
+void UtilSpool::saveCursor(){
+  uint8_t entry[12];
+  for(int i = 0; i < 4; i++){
+    entry[i] = _cursor.segment >> (8 * i);
+    entry[4 + i] = _cursor.offset >> (8 * i);
+  }
+  uint32_t crc = utilCRC32(entry, 8);
+  for(int i = 0; i < 4; i++){
+    entry[8 + i] = crc >> (8 * i);
+  }
+
+  File file = SPIFFS.open(cursorLog(_log), FILE_APPEND);
+  if(file.size() + sizeof(entry) > UTIL_SPOOL_CURSOR_LOG){
+    file.close();
+    _log = 1 - _log;
+    file = SPIFFS.open(cursorLog(_log), FILE_WRITE);
+    compactions++;
+    if(file.write(entry, sizeof(entry)) == sizeof(entry)){
+      file.close();
+      SPIFFS.remove(cursorLog(1 - _log));
+      committed++;
+      return;
+    }
+  }
+  else if(file.write(entry, sizeof(entry)) == sizeof(entry)){
+    committed++;
+  }
+  file.close();
+}
+
+//------------------------------------------------------------------------------------
+
+// Closes the head segment and starts the next one. With every segment in
+// use the oldest goes, records in it that were not read are lost.
+void UtilSpool::rotate(){
+  _writer.close();
+  _head++;
+  _headSize = 0;
+  _torn = false;
+
+  if((int)(_head - _first) >= _segments){
+    Serial.println("ERROR: UtilSpool - Spool full, dropped the oldest segment");
+    SPIFFS.remove(segment(_first));
+    _first++;
+    dropped++;
+    if(_cursor.segment < _first){
+      _cursor = {_first, 0};
+      saveCursor();
+    }
+    if(_read.segment < _first){
+      _reader.close();
+      _read = _cursor;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+// Size of segment number. A partial record at its end means power went
+// during its write, appends start a new segment instead of writing after it.
+uint32_t UtilSpool::scan(uint32_t number){
+  File file = SPIFFS.open(segment(number), FILE_READ);
+  if(!file){
+    return 0;
+  }
+  size_t size = file.size();
+  while(next(file, size - file.position()) > 0){
+  }
+  _torn = file.position() < size;
+  file.close();
+  return size;
+}
+
+//------------------------------------------------------------------------------------
+
+// Reads the record at the position of file into _record. Returns its
+// length, 0 at the end of what limit allows, -1 when it is damaged. A
+// damaged record leaves file where it started.
+int UtilSpool::next(File &file, size_t limit){
+  if(limit < UTIL_SPOOL_HEADER){
+    return limit == 0 ? 0 : -1;
+  }
+  size_t start = file.position();
+  if(file.read(_record, UTIL_SPOOL_HEADER) != UTIL_SPOOL_HEADER){
+    file.seek(start);
+    return -1;
+  }
+
+  size_t length = _record[0] | _record[1] << 8;
+  uint32_t crc = _record[2] | _record[3] << 8 | _record[4] << 16 | (uint32_t)_record[5] << 24;
+  if(length == 0 || UTIL_SPOOL_HEADER + length > UTIL_SPOOL_RECORD_SIZE || UTIL_SPOOL_HEADER + length > limit ||
+     file.read(_record + UTIL_SPOOL_HEADER, length) != length ||
+     crc != utilCRC32(_record + UTIL_SPOOL_HEADER, length, utilCRC32(_record, 2))){
+    file.seek(start);
+    return -1;
+  }
+  return length;
+}
+
+//------------------------------------------------------------------------------------
+
+// a comes before b in the spool.
+bool UtilSpool::before(const UtilSpoolMark &a, const UtilSpoolMark &b){
+  return a.segment != b.segment ? a.segment < b.segment : a.offset < b.offset;
+}
+
+#endif
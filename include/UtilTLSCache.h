@@ -0,0 +1,827 @@
+/*
+  UtilTLSCache.h - ESPUtils Library for development on the ESP32 Platform
+  Created by Joe Andolina, April 1, 2020.
+  Released into the public domain.
+
+---------------------------------------------------------------------
+
+A full TLS handshake costs the ESP32 seconds of CPU and radio time, an
+abbreviated one that resumes an earlier session a fraction of that.
+UtilTLSClient is a WiFiClientSecure that offers the last session it got
+from a host:port on the next connect() and keeps the new one afterwards.
+
+  UtilTLSClient client;
+  client.setCACert(rootCA);
+  client.connect("login.salesforce.com", 443); // resumes when it can
+
+UtilTLSCache holds one session per host:port, UTIL_TLS_CACHE_SIZE in RAM,
+least recently used first out. A session is offered for UTIL_TLS_LIFETIME
+seconds at most, or less when the server's ticket says so. With
+UTIL_TLS_PERSIST sessions are also kept in NVS, so the first connect after
+a restart or deep sleep resumes too. Session secrets are then stored in
+flash in the clear unless NVS encryption is turned on.
+
+Expiry runs on time(), which keeps counting through deep sleep. After a
+power cycle it starts over and stored sessions look like they come from
+the future. Those count as expired.
+
+hits counts resumed handshakes, misses full ones, refused the misses
+where a session was offered and the server did not take it.
+
+connect() waits until the connection is up. begin() and advance() take it
+a step at a time instead, for callers that cannot block the loop:
+
+  client.begin("login.salesforce.com", 443);
+  ...
+  if(client.advance() == tls_connected) ... // tls_failed when it did not work out
+
+advance() never waits on the network. It moves from tls_resolving to
+tls_connecting to tls_handshaking as each step completes, a handshake
+one mbedtls step per call. The answer to a lookup the client gave up on,
+by stopping or going away, is dropped when it comes.
+
+On the ESP32 the handshake follows start_ssl_client() from arduino-esp32
+2.0, which gives no way to set a session before the handshake. The host
+build steps through the stand-ins in host/hal instead.
+
+---------------------------------------------------------------------*/
+
+#if !defined(UTIL_TLS_CACHE_H)
+#define UTIL_TLS_CACHE_H
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <WiFiClientSecure.h>
+#include <UtilLock.h>
+#include <UtilParameters.h>
+#include <string>
+#include <time.h>
+
+#ifndef ESPUTILS_HOST
+#include <lwip/dns.h>
+#include <lwip/tcpip.h>
+#include <lwip/sockets.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/ssl.h>
+#include <ssl_client.h>
+#endif
+
+#ifndef UTIL_TLS_CACHE_SIZE
+#define UTIL_TLS_CACHE_SIZE 4
+#endif
+
+#ifndef UTIL_TLS_LIFETIME
+#define UTIL_TLS_LIFETIME 3600
+#endif
+
+#ifdef UTIL_TLS_PERSIST
+#define UTIL_TLS_PERSIST_DEFAULT true
+#else
+#define UTIL_TLS_PERSIST_DEFAULT false
+#endif
+
+#ifndef UTIL_TLS_TIMEOUT
+#define UTIL_TLS_TIMEOUT 15000 // ms connect() waits for the lookup, connect and handshake
+#endif
+
+#define UTIL_TLS_NAMESPACE "tls"
+
+enum UtilTLSState {
+  tls_idle,
+  tls_resolving,
+  tls_connecting,
+  tls_handshaking,
+  tls_connected,
+  tls_failed
+};
+
+//------------------------------------------------------------------------------------
+struct UtilTLSSession {
+  uint32_t key = 0;     // utilHash of host:port, 0 when unused
+  uint32_t expires = 0; // time() seconds
+  uint32_t used = 0;
+  std::string data;
+};
+
+//------------------------------------------------------------------------------------
+class UtilTLSCache {
+public:
+  static uint32_t lifetime; // seconds, 0 turns resumption off
+  static bool persist;
+
+  static uint32_t hits;
+  static uint32_t misses;
+  static uint32_t refused;
+  static uint32_t expired;
+
+  static bool find(const char *host, uint16_t port, std::string &session);
+  static void store(const char *host, uint16_t port, const std::string &session, uint32_t ticketLifetime = 0);
+  static void remove(const char *host, uint16_t port);
+  static void record(bool offered, bool resumed);
+  static void clear(bool stored = true);
+  static void resetStats();
+
+private:
+  static UtilTLSSession _sessions[UTIL_TLS_CACHE_SIZE];
+  static uint32_t _uses;
+  static UtilLock _lock;
+
+  static uint32_t now();
+  static uint32_t key(const char *host, uint16_t port);
+  static void nvsKey(uint32_t key, char *name);
+  static UtilTLSSession *lookup(uint32_t key);
+  static UtilTLSSession *slot(uint32_t key);
+  static bool load(uint32_t key, UtilTLSSession &session);
+  static void save(const UtilTLSSession &session);
+  static void erase(uint32_t key);
+};
+
+uint32_t UtilTLSCache::lifetime = UTIL_TLS_LIFETIME;
+bool UtilTLSCache::persist = UTIL_TLS_PERSIST_DEFAULT;
+uint32_t UtilTLSCache::hits = 0;
+uint32_t UtilTLSCache::misses = 0;
+uint32_t UtilTLSCache::refused = 0;
+uint32_t UtilTLSCache::expired = 0;
+UtilTLSSession UtilTLSCache::_sessions[UTIL_TLS_CACHE_SIZE];
+uint32_t UtilTLSCache::_uses = 0;
+UtilLock UtilTLSCache::_lock;
+
+//------------------------------------------------------------------------------------
+class UtilTLSClient : public WiFiClientSecure {
+public:
+  using WiFiClientSecure::connect;
+  ~UtilTLSClient();
+  int connect(const char *host, uint16_t port) override;
+  void stop() override;
+
+  bool begin(const char *host, uint16_t port);
+  UtilTLSState advance();
+  UtilTLSState state();
+  bool resumed();
+
+private:
+  UtilTLSState _state = tls_idle;
+  std::string _host;
+  uint16_t _port = 0;
+  std::string _offer;         // Cached session offered to the server
+  bool _offered = false;
+  bool _resumed = false;
+
+  void established();
+  void fail(const char *host, int error);
+
+  #ifdef ESPUTILS_HOST
+  unsigned long _lookupStart = 0;
+  #else
+  volatile int _lookup = 0;   // Set by resolved(), 1 found, -1 failed
+  uint32_t _lookupId = 0;     // Generation of the lookup out, 0 for none
+  UtilTLSClient *_nextLookup = NULL;
+  ip_addr_t _address;
+
+  static UtilTLSClient *_lookups; // Clients with a lookup out
+  static uint32_t _lookupCount;
+  static UtilLock _lookupLock;
+
+  static void resolved(const char *name, const ip_addr_t *address, void *arg);
+  void forget();
+  int open();
+  int setup();
+  #endif
+};
+
+//------------------------------------------------------------------------------------
+
+// The session last stored for host:port, false when there is none that is
+// still fresh.
+bool UtilTLSCache::find(const char *host, uint16_t port, std::string &session){
+  if(lifetime == 0){
+    return false;
+  }
+
+  UtilLockGuard guard(_lock);
+  uint32_t id = key(host, port);
+  UtilTLSSession *entry = lookup(id);
+  if(entry == NULL && persist){
+    UtilTLSSession stored;
+    if(load(id, stored)){
+      entry = slot(id);
+      *entry = stored;
+    }
+  }
+  if(entry == NULL){
+    return false;
+  }
+
+  uint32_t seconds = now();
+  if(seconds >= entry->expires || entry->expires - seconds > lifetime){
+    expired++;
+    if(persist){
+      erase(id);
+    }
+    *entry = UtilTLSSession();
+    return false;
+  }
+
+  entry->used = ++_uses;
+  session = entry->data;
+  return true;
+}
+
+//------------------------------------------------------------------------------------
+
+// Keeps session for the next connect to host:port. ticketLifetime is the
+// server's hint in seconds, 0 when it gave none.
+void UtilTLSCache::store(const char *host, uint16_t port, const std::string &session, uint32_t ticketLifetime){
+  if(lifetime == 0 || session.empty()){
+    return;
+  }
+
+  UtilLockGuard guard(_lock);
+  uint32_t id = key(host, port);
+  UtilTLSSession *entry = slot(id);
+  bool changed = entry->key != id || entry->data != session;
+
+  entry->key = id;
+  entry->expires = now() + (ticketLifetime > 0 && ticketLifetime < lifetime ? ticketLifetime : lifetime);
+  entry->used = ++_uses;
+  entry->data = session;
+
+  // Only a new session is worth a flash write, the expiry moves with it.
+  if(persist && changed){
+    save(*entry);
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+// Forgets host:port, e.g. after the server failed a handshake on its session.
+void UtilTLSCache::remove(const char *host, uint16_t port){
+  UtilLockGuard guard(_lock);
+  uint32_t id = key(host, port);
+  UtilTLSSession *entry = lookup(id);
+  if(entry != NULL){
+    *entry = UtilTLSSession();
+  }
+  if(persist){
+    erase(id);
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilTLSCache::record(bool offered, bool resumed){
+  UtilLockGuard guard(_lock);
+  if(resumed){
+    hits++;
+    return;
+  }
+  misses++;
+  if(offered){
+    refused++;
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+// Drops the sessions in RAM, and the ones in NVS unless stored is false.
+void UtilTLSCache::clear(bool stored){
+  UtilLockGuard guard(_lock);
+  for(int i = 0; i < UTIL_TLS_CACHE_SIZE; i++){
+    _sessions[i] = UtilTLSSession();
+  }
+
+  if(stored){
+    Preferences preferences;
+    preferences.begin(UTIL_TLS_NAMESPACE, false);
+    preferences.clear();
+    preferences.end();
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilTLSCache::resetStats(){
+  UtilLockGuard guard(_lock);
+  hits = misses = refused = expired = 0;
+}
+
+//------------------------------------------------------------------------------------
+
+uint32_t UtilTLSCache::now(){
+  #ifdef ESPUTILS_HOST
+  return HostClock::now() / 1000;
+  #else
+  return time(NULL);
+  #endif
+}
+
+//------------------------------------------------------------------------------------
+
+uint32_t UtilTLSCache::key(const char *host, uint16_t port){
+  uint32_t id = utilHash(host);
+  id = (id ^ (port & 0xFF)) * 16777619u;
+  id = (id ^ (port >> 8)) * 16777619u;
+  return id == 0 ? 1 : id;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilTLSCache::nvsKey(uint32_t key, char *name){
+  sprintf(name, "s%08x", (unsigned int)key);
+}
+
+//------------------------------------------------------------------------------------
+
+UtilTLSSession *UtilTLSCache::lookup(uint32_t key){
+  for(int i = 0; i < UTIL_TLS_CACHE_SIZE; i++){
+    if(_sessions[i].key == key){
+      return &_sessions[i];
+    }
+  }
+  return NULL;
+}
+
+//------------------------------------------------------------------------------------
+
+// The entry for key, or the least recently used one to replace.
+UtilTLSSession *UtilTLSCache::slot(uint32_t key){
+  UtilTLSSession *entry = lookup(key);
+  if(entry != NULL){
+    return entry;
+  }
+
+  entry = &_sessions[0];
+  for(int i = 1; i < UTIL_TLS_CACHE_SIZE; i++){
+    if(_sessions[i].used < entry->used){
+      entry = &_sessions[i];
+    }
+  }
+  return entry;
+}
+
+//------------------------------------------------------------------------------------
+
+// NVS holds the expiry (4 bytes, little endian) followed by the session.
+bool UtilTLSCache::load(uint32_t key, UtilTLSSession &session){
+  char name[12];
+  nvsKey(key, name);
+
+  Preferences preferences;
+  preferences.begin(UTIL_TLS_NAMESPACE, true);
+  size_t size = preferences.isKey(name) ? preferences.getBytesLength(name) : 0;
+  if(size <= 4){
+    preferences.end();
+    return false;
+  }
+
+  std::string bytes(size, '\0');
+  preferences.getBytes(name, &bytes[0], size);
+  preferences.end();
+
+  session.key = key;
+  session.expires = (uint8_t)bytes[0] | (uint8_t)bytes[1] << 8 | (uint8_t)bytes[2] << 16 | (uint32_t)(uint8_t)bytes[3] << 24;
+  session.used = ++_uses;
+  session.data = bytes.substr(4);
+  return true;
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilTLSCache::save(const UtilTLSSession &session){
+  char name[12];
+  nvsKey(session.key, name);
+
+  std::string bytes(4, '\0');
+  for(int i = 0; i < 4; i++){
+    bytes[i] = (char)(session.expires >> (i * 8));
+  }
+  bytes += session.data;
+
+  Preferences preferences;
+  preferences.begin(UTIL_TLS_NAMESPACE, false);
+  if(preferences.putBytes(name, bytes.data(), bytes.size()) != bytes.size()){
+    Serial.println("ERROR: UtilTLSCache - Unable to store session");
+  }
+  preferences.end();
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilTLSCache::erase(uint32_t key){
+  char name[12];
+  nvsKey(key, name);
+
+  Preferences preferences;
+  preferences.begin(UTIL_TLS_NAMESPACE, false);
+  if(preferences.isKey(name)){
+    preferences.remove(name);
+  }
+  preferences.end();
+}
+
+//------------------------------------------------------------------------------------
+
+// True when the last connect resumed a cached session.
+bool UtilTLSClient::resumed(){
+  return _resumed;
+}
+
+//------------------------------------------------------------------------------------
+
+UtilTLSState UtilTLSClient::state(){
+  return _state;
+}
+
+//------------------------------------------------------------------------------------
+
+// begin() and advance() until connected, or UTIL_TLS_TIMEOUT ms have passed.
+int UtilTLSClient::connect(const char *host, uint16_t port){
+  if(!begin(host, port)){
+    return 0;
+  }
+
+  unsigned long start = millis();
+  while(advance() < tls_connected){
+    if(millis() - start > UTIL_TLS_TIMEOUT){
+      fail(host, 0);
+      return 0;
+    }
+    delay(1);
+  }
+  return _state == tls_connected;
+}
+
+//------------------------------------------------------------------------------------
+
+UtilTLSClient::~UtilTLSClient(){
+  #ifndef ESPUTILS_HOST
+  forget();
+  #endif
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilTLSClient::stop(){
+  #ifndef ESPUTILS_HOST
+  forget();
+  #endif
+  WiFiClientSecure::stop();
+  _state = tls_idle;
+}
+
+//------------------------------------------------------------------------------------
+
+// The handshake is through, keeps the new session for the next connect.
+void UtilTLSClient::established(){
+  _state = tls_connected;
+  #ifdef ESPUTILS_HOST
+  _resumed = WiFiClientSecure::resumed();
+  UtilTLSCache::record(_offered, _resumed);
+  UtilTLSCache::store(_host.c_str(), _port, session());
+  #else
+  _connected = true;
+
+  mbedtls_ssl_session offer, current;
+  mbedtls_ssl_session_init(&offer);
+  mbedtls_ssl_session_init(&current);
+  bool offered = _offered && mbedtls_ssl_session_load(&offer, (const unsigned char *)_offer.data(), _offer.size()) == 0;
+  if(mbedtls_ssl_get_session(&sslclient->ssl_ctx, &current) == 0){
+    // The server only echoes the offered session id when it resumes.
+    _resumed = offered && current.id_len > 0 && current.id_len == offer.id_len && memcmp(current.id, offer.id, current.id_len) == 0;
+
+    size_t size = 0;
+    mbedtls_ssl_session_save(&current, NULL, 0, &size);
+    std::string saved(size, '\0');
+    if(size > 0 && mbedtls_ssl_session_save(&current, (unsigned char *)&saved[0], size, &size) == 0){
+      uint32_t ticketLifetime = 0;
+      #ifdef MBEDTLS_SSL_SESSION_TICKETS
+      ticketLifetime = current.ticket_lifetime;
+      #endif
+      UtilTLSCache::store(_host.c_str(), _port, saved, ticketLifetime);
+    }
+  }
+  UtilTLSCache::record(_offered, _resumed);
+
+  mbedtls_ssl_session_free(&current);
+  mbedtls_ssl_session_free(&offer);
+  #endif
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilTLSClient::fail(const char *host, int error){
+  #ifndef ESPUTILS_HOST
+  if(error != 0){
+    Serial.printf("ERROR: UtilTLSClient - Connecting to %s failed (-0x%04x)\n", host, -error);
+    _lastError = error;
+  }
+  #endif
+  stop();
+  _state = tls_failed;
+}
+
+//------------------------------------------------------------------------------------
+#ifdef ESPUTILS_HOST
+
+// Looks up host and starts connecting, returns false when that failed at once.
+bool UtilTLSClient::begin(const char *host, uint16_t port){
+  stop();
+  _host = host;
+  _port = port;
+  _resumed = false;
+  _offered = UtilTLSCache::find(host, port, _offer);
+  if(!_offered){
+    _offer.clear();
+  }
+  _lookupStart = millis();
+  _state = tls_resolving;
+  return true;
+}
+
+//------------------------------------------------------------------------------------
+
+// Takes the next step without waiting for the network, the same ones the
+// ESP32 takes on the stand-ins in host/hal.
+UtilTLSState UtilTLSClient::advance(){
+  int result;
+  switch(_state){
+    case tls_resolving:
+      if(millis() - _lookupStart < (unsigned long)HostNetwork::resolveTime()){
+        break;
+      }
+      if(connectStart(_host.c_str(), _port) < 0){
+        fail(_host.c_str(), 0);
+        break;
+      }
+      _state = tls_connecting;
+      break;
+
+    case tls_connecting:
+      result = connectPoll();
+      if(result < 0){
+        fail(_host.c_str(), 0);
+      }
+      else if(result > 0){
+        setSession(_offer);
+        handshakeStart(_host.c_str(), _port);
+        _state = tls_handshaking;
+      }
+      break;
+
+    case tls_handshaking:
+      result = handshakePoll();
+      if(result < 0){
+        fail(_host.c_str(), 0);
+      }
+      else if(result > 0){
+        established();
+      }
+      break;
+
+    default:
+      break;
+  }
+  return _state;
+}
+
+//------------------------------------------------------------------------------------
+#else
+
+UtilTLSClient *UtilTLSClient::_lookups = NULL;
+uint32_t UtilTLSClient::_lookupCount = 0;
+UtilLock UtilTLSClient::_lookupLock;
+
+//------------------------------------------------------------------------------------
+
+// Looks up host and starts connecting, returns false when that failed at once.
+bool UtilTLSClient::begin(const char *host, uint16_t port){
+  stop();
+  _host = host;
+  _port = port;
+  _resumed = false;
+  _offered = UtilTLSCache::find(host, port, _offer);
+  if(!_offered){
+    _offer.clear();
+  }
+
+  // As WiFi.hostByName() does, without waiting for the answer. lwIP gets
+  // the generation of the lookup rather than the client, which may be
+  // gone by the time the answer comes.
+  ip_addr_t address;
+  {
+    UtilLockGuard guard(_lookupLock);
+    _lookup = 0;
+    if(++_lookupCount == 0){
+      ++_lookupCount;
+    }
+    _lookupId = _lookupCount;
+    _nextLookup = _lookups;
+    _lookups = this;
+  }
+  #if LWIP_TCPIP_CORE_LOCKING
+  LOCK_TCPIP_CORE();
+  #endif
+  err_t result = dns_gethostbyname(host, &address, UtilTLSClient::resolved, (void *)(uintptr_t)_lookupId);
+  #if LWIP_TCPIP_CORE_LOCKING
+  UNLOCK_TCPIP_CORE();
+  #endif
+  if(result == ERR_OK){
+    forget();
+    _address = address;
+    _lookup = 1;
+  }
+  else if(result != ERR_INPROGRESS){
+    fail(host, 0);
+    return false;
+  }
+  _state = tls_resolving;
+  return true;
+}
+
+//------------------------------------------------------------------------------------
+
+// Called by lwIP with the address, NULL when the lookup failed, and the
+// generation of the lookup. No client waits for it once it was given up.
+void UtilTLSClient::resolved(const char *name, const ip_addr_t *address, void *arg){
+  UtilLockGuard guard(_lookupLock);
+  for(UtilTLSClient **link = &_lookups; *link != NULL; link = &(*link)->_nextLookup){
+    UtilTLSClient *client = *link;
+    if(client->_lookupId == (uint32_t)(uintptr_t)arg){
+      if(address != NULL){
+        client->_address = *address;
+      }
+      client->_lookup = address != NULL ? 1 : -1;
+      client->_lookupId = 0;
+      *link = client->_nextLookup;
+      return;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------------
+
+// Gives up the lookup that is out, if any.
+void UtilTLSClient::forget(){
+  UtilLockGuard guard(_lookupLock);
+  for(UtilTLSClient **link = &_lookups; *link != NULL; link = &(*link)->_nextLookup){
+    if(*link == this){
+      *link = _nextLookup;
+      break;
+    }
+  }
+  _lookupId = 0;
+}
+
+//------------------------------------------------------------------------------------
+
+// Takes the next step without waiting for the network. A handshake moves
+// one mbedtls step at a time.
+UtilTLSState UtilTLSClient::advance(){
+  int result;
+  switch(_state){
+    case tls_resolving:
+      if(_lookup == 0){
+        break;
+      }
+      if(_lookup < 0 || (result = open()) != 0){
+        fail(_host.c_str(), _lookup < 0 ? 0 : result);
+        break;
+      }
+      _state = tls_connecting;
+      break;
+
+    case tls_connecting: {
+      fd_set writable;
+      FD_ZERO(&writable);
+      FD_SET(sslclient->socket, &writable);
+      struct timeval now = {0, 0};
+      if(select(sslclient->socket + 1, NULL, &writable, NULL, &now) <= 0){
+        break;
+      }
+
+      int error = 0;
+      socklen_t size = sizeof(error);
+      getsockopt(sslclient->socket, SOL_SOCKET, SO_ERROR, &error, &size);
+      if(error != 0 || (result = setup()) != 0){
+        fail(_host.c_str(), error != 0 ? MBEDTLS_ERR_NET_CONNECT_FAILED : result);
+        break;
+      }
+      _state = tls_handshaking;
+      break;
+    }
+
+    case tls_handshaking:
+      result = mbedtls_ssl_handshake_step(&sslclient->ssl_ctx);
+      if(result == MBEDTLS_ERR_SSL_WANT_READ || result == MBEDTLS_ERR_SSL_WANT_WRITE){
+        break;
+      }
+      if(result != 0 && _offered){
+        // Some servers fail the handshake on a session they no longer know
+        // instead of falling back to a full one.
+        UtilTLSCache::remove(_host.c_str(), _port);
+        _offered = false;
+        _offer.clear();
+        WiFiClientSecure::stop();
+        if((result = open()) == 0){
+          _state = tls_connecting;
+          break;
+        }
+      }
+      if(result != 0){
+        fail(_host.c_str(), result);
+      }
+      else if(sslclient->ssl_ctx.state == MBEDTLS_SSL_HANDSHAKE_OVER){
+        established();
+      }
+      break;
+
+    default:
+      break;
+  }
+  return _state;
+}
+
+//------------------------------------------------------------------------------------
+
+// Non-blocking socket connecting to the looked up address.
+int UtilTLSClient::open(){
+  int fd = lwip_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if(fd < 0){
+    return MBEDTLS_ERR_NET_SOCKET_FAILED;
+  }
+  sslclient->socket = fd; // Closed by stop() from here on
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_addr.s_addr = ip_2_ip4(&_address)->addr;
+  server.sin_port = htons(_port);
+  if(lwip_connect(fd, (struct sockaddr *)&server, sizeof(server)) != 0 && errno != EINPROGRESS){
+    return MBEDTLS_ERR_NET_CONNECT_FAILED;
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------------
+
+// start_ssl_client() from the connected socket on, with the cached session
+// set before the handshake.
+int UtilTLSClient::setup(){
+  sslclient_context *ssl = sslclient;
+  mbedtls_ssl_init(&ssl->ssl_ctx);
+  mbedtls_ssl_config_init(&ssl->ssl_conf);
+  mbedtls_ctr_drbg_init(&ssl->drbg_ctx);
+  mbedtls_entropy_init(&ssl->entropy_ctx);
+  mbedtls_x509_crt_init(&ssl->ca_cert);
+
+  const char *personal = "esputils";
+  int result = mbedtls_ctr_drbg_seed(&ssl->drbg_ctx, mbedtls_entropy_func, &ssl->entropy_ctx, (const unsigned char *)personal, strlen(personal));
+  if(result != 0){
+    return result;
+  }
+
+  result = mbedtls_ssl_config_defaults(&ssl->ssl_conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+  if(result != 0){
+    return result;
+  }
+
+  if(_CA_cert != NULL){
+    result = mbedtls_x509_crt_parse(&ssl->ca_cert, (const unsigned char *)_CA_cert, strlen(_CA_cert) + 1);
+    if(result != 0){
+      return result;
+    }
+    mbedtls_ssl_conf_ca_chain(&ssl->ssl_conf, &ssl->ca_cert, NULL);
+    mbedtls_ssl_conf_authmode(&ssl->ssl_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  }
+  else if(_use_insecure){
+    mbedtls_ssl_conf_authmode(&ssl->ssl_conf, MBEDTLS_SSL_VERIFY_NONE);
+  }
+  else {
+    // Same as WiFiClientSecure, no root CA needs setInsecure().
+    return MBEDTLS_ERR_X509_CERT_VERIFY_FAILED;
+  }
+
+  mbedtls_ssl_conf_rng(&ssl->ssl_conf, mbedtls_ctr_drbg_random, &ssl->drbg_ctx);
+  if((result = mbedtls_ssl_setup(&ssl->ssl_ctx, &ssl->ssl_conf)) != 0 ||
+     (result = mbedtls_ssl_set_hostname(&ssl->ssl_ctx, _host.c_str())) != 0){
+    return result;
+  }
+
+  if(_offered){
+    mbedtls_ssl_session offer;
+    mbedtls_ssl_session_init(&offer);
+    if(mbedtls_ssl_session_load(&offer, (const unsigned char *)_offer.data(), _offer.size()) == 0){
+      result = mbedtls_ssl_set_session(&ssl->ssl_ctx, &offer);
+    }
+    mbedtls_ssl_session_free(&offer);
+    if(result != 0){
+      return result;
+    }
+  }
+  mbedtls_ssl_set_bio(&ssl->ssl_ctx, &ssl->socket, mbedtls_net_send, mbedtls_net_recv, NULL);
+  return 0;
+}
+
+#endif
+#endif
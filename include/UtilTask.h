@@ -0,0 +1,242 @@
+/*
+  UtilTask.h - ESPUtils Library for development on the ESP32 Platform
+  Created by Joe Andolina, April 1, 2020.
+  Released into the public domain.
+
+---------------------------------------------------------------------
+
+By default every manager runs on the Arduino loop task, called from
+ESPUtils::loop(). With USE_TASKS defined in Config.h each enabled manager
+gets a task of its own instead, pinned to a configurable core and running
+at a configurable priority, so a TLS handshake in SFMan or a LoRa packet
+on air no longer holds up everything else.
+
+Managers and the loop task only talk through UtilSPSCQueue mailboxes:
+  - sendMessage() called on the loop task queues the message for the
+    manager task, which does the (blocking) transmit.
+  - Received messages are queued by the manager task and handed to the
+    message callback from ESPUtils::loop(), so application handlers
+    always run on the loop task, same as without USE_TASKS.
+
+Each queue has a single producer and a single consumer, call sendMessage()
+from the loop task (or from the manager's own task) only.
+
+UtilTask wraps xTaskCreatePinnedToCore(). The host build runs the same
+code on std::thread, core and priority are ignored there.
+
+A task with nothing to do can wait() for up to a time, and another task
+wake() it early when work comes in, e.g. a request queued for SFMan.
+
+---------------------------------------------------------------------*/
+
+#if !defined(UTIL_TASK_H)
+#define UTIL_TASK_H
+
+#include <Arduino.h>
+#include <UtilQueue.h>
+#include <atomic>
+#include <UtilScheduler.h>
+
+#ifdef ESPUTILS_HOST
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#else
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#endif
+
+#ifndef UTIL_TASK_STACK
+#define UTIL_TASK_STACK 4096
+#endif
+
+#ifndef UTIL_TASK_QUEUE_SIZE
+#define UTIL_TASK_QUEUE_SIZE 8
+#endif
+
+#define UTIL_ANY_CORE -1
+
+//------------------------------------------------------------------------------------
+class UtilTask {
+public:
+  UtilTask(){};
+  ~UtilTask();
+
+  bool start(const char *name, UtilTaskCallback loop, int core = UTIL_ANY_CORE, int priority = 1, uint32_t stackSize = UTIL_TASK_STACK);
+  void stop();
+  bool running();
+  bool isCurrent();
+  uint32_t iterations();
+  void wait(uint32_t ms);
+  void wake();
+
+  static void pause(uint32_t ms);
+
+private:
+  UtilTaskCallback _loop = NULL;
+  std::atomic<bool> _running{false};
+  std::atomic<uint32_t> _iterations{0};
+
+  #ifdef ESPUTILS_HOST
+  std::thread _thread;
+  std::atomic<std::thread::id> _id;
+  std::mutex _wakeLock;
+  std::condition_variable _wakeEvent;
+  bool _woken = false;
+  #else
+  TaskHandle_t volatile _handle = NULL;
+  #endif
+
+  static void run(void *task);
+
+  UtilTask(const UtilTask &);
+  UtilTask &operator=(const UtilTask &);
+};
+
+//------------------------------------------------------------------------------------
+
+UtilTask::~UtilTask(){
+  stop();
+}
+
+//------------------------------------------------------------------------------------
+
+// Calls loop over and over on a new task until stop(). loop is expected to
+// block or pause() so lower priority tasks get to run.
+bool UtilTask::start(const char *name, UtilTaskCallback loop, int core, int priority, uint32_t stackSize){
+  if(_running){
+    return true;
+  }
+
+  _loop = loop;
+  _running = true;
+
+  #ifdef ESPUTILS_HOST
+  _thread = std::thread(run, this);
+  return true;
+  #else
+  BaseType_t result = xTaskCreatePinnedToCore(run, name, stackSize, this, priority, NULL, core == UTIL_ANY_CORE ? tskNO_AFFINITY : core);
+  if(result != pdPASS){
+    Serial.println("ERROR: UtilTask - Unable to start task " + String(name));
+    _running = false;
+    return false;
+  }
+  return true;
+  #endif
+}
+
+//------------------------------------------------------------------------------------
+
+// Lets the current loop iteration finish, then waits for the task to end.
+void UtilTask::stop(){
+  _running = false;
+  if(isCurrent()){
+    return;
+  }
+  wake();
+
+  #ifdef ESPUTILS_HOST
+  if(_thread.joinable()){
+    _thread.join();
+  }
+  #else
+  while(_handle != NULL){
+    pause(1);
+  }
+  #endif
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilTask::running(){
+  return _running;
+}
+
+//------------------------------------------------------------------------------------
+
+bool UtilTask::isCurrent(){
+  #ifdef ESPUTILS_HOST
+  return _id.load() == std::this_thread::get_id();
+  #else
+  return _handle != NULL && _handle == xTaskGetCurrentTaskHandle();
+  #endif
+}
+
+//------------------------------------------------------------------------------------
+
+uint32_t UtilTask::iterations(){
+  return _iterations;
+}
+
+//------------------------------------------------------------------------------------
+
+// Called from the task itself: pauses for up to ms, less once wake() is
+// called. A wake() that came while the task was busy ends the next wait.
+void UtilTask::wait(uint32_t ms){
+  #ifdef ESPUTILS_HOST
+  std::unique_lock<std::mutex> lock(_wakeLock);
+  _wakeEvent.wait_for(lock, std::chrono::milliseconds(ms), [this]{ return _woken; });
+  _woken = false;
+  #else
+  ulTaskNotifyTake(pdTRUE, ms / portTICK_PERIOD_MS > 0 ? ms / portTICK_PERIOD_MS : 1);
+  #endif
+}
+
+//------------------------------------------------------------------------------------
+
+// Ends the task's wait(), from any other task.
+void UtilTask::wake(){
+  #ifdef ESPUTILS_HOST
+  {
+    std::lock_guard<std::mutex> lock(_wakeLock);
+    _woken = true;
+  }
+  _wakeEvent.notify_one();
+  #else
+  TaskHandle_t handle = _handle;
+  if(handle != NULL){
+    xTaskNotifyGive(handle);
+  }
+  #endif
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilTask::pause(uint32_t ms){
+  #ifdef ESPUTILS_HOST
+  if(ms == 0){
+    std::this_thread::yield();
+  } else {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+  }
+  #else
+  vTaskDelay(ms / portTICK_PERIOD_MS > 0 ? ms / portTICK_PERIOD_MS : 1);
+  #endif
+}
+
+//------------------------------------------------------------------------------------
+
+void UtilTask::run(void *task){
+  UtilTask *self = (UtilTask *)task;
+  #ifdef ESPUTILS_HOST
+  self->_id = std::this_thread::get_id();
+  #else
+  self->_handle = xTaskGetCurrentTaskHandle();
+  #endif
+
+  while(self->_running){
+    self->_loop();
+    self->_iterations++;
+  }
+
+  #ifdef ESPUTILS_HOST
+  self->_id = std::thread::id();
+  #else
+  // stop() waits for this, clear it last.
+  self->_handle = NULL;
+  vTaskDelete(NULL);
+  #endif
+}
+
+#endif
@@ -13,6 +13,7 @@
 //#include <WiFiAP.h>
 //#include <WiFiMulti.h>
 #include <WiFiClientSecure.h>
+#include <UtilTLSCache.h>
 
 //typedef void (*WiFiManagerCallback)();
 enum UtilWifiState { idle, connecting, connected, disconnected };
@@ -20,7 +21,8 @@ enum UtilWifiState { idle, connecting, connected, disconnected };
 //------------------------------------------------------------------------------------
 class WiFiManager{
 public:
-    static unsigned long retryTime;
+    static volatile bool needsReconnect;
+    static volatile bool needsClock;
     static UtilWifiState state;
     static void setClock();
     static void beginAccessPoint();
@@ -33,14 +35,25 @@ public:
     static void handleEvent(WiFiEvent_t event);
     static void onConnect();
     static void onDisconnect();
+    static void reconnect();
     static void loop();
+    static void taskLoop();
+
+#ifdef USE_TASKS
+    static UtilTask task;
+#endif
 
 private:
 };
 
-unsigned long WiFiManager::retryTime = 0;
+volatile bool WiFiManager::needsReconnect = false;
+volatile bool WiFiManager::needsClock = false;
 UtilWifiState WiFiManager::state = idle;
 
+#ifdef USE_TASKS
+UtilTask WiFiManager::task;
+#endif
+
 //------------------------------------------------------------------------------------
 
 void WiFiManager::handleEvent(system_event_id_t  event){
@@ -110,10 +123,15 @@ void WiFiManager::beginConnection(wifi_mode_t wifi_mode){
         Serial.println("ERROR: ESPUtils - Check to see WIFI_SSID and WIFI_PASS have been set in ESPUtils/Config.h or use WiFiManager::beginConnection(const char* ssid, const char *passphrase, wifi_mode_t wifi_mode)");
         return;
     }
+    // Set ahead of begin(), the connect event may arrive before begin() returns.
+    WiFiManager::state = connecting;
     WiFi.onEvent(WiFiManager::handleEvent);
     WiFi.mode(wifi_mode);
     WiFi.begin(WIFI_SSID, WIFI_PASS);
-    WiFiManager::state = connecting;
+
+    #ifdef USE_TASKS
+    WiFiManager::task.start("WiFi", WiFiManager::taskLoop, WIFI_TASK_CORE, WIFI_TASK_PRIORITY);
+    #endif
 }
 
 //------------------------------------------------------------------------------------
@@ -131,7 +149,13 @@ void WiFiManager::onConnect(){
     Serial.println("STA IPv4: "+ WiFi.localIP());
     Serial.print("STA IPv6: "+ WiFi.localIPv6().toString());
     WiFiManager::state = connected;
+
+    #ifdef USE_TASKS
+    // Waiting for NTP would hold up the WiFi event task, let the WiFi task do it.
+    WiFiManager::needsClock = true;
+    #else
     WiFiManager::setClock();
+    #endif
 }
 
 //------------------------------------------------------------------------------------
@@ -142,7 +166,8 @@ void WiFiManager::onDisconnect(){
         return;
     }
     WiFiManager::state = connecting;
-    WiFiManager::retryTime = millis() + WIFI_RETRY_DELAY;
+    // WiFi events arrive on the event task, the retry is scheduled from loop().
+    WiFiManager::needsReconnect = true;
 }
 
 //---------------------------------------------------------------------
@@ -170,12 +195,41 @@ void WiFiManager::setClock() {
 
 //------------------------------------------------------------------------------------
 
+void WiFiManager::reconnect(){
+    Serial.println("Attempting WiFi Reconnect");
+    WiFiManager::beginConnection(WiFi.getMode());
+}
+
+//------------------------------------------------------------------------------------
+
+// With USE_TASKS the WiFi task takes care of this, see taskLoop().
 void WiFiManager::loop(){
-    if (WiFiManager::retryTime != 0 && WiFiManager::retryTime < millis()){
-        WiFiManager::retryTime = 0;
-        Serial.println("Attempting WiFi Reconnect");
-        WiFiManager::beginConnection(WiFi.getMode());
+    #ifndef USE_TASKS
+    if (WiFiManager::needsReconnect){
+        WiFiManager::needsReconnect = false;
+        UtilScheduler::schedule(WiFiManager::reconnect, WIFI_RETRY_DELAY);
     }
+    #endif
+}
+
+//------------------------------------------------------------------------------------
+
+// Body of the WiFi task with USE_TASKS, reconnects and sets the clock.
+void WiFiManager::taskLoop(){
+    #ifdef USE_TASKS
+    if (WiFiManager::needsReconnect){
+        WiFiManager::needsReconnect = false;
+        UtilTask::pause(WIFI_RETRY_DELAY);
+        WiFiManager::reconnect();
+    }
+
+    if (WiFiManager::needsClock){
+        WiFiManager::needsClock = false;
+        WiFiManager::setClock();
+    }
+
+    UtilTask::pause(WIFI_RETRY_DELAY);
+    #endif
 }
 
-#endif
\ No newline at end of file
+#endif